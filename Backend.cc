@@ -0,0 +1,456 @@
+//
+//  Backend.cc
+//  Layer7LoadBalancer
+//  Created by Rick Tyler
+//
+//  SPDX-License-Identifier: MIT
+
+# include "Backend.h"
+# include "Connection.h"
+# include "HTTP2Client.h"
+# include "Exception.h"
+# include "Log.h"
+# include <string.h>
+# include <math.h>
+
+// # define TRACE    1
+
+Backend :: Backend( const char *destStr, bool useTLS )
+{
+	this->destStr = destStr;
+	this->useTLS = useTLS;
+	this->sessions = 0;
+	this->circuitOpen = false;
+	this->ejectedUntil = 0;
+	this->recoveredAt = 0;
+	this->limit = 0;
+}
+
+bool
+Backend :: isAvailable( void )
+{
+	return( !circuitOpen && !isEjected() );
+}
+
+void
+Backend :: healthCheckSucceeded( void )
+{
+	failed = 0;
+	if( !circuitOpen )
+		return;
+	if( ++passed >= rise )
+	{
+		passed = 0;
+		circuitOpen = false;
+		recoveredAt = Thread::milliseconds();
+		Log::log( "Backend[ %s ]: UP (%d checks passed)", destStr, rise );
+	}
+}
+
+void
+Backend :: healthCheckFailed( const char *error )
+{
+	passed = 0;
+	if( circuitOpen )
+		return;
+# if TRACE
+	Log::console( "Backend[ %s ]::healthCheckFailed: %s", destStr, error );
+# endif // TRACE
+	if( ++failed >= fall )
+	{
+		failed = 0;
+		circuitOpen = true;
+		Log::log( "Backend[ %s ]: DOWN (%s)", destStr, error );
+	}
+}
+
+void
+Backend :: sessionEnded( void )
+{
+	--sessions;
+	if( pool )
+		pool->sessionEnded();
+}
+
+// reuse the most recently idled keep-alive connection that's still open,
+// or open a stream on an HTTP/2 connection with room for one, otherwise
+// connect (may raise)
+
+Connection *
+Backend :: getConnection( bool *reused )
+{
+	if( reused )
+		*reused = false;
+	for( ;; )
+	{
+		Connection *connection;
+		{
+			lock_guard< mutex > lock( idleMutex );
+			if( idle.empty() )
+				break;
+			connection = idle.back();
+			idle.pop_back();
+		}
+		if( connection->isReusable() )
+		{
+			if( reused )
+				*reused = true;
+			return( connection );
+		}
+		delete( connection );
+	}
+	bool multiplexing = http2 && !http2Declined;
+	if( multiplexing )
+	{
+		// a stream on a multiplexed connection, when one has room; while
+		// none has, one session connects and the rest wait to share it
+		unique_lock< mutex > lock( idleMutex );
+		for( ;; )
+		{
+			for( auto it = http2Clients.begin(); it != http2Clients.end(); )
+			{
+				if( !(*it)->isOpen() )
+					it = http2Clients.erase( it );
+				else if( (*it)->reserve() )
+				{
+					if( reused )
+						*reused = true;
+					return( new Connection( new HTTP2ClientStream( *it ) ) );
+				}
+				else
+					it++;
+			}
+			if( !http2Connecting )
+				break;
+			http2Connected.wait( lock );
+		}
+		http2Connecting = true;
+	}
+	Connection *connection = nullptr;
+	shared_ptr< HTTP2Client > client;
+	try
+	{
+		connection = new Connection( destStr, useTLS, connectTimeout, http2 );
+		if( connection->http2 )
+		{
+			client = HTTP2Client::start( connection, destStr );
+			if( !client->reserve() )
+				Exception::raise( "Backend[ %s ]: HTTP/2 connection allows no streams", destStr );
+		}
+	}
+	catch( const char * )
+	{
+		if( multiplexing )
+		{
+			lock_guard< mutex > lock( idleMutex );
+			http2Connecting = false;
+			http2Connected.notify_all();
+		}
+		throw;
+	}
+	if( http2 )
+	{
+		lock_guard< mutex > lock( idleMutex );
+		if( client )
+			http2Clients.push_back( client );
+		http2Declined = !client;	// HTTP/1.1, so connect as for any backend
+		if( multiplexing )
+		{
+			http2Connecting = false;
+			http2Connected.notify_all();
+		}
+	}
+	return( client ? new Connection( new HTTP2ClientStream( client ) ) : connection );
+}
+
+void
+Backend :: releaseConnection( Connection *connection )
+{
+	if( connection->isMultiplexed() )
+	{
+		delete( connection );	// the stream's done; its connection carries on
+		return;
+	}
+	{
+		lock_guard< mutex > lock( idleMutex );
+		if( idle.size() < maxIdleConnections )
+		{
+			idle.push_back( connection );
+			return;
+		}
+	}
+	delete( connection );
+}
+
+size_t
+Backend :: idleConnections( void )
+{
+	lock_guard< mutex > lock( idleMutex );
+	return( idle.size() );
+}
+
+// effective balancing weight, reduced while warming up after recovery
+
+double
+Backend :: weight( int64_t now )
+{
+	if( !slowStart )
+		return( 1.0 );
+	int64_t elapsed = now - recoveredAt.load();
+	if( elapsed >= slowStart )
+		return( 1.0 );
+	if( elapsed <= 0 )
+		return( slowStartMinWeight );
+	double ramp = (double) elapsed / slowStart;
+	if( slowStartExponential )
+		return( slowStartMinWeight * pow( 1.0 / slowStartMinWeight, ramp ) );
+	return( slowStartMinWeight + (1.0 - slowStartMinWeight) * ramp );
+}
+
+// called from session threads with the outcome of live traffic
+
+void
+Backend :: reportSuccess( void )
+{
+	outlierMutex.lock();
+	rollInterval();
+	consecutiveFailures = 0;
+	++intervalRequests;
+	outlierMutex.unlock();
+}
+
+void
+Backend :: reportFailure( const char *reason )
+{
+	outlierMutex.lock();
+	rollInterval();
+	++intervalRequests;
+	++intervalErrors;
+	++consecutiveFailures;
+	if( limit.load() )
+		backoff();
+	if( !isEjected() )
+	{
+		if( outlierConsecutiveFailures && consecutiveFailures >= outlierConsecutiveFailures )
+			eject( reason );
+		else if( outlierErrorRate && intervalRequests >= outlierMinRequests
+			&& intervalErrors * 100 >= outlierErrorRate * intervalRequests )
+			eject( "error rate" );
+	}
+	outlierMutex.unlock();
+}
+
+// request latency sample (ms from request forwarded to first response byte)
+
+void
+Backend :: reportLatency( int64_t latency )
+{
+	if( !limit.load() )
+		return;
+	limitMutex.lock();
+	// re-learn the floor periodically so a permanently slower backend isn't
+	// held to latency it can no longer reach
+	if( ++latencySamples >= 1000 )
+	{
+		latencySamples = 0;
+		minLatency = 0;
+	}
+	if( !minLatency || latency < minLatency )
+		minLatency = max( latency, (int64_t) 1 );
+	bool congested = latency * 100 > minLatency * concurrencyTolerance;
+	if( !congested && sessions.load() >= (int) limit.load() - 1 )
+	{
+		// additive increase: about +1 per limit's worth of fast responses
+		// (under limitMutex, so a concurrent backoff() isn't overwritten)
+		double current = limit.load();
+		limit = min( (double) concurrencyMax, current + 1.0 / current );
+	}
+	limitMutex.unlock();
+	if( congested )
+		backoff();
+}
+
+void
+Backend :: backoff( void )
+{
+	limitMutex.lock();
+	int64_t now = Thread::milliseconds();
+	// one multiplicative decrease per latency period, not per sample
+	if( now - lastBackoff >= max( minLatency, (int64_t) 10 ) )
+	{
+		lastBackoff = now;
+		limit = max( (double) concurrencyMin, limit.load() * 0.9 );
+	}
+	limitMutex.unlock();
+}
+
+// outlierMutex held
+
+void
+Backend :: rollInterval( void )
+{
+	int64_t now = Thread::milliseconds();
+	if( now - intervalStart < outlierInterval )
+		return;
+	intervalStart = now;
+	intervalRequests = 0;
+	intervalErrors = 0;
+}
+
+void
+Backend :: eject( const char *reason )
+{
+	int64_t now = Thread::milliseconds();
+	if( now - lastEjection > outlierMaxEjectionTime )
+		ejections = 0;	// well-behaved long enough to forget earlier ejections
+	int64_t duration = outlierEjectionTime;
+	for( int i = 0; i < ejections && duration < outlierMaxEjectionTime; i++ )
+		duration *= 2;
+	duration = min( duration, (int64_t) outlierMaxEjectionTime );
+	++ejections;
+	lastEjection = now;
+	ejectedUntil = now + duration;
+	recoveredAt = now + duration;
+	consecutiveFailures = 0;
+	intervalStart = now;
+	intervalRequests = 0;
+	intervalErrors = 0;
+	Log::log( "Backend[ %s ]: EJECTED for %lldms (%s)", destStr, (long long) duration, reason );
+}
+
+// weighted least-connections over the available backends (the lowest
+// (sessions + 1) / weight wins); ties rotate round-robin. Returns nullptr
+// when nothing is available or sessions are already queued for a backend.
+// A preferred (sticky) backend is used whenever it can take the session.
+
+Backend *
+BackendPool :: select( Backend *preferred )
+{
+	lock_guard< mutex > lock( poolMutex );
+	if( !queue.empty() )
+		return( nullptr );
+	if( preferred && preferred->pool == this && preferred->isAvailable() && preferred->hasCapacity() )
+	{
+		++preferred->sessions;
+		return( preferred );
+	}
+	return( choose() );
+}
+
+// wait in FIFO order, up to queueTimeout ms, for a backend below its limit
+
+Backend *
+BackendPool :: acquire( void )
+{
+	unique_lock< mutex > lock( poolMutex );
+	if( queue.size() >= queueSize )
+	{
+		++queueRejected;
+		return( nullptr );
+	}
+	uint64_t ticket = nextTicket++;
+	queue.push_back( ticket );
+	int64_t deadline = Thread::milliseconds() + queueTimeout;
+	for( ;; )
+	{
+		Backend *backend;
+		if( queue.front() == ticket && (backend = choose()) )
+		{
+			queue.pop_front();
+			changed.notify_all();
+			return( backend );
+		}
+		int64_t now = Thread::milliseconds();
+		if( now >= deadline )
+		{
+			for( auto it = queue.begin(); it != queue.end(); it++ )
+			{
+				if( *it == ticket )
+				{
+					queue.erase( it );
+					break;
+				}
+			}
+			changed.notify_all();
+			++queueTimedOut;
+			return( nullptr );
+		}
+		// limits and health can also change without a session ending
+		changed.wait_for( lock, std::chrono::milliseconds( min( deadline - now, (int64_t) 50 ) ) );
+	}
+}
+
+size_t
+BackendPool :: queueLength( void )
+{
+	lock_guard< mutex > lock( poolMutex );
+	return( queue.size() );
+}
+
+void
+BackendPool :: sessionEnded( void )
+{
+	lock_guard< mutex > lock( poolMutex );
+	if( !queue.empty() )
+		changed.notify_all();
+}
+
+// poolMutex held
+
+Backend *
+BackendPool :: choose( void )
+{
+	size_t n = backends.size();
+	Backend *selected = nullptr;
+	double least = 0;
+	bool available = false;
+	for( size_t i = 0; i < n; i++ )
+	{
+		Backend *backend = backends[ (next + i) % n ];
+		if( !backend->isAvailable() )
+			continue;
+		available = true;
+		if( !backend->hasCapacity() )
+			continue;
+		double load = (backend->sessions.load() + 1) / backend->weight();
+		if( !selected || load < least )
+		{
+			selected = backend;
+			least = load;
+		}
+	}
+	if( !available )
+	{
+		// every backend is down or ejected: rather than refusing all traffic,
+		// fall back to ejected backends whose health checks still pass (one
+		// that's only at its limit queues the session instead)
+		for( size_t i = 0; i < n; i++ )
+		{
+			Backend *backend = backends[ (next + i) % n ];
+			if( backend->circuitOpen || !backend->hasCapacity() )
+				continue;
+			double load = backend->sessions.load() + 1;
+			if( !selected || load < least )
+			{
+				selected = backend;
+				least = load;
+			}
+		}
+	}
+	if( !selected )
+		return( nullptr );
+	next = (next + 1) % n;
+	++selected->sessions;
+	return( selected );
+}
+
+Backend *
+BackendPool :: find( const char *destStr )
+{
+	for( auto it = backends.begin(); it != backends.end(); it++ )
+	{
+		if( strcmp( (*it)->destStr, destStr ) == 0 )
+			return( *it );
+	}
+	return( nullptr );
+}
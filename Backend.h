@@ -0,0 +1,144 @@
+//
+//  Backend.h
+//  Layer7LoadBalancer
+//  Created by Rick Tyler
+//
+//  SPDX-License-Identifier: MIT
+
+# ifndef _Backend_h_
+# define _Backend_h_
+
+# include "Thread.h"
+# include <atomic>
+# include <condition_variable>
+# include <deque>
+# include <memory>
+# include <mutex>
+# include <vector>
+
+using namespace std;
+
+class BackendPool;
+class Connection;
+class Compression;
+class HTTP2Client;
+
+// runtime state of a single proxy destination (one TCP/TLS line in the config)
+
+class Backend
+{
+    public:
+
+	Backend( const char *destStr, bool useTLS );
+	bool isAvailable( void );
+	void healthCheckSucceeded( void );
+	void healthCheckFailed( const char *error );
+	void sessionEnded( void );
+	void reportSuccess( void );
+	void reportFailure( const char *reason );
+	bool isEjected( void ) { return( Thread::milliseconds() < ejectedUntil.load() ); }
+	int sessionCount( void ) { return( sessions.load() ); }
+	double weight( void ) { return( weight( Thread::milliseconds() ) ); }
+	double weight( int64_t now );	// as of now (ms)
+	void reportLatency( int64_t latency );
+	void setConcurrencyLimit( int limit ) { this->limit = limit; }
+	int concurrencyLimit( void ) { return( (int) limit.load() ); }
+	bool hasCapacity( void ) { return( limit.load() == 0 || sessions.load() < (int) limit.load() ); }
+	Connection *getConnection( bool *reused = nullptr );
+	void releaseConnection( Connection *connection );
+	size_t idleConnections( void );
+	const char *destStr;
+	bool useTLS;
+	int rise = 2;		// consecutive passed checks that close an open circuit
+	int fall = 3;		// consecutive failed checks that open the circuit
+	int connectTimeout = 0;	// ms, 0 waits indefinitely
+	size_t maxIdleConnections = 16;	// keep-alive connections kept for request balancing
+	bool http2 = false;		// offer "h2", multiplexing requests if the backend takes it
+
+	// passive outlier detection (0 disables a threshold)
+	int outlierConsecutiveFailures = 5;
+	int outlierErrorRate = 0;		// percent of requests in outlierInterval
+	int outlierMinRequests = 20;
+	int outlierInterval = 10000;		// ms
+	int outlierEjectionTime = 30000;	// ms, doubled on each repeat ejection
+	int outlierMaxEjectionTime = 300000;	// ms
+
+	// slow start: weight ramps from slowStartMinWeight to 1 over slowStart ms
+	// after the backend recovers from an open circuit or an ejection
+	int slowStart = 0;			// ms, 0 disables
+	bool slowStartExponential = false;	// default is a linear ramp
+	double slowStartMinWeight = 0.1;
+
+	// adaptive concurrency limit: AIMD on request latency, grows while latency
+	// stays within concurrencyTolerance percent of the lowest seen and backs
+	// off multiplicatively when it doesn't (enabled by setConcurrencyLimit())
+	int concurrencyMin = 1;
+	int concurrencyMax = 1000;
+	int concurrencyTolerance = 200;
+
+    private:
+
+	atomic< int > sessions;
+	atomic< bool > circuitOpen;
+	int passed = 0;		// only touched by the health check thread
+	int failed = 0;
+	atomic< int64_t > ejectedUntil;
+	atomic< int64_t > recoveredAt;
+	mutex outlierMutex;
+	int consecutiveFailures = 0;
+	int intervalRequests = 0;
+	int intervalErrors = 0;
+	int64_t intervalStart = 0;
+	int ejections = 0;
+	int64_t lastEjection = 0;
+	void rollInterval( void );
+	void eject( const char *reason );
+	atomic< double > limit;
+	mutex limitMutex;
+	int64_t minLatency = 0;
+	int64_t lastBackoff = 0;
+	int latencySamples = 0;
+	void backoff( void );
+	BackendPool *pool = nullptr;
+	mutex idleMutex;
+	vector< Connection * > idle;	// most recently released last
+	vector< shared_ptr< HTTP2Client > > http2Clients;	// under idleMutex
+	bool http2Connecting = false;
+	atomic< bool > http2Declined { false };	// the last connection took HTTP/1.1
+	condition_variable http2Connected;
+
+    friend class BackendPool;
+    friend class HTTPProxySessionContext;
+};
+
+// set of backends a listener balances over
+
+class BackendPool
+{
+    public:
+
+	BackendPool( void ) { queueRejected = 0; queueTimedOut = 0; }
+	void add( Backend *backend ) { backend->pool = this; backends.push_back( backend ); }
+	Backend *select( Backend *preferred = nullptr );
+	Backend *acquire( void );
+	Backend *find( const char *destStr );
+	size_t queueLength( void );
+	void sessionEnded( void );
+	vector< Backend * > backends;
+	size_t queueSize = 0;		// sessions allowed to wait when every backend is at its limit
+	int queueTimeout = 1000;	// ms a queued session waits for a backend
+	atomic< size_t > queueRejected;
+	atomic< size_t > queueTimedOut;
+	Compression *compression = nullptr;	// of responses, per COMPRESS
+
+    private:
+
+	size_t next = 0;
+	mutex poolMutex;
+	condition_variable changed;
+	deque< uint64_t > queue;	// FIFO of waiting sessions' tickets
+	uint64_t nextTicket = 0;
+	Backend *choose( void );
+};
+
+# endif // _Backend_h_
@@ -0,0 +1,211 @@
+//
+//  BenchRelay.cc
+//  Layer7LoadBalancer
+//  Created by Rick Tyler
+//
+//  Microbenchmark for ProxySession's relay I/O: the same bytes relayed
+//  client to server through transports tested on every call, as the relay
+//  loop did, and through the transport types it is now compiled for.
+//
+//  SPDX-License-Identifier: MIT
+
+# include "Transport.h"
+# include "Thread.h"
+# include "Exception.h"
+# include "Log.h"
+
+# include <openssl/ssl.h>
+# include <openssl/err.h>
+# include <string.h>
+# include <stdlib.h>
+# include <unistd.h>
+# include <algorithm>
+# include <chrono>
+# include <thread>
+
+// # define TRACE    1
+
+using namespace std;
+
+# define BENCH_BUF_LEN    16384		// a full TLS record per read
+
+// what ProxySession did per read: test the transport on each call, and ask
+// the backend for bytes select() might have missed (a recv() when plain)
+
+class DynamicTransport
+{
+    public:
+
+	DynamicTransport( int socket, SSL *ssl ) { this->socket = socket; this->ssl = ssl; }
+	ssize_t read( void *buf, size_t len )
+	{
+		if( ssl )
+			return( SSL_read( ssl, buf, (int) len ) );
+		return( recv( socket, buf, len, 0 ) );
+	}
+	ssize_t write( const void *data, size_t len )
+	{
+		if( ssl )
+			return( SSL_write( ssl, data, (int) len ) );
+		return( send( socket, data, len, 0 ) );
+	}
+	ssize_t pending( void )
+	{
+		if( ssl )
+			return( SSL_pending( ssl ) );
+		char c;
+		ssize_t n = recv( socket, &c, 1, MSG_PEEK | MSG_DONTWAIT );
+		return( n > 0 ? n : 0 );
+	}
+	int socket;
+	SSL *ssl;
+};
+
+static SSL_CTX *serverCtx;
+static SSL_CTX *clientCtx;
+
+static SSL *
+endpoint( int socket, bool secure, bool server )
+{
+	if( !secure )
+		return( nullptr );
+	SSL *ssl = SSL_new( server ? serverCtx : clientCtx );
+	SSL_set_fd( ssl, socket );
+	if( (server ? SSL_accept( ssl ) : SSL_connect( ssl )) != 1 )
+		Exception::raise( "BenchRelay: TLS handshake failed (%s)", ERR_error_string( ERR_get_error(), NULL ) );
+	return( ssl );
+}
+
+static void
+release( int socket, SSL *ssl )
+{
+	if( ssl )
+		SSL_free( ssl );
+	close( socket );
+}
+
+// the client writes total bytes, the relay forwards them, the server drains
+// them; only the relay is timed
+
+template< class Client, class Server > static double
+run( bool clientTLS, bool serverTLS, size_t total, bool perCall )
+{
+	int clientPair[ 2 ], serverPair[ 2 ];
+	if( socketpair( AF_UNIX, SOCK_STREAM, 0, clientPair ) < 0 || socketpair( AF_UNIX, SOCK_STREAM, 0, serverPair ) < 0 )
+		Exception::raise( "BenchRelay: socketpair() failed (%s)", strerror( errno ) );
+
+	thread client( [ = ]()
+	{
+		SSL *ssl = endpoint( clientPair[ 0 ], clientTLS, false );
+		DynamicTransport out( clientPair[ 0 ], ssl );
+		char data[ BENCH_BUF_LEN ];
+		memset( data, 'x', sizeof( data ) );
+		for( size_t sent = 0; sent < total; )
+		{
+			ssize_t n = out.write( data, min( sizeof( data ), total - sent ) );
+			if( n <= 0 )
+				break;
+			sent += n;
+		}
+		release( clientPair[ 0 ], ssl );
+	} );
+	thread server( [ = ]()
+	{
+		SSL *ssl = endpoint( serverPair[ 1 ], serverTLS, true );
+		DynamicTransport in( serverPair[ 1 ], ssl );
+		char data[ BENCH_BUF_LEN ];
+		for( size_t received = 0; received < total; )
+		{
+			ssize_t n = in.read( data, sizeof( data ) );
+			if( n <= 0 )
+				break;
+			received += n;
+		}
+		release( serverPair[ 1 ], ssl );
+	} );
+
+	SSL *clientSSL = endpoint( clientPair[ 1 ], clientTLS, true );
+	SSL *serverSSL = endpoint( serverPair[ 0 ], serverTLS, false );
+	Client *from = new Client( clientPair[ 1 ], clientSSL );
+	Server *to = new Server( serverPair[ 0 ], serverSSL );
+	char *buf = (char *) malloc( BENCH_BUF_LEN );
+	size_t relayed = 0;
+	auto start = chrono::steady_clock::now();
+	while( relayed < total )
+	{
+		if( perCall )
+			bzero( buf, BENCH_BUF_LEN );
+		ssize_t len = from->read( buf, BENCH_BUF_LEN );
+		if( len <= 0 )
+			Exception::raise( "BenchRelay: read() failed" );
+		for( ssize_t sent, offset = 0; offset < len; offset += sent )
+		{
+			if( (sent = to->write( buf + offset, len - offset )) <= 0 )
+				Exception::raise( "BenchRelay: write() failed" );
+		}
+		relayed += len;
+		if( perCall )
+			(void) to->pending();
+	}
+	chrono::duration< double > elapsed = chrono::steady_clock::now() - start;
+
+	client.join();
+	server.join();
+	release( clientPair[ 1 ], clientSSL );
+	release( serverPair[ 0 ], serverSSL );
+	delete( from );
+	delete( to );
+	free( buf );
+	return( (double) total / (1024 * 1024) / elapsed.count() );
+}
+
+// the four pairs ProxySession::_main chooses between
+
+static double
+compiled( bool clientTLS, bool serverTLS, size_t total )
+{
+	if( clientTLS )
+		return( serverTLS ? run< TLSTransport, TLSTransport >( true, true, total, false )
+			: run< TLSTransport, PlainTransport >( true, false, total, false ) );
+	return( serverTLS ? run< PlainTransport, TLSTransport >( false, true, total, false )
+		: run< PlainTransport, PlainTransport >( false, false, total, false ) );
+}
+
+int
+main( int argc, char **argv )
+{
+	try
+	{
+		size_t megabytes = argc > 1 ? atoi( argv[ 1 ] ) : 256;
+		int rounds = argc > 2 ? atoi( argv[ 2 ] ) : 3;
+		if( argc > 3 || !megabytes || rounds < 1 )
+			Exception::raise( "Usage: %s [ megabytes [ rounds ] ]", argv[ 0 ] );
+		size_t total = megabytes * 1024 * 1024;
+
+		serverCtx = SSL_CTX_new( TLS_server_method() );
+		clientCtx = SSL_CTX_new( TLS_client_method() );
+		if( SSL_CTX_use_certificate_chain_file( serverCtx, "localhost.crt" ) != 1
+			|| SSL_CTX_use_PrivateKey_file( serverCtx, "localhost.key", SSL_FILETYPE_PEM ) != 1 )
+			Exception::raise( "BenchRelay: localhost.crt or localhost.key unusable (run from the source directory)" );
+
+		for( int pair = 0; pair < 4; pair++ )
+		{
+			bool clientTLS = pair & 2, serverTLS = pair & 1;
+			double perCall = 0, typed = 0;
+			for( int i = 0; i < rounds; i++ )
+			{
+				// the best of each, so scheduling noise favors neither
+				perCall = max( perCall, run< DynamicTransport, DynamicTransport >( clientTLS, serverTLS, total, true ) );
+				typed = max( typed, compiled( clientTLS, serverTLS, total ) );
+			}
+			Log::console( "%-5s -> %-5s: per-call %6.0f MB/s, compiled %6.0f MB/s (%+.1f%%)", clientTLS ? "TLS" : "plain",
+				serverTLS ? "TLS" : "plain", perCall, typed, (typed / perCall - 1) * 100 );
+		}
+	}
+	catch( const char *error )
+	{
+		Log::console( "%s", error );
+		exit( -1 );
+	}
+	exit( 0 );
+}
@@ -0,0 +1,407 @@
+//
+//  Cache.cc
+//  Layer7LoadBalancer
+//  Created by Rick Tyler
+//
+//  SPDX-License-Identifier: MIT
+
+# include "Cache.h"
+# include "Thread.h"
+# include "HTTPScan.h"
+# include <ctype.h>
+# include <stdlib.h>
+# include <string.h>
+# include <time.h>
+
+// # define TRACE    1
+
+# define CACHE_SHARDS         16
+# define SKETCH_MIN_WIDTH     1024
+# define AVERAGE_OBJECT_SIZE  8192	// sizes the sketch: about one counter per cacheable object
+
+FrequencySketch :: FrequencySketch( size_t width )
+{
+	size_t n = SKETCH_MIN_WIDTH;
+	while( n < width )
+		n *= 2;
+	counters.assign( n, 0 );
+	mask = n - 1;
+	sampleSize = n * 10;
+}
+
+void
+FrequencySketch :: increment( uint64_t hash )
+{
+	for( int row = 0; row < 4; row++ )
+	{
+		uint8_t& counter = counters[ index( hash, row ) ];
+		if( counter < 15 )
+			++counter;
+	}
+	if( ++additions >= sampleSize )
+	{
+		// age: halve every counter
+		for( auto it = counters.begin(); it != counters.end(); it++ )
+			*it >>= 1;
+		additions /= 2;
+	}
+}
+
+int
+FrequencySketch :: estimate( uint64_t hash )
+{
+	int least = 15;
+	for( int row = 0; row < 4; row++ )
+		least = min( least, (int) counters[ index( hash, row ) ] );
+	return( least );
+}
+
+Cache :: Cache( size_t size, size_t maxObjectSize )
+{
+	this->size = size;
+	this->maxObjectSize = maxObjectSize ? maxObjectSize : size / CACHE_SHARDS / 4;
+	hits = misses = insertions = evictions = rejections = coalesced = 0;
+	for( int i = 0; i < CACHE_SHARDS; i++ )
+		shards.push_back( new Shard( size / CACHE_SHARDS / AVERAGE_OBJECT_SIZE ) );
+}
+
+Cache :: ~Cache()
+{
+	for( auto it = shards.begin(); it != shards.end(); it++ )
+		delete( *it );
+}
+
+// may this request be answered from (lookup) or stored in the cache
+
+bool
+Cache :: isCacheable( HTTPParser *request, bool *lookup )
+{
+	if( request->method != "GET" || !request->header( "Authorization" ).empty() )
+		return( false );
+	if( request->hasToken( "Cache-Control", "no-store" ) )
+		return( false );
+	*lookup = !request->hasToken( "Cache-Control", "no-cache" ) && !request->hasToken( "Pragma", "no-cache" );
+	return( true );
+}
+
+// HTTP-date (IMF-fixdate) to seconds, -1 if malformed
+
+static int64_t
+httpDate( string_view value )
+{
+	char date[ 64 ];
+	if( value.empty() || value.size() >= sizeof( date ) )
+		return( -1 );
+	memcpy( date, value.data(), value.size() );
+	date[ value.size() ] = '\0';
+	struct tm tm;
+	memset( &tm, 0, sizeof( tm ) );
+	const char *end = strptime( date, "%a, %d %b %Y %H:%M:%S GMT", &tm );
+	if( !end || *end )
+		return( -1 );
+	return( (int64_t) timegm( &tm ) );
+}
+
+// value of a Cache-Control directive (e.g. max-age=N), -1 if absent
+
+static int64_t
+directive( HTTPParser *response, string_view name )
+{
+	for( auto it = response->headers.begin(); it != response->headers.end(); it++ )
+	{
+		if( !equalsIgnoreCase( it->name, "Cache-Control" ) )
+			continue;
+		const char *c = it->value.data();
+		const char *end = c + it->value.size();
+		while( c < end )
+		{
+			const char *comma = HTTPScan::find( c, end, ',' );
+			while( c < comma && (*c == ' ' || *c == '\t') )
+				++c;
+			const char *equals = HTTPScan::find( c, comma, '=' );
+			if( equalsIgnoreCase( string_view( c, equals - c ), name ) )
+				return( equals < comma ? strtoll( equals + 1, nullptr, 10 ) : 0 );
+			c = comma + 1;
+		}
+	}
+	return( -1 );
+}
+
+// ms the response stays fresh, 0 if it mustn't be stored
+
+int64_t
+Cache :: freshness( HTTPParser *response )
+{
+	switch( response->status )
+	{
+		case 200: case 203: case 204: case 300: case 301: case 404: case 410:
+			break;
+		default:
+			return( 0 );
+	}
+	if( directive( response, "no-store" ) >= 0 || directive( response, "no-cache" ) >= 0 || directive( response, "private" ) >= 0 )
+		return( 0 );
+	if( !response->header( "Set-Cookie" ).empty() || response->hasToken( "Vary", "*" ) )
+		return( 0 );
+
+	int64_t ttl;
+	if( (ttl = directive( response, "s-maxage" )) < 0 && (ttl = directive( response, "max-age" )) < 0 )
+	{
+		string_view expires = response->header( "Expires" );
+		if( expires.empty() )
+			return( 0 );
+		int64_t date = httpDate( response->header( "Date" ) );
+		ttl = httpDate( expires ) - (date >= 0 ? date : (int64_t) time( NULL ));
+	}
+	string_view age = response->header( "Age" );
+	if( !age.empty() )
+		ttl -= strtoll( string( age ).c_str(), nullptr, 10 );
+	return( ttl > 0 ? ttl * 1000 : 0 );
+}
+
+string
+Cache :: primaryKey( HTTPParser *request )
+{
+	string key( request->method );
+	key += ' ';
+	for( auto c : request->header( "Host" ) )
+		key += tolower( c );
+	key += ' ';
+	key += request->path;
+	return( key );
+}
+
+string
+Cache :: variantKey( const string& primary, HTTPParser *request, const vector< string >& names )
+{
+	string key( primary );
+	for( auto it = names.begin(); it != names.end(); it++ )
+	{
+		key += '\n';
+		key += request->header( *it );
+	}
+	return( key );
+}
+
+// shardMutex held
+
+void
+Cache :: erase( Shard *shard, list< Entry >::iterator it )
+{
+	shard->bytes -= it->response->data.size();
+	shard->index.erase( it->key );
+	shard->lru.erase( it );
+}
+
+shared_ptr< CachedResponse >
+Cache :: lookup( HTTPParser *request )
+{
+	string primary = primaryKey( request );
+	uint64_t hash;
+	Shard *shard = this->shard( primary, &hash );
+	lock_guard< mutex > lock( shard->shardMutex );
+	string key = this->key( shard, primary, request );
+	shard->sketch.increment( hash );
+
+	auto it = shard->index.find( key );
+	if( it == shard->index.end() )
+	{
+		++misses;
+		return( nullptr );
+	}
+	if( Thread::milliseconds() >= it->second->response->expires )
+	{
+		erase( shard, it->second );
+		++misses;
+		return( nullptr );
+	}
+	shard->lru.splice( shard->lru.begin(), shard->lru, it->second );
+	++hits;
+	return( it->second->response );
+}
+
+// store a response; returns it (admitted or not) for any waiting requests
+
+shared_ptr< CachedResponse >
+Cache :: insert( HTTPParser *request, string_view vary, string data, size_t statusLineLen, int64_t ttl, bool close )
+{
+	if( data.size() > maxObjectSize )
+		return( nullptr );
+	string primary = primaryKey( request );
+	uint64_t hash;
+	Shard *shard = this->shard( primary, &hash );
+
+	vector< string > names;
+	const char *c = vary.data();
+	const char *end = c + vary.size();
+	while( c < end )
+	{
+		const char *comma = HTTPScan::find( c, end, ',' );
+		string name;
+		for( ; c < comma; c++ )
+		{
+			if( *c != ' ' && *c != '\t' )
+				name += tolower( *c );
+		}
+		if( !name.empty() )
+			names.push_back( name );
+		c = comma + 1;
+	}
+	string key = names.empty() ? primary : variantKey( primary, request, names );
+
+	shared_ptr< CachedResponse > response = make_shared< CachedResponse >();
+	response->stored = Thread::milliseconds();
+	response->expires = response->stored + ttl;
+	response->statusLineLen = statusLineLen;
+	response->close = close;
+	response->data = move( data );
+	response->key = key;
+	size_t size = response->data.size();
+	size_t budget = this->size / shards.size();
+
+	lock_guard< mutex > lock( shard->shardMutex );
+	auto existing = shard->index.find( key );
+	if( existing != shard->index.end() )
+		erase( shard, existing->second );
+	if( names.empty() )
+		shard->vary.erase( primary );
+	else
+		shard->vary[ primary ] = names;
+	while( shard->bytes + size > budget && !shard->lru.empty() )
+	{
+		// TinyLFU: only displace entries requested less often
+		Entry& victim = shard->lru.back();
+		if( shard->sketch.estimate( hash ) <= shard->sketch.estimate( victim.hash ) )
+		{
+			++rejections;
+			return( response );
+		}
+		erase( shard, prev( shard->lru.end() ) );
+		++evictions;
+	}
+	shard->lru.push_front( Entry{ key, hash, response } );
+	shard->index[ key ] = shard->lru.begin();
+	shard->bytes += size;
+	++insertions;
+	return( response );
+}
+
+// the shard holding a primary key's entries
+
+Cache::Shard *
+Cache :: shard( const string& primary, uint64_t *hash )
+{
+	uint64_t h = std::hash< string >()( primary );
+	if( hash )
+		*hash = h;
+	return( shards[ h % shards.size() ] );
+}
+
+// the lookup key for a request (its variant key once the response has said
+// what it Varies on); shardMutex held
+
+string
+Cache :: key( Shard *shard, const string& primary, HTTPParser *request )
+{
+	auto vary = shard->vary.find( primary );
+	return( vary == shard->vary.end() ? primary : variantKey( primary, request, vary->second ) );
+}
+
+// join the fetch of an identical request already on its way to a backend,
+// or (*leader) become the one fetching
+
+shared_ptr< InFlight >
+Cache :: join( HTTPParser *request, bool *leader )
+{
+	string primary = primaryKey( request );
+	Shard *shard = this->shard( primary );
+	lock_guard< mutex > lock( shard->shardMutex );
+	string key = this->key( shard, primary, request );
+	shared_ptr< InFlight > inFlight;
+	auto it = shard->inFlight.find( key );
+	if( (*leader = it == shard->inFlight.end()) )
+	{
+		inFlight = make_shared< InFlight >();
+		inFlight->key = key;
+		shard->inFlight[ key ] = inFlight;
+	}
+	else
+		inFlight = it->second;
+	return( inFlight );
+}
+
+void
+Cache :: finish( shared_ptr< InFlight > inFlight, shared_ptr< CachedResponse > response )
+{
+	Shard *shard = this->shard( inFlight->key.substr( 0, inFlight->key.find( '\n' ) ) );
+	{
+		lock_guard< mutex > lock( shard->shardMutex );
+		auto it = shard->inFlight.find( inFlight->key );
+		if( it != shard->inFlight.end() && it->second == inFlight )
+			shard->inFlight.erase( it );
+	}
+	inFlight->finish( response );
+}
+
+// wait for the leader's response; null if there's none (not shareable, or
+// timed out) or it's a different variant than this request asked for
+
+shared_ptr< CachedResponse >
+Cache :: wait( shared_ptr< InFlight > inFlight, HTTPParser *request, int timeout )
+{
+	shared_ptr< CachedResponse > response = inFlight->wait( timeout );
+	if( !response )
+		return( nullptr );
+	string primary = primaryKey( request );
+	Shard *shard = this->shard( primary );
+	string key;
+	{
+		lock_guard< mutex > lock( shard->shardMutex );
+		key = this->key( shard, primary, request );
+	}
+	if( key != response->key )
+		return( nullptr );
+	++coalesced;
+	return( response );
+}
+
+shared_ptr< CachedResponse >
+InFlight :: wait( int timeout )
+{
+	unique_lock< mutex > lock( inFlightMutex );
+	finished.wait_for( lock, std::chrono::milliseconds( timeout ), [ this ] { return( done ); } );
+	return( response );
+}
+
+void
+InFlight :: finish( shared_ptr< CachedResponse > response )
+{
+	lock_guard< mutex > lock( inFlightMutex );
+	this->response = response;
+	done = true;
+	finished.notify_all();
+}
+
+size_t
+Cache :: bytes( void )
+{
+	size_t total = 0;
+	for( auto it = shards.begin(); it != shards.end(); it++ )
+	{
+		lock_guard< mutex > lock( (*it)->shardMutex );
+		total += (*it)->bytes;
+	}
+	return( total );
+}
+
+size_t
+Cache :: entries( void )
+{
+	size_t total = 0;
+	for( auto it = shards.begin(); it != shards.end(); it++ )
+	{
+		lock_guard< mutex > lock( (*it)->shardMutex );
+		total += (*it)->index.size();
+	}
+	return( total );
+}
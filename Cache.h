@@ -0,0 +1,142 @@
+//
+//  Cache.h
+//  Layer7LoadBalancer
+//  Created by Rick Tyler
+//
+//  SPDX-License-Identifier: MIT
+
+# ifndef _Cache_h_
+# define _Cache_h_
+
+# include "HTTPParser.h"
+# include <atomic>
+# include <condition_variable>
+# include <list>
+# include <memory>
+# include <mutex>
+# include <string>
+# include <unordered_map>
+# include <vector>
+# include <stdint.h>
+
+using namespace std;
+
+// a stored response, relayed byte for byte (with an Age header added)
+
+class CachedResponse
+{
+    public:
+
+	string data;			// status line, headers and body as received
+	size_t statusLineLen = 0;	// Age goes after the status line
+	int64_t stored = 0;		// ms
+	int64_t expires = 0;		// ms
+	bool close = false;		// response ends its connection
+	string key;			// including the Vary headers' values
+};
+
+// A cache miss being fetched. Identical requests arriving meanwhile wait
+// for it rather than going to a backend themselves, then all relay the one
+// response (null if it turned out not to be shareable).
+
+class InFlight
+{
+    public:
+
+	shared_ptr< CachedResponse > wait( int timeout );
+	void finish( shared_ptr< CachedResponse > response );
+	string key;
+
+    private:
+
+	mutex inFlightMutex;
+	condition_variable finished;
+	bool done = false;
+	shared_ptr< CachedResponse > response;
+};
+
+// Frequency estimate for TinyLFU admission: 4 rows of 4-bit counters
+// (kept in bytes), all halved every sampleSize increments so popularity
+// ages out.
+
+class FrequencySketch
+{
+    public:
+
+	FrequencySketch( size_t width );
+	void increment( uint64_t hash );
+	int estimate( uint64_t hash );
+
+    private:
+
+	vector< uint8_t > counters;
+	size_t mask;
+	size_t additions = 0;
+	size_t sampleSize;
+	size_t index( uint64_t hash, int row ) { return( ((uint32_t) hash + row * (uint32_t) (hash >> 32)) & mask ); }
+};
+
+// Sharded in-memory HTTP response cache. Responses are keyed on method,
+// host and path, plus the request headers the response Varies on. Each
+// shard is an LRU list under a byte budget; when something has to be
+// evicted, a new response is only admitted if the sketch says it's been
+// requested more often than the entry it would evict (TinyLFU).
+
+class Cache
+{
+    public:
+
+	Cache( size_t size, size_t maxObjectSize = 0 );
+	~Cache();
+	shared_ptr< CachedResponse > lookup( HTTPParser *request );
+	shared_ptr< CachedResponse > insert( HTTPParser *request, string_view vary, string data, size_t statusLineLen, int64_t ttl, bool close );
+	shared_ptr< InFlight > join( HTTPParser *request, bool *leader );
+	shared_ptr< CachedResponse > wait( shared_ptr< InFlight > inFlight, HTTPParser *request, int timeout );
+	void finish( shared_ptr< InFlight > inFlight, shared_ptr< CachedResponse > response );
+	size_t bytes( void );
+	size_t entries( void );
+	static bool isCacheable( HTTPParser *request, bool *lookup );
+	static int64_t freshness( HTTPParser *response );
+	size_t size;
+	size_t maxObjectSize;
+	atomic< size_t > hits;
+	atomic< size_t > misses;
+	atomic< size_t > insertions;
+	atomic< size_t > evictions;
+	atomic< size_t > rejections;	// refused admission
+	atomic< size_t > coalesced;	// misses answered by another session's fetch
+
+    private:
+
+	class Entry
+	{
+	    public:
+
+		string key;
+		uint64_t hash;
+		shared_ptr< CachedResponse > response;
+	};
+
+	class Shard
+	{
+	    public:
+
+		Shard( size_t width ) : sketch( width ) { }
+		mutex shardMutex;
+		list< Entry > lru;		// most recently used first
+		unordered_map< string, list< Entry >::iterator > index;
+		unordered_map< string, vector< string > > vary;	// header names, by primary key
+		unordered_map< string, shared_ptr< InFlight > > inFlight;
+		size_t bytes = 0;
+		FrequencySketch sketch;
+	};
+
+	vector< Shard * > shards;
+	static string primaryKey( HTTPParser *request );
+	static string variantKey( const string& primary, HTTPParser *request, const vector< string >& names );
+	void erase( Shard *shard, list< Entry >::iterator it );
+	Shard *shard( const string& primary, uint64_t *hash = nullptr );
+	static string key( Shard *shard, const string& primary, HTTPParser *request );
+};
+
+# endif // _Cache_h_
@@ -0,0 +1,99 @@
+//
+//  Certificates.cc
+//  Layer7LoadBalancer
+//  Created by Rick Tyler
+//
+//  SPDX-License-Identifier: MIT
+
+# include "Certificates.h"
+# include <ctype.h>
+# include <openssl/x509v3.h>
+
+// # define TRACE    1
+
+Certificates :: ~Certificates()
+{
+	for( auto it = contexts.begin(); it != contexts.end(); it++ )
+		SSL_CTX_free( *it );
+}
+
+void
+Certificates :: add( SSL_CTX *ssl_ctx )
+{
+	contexts.push_back( ssl_ctx );
+	X509 *cert = SSL_CTX_get0_certificate( ssl_ctx );
+	if( !cert )
+		return;
+	bool named = false;
+	GENERAL_NAMES *altNames = (GENERAL_NAMES *) X509_get_ext_d2i( cert, NID_subject_alt_name, nullptr, nullptr );
+	for( int i = 0; altNames && i < sk_GENERAL_NAME_num( altNames ); i++ )
+	{
+		GENERAL_NAME *altName = sk_GENERAL_NAME_value( altNames, i );
+		if( altName->type != GEN_DNS )
+			continue;
+		ASN1_IA5STRING *dns = altName->d.dNSName;
+		addName( string( (const char *) ASN1_STRING_get0_data( dns ), ASN1_STRING_length( dns ) ), ssl_ctx );
+		named = true;
+	}
+	GENERAL_NAMES_free( altNames );
+	if( named )
+		return;
+	// no DNS names: fall back to the subject's common name
+	X509_NAME *subject = X509_get_subject_name( cert );
+	int index = X509_NAME_get_index_by_NID( subject, NID_commonName, -1 );
+	if( index >= 0 )
+	{
+		ASN1_STRING *cn = X509_NAME_ENTRY_get_data( X509_NAME_get_entry( subject, index ) );
+		addName( string( (const char *) ASN1_STRING_get0_data( cn ), ASN1_STRING_length( cn ) ), ssl_ctx );
+	}
+}
+
+// the first certificate listing a name keeps it
+
+void
+Certificates :: addName( string name, SSL_CTX *ssl_ctx )
+{
+	for( auto it = name.begin(); it != name.end(); it++ )
+		*it = (char) tolower( (unsigned char) *it );
+	if( name.compare( 0, 2, "*." ) == 0 )
+		(void) wildcards.emplace( name.substr( 2 ), ssl_ctx );
+	else
+		(void) names.emplace( name, ssl_ctx );
+}
+
+SSL_CTX *
+Certificates :: select( string_view serverName )
+{
+	string name( serverName );
+	for( auto it = name.begin(); it != name.end(); it++ )
+		*it = (char) tolower( (unsigned char) *it );
+	if( !name.empty() && name.back() == '.' )
+		name.pop_back();
+	auto it = names.find( name );
+	if( it != names.end() )
+		return( it->second );
+	size_t dot = name.find( '.' );
+	if( dot != string::npos && !wildcards.empty() )
+	{
+		auto it = wildcards.find( name.substr( dot + 1 ) );
+		if( it != wildcards.end() )
+			return( it->second );
+	}
+	return( defaultContext() );
+}
+
+// OpenSSL's servername callback: switch the handshake to the certificate
+// for the name the client asked for
+
+int
+Certificates :: serverNameCallback( SSL *ssl, int *alert, void *arg )
+{
+	(void) alert;
+	const char *serverName = SSL_get_servername( ssl, TLSEXT_NAMETYPE_host_name );
+	if( !serverName )
+		return( SSL_TLSEXT_ERR_NOACK );
+	SSL_CTX *ssl_ctx = ((Certificates *) arg)->select( serverName );
+	if( ssl_ctx && ssl_ctx != SSL_get_SSL_CTX( ssl ) )
+		(void) SSL_set_SSL_CTX( ssl, ssl_ctx );
+	return( SSL_TLSEXT_ERR_OK );
+}
@@ -0,0 +1,47 @@
+//
+//  Certificates.h
+//  Layer7LoadBalancer
+//  Created by Rick Tyler
+//
+//  SPDX-License-Identifier: MIT
+
+# ifndef _Certificates_h_
+# define _Certificates_h_
+
+# include <string>
+# include <string_view>
+# include <unordered_map>
+# include <vector>
+# include <openssl/ssl.h>
+
+using namespace std;
+
+// The certificates a TLS listener serves, one preloaded SSL_CTX per
+// CERTIFICATE/KEY pair, chosen during the handshake by the client's SNI
+// name. Names come from each certificate (DNS subjectAltNames, else the
+// CN): exact names and "*.suffix" wildcards (one label, RFC 6125) are
+// hashed, so a lookup costs at most two probes however many hosts there
+// are. The first context is the default, for clients sending no name or
+// one that matches nothing.
+
+class Certificates
+{
+    public:
+
+	~Certificates();
+	void add( SSL_CTX *ssl_ctx );	// takes ownership
+	SSL_CTX *select( string_view serverName );
+	SSL_CTX *defaultContext( void ) { return( contexts.empty() ? nullptr : contexts.front() ); }
+	size_t size( void ) { return( contexts.size() ); }
+	size_t nameCount( void ) { return( names.size() + wildcards.size() ); }
+	static int serverNameCallback( SSL *ssl, int *alert, void *arg );
+
+    private:
+
+	vector< SSL_CTX * > contexts;
+	unordered_map< string, SSL_CTX * > names;	// exact host names
+	unordered_map< string, SSL_CTX * > wildcards;	// "*.example.com" as "example.com"
+	void addName( string name, SSL_CTX *ssl_ctx );
+};
+
+# endif // _Certificates_h_
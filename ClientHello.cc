@@ -0,0 +1,143 @@
+//
+//  ClientHello.cc
+//  Layer7LoadBalancer
+//  Created by Rick Tyler
+//
+//  SPDX-License-Identifier: MIT
+
+# include "ClientHello.h"
+# include <ctype.h>
+
+// # define TRACE    1
+
+# define RECORD_HANDSHAKE       22
+# define RECORD_HEADER_LEN      5
+# define RECORD_MAX             (16384 + 2048)
+# define HANDSHAKE_CLIENT_HELLO 1
+# define EXTENSION_SERVER_NAME  0
+# define EXTENSION_ALPN         16
+# define SERVER_NAME_HOST       0
+
+static size_t
+get16( const unsigned char *p )
+{
+	return( ((size_t) p[ 0 ] << 8) | p[ 1 ] );
+}
+
+static size_t
+get24( const unsigned char *p )
+{
+	return( ((size_t) p[ 0 ] << 16) | ((size_t) p[ 1 ] << 8) | p[ 2 ] );
+}
+
+// the handshake message is gathered from the records' payloads, so one
+// split across records parses like any other
+
+int
+ClientHello :: parse( const unsigned char *data, size_t len )
+{
+	serverName.clear();
+	protocols.clear();
+	error = nullptr;
+
+	string message;
+	size_t offset = 0;
+	while( offset + RECORD_HEADER_LEN <= len )
+	{
+		const unsigned char *record = data + offset;
+		if( record[ 0 ] != RECORD_HANDSHAKE )
+			return( fail( offset ? "handshake interrupted" : "not a TLS handshake" ) );
+		if( record[ 1 ] != 3 )
+			return( fail( "unsupported record version" ) );
+		size_t recordLen = get16( record + 3 );
+		if( recordLen == 0 || recordLen > RECORD_MAX )
+			return( fail( "bad record length" ) );
+		if( offset + RECORD_HEADER_LEN + recordLen > len )
+			break;
+		message.append( (const char *) record + RECORD_HEADER_LEN, recordLen );
+		offset += RECORD_HEADER_LEN + recordLen;
+		if( message.size() >= 4 )
+		{
+			const unsigned char *p = (const unsigned char *) message.data();
+			if( p[ 0 ] != HANDSHAKE_CLIENT_HELLO )
+				return( fail( "not a ClientHello" ) );
+			size_t messageLen = get24( p + 1 );
+			if( messageLen > CLIENT_HELLO_MAX )
+				return( fail( "ClientHello too long" ) );
+			if( message.size() >= 4 + messageLen )
+				return( parseMessage( p + 4, messageLen ) );
+		}
+	}
+	if( len && data[ 0 ] != RECORD_HANDSHAKE )
+		return( fail( "not a TLS handshake" ) );
+	return( CLIENT_HELLO_INCOMPLETE );
+}
+
+int
+ClientHello :: parseMessage( const unsigned char *p, size_t len )
+{
+	const unsigned char *end = p + len;
+
+	// legacy_version, random, session id, cipher suites, compression methods
+	if( end - p < 2 + 32 + 1 )
+		return( fail( "ClientHello truncated" ) );
+	p += 2 + 32;
+	p += 1 + p[ 0 ];
+	if( end - p < 2 || (size_t) (end - p) < 2 + get16( p ) )
+		return( fail( "ClientHello truncated" ) );
+	p += 2 + get16( p );
+	if( end - p < 1 || (size_t) (end - p) < 1 + (size_t) p[ 0 ] )
+		return( fail( "ClientHello truncated" ) );
+	p += 1 + p[ 0 ];
+	if( p == end )
+		return( CLIENT_HELLO_COMPLETE );	// no extensions, so no SNI
+
+	if( end - p < 2 || (size_t) (end - p) != 2 + get16( p ) )
+		return( fail( "bad extensions length" ) );
+	p += 2;
+	while( p < end )
+	{
+		if( end - p < 4 || (size_t) (end - p) < 4 + get16( p + 2 ) )
+			return( fail( "extension truncated" ) );
+		int type = (int) get16( p );
+		size_t extensionLen = get16( p + 2 );
+		if( parseExtension( type, p + 4, extensionLen ) == CLIENT_HELLO_ERROR )
+			return( CLIENT_HELLO_ERROR );
+		p += 4 + extensionLen;
+	}
+	return( CLIENT_HELLO_COMPLETE );
+}
+
+int
+ClientHello :: parseExtension( int type, const unsigned char *p, size_t len )
+{
+	if( type != EXTENSION_SERVER_NAME && type != EXTENSION_ALPN )
+		return( CLIENT_HELLO_COMPLETE );
+	if( len < 2 || get16( p ) != len - 2 )
+		return( fail( type == EXTENSION_ALPN ? "bad ALPN list" : "bad server name list" ) );
+	const unsigned char *end = p + len;
+	p += 2;
+	while( p < end )
+	{
+		if( type == EXTENSION_ALPN )
+		{
+			size_t protocolLen = p[ 0 ];
+			if( protocolLen == 0 || (size_t) (end - p) < 1 + protocolLen )
+				return( fail( "bad ALPN list" ) );
+			protocols.push_back( string( (const char *) p + 1, protocolLen ) );
+			p += 1 + protocolLen;
+			continue;
+		}
+		if( end - p < 3 || (size_t) (end - p) < 3 + get16( p + 1 ) )
+			return( fail( "bad server name list" ) );
+		size_t nameLen = get16( p + 1 );
+		if( p[ 0 ] == SERVER_NAME_HOST && serverName.empty() )
+		{
+			serverName.assign( (const char *) p + 3, nameLen );
+			for( size_t i = 0; i < nameLen; i++ )
+				serverName[ i ] = (char) tolower( (unsigned char) serverName[ i ] );
+		}
+		p += 3 + nameLen;
+	}
+	return( CLIENT_HELLO_COMPLETE );
+}
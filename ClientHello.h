@@ -0,0 +1,44 @@
+//
+//  ClientHello.h
+//  Layer7LoadBalancer
+//  Created by Rick Tyler
+//
+//  SPDX-License-Identifier: MIT
+
+# ifndef _ClientHello_h_
+# define _ClientHello_h_
+
+# include <string>
+# include <vector>
+# include <stddef.h>
+
+using namespace std;
+
+# define CLIENT_HELLO_INCOMPLETE    0
+# define CLIENT_HELLO_COMPLETE      1
+# define CLIENT_HELLO_ERROR        -1
+
+# define CLIENT_HELLO_MAX    65536	// handshake message bytes, across records
+
+// What a TLS passthrough listener routes on: the server name (SNI) and
+// offered protocols (ALPN) of a ClientHello, read from bytes peeked off
+// the client's socket, which the backend then sees untouched. The message
+// may span several handshake records.
+
+class ClientHello
+{
+    public:
+
+	int parse( const unsigned char *data, size_t len );
+	string serverName;		// lowercased; empty when the client sent none
+	vector< string > protocols;	// ALPN, in the client's order
+	const char *error = nullptr;
+
+    private:
+
+	int fail( const char *error ) { this->error = error; return( CLIENT_HELLO_ERROR ); }
+	int parseMessage( const unsigned char *p, size_t len );
+	int parseExtension( int type, const unsigned char *p, size_t len );
+};
+
+# endif // _ClientHello_h_
@@ -0,0 +1,266 @@
+//
+//  Compression.cc
+//  Layer7LoadBalancer
+//  Created by Rick Tyler
+//
+//  SPDX-License-Identifier: MIT
+
+# include "Compression.h"
+# include "HTTPScan.h"
+# include "Exception.h"
+# include <stdlib.h>
+# include <string.h>
+
+// # define TRACE    1
+
+# define GZIP_LEVEL              6
+# define ZSTD_LEVEL              3
+# define COMPRESS_CHUNK          16384	// output grows by this much at a time
+# define MAX_IDLE_COMPRESSORS    64	// per encoding
+
+mutex Compressor::poolMutex;
+vector< Compressor * > Compressor::idle[ 2 ];
+
+Compression :: Compression( int encodings, size_t minSize, const vector< string >& types )
+{
+	this->encodings = encodings;
+	this->minSize = minSize;
+	this->types = types;
+	responses = bytesIn = bytesOut = 0;
+}
+
+static string_view
+trim( const char *start, const char *end )
+{
+	while( start < end && (*start == ' ' || *start == '\t') )
+		++start;
+	while( end > start && (end[ -1 ] == ' ' || end[ -1 ] == '\t') )
+		--end;
+	return( string_view( start, end - start ) );
+}
+
+// COMPRESS value (e.g. gzip,zstd) to an encoding set, -1 if it names one
+// this build doesn't support
+
+int
+Compression :: parseEncodings( const string& list )
+{
+	int encodings = 0;
+	const char *c = list.data();
+	const char *end = c + list.size();
+	while( c < end )
+	{
+		const char *comma = HTTPScan::find( c, end, ',' );
+		string_view name = trim( c, comma );
+		if( name == "gzip" )
+			encodings |= ENCODING_GZIP;
+# if HAVE_ZSTD
+		else if( name == "zstd" )
+			encodings |= ENCODING_ZSTD;
+# endif // HAVE_ZSTD
+		else
+			return( -1 );
+		c = comma + 1;
+	}
+	return( encodings );
+}
+
+// encodings the client's Accept-Encoding allows (q=0 excludes one; * stands
+// for any not listed); none unless it can take a chunked response
+
+int
+Compression :: accepted( HTTPParser *request )
+{
+	if( request->version != "HTTP/1.1" )
+		return( 0 );
+	int listed = 0, allowed = 0;
+	bool any = false;
+	for( auto it = request->headers.begin(); it != request->headers.end(); it++ )
+	{
+		if( !equalsIgnoreCase( it->name, "Accept-Encoding" ) )
+			continue;
+		const char *c = it->value.data();
+		const char *end = c + it->value.size();
+		while( c < end )
+		{
+			const char *comma = HTTPScan::find( c, end, ',' );
+			const char *semicolon = HTTPScan::find( c, comma, ';' );
+			string_view name = trim( c, semicolon );
+			bool zero = false;
+			if( semicolon < comma )
+			{
+				string_view param = trim( semicolon + 1, comma );
+				if( param.size() > 2 && (param[ 0 ] == 'q' || param[ 0 ] == 'Q') && param[ 1 ] == '=' )
+					zero = strtod( string( param.substr( 2 ) ).c_str(), nullptr ) <= 0;
+			}
+			int encoding = equalsIgnoreCase( name, "gzip" ) || equalsIgnoreCase( name, "x-gzip" ) ? ENCODING_GZIP
+				: equalsIgnoreCase( name, "zstd" ) ? ENCODING_ZSTD : 0;
+			listed |= encoding;
+			if( !zero )
+				allowed |= encoding;
+			if( name == "*" )
+				any = !zero;
+			c = comma + 1;
+		}
+	}
+	if( any )
+		allowed |= (ENCODING_GZIP | ENCODING_ZSTD) & ~listed;
+	return( allowed );
+}
+
+const char *
+Compression :: name( int encoding )
+{
+	return( encoding == ENCODING_ZSTD ? "zstd" : "gzip" );
+}
+
+// the encoding to use for a client accepting these, 0 for none; zstd is
+// preferred, being both faster and smaller
+
+int
+Compression :: select( int accepted ) const
+{
+	int usable = encodings & accepted;
+	if( usable & ENCODING_ZSTD )
+		return( ENCODING_ZSTD );
+	return( usable & ENCODING_GZIP );
+}
+
+bool
+Compression :: applies( HTTPParser *response, HTTPBody *body ) const
+{
+	if( response->status != 200 || body->framing == HTTP_BODY_NONE )
+		return( false );
+	if( body->framing == HTTP_BODY_LENGTH && body->length < minSize )
+		return( false );
+	if( !response->header( "Content-Encoding" ).empty() || !response->header( "Content-Range" ).empty()
+		|| response->hasToken( "Cache-Control", "no-transform" ) )
+		return( false );
+	string_view type = response->header( "Content-Type" );
+	for( auto it = types.begin(); it != types.end(); it++ )
+	{
+		if( type.size() >= it->size() && equalsIgnoreCase( type.substr( 0, it->size() ), *it ) )
+			return( true );
+	}
+	return( false );
+}
+
+Compressor :: Compressor( int encoding )
+{
+	this->encoding = encoding;
+	memset( &zs, 0, sizeof( zs ) );
+	if( encoding == ENCODING_GZIP )
+	{
+		// window bits + 16: gzip header and trailer
+		if( deflateInit2( &zs, GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY ) != Z_OK )
+			Exception::raise( "Compressor: deflateInit2() failed" );
+	}
+# if HAVE_ZSTD
+	else
+	{
+		if( !(cctx = ZSTD_createCCtx()) )
+			Exception::raise( "Compressor: ZSTD_createCCtx() failed" );
+		ZSTD_CCtx_setParameter( cctx, ZSTD_c_compressionLevel, ZSTD_LEVEL );
+	}
+# endif // HAVE_ZSTD
+}
+
+Compressor :: ~Compressor()
+{
+	if( encoding == ENCODING_GZIP )
+		deflateEnd( &zs );
+# if HAVE_ZSTD
+	else
+		ZSTD_freeCCtx( cctx );
+# endif // HAVE_ZSTD
+}
+
+void
+Compressor :: reset( void )
+{
+	if( encoding == ENCODING_GZIP )
+		deflateReset( &zs );
+# if HAVE_ZSTD
+	else
+		ZSTD_CCtx_reset( cctx, ZSTD_reset_session_only );
+# endif // HAVE_ZSTD
+}
+
+Compressor *
+Compressor :: get( int encoding )
+{
+	{
+		lock_guard< mutex > lock( poolMutex );
+		vector< Compressor * >& pool = idle[ encoding == ENCODING_ZSTD ];
+		if( !pool.empty() )
+		{
+			Compressor *compressor = pool.back();
+			pool.pop_back();
+			return( compressor );
+		}
+	}
+	return( new Compressor( encoding ) );
+}
+
+// back to the pool, ready for the next response
+
+void
+Compressor :: release( Compressor *compressor )
+{
+	compressor->reset();
+	{
+		lock_guard< mutex > lock( poolMutex );
+		vector< Compressor * >& pool = idle[ compressor->encoding == ENCODING_ZSTD ];
+		if( pool.size() < MAX_IDLE_COMPRESSORS )
+		{
+			pool.push_back( compressor );
+			return;
+		}
+	}
+	delete( compressor );
+}
+
+// append the compressed form of data to out, flushed so the client can decode
+// everything it has been sent (streamed responses like SSE don't stall behind
+// the compressor); finish ends the stream
+
+bool
+Compressor :: compress( const char *data, size_t len, bool finish, string *out )
+{
+	if( encoding == ENCODING_GZIP )
+	{
+		zs.next_in = (Bytef *) data;
+		zs.avail_in = (uInt) len;
+		do
+		{
+			size_t at = out->size();
+			out->resize( at + COMPRESS_CHUNK );
+			zs.next_out = (Bytef *) &(*out)[ at ];
+			zs.avail_out = COMPRESS_CHUNK;
+			int result = deflate( &zs, finish ? Z_FINISH : Z_SYNC_FLUSH );
+			out->resize( at + COMPRESS_CHUNK - zs.avail_out );
+			if( result == Z_STREAM_ERROR )
+				return( false );
+		}
+		while( zs.avail_out == 0 || zs.avail_in > 0 );
+		return( true );
+	}
+# if HAVE_ZSTD
+	ZSTD_inBuffer in = { data, len, 0 };
+	size_t remaining;
+	do
+	{
+		size_t at = out->size();
+		out->resize( at + COMPRESS_CHUNK );
+		ZSTD_outBuffer output = { &(*out)[ at ], COMPRESS_CHUNK, 0 };
+		remaining = ZSTD_compressStream2( cctx, &output, &in, finish ? ZSTD_e_end : ZSTD_e_flush );
+		out->resize( at + output.pos );
+		if( ZSTD_isError( remaining ) )
+			return( false );
+	}
+	while( remaining != 0 );
+	return( true );
+# else
+	return( false );
+# endif // HAVE_ZSTD
+}
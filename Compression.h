@@ -0,0 +1,74 @@
+//
+//  Compression.h
+//  Layer7LoadBalancer
+//  Created by Rick Tyler
+//
+//  SPDX-License-Identifier: MIT
+
+# ifndef _Compression_h_
+# define _Compression_h_
+
+# include "HTTPParser.h"
+# include <atomic>
+# include <mutex>
+# include <string>
+# include <vector>
+# include <zlib.h>
+# if HAVE_ZSTD
+# include <zstd.h>
+# endif // HAVE_ZSTD
+
+using namespace std;
+
+# define ENCODING_GZIP    1	// bits in an encoding set
+# define ENCODING_ZSTD    2
+
+// Which responses from a pool are compressed on the way to the client:
+// those of an allowed Content-Type (prefix match) at least minSize bytes
+// long (chunked and close-delimited bodies are assumed to be), not already
+// encoded, to clients that accept one of the configured encodings.
+
+class Compression
+{
+    public:
+
+	Compression( int encodings, size_t minSize, const vector< string >& types );
+	static int parseEncodings( const string& list );
+	static int accepted( HTTPParser *request );
+	static const char *name( int encoding );
+	int select( int accepted ) const;
+	bool applies( HTTPParser *response, HTTPBody *body ) const;
+	int encodings;
+	size_t minSize;
+	vector< string > types;
+	atomic< size_t > responses;	// compressed
+	atomic< size_t > bytesIn;
+	atomic< size_t > bytesOut;
+};
+
+// A gzip or zstd stream. Streams are pooled per encoding and reset between
+// responses, so their (large) state isn't reallocated for each one.
+
+class Compressor
+{
+    public:
+
+	static Compressor *get( int encoding );
+	static void release( Compressor *compressor );
+	bool compress( const char *data, size_t len, bool finish, string *out );
+	int encoding;
+
+    private:
+
+	Compressor( int encoding );
+	~Compressor();
+	void reset( void );
+	z_stream zs;
+# if HAVE_ZSTD
+	ZSTD_CCtx *cctx = nullptr;
+# endif // HAVE_ZSTD
+	static mutex poolMutex;
+	static vector< Compressor * > idle[ 2 ];	// by encoding
+};
+
+# endif // _Compression_h_
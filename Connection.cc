@@ -6,15 +6,23 @@
 //  SPDX-License-Identifier: MIT
 
 # include "Connection.h"
+# include "HTTP2Client.h"
 # include "Thread.h"
 # include "Exception.h"
 # include "Log.h"
 # include <fcntl.h>
+# include <limits.h>
+# include <poll.h>
+# include <string.h>
+# include <string>
 
 # include <signal.h>
 
 // # define TRACE    1
 
+# define CONNECT_WAIT    10000	// ms per connect() attempt when no timeout is given
+# define WRITEV_COALESCE_MAX    1024	// bytes of a final segment copied to share the header's record
+
 using namespace std;
 
 # define SSL_error() ERR_error_string( ERR_get_error(), NULL )
@@ -22,10 +30,11 @@ using namespace std;
 SSL_CTX * Connection :: ssl_ctx = nullptr;
 mutex Connection :: mutex;
 
-Connection :: Connection ( const char *destStr, bool useTLS )
+Connection :: Connection ( const char *destStr, bool useTLS, int timeout, bool offerHTTP2 )
 {
 	sockAddr = new SocketAddress( destStr );
 	this->useTLS = useTLS;
+	int64_t deadline = timeout > 0 ? Thread::milliseconds() + timeout : 0;
 
 	Connection::mutex.lock();
 
@@ -60,6 +69,9 @@ Connection :: Connection ( const char *destStr, bool useTLS )
 	
 	for( ;; )
 	{
+		if( deadline && Thread::milliseconds() >= deadline )
+			Exception::raise( "Connection::Connection( \"%s\" ) connect() timed out (%dms)", destStr, timeout );
+
 		socket = ::socket( AF_INET, SOCK_STREAM, 0 );
 		if( socket == -1 )
 			Exception::raise( "Connection::Connection( \"%s\" ) socket() failed (%s)", destStr, strerror( errno ) );
@@ -93,11 +105,12 @@ Connection :: Connection ( const char *destStr, bool useTLS )
 				FD_ZERO( &fdset );
 				FD_ZERO( &empty_fdset );
 				FD_SET( socket, &fdset );
+				int64_t wait = deadline ? max( (int64_t) 0, deadline - Thread::milliseconds() ) : CONNECT_WAIT;
 				struct timeval timeout;
-				timeout.tv_sec = 0; 
-				timeout.tv_usec = 100000; 
+				timeout.tv_sec = wait / 1000; 
+				timeout.tv_usec = (wait % 1000) * 1000; 
 
-				result = select( socket, &empty_fdset, &fdset, &empty_fdset, &timeout ); 
+				result = select( socket + 1, &empty_fdset, &fdset, &empty_fdset, &timeout ); 
 
 				if( result < 0 && errno != EINTR )
 				{
@@ -121,24 +134,21 @@ Connection :: Connection ( const char *destStr, bool useTLS )
 # ifdef TRACE
 						Log::console( "Connection::Connection( \"%s\" ) getsockopt() failed (%s) [%d]",
 							destStr, strerror( optval ), optval );
-# endif // TRACE
-						if( optval == 61 )
-						{
-							(void) close( socket );
-							Exception::raise( "Connection::Connection( \"%s\" ) server down?", destStr, strerror( errno ) );
-						}
-						else
-							continue;
-					}
-					else
-					{ 
-# ifdef TRACE
-						Log::console( "Connection::Connection( \"%s\" ) select() timed out", destStr );
 # endif // TRACE
 						(void) close( socket );
+						if( optval == ECONNREFUSED )
+							Exception::raise( "Connection::Connection( \"%s\" ) server down?", destStr );
 						continue;
-					} 
+					}
 				}
+				else
+				{ 
+# ifdef TRACE
+					Log::console( "Connection::Connection( \"%s\" ) select() timed out", destStr );
+# endif // TRACE
+					(void) close( socket );
+					continue;
+				} 
 			}
 			else
 				Exception::raise( "Connection::Connection( \"%s\" ) connect() failed (%s)", destStr, strerror( errno ) );
@@ -164,6 +174,20 @@ Connection :: Connection ( const char *destStr, bool useTLS )
 			destStr, strerror( errno ) );
 	} 
 
+	if( timeout > 0 )
+	{
+		// bound the handshake and any later blocking I/O on this connection
+		struct timeval tv;
+		tv.tv_sec = timeout / 1000;
+		tv.tv_usec = (timeout % 1000) * 1000;
+		if( setsockopt( socket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof( tv ) ) < 0
+			|| setsockopt( socket, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof( tv ) ) < 0 )
+		{
+			(void) close( socket );
+			Exception::raise( "Connection::Connection( \"%s\" ) setsockopt( SO_RCVTIMEO ) failed (%s)", destStr, strerror( errno ) );
+		}
+	}
+
 	if( useTLS )
 	{
 		if( !(ssl = SSL_new( Connection::ssl_ctx )) )
@@ -178,6 +202,14 @@ Connection :: Connection ( const char *destStr, bool useTLS )
 			Exception::raise( "Connection::Connection( %s ) SSL_set_fd() failed (%s)", destStr, SSL_error() );
 		}
 
+		// ALPN protocol list: "h2", then "http/1.1" for servers without it
+		static const unsigned char protocols[] = "\x02h2\x08http/1.1";
+		if( offerHTTP2 && SSL_set_alpn_protos( ssl, protocols, sizeof( protocols ) - 1 ) != 0 )
+		{
+			(void) close( socket );
+			Exception::raise( "Connection::Connection( %s ) SSL_set_alpn_protos() failed (%s)", destStr, SSL_error() );
+		}
+
 		int SSL_connected;
 		if( (SSL_connected = SSL_connect( ssl )) <= 0 )
 		{
@@ -185,6 +217,11 @@ Connection :: Connection ( const char *destStr, bool useTLS )
 			Exception::raise( "Connection::Connection( %s ) SSL_connect() failed (%s) [%d]",
 				destStr, SSL_connected == -1 ? "out of resource?" : SSL_error(), SSL_connected );
 		}
+
+		const unsigned char *protocol = nullptr;
+		unsigned int protocolLen = 0;
+		SSL_get0_alpn_selected( ssl, &protocol, &protocolLen );
+		http2 = protocolLen == 2 && memcmp( protocol, "h2", 2 ) == 0;
 	}
 
 # if TRACE
@@ -192,18 +229,61 @@ Connection :: Connection ( const char *destStr, bool useTLS )
 # endif // TRACE
 }
 
+Connection :: Connection( HTTP2ClientStream *stream )
+{
+	this->socket = -1;
+	this->useTLS = false;
+	this->http2 = true;
+	this->stream = stream;
+}
+
 ssize_t
 Connection :: pending( void )
 {
+	if( stream )
+		return( stream->pending() );
 	if( useTLS )
 		return SSL_pending( ssl );
 	char c;
-	return peek( &c, 1 );
+	ssize_t n = recv( socket, &c, 1, MSG_PEEK | MSG_DONTWAIT );
+	return( n > 0 ? n : 0 );
+}
+
+// true once there is something to read (or EOF) within timeout ms, -1 waits indefinitely
+
+bool
+Connection :: wait( int timeout )
+{
+	if( stream )
+		return( stream->wait( timeout ) );
+	if( useTLS && SSL_pending( ssl ) > 0 )
+		return( true );
+	struct pollfd pfd = { socket, POLLIN, 0 };
+	int result;
+	while( (result = poll( &pfd, 1, timeout )) < 0 && errno == EINTR )
+		;
+	return( result > 0 );
+}
+
+// an idle keep-alive connection can be reused if the server hasn't closed it
+// (or sent anything unsolicited) since the last response
+
+bool
+Connection :: isReusable( void )
+{
+	if( stream )
+		return( false );
+	if( useTLS && SSL_pending( ssl ) > 0 )
+		return( false );
+	struct pollfd pfd = { socket, POLLIN, 0 };
+	return( poll( &pfd, 1, 0 ) == 0 );
 }
 
 ssize_t
 Connection :: peek( void *buf, size_t len )
 {
+	if( stream )
+		return( -1 );
 	if( useTLS )
 		return( SSL_peek( ssl, buf, (int) len ) );
 	return( recv( socket, buf, len, MSG_PEEK ) );
@@ -211,6 +291,8 @@ Connection :: peek( void *buf, size_t len )
 
 ssize_t
 Connection :: read( void *buf, size_t len ) {
+	if( stream )
+		return( stream->read( buf, len ) );
 	if( useTLS )
 		return( SSL_read( ssl, buf, (int) len ) );
 	return( recv( socket, buf, len, 0 ) );
@@ -219,16 +301,85 @@ Connection :: read( void *buf, size_t len ) {
 ssize_t
 Connection :: write( void *data, size_t len )
 {
+	if( stream )
+		return( stream->write( (const char *) data, len ) );
 	if( useTLS )
 		return( SSL_write( ssl, data, (int) len ) );
 	return( send( socket, data, len, 0 ) );
 } 
 
+// write every segment, -1 on failure. An HTTP/2 stream takes them one at a
+// time. TLS has no gather write, so the header segments are coalesced into
+// one record rather than one record each. The last segment (the header's
+// end and any body read with it) joins them when it's at most
+// WRITEV_COALESCE_MAX bytes, and is written in place when it's longer, so
+// no more than that of a body is ever copied.
+
+ssize_t
+Connection :: writev( const struct iovec *iov, int count )
+{
+	size_t total = 0;
+	for( int i = 0; i < count; i++ )
+		total += iov[ i ].iov_len;
+	if( stream )
+	{
+		for( int i = 0; i < count; i++ )
+		{
+			if( stream->write( (const char *) iov[ i ].iov_base, iov[ i ].iov_len ) < 0 )
+				return( -1 );
+		}
+		return( (ssize_t) total );
+	}
+	if( useTLS )
+	{
+		static thread_local string coalesced;
+		coalesced.clear();
+		int last = count - 1;
+		bool inPlace = count > 0 && iov[ last ].iov_len > WRITEV_COALESCE_MAX;
+		for( int i = 0; i < (inPlace ? last : count); i++ )
+			coalesced.append( (const char *) iov[ i ].iov_base, iov[ i ].iov_len );
+		size_t written;
+		if( !coalesced.empty() && SSL_write_ex( ssl, coalesced.data(), coalesced.size(), &written ) != 1 )
+			return( -1 );
+		if( inPlace && SSL_write_ex( ssl, iov[ last ].iov_base, iov[ last ].iov_len, &written ) != 1 )
+			return( -1 );
+		return( (ssize_t) total );
+	}
+	struct iovec segments[ IOV_MAX ];
+	if( count > IOV_MAX )
+		return( -1 );
+	memcpy( segments, iov, count * sizeof( struct iovec ) );
+	struct iovec *next = segments;
+	size_t left = total;
+	while( left )
+	{
+		ssize_t sent = ::writev( socket, next, count );
+		if( sent <= 0 )
+			return( -1 );
+		left -= sent;
+		// skip what went, resuming mid-segment if need be
+		while( count && (size_t) sent >= next->iov_len )
+		{
+			sent -= next->iov_len;
+			++next;
+			--count;
+		}
+		if( count )
+		{
+			next->iov_base = (char *) next->iov_base + sent;
+			next->iov_len -= sent;
+		}
+	}
+	return( (ssize_t) total );
+}
+
 Connection :: ~Connection ()
 {
 # if TRACE
 	Log::console( "Connection::~Connection" );
 # endif // TRACE
+	if( stream )
+		delete( stream );
 	if( ssl )
 	{
 		SSL_shutdown( ssl );
@@ -11,20 +11,29 @@
 # include "SocketAddress.h"
 # include <openssl/ssl.h>
 # include <openssl/err.h>
+# include <sys/uio.h>
 
 using namespace std;
 
+class HTTP2ClientStream;
+
 class Connection
 {
     public:
 
-	Connection( const char *destStr, bool secure = true ); 
+	Connection( const char *destStr, bool secure = true, int timeout = 0, bool offerHTTP2 = false );
+	Connection( HTTP2ClientStream *stream );	// a request on a multiplexed connection
 	~Connection();
 	ssize_t write( void *data, size_t len );
+	ssize_t writev( const struct iovec *iov, int count );
 	ssize_t peek( void *buf, size_t len );
 	ssize_t read( void *buf, size_t len );
 	ssize_t pending( void ); 
+	bool wait( int timeout );
+	bool isReusable( void );
+	bool isMultiplexed( void ) { return( stream != nullptr ); }
 	int socket;
+	bool http2 = false;		// the server took "h2" by ALPN
 	static SSL_CTX *ssl_ctx;
 
     private:
@@ -32,7 +41,10 @@ class Connection
 	SocketAddress *sockAddr = nullptr;
 	SSL *ssl = nullptr;
 	bool useTLS;
+	HTTP2ClientStream *stream = nullptr;
 	static mutex mutex;
+
+    friend class ProxySession;
 };
 
 # endif // _Connection_h_
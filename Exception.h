@@ -16,7 +16,7 @@ class Exception
 	{
 		va_list args;
 		va_start( args, fmt );
-		static char buf[ 8192 ];
+		static thread_local char buf[ 8192 ];
 		vsprintf( buf, fmt, args );
 		va_end( args );
 		throw( (const char *) buf );
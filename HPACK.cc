@@ -0,0 +1,523 @@
+//
+//  HPACK.cc
+//  Layer7LoadBalancer
+//  Created by Rick Tyler
+//
+//  SPDX-License-Identifier: MIT
+
+# include "HPACK.h"
+# include <string.h>
+
+// # define TRACE    1
+
+# define STATIC_ENTRIES    61
+# define ENTRY_OVERHEAD    32	// RFC 7541 4.1
+# define INDEX_VALUE_MAX   256	// longer values aren't worth a table entry
+# define HUFFMAN_EOS       256
+
+static const struct { const char *name; const char *value; } staticTable[ STATIC_ENTRIES ] =
+{
+	{ ":authority", "" },
+	{ ":method", "GET" },
+	{ ":method", "POST" },
+	{ ":path", "/" },
+	{ ":path", "/index.html" },
+	{ ":scheme", "http" },
+	{ ":scheme", "https" },
+	{ ":status", "200" },
+	{ ":status", "204" },
+	{ ":status", "206" },
+	{ ":status", "304" },
+	{ ":status", "400" },
+	{ ":status", "404" },
+	{ ":status", "500" },
+	{ "accept-charset", "" },
+	{ "accept-encoding", "gzip, deflate" },
+	{ "accept-language", "" },
+	{ "accept-ranges", "" },
+	{ "accept", "" },
+	{ "access-control-allow-origin", "" },
+	{ "age", "" },
+	{ "allow", "" },
+	{ "authorization", "" },
+	{ "cache-control", "" },
+	{ "content-disposition", "" },
+	{ "content-encoding", "" },
+	{ "content-language", "" },
+	{ "content-length", "" },
+	{ "content-location", "" },
+	{ "content-range", "" },
+	{ "content-type", "" },
+	{ "cookie", "" },
+	{ "date", "" },
+	{ "etag", "" },
+	{ "expect", "" },
+	{ "expires", "" },
+	{ "from", "" },
+	{ "host", "" },
+	{ "if-match", "" },
+	{ "if-modified-since", "" },
+	{ "if-none-match", "" },
+	{ "if-range", "" },
+	{ "if-unmodified-since", "" },
+	{ "last-modified", "" },
+	{ "link", "" },
+	{ "location", "" },
+	{ "max-forwards", "" },
+	{ "proxy-authenticate", "" },
+	{ "proxy-authorization", "" },
+	{ "range", "" },
+	{ "referer", "" },
+	{ "refresh", "" },
+	{ "retry-after", "" },
+	{ "server", "" },
+	{ "set-cookie", "" },
+	{ "strict-transport-security", "" },
+	{ "transfer-encoding", "" },
+	{ "user-agent", "" },
+	{ "vary", "" },
+	{ "via", "" },
+	{ "www-authenticate", "" },
+};
+
+// RFC 7541 Appendix B: code (right-aligned) and length in bits, by symbol
+
+static const struct { uint32_t code; int bits; } huffmanCodes[ 257 ] =
+{
+	{ 0x1ff8, 13 }, { 0x7fffd8, 23 }, { 0xfffffe2, 28 }, { 0xfffffe3, 28 },
+	{ 0xfffffe4, 28 }, { 0xfffffe5, 28 }, { 0xfffffe6, 28 }, { 0xfffffe7, 28 },
+	{ 0xfffffe8, 28 }, { 0xffffea, 24 }, { 0x3ffffffc, 30 }, { 0xfffffe9, 28 },
+	{ 0xfffffea, 28 }, { 0x3ffffffd, 30 }, { 0xfffffeb, 28 }, { 0xfffffec, 28 },
+	{ 0xfffffed, 28 }, { 0xfffffee, 28 }, { 0xfffffef, 28 }, { 0xffffff0, 28 },
+	{ 0xffffff1, 28 }, { 0xffffff2, 28 }, { 0x3ffffffe, 30 }, { 0xffffff3, 28 },
+	{ 0xffffff4, 28 }, { 0xffffff5, 28 }, { 0xffffff6, 28 }, { 0xffffff7, 28 },
+	{ 0xffffff8, 28 }, { 0xffffff9, 28 }, { 0xffffffa, 28 }, { 0xffffffb, 28 },
+	{ 0x14, 6 }, { 0x3f8, 10 }, { 0x3f9, 10 }, { 0xffa, 12 },
+	{ 0x1ff9, 13 }, { 0x15, 6 }, { 0xf8, 8 }, { 0x7fa, 11 },
+	{ 0x3fa, 10 }, { 0x3fb, 10 }, { 0xf9, 8 }, { 0x7fb, 11 },
+	{ 0xfa, 8 }, { 0x16, 6 }, { 0x17, 6 }, { 0x18, 6 },
+	{ 0x0, 5 }, { 0x1, 5 }, { 0x2, 5 }, { 0x19, 6 },
+	{ 0x1a, 6 }, { 0x1b, 6 }, { 0x1c, 6 }, { 0x1d, 6 },
+	{ 0x1e, 6 }, { 0x1f, 6 }, { 0x5c, 7 }, { 0xfb, 8 },
+	{ 0x7ffc, 15 }, { 0x20, 6 }, { 0xffb, 12 }, { 0x3fc, 10 },
+	{ 0x1ffa, 13 }, { 0x21, 6 }, { 0x5d, 7 }, { 0x5e, 7 },
+	{ 0x5f, 7 }, { 0x60, 7 }, { 0x61, 7 }, { 0x62, 7 },
+	{ 0x63, 7 }, { 0x64, 7 }, { 0x65, 7 }, { 0x66, 7 },
+	{ 0x67, 7 }, { 0x68, 7 }, { 0x69, 7 }, { 0x6a, 7 },
+	{ 0x6b, 7 }, { 0x6c, 7 }, { 0x6d, 7 }, { 0x6e, 7 },
+	{ 0x6f, 7 }, { 0x70, 7 }, { 0x71, 7 }, { 0x72, 7 },
+	{ 0xfc, 8 }, { 0x73, 7 }, { 0xfd, 8 }, { 0x1ffb, 13 },
+	{ 0x7fff0, 19 }, { 0x1ffc, 13 }, { 0x3ffc, 14 }, { 0x22, 6 },
+	{ 0x7ffd, 15 }, { 0x3, 5 }, { 0x23, 6 }, { 0x4, 5 },
+	{ 0x24, 6 }, { 0x5, 5 }, { 0x25, 6 }, { 0x26, 6 },
+	{ 0x27, 6 }, { 0x6, 5 }, { 0x74, 7 }, { 0x75, 7 },
+	{ 0x28, 6 }, { 0x29, 6 }, { 0x2a, 6 }, { 0x7, 5 },
+	{ 0x2b, 6 }, { 0x76, 7 }, { 0x2c, 6 }, { 0x8, 5 },
+	{ 0x9, 5 }, { 0x2d, 6 }, { 0x77, 7 }, { 0x78, 7 },
+	{ 0x79, 7 }, { 0x7a, 7 }, { 0x7b, 7 }, { 0x7ffe, 15 },
+	{ 0x7fc, 11 }, { 0x3ffd, 14 }, { 0x1ffd, 13 }, { 0xffffffc, 28 },
+	{ 0xfffe6, 20 }, { 0x3fffd2, 22 }, { 0xfffe7, 20 }, { 0xfffe8, 20 },
+	{ 0x3fffd3, 22 }, { 0x3fffd4, 22 }, { 0x3fffd5, 22 }, { 0x7fffd9, 23 },
+	{ 0x3fffd6, 22 }, { 0x7fffda, 23 }, { 0x7fffdb, 23 }, { 0x7fffdc, 23 },
+	{ 0x7fffdd, 23 }, { 0x7fffde, 23 }, { 0xffffeb, 24 }, { 0x7fffdf, 23 },
+	{ 0xffffec, 24 }, { 0xffffed, 24 }, { 0x3fffd7, 22 }, { 0x7fffe0, 23 },
+	{ 0xffffee, 24 }, { 0x7fffe1, 23 }, { 0x7fffe2, 23 }, { 0x7fffe3, 23 },
+	{ 0x7fffe4, 23 }, { 0x1fffdc, 21 }, { 0x3fffd8, 22 }, { 0x7fffe5, 23 },
+	{ 0x3fffd9, 22 }, { 0x7fffe6, 23 }, { 0x7fffe7, 23 }, { 0xffffef, 24 },
+	{ 0x3fffda, 22 }, { 0x1fffdd, 21 }, { 0xfffe9, 20 }, { 0x3fffdb, 22 },
+	{ 0x3fffdc, 22 }, { 0x7fffe8, 23 }, { 0x7fffe9, 23 }, { 0x1fffde, 21 },
+	{ 0x7fffea, 23 }, { 0x3fffdd, 22 }, { 0x3fffde, 22 }, { 0xfffff0, 24 },
+	{ 0x1fffdf, 21 }, { 0x3fffdf, 22 }, { 0x7fffeb, 23 }, { 0x7fffec, 23 },
+	{ 0x1fffe0, 21 }, { 0x1fffe1, 21 }, { 0x3fffe0, 22 }, { 0x1fffe2, 21 },
+	{ 0x7fffed, 23 }, { 0x3fffe1, 22 }, { 0x7fffee, 23 }, { 0x7fffef, 23 },
+	{ 0xfffea, 20 }, { 0x3fffe2, 22 }, { 0x3fffe3, 22 }, { 0x3fffe4, 22 },
+	{ 0x7ffff0, 23 }, { 0x3fffe5, 22 }, { 0x3fffe6, 22 }, { 0x7ffff1, 23 },
+	{ 0x3ffffe0, 26 }, { 0x3ffffe1, 26 }, { 0xfffeb, 20 }, { 0x7fff1, 19 },
+	{ 0x3fffe7, 22 }, { 0x7ffff2, 23 }, { 0x3fffe8, 22 }, { 0x1ffffec, 25 },
+	{ 0x3ffffe2, 26 }, { 0x3ffffe3, 26 }, { 0x3ffffe4, 26 }, { 0x7ffffde, 27 },
+	{ 0x7ffffdf, 27 }, { 0x3ffffe5, 26 }, { 0xfffff1, 24 }, { 0x1ffffed, 25 },
+	{ 0x7fff2, 19 }, { 0x1fffe3, 21 }, { 0x3ffffe6, 26 }, { 0x7ffffe0, 27 },
+	{ 0x7ffffe1, 27 }, { 0x3ffffe7, 26 }, { 0x7ffffe2, 27 }, { 0xfffff2, 24 },
+	{ 0x1fffe4, 21 }, { 0x1fffe5, 21 }, { 0x3ffffe8, 26 }, { 0x3ffffe9, 26 },
+	{ 0xffffffd, 28 }, { 0x7ffffe3, 27 }, { 0x7ffffe4, 27 }, { 0x7ffffe5, 27 },
+	{ 0xfffec, 20 }, { 0xfffff3, 24 }, { 0xfffed, 20 }, { 0x1fffe6, 21 },
+	{ 0x3fffe9, 22 }, { 0x1fffe7, 21 }, { 0x1fffe8, 21 }, { 0x7ffff3, 23 },
+	{ 0x3fffea, 22 }, { 0x3fffeb, 22 }, { 0x1ffffee, 25 }, { 0x1ffffef, 25 },
+	{ 0xfffff4, 24 }, { 0xfffff5, 24 }, { 0x3ffffea, 26 }, { 0x7ffff4, 23 },
+	{ 0x3ffffeb, 26 }, { 0x7ffffe6, 27 }, { 0x3ffffec, 26 }, { 0x3ffffed, 26 },
+	{ 0x7ffffe7, 27 }, { 0x7ffffe8, 27 }, { 0x7ffffe9, 27 }, { 0x7ffffea, 27 },
+	{ 0x7ffffeb, 27 }, { 0xffffffe, 28 }, { 0x7ffffec, 27 }, { 0x7ffffed, 27 },
+	{ 0x7ffffee, 27 }, { 0x7ffffef, 27 }, { 0x7fffff0, 27 }, { 0x3ffffee, 26 },
+	{ 0x3fffffff, 30 },
+};
+
+// the code is canonical: sorted by length, codes of each length are
+// consecutive, so a code decodes by its offset from the first of its length
+
+class HuffmanDecodeTable
+{
+    public:
+
+	HuffmanDecodeTable( void )
+	{
+		int order[ 257 ];
+		for( int i = 0; i < 257; i++ )
+			order[ i ] = i;
+		for( int i = 1; i < 257; i++ )
+		{
+			int symbol = order[ i ], j = i;
+			for( ; j > 0 && huffmanCodes[ order[ j - 1 ] ].bits > huffmanCodes[ symbol ].bits; j-- )
+				order[ j ] = order[ j - 1 ];
+			order[ j ] = symbol;
+		}
+		for( int i = 0; i < 257; i++ )
+		{
+			int bits = huffmanCodes[ order[ i ] ].bits;
+			if( count[ bits ]++ == 0 )
+			{
+				first[ bits ] = huffmanCodes[ order[ i ] ].code;
+				firstSymbol[ bits ] = i;
+			}
+			symbols[ i ] = order[ i ];
+		}
+	}
+	uint32_t first[ 31 ] = { 0 };
+	int firstSymbol[ 31 ] = { 0 };
+	uint32_t count[ 31 ] = { 0 };
+	int symbols[ 257 ];
+};
+
+bool
+Huffman :: decode( const unsigned char *data, size_t len, string *out )
+{
+	static const HuffmanDecodeTable table;
+	uint32_t code = 0;
+	int bits = 0;
+	for( size_t i = 0; i < len; i++ )
+	{
+		for( int bit = 7; bit >= 0; bit-- )
+		{
+			code = (code << 1) | ((data[ i ] >> bit) & 1);
+			if( ++bits > 30 )
+				return( false );
+			if( table.count[ bits ] && code - table.first[ bits ] < table.count[ bits ] )
+			{
+				int symbol = table.symbols[ table.firstSymbol[ bits ] + (code - table.first[ bits ]) ];
+				if( symbol == HUFFMAN_EOS )
+					return( false );
+				out->push_back( (char) symbol );
+				code = 0;
+				bits = 0;
+			}
+		}
+	}
+	// padding is up to 7 bits of EOS's prefix, all ones
+	return( bits < 8 && code == (1u << bits) - 1 );
+}
+
+void
+Huffman :: encode( string_view s, string *out )
+{
+	uint64_t pending = 0;
+	int bits = 0;
+	for( size_t i = 0; i < s.size(); i++ )
+	{
+		unsigned char c = (unsigned char) s[ i ];
+		pending = (pending << huffmanCodes[ c ].bits) | huffmanCodes[ c ].code;
+		bits += huffmanCodes[ c ].bits;
+		while( bits >= 8 )
+		{
+			bits -= 8;
+			out->push_back( (char) (pending >> bits) );
+		}
+	}
+	if( bits )
+		out->push_back( (char) ((pending << (8 - bits)) | (0xff >> bits)) );
+}
+
+size_t
+Huffman :: length( string_view s )
+{
+	size_t bits = 0;
+	for( size_t i = 0; i < s.size(); i++ )
+		bits += huffmanCodes[ (unsigned char) s[ i ] ].bits;
+	return( (bits + 7) / 8 );
+}
+
+// integers with an N-bit prefix (RFC 7541 5.1)
+
+static bool
+readInteger( const unsigned char **p, const unsigned char *end, int prefix, uint64_t *value )
+{
+	if( *p >= end )
+		return( false );
+	uint64_t max = (1u << prefix) - 1;
+	*value = *(*p)++ & max;
+	if( *value < max )
+		return( true );
+	for( int shift = 0; *p < end && shift <= 56; shift += 7 )
+	{
+		unsigned char byte = *(*p)++;
+		*value += (uint64_t) (byte & 0x7f) << shift;
+		if( !(byte & 0x80) )
+			return( true );
+	}
+	return( false );
+}
+
+static void
+writeInteger( uint64_t value, int prefix, unsigned char flags, string *out )
+{
+	uint64_t max = (1u << prefix) - 1;
+	if( value < max )
+	{
+		out->push_back( (char) (flags | value) );
+		return;
+	}
+	out->push_back( (char) (flags | max) );
+	for( value -= max; value >= 0x80; value >>= 7 )
+		out->push_back( (char) (0x80 | (value & 0x7f)) );
+	out->push_back( (char) value );
+}
+
+bool
+HPACKTable :: get( size_t index, string_view *name, string_view *value )
+{
+	if( index == 0 )
+		return( false );
+	if( index <= STATIC_ENTRIES )
+	{
+		*name = staticTable[ index - 1 ].name;
+		*value = staticTable[ index - 1 ].value;
+		return( true );
+	}
+	index -= STATIC_ENTRIES + 1;
+	if( index >= entries.size() )
+		return( false );
+	*name = entries[ index ].first;
+	*value = entries[ index ].second;
+	return( true );
+}
+
+// index of an entry with this name and value, else of one with this name, else 0
+
+size_t
+HPACKTable :: find( string_view name, string_view value, bool *exact )
+{
+	size_t named = 0;
+	*exact = false;
+	for( size_t i = 0; i < STATIC_ENTRIES; i++ )
+	{
+		if( name != staticTable[ i ].name )
+			continue;
+		if( value == staticTable[ i ].value )
+		{
+			*exact = true;
+			return( i + 1 );
+		}
+		if( !named )
+			named = i + 1;
+	}
+	for( size_t i = 0; i < entries.size(); i++ )
+	{
+		if( name != entries[ i ].first )
+			continue;
+		if( value == entries[ i ].second )
+		{
+			*exact = true;
+			return( STATIC_ENTRIES + 1 + i );
+		}
+		if( !named )
+			named = STATIC_ENTRIES + 1 + i;
+	}
+	return( named );
+}
+
+// an entry larger than the whole table empties it (RFC 7541 4.4)
+
+void
+HPACKTable :: add( string_view name, string_view value )
+{
+	size_t entrySize = name.size() + value.size() + ENTRY_OVERHEAD;
+	if( entrySize > maxSize )
+	{
+		entries.clear();
+		size = 0;
+		return;
+	}
+	evict( entrySize );
+	entries.emplace_front( string( name ), string( value ) );
+	size += entrySize;
+}
+
+void
+HPACKTable :: resize( size_t maxSize )
+{
+	this->maxSize = maxSize;
+	evict( 0 );
+}
+
+void
+HPACKTable :: evict( size_t room )
+{
+	while( !entries.empty() && size + room > maxSize )
+	{
+		size -= entries.back().first.size() + entries.back().second.size() + ENTRY_OVERHEAD;
+		entries.pop_back();
+	}
+}
+
+bool
+HPACKDecoder :: literal( const unsigned char **p, const unsigned char *end, string *out )
+{
+	if( *p >= end )
+		return( fail( "truncated string" ) );
+	bool huffman = (**p & 0x80) != 0;
+	uint64_t len;
+	if( !readInteger( p, end, 7, &len ) || len > (uint64_t) (end - *p) )
+		return( fail( "truncated string" ) );
+	out->clear();
+	if( huffman )
+	{
+		if( !Huffman::decode( *p, (size_t) len, out ) )
+			return( fail( "bad Huffman code" ) );
+	}
+	else
+		out->assign( (const char *) *p, (size_t) len );
+	*p += len;
+	return( true );
+}
+
+// a whole header block, in order; false (error set) is a COMPRESSION_ERROR,
+// after which the table can't be trusted and the connection must end
+
+bool
+HPACKDecoder :: decode( const unsigned char *data, size_t len, vector< pair< string, string > > *headers )
+{
+	const unsigned char *p = data;
+	const unsigned char *end = data + len;
+	size_t listSize = 0;
+	bool first = true;
+	headers->clear();
+	error = nullptr;
+	while( p < end )
+	{
+		unsigned char byte = *p;
+		uint64_t index;
+		string name, value;
+		if( (byte & 0xe0) == 0x20 )
+		{
+			// dynamic table size update, only ahead of the fields
+			if( !first || !readInteger( &p, end, 5, &index ) || index > HPACK_TABLE_SIZE )
+				return( fail( "bad table size update" ) );
+			table.resize( (size_t) index );
+			continue;
+		}
+		first = false;
+		if( byte & 0x80 )
+		{
+			// indexed field
+			string_view n, v;
+			if( !readInteger( &p, end, 7, &index ) || !table.get( (size_t) index, &n, &v ) )
+				return( fail( "bad index" ) );
+			name = n;
+			value = v;
+		}
+		else
+		{
+			// literal, with incremental indexing (01), without (0000) or never indexed (0001)
+			bool indexing = (byte & 0xc0) == 0x40;
+			if( !readInteger( &p, end, indexing ? 6 : 4, &index ) )
+				return( fail( "truncated field" ) );
+			if( index )
+			{
+				string_view n, v;
+				if( !table.get( (size_t) index, &n, &v ) )
+					return( fail( "bad index" ) );
+				name = n;
+			}
+			else if( !literal( &p, end, &name ) )
+				return( false );
+			if( !literal( &p, end, &value ) )
+				return( false );
+			if( indexing )
+				table.add( name, value );
+		}
+		listSize += name.size() + value.size() + ENTRY_OVERHEAD;
+		if( listSize > maxListSize )
+			return( fail( "header list too large" ) );
+		headers->emplace_back( move( name ), move( value ) );
+	}
+	return( true );
+}
+
+void
+HPACKEncoder :: setTableSize( size_t size )
+{
+	size = min( size, (size_t) HPACK_TABLE_SIZE );
+	if( size == table.maxSize )
+		return;
+	table.resize( size );
+	sizeUpdate = size;
+}
+
+void
+HPACKEncoder :: literal( string_view s, string *out )
+{
+	size_t huffmanLen = Huffman::length( s );
+	if( huffmanLen < s.size() )
+	{
+		writeInteger( huffmanLen, 7, 0x80, out );
+		Huffman::encode( s, out );
+		return;
+	}
+	writeInteger( s.size(), 7, 0, out );
+	out->append( s );
+}
+
+// fields that repeat across responses go in the table; ones that change
+// with every response would only push those out
+
+static bool
+isVolatile( string_view name )
+{
+	static const char *names[] = { "content-length", "date", "etag", "last-modified", "age", "expires",
+		"location", "content-range", "x-request-id" };
+	for( size_t i = 0; i < sizeof( names ) / sizeof( names[ 0 ] ); i++ )
+	{
+		if( name == names[ i ] )
+			return( true );
+	}
+	return( false );
+}
+
+// append one field of a header block; name must be lowercase
+
+void
+HPACKEncoder :: encode( string_view name, string_view value, string *out )
+{
+	if( sizeUpdate != SIZE_MAX )
+	{
+		writeInteger( sizeUpdate, 5, 0x20, out );
+		sizeUpdate = SIZE_MAX;
+	}
+	bool exact;
+	size_t index = table.find( name, value, &exact );
+	if( exact )
+	{
+		writeInteger( index, 7, 0x80, out );
+		return;
+	}
+	if( name == "set-cookie" )
+		writeInteger( index, 4, 0x10, out );	// never indexed, by any proxy on the way
+	else if( isVolatile( name ) || value.size() > INDEX_VALUE_MAX || table.maxSize == 0 )
+		writeInteger( index, 4, 0x00, out );
+	else
+	{
+		writeInteger( index, 6, 0x40, out );
+		table.add( name, value );
+	}
+	if( !index )
+		literal( name, out );
+	literal( value, out );
+}
@@ -0,0 +1,85 @@
+//
+//  HPACK.h
+//  Layer7LoadBalancer
+//  Created by Rick Tyler
+//
+//  SPDX-License-Identifier: MIT
+
+# ifndef _HPACK_h_
+# define _HPACK_h_
+
+# include <deque>
+# include <string>
+# include <string_view>
+# include <utility>
+# include <vector>
+# include <stddef.h>
+# include <stdint.h>
+
+using namespace std;
+
+# define HPACK_TABLE_SIZE    4096	// SETTINGS_HEADER_TABLE_SIZE default
+
+// HTTP/2 header compression (RFC 7541). Each side of a connection keeps a
+// dynamic table its peer mirrors: the decoder's follows the client's
+// encoder, the encoder's is the one the client decodes with. Indexes count
+// the static table's 61 entries first, then the dynamic table newest first.
+
+class HPACKTable
+{
+    public:
+
+	HPACKTable( size_t maxSize = HPACK_TABLE_SIZE ) { this->maxSize = maxSize; }
+	bool get( size_t index, string_view *name, string_view *value );
+	size_t find( string_view name, string_view value, bool *exact );
+	void add( string_view name, string_view value );
+	void resize( size_t maxSize );
+	size_t maxSize;
+	size_t size = 0;
+
+    private:
+
+	deque< pair< string, string > > entries;	// newest first
+	void evict( size_t room );
+};
+
+class HPACKDecoder
+{
+    public:
+
+	HPACKDecoder( size_t maxListSize ) { this->maxListSize = maxListSize; }
+	bool decode( const unsigned char *data, size_t len, vector< pair< string, string > > *headers );
+	const char *error = nullptr;
+
+    private:
+
+	HPACKTable table;
+	size_t maxListSize;		// decoded names and values, 32 bytes per field added
+	bool fail( const char *error ) { this->error = error; return( false ); }
+	bool literal( const unsigned char **p, const unsigned char *end, string *out );
+};
+
+class HPACKEncoder
+{
+    public:
+
+	void encode( string_view name, string_view value, string *out );
+	void setTableSize( size_t size );	// the client's SETTINGS_HEADER_TABLE_SIZE
+
+    private:
+
+	HPACKTable table;
+	size_t sizeUpdate = SIZE_MAX;		// to signal at the start of the next block
+	void literal( string_view s, string *out );
+};
+
+class Huffman
+{
+    public:
+
+	static bool decode( const unsigned char *data, size_t len, string *out );
+	static void encode( string_view s, string *out );
+	static size_t length( string_view s );	// encoded bytes
+};
+
+# endif // _HPACK_h_
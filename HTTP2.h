@@ -0,0 +1,85 @@
+//
+//  HTTP2.h
+//  Layer7LoadBalancer
+//  Created by Rick Tyler
+//
+//  SPDX-License-Identifier: MIT
+
+# ifndef _HTTP2_h_
+# define _HTTP2_h_
+
+# include <string>
+# include <stddef.h>
+# include <stdint.h>
+
+using namespace std;
+
+// HTTP/2 framing (RFC 9113), shared by client sessions and backend connections
+
+# define H2_PREFACE               "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+# define H2_PREFACE_LEN           24
+# define H2_FRAME_HEADER_LEN      9
+
+# define H2_FRAME_DATA            0
+# define H2_FRAME_HEADERS         1
+# define H2_FRAME_PRIORITY        2
+# define H2_FRAME_RST_STREAM      3
+# define H2_FRAME_SETTINGS        4
+# define H2_FRAME_PUSH_PROMISE    5
+# define H2_FRAME_PING            6
+# define H2_FRAME_GOAWAY          7
+# define H2_FRAME_WINDOW_UPDATE   8
+# define H2_FRAME_CONTINUATION    9
+
+# define H2_FLAG_END_STREAM       0x01
+# define H2_FLAG_ACK              0x01
+# define H2_FLAG_END_HEADERS      0x04
+# define H2_FLAG_PADDED           0x08
+# define H2_FLAG_PRIORITY         0x20
+
+# define H2_SETTINGS_HEADER_TABLE_SIZE       1
+# define H2_SETTINGS_ENABLE_PUSH             2
+# define H2_SETTINGS_MAX_CONCURRENT_STREAMS  3
+# define H2_SETTINGS_INITIAL_WINDOW_SIZE     4
+# define H2_SETTINGS_MAX_FRAME_SIZE          5
+
+# define H2_NO_ERROR              0
+# define H2_PROTOCOL_ERROR        1
+# define H2_INTERNAL_ERROR        2
+# define H2_FLOW_CONTROL_ERROR    3
+# define H2_STREAM_CLOSED         5
+# define H2_FRAME_SIZE_ERROR      6
+# define H2_REFUSED_STREAM        7
+# define H2_CANCEL                8
+# define H2_COMPRESSION_ERROR     9
+
+# define H2_FRAME_MAX             16384		// our SETTINGS_MAX_FRAME_SIZE (the default)
+# define H2_DEFAULT_WINDOW        65535
+# define H2_WINDOW_MAX            0x7fffffff
+
+class HTTP2Frame
+{
+    public:
+
+	static void header( string *out, size_t len, int type, int flags, uint32_t id ) {
+		out->push_back( (char) (len >> 16) );
+		out->push_back( (char) (len >> 8) );
+		out->push_back( (char) len );
+		out->push_back( (char) type );
+		out->push_back( (char) flags );
+		put32( id, out );
+	}
+
+	static void put32( uint32_t value, string *out ) {
+		out->push_back( (char) (value >> 24) );
+		out->push_back( (char) (value >> 16) );
+		out->push_back( (char) (value >> 8) );
+		out->push_back( (char) value );
+	}
+
+	static uint32_t get32( const unsigned char *p ) {
+		return( ((uint32_t) p[ 0 ] << 24) | ((uint32_t) p[ 1 ] << 16) | ((uint32_t) p[ 2 ] << 8) | p[ 3 ] );
+	}
+};
+
+# endif // _HTTP2_h_
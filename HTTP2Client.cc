@@ -0,0 +1,828 @@
+//
+//  HTTP2Client.cc
+//  Layer7LoadBalancer
+//  Created by Rick Tyler
+//
+//  SPDX-License-Identifier: MIT
+
+# include "HTTP2Client.h"
+# include "HTTP2.h"
+# include "Exception.h"
+# include "Log.h"
+# include <errno.h>
+# include <fcntl.h>
+# include <string.h>
+# include <unistd.h>
+# include <poll.h>
+
+// # define TRACE    1
+
+# define CLIENT_STREAMS        100		// streams per backend connection, at most
+# define STREAM_WINDOW         (256 * 1024)	// response bytes a stream may have unread
+# define CONNECTION_WINDOW     (1024 * 1024)
+# define STREAM_BUFFER_MAX     (256 * 1024)	// request body a session may write ahead
+# define HEAD_MAX              65536		// request header, HTTP/1.1 as written
+# define READ_LEN              16384
+
+atomic< size_t > HTTP2Client::connections( 0 );
+atomic< size_t > HTTP2Client::streams( 0 );
+
+// fields that describe a connection, not the message (RFC 9113 8.2.2)
+
+static bool
+isConnectionField( string_view name )
+{
+	return( equalsIgnoreCase( name, "connection" ) || equalsIgnoreCase( name, "keep-alive" )
+		|| equalsIgnoreCase( name, "proxy-connection" ) || equalsIgnoreCase( name, "transfer-encoding" )
+		|| equalsIgnoreCase( name, "upgrade" ) );
+}
+
+static const char *
+reasonPhrase( int status )
+{
+	switch( status )
+	{
+		case 100: return( "Continue" );
+		case 200: return( "OK" );
+		case 201: return( "Created" );
+		case 204: return( "No Content" );
+		case 206: return( "Partial Content" );
+		case 301: return( "Moved Permanently" );
+		case 302: return( "Found" );
+		case 304: return( "Not Modified" );
+		case 307: return( "Temporary Redirect" );
+		case 308: return( "Permanent Redirect" );
+		case 400: return( "Bad Request" );
+		case 401: return( "Unauthorized" );
+		case 403: return( "Forbidden" );
+		case 404: return( "Not Found" );
+		case 425: return( "Too Early" );
+		case 429: return( "Too Many Requests" );
+		case 500: return( "Internal Server Error" );
+		case 502: return( "Bad Gateway" );
+		case 503: return( "Service Unavailable" );
+		case 504: return( "Gateway Timeout" );
+		default: return( "" );
+	}
+}
+
+HTTP2ClientStream :: HTTP2ClientStream( shared_ptr< HTTP2Client > client )
+{
+	this->client = client;
+}
+
+HTTP2ClientStream :: ~HTTP2ClientStream()
+{
+	client->closeStream( this );
+}
+
+// a request's pseudo-header and header fields, false if it can't be sent
+// as HTTP/2
+
+bool
+HTTP2ClientStream :: requestFields( HTTPParser *request, bool secure, vector< pair< string, string > > *fields )
+{
+	if( request->method == "CONNECT" || request->path.empty() )
+		return( false );
+	fields->emplace_back( ":method", string( request->method ) );
+	fields->emplace_back( ":scheme", secure ? "https" : "http" );
+	string_view authority = request->header( "Host" );
+	if( !authority.empty() )
+		fields->emplace_back( ":authority", string( authority ) );
+	fields->emplace_back( ":path", string( request->path ) );
+	for( auto it = request->headers.begin(); it != request->headers.end(); it++ )
+	{
+		if( isConnectionField( it->name ) || equalsIgnoreCase( it->name, "host" )
+			|| (equalsIgnoreCase( it->name, "te" ) && !equalsIgnoreCase( it->value, "trailers" )) )
+			continue;
+		string name( it->name );
+		for( size_t i = 0; i < name.size(); i++ )
+			name[ i ] = (char) tolower( (unsigned char) name[ i ] );
+		fields->emplace_back( move( name ), string( it->value ) );
+	}
+	return( true );
+}
+
+// a response header as HTTP/1.1, its body chunked when HTTP/2 framing was
+// all that delimited it
+
+string
+HTTP2ClientStream :: responseHeader( int status, const vector< pair< string, string > >& fields, bool headRequest,
+	bool endStream, bool *chunked )
+{
+	string header = "HTTP/1.1 " + to_string( status ) + " " + reasonPhrase( status ) + "\r\n";
+	bool length = false;
+	for( auto it = fields.begin(); it != fields.end(); it++ )
+	{
+		if( it->first.empty() || it->first[ 0 ] == ':' || isConnectionField( it->first ) )
+			continue;
+		if( it->first == "content-length" )
+			length = true;
+		header += it->first + ": " + it->second + "\r\n";
+	}
+	*chunked = false;
+	if( !length && !headRequest && status >= 200 && status != 204 && status != 304 )
+	{
+		if( endStream )
+			header += "content-length: 0\r\n";
+		else
+		{
+			header += "transfer-encoding: chunked\r\n";
+			*chunked = true;
+		}
+	}
+	header += "\r\n";
+	return( header );
+}
+
+// the request as HTTP/1.1: its header opens the stream, its body is
+// decoded from its framing and sent as DATA
+
+ssize_t
+HTTP2ClientStream :: write( const char *data, size_t len )
+{
+	if( id )
+		return( queueBody( data, len ) < 0 ? -1 : (ssize_t) len );
+	head.append( data, len );
+	HTTPParser request;
+	int result = request.parse( head.data(), head.size() );
+	if( result == HTTP_ERROR )
+		return( -1 );
+	if( result != HTTP_COMPLETE )
+		return( head.size() > HEAD_MAX ? -1 : (ssize_t) len );
+	vector< pair< string, string > > fields;
+	if( !requestFields( &request, true, &fields ) || requestBody.frame( &request ) == HTTP_ERROR )
+	{
+		Log::log( "HTTP2Client[ %s ]: request can't be sent as HTTP/2", client->destStr );
+		return( -1 );
+	}
+	headRequest = request.method == "HEAD";
+	string rest = head.substr( request.headerLen );
+	string().swap( head );
+	if( !client->openStream( this, &fields, requestBody.done() ) )
+		return( -1 );
+	if( !rest.empty() && queueBody( rest.data(), rest.size() ) < 0 )
+		return( -1 );
+	return( (ssize_t) len );
+}
+
+// request body for the client's thread to frame, waiting while the stream
+// is STREAM_BUFFER_MAX ahead of flow control
+
+ssize_t
+HTTP2ClientStream :: queueBody( const char *data, size_t len )
+{
+	string payload;
+	if( !requestBody.done() )
+		(void) requestBody.consume( data, len, &payload );
+	if( requestBody.error )
+		return( -1 );
+	{
+		unique_lock< mutex > lock( client->clientMutex );
+		client->changed.wait( lock, [ this ] { return( reset || body.size() < STREAM_BUFFER_MAX ); } );
+		if( reset )
+			return( -1 );
+		body += payload;
+		bodyDone = requestBody.done();
+	}
+	client->wake();
+	return( (ssize_t) len );
+}
+
+// the response as HTTP/1.1; 0 once it's all read or the stream was reset
+
+ssize_t
+HTTP2ClientStream :: read( void *buf, size_t len )
+{
+	size_t n;
+	bool credit;
+	{
+		unique_lock< mutex > lock( client->clientMutex );
+		client->changed.wait( lock, [ this ] { return( response.size() > responseOffset || responseDone || reset ); } );
+		n = min( len, response.size() - responseOffset );
+		memcpy( buf, response.data() + responseOffset, n );
+		responseOffset += n;
+		if( responseOffset == response.size() )
+		{
+			response.clear();
+			responseOffset = 0;
+		}
+		credit = owed && response.size() - responseOffset < STREAM_BUFFER_MAX / 2;
+	}
+	if( credit )
+		client->wake();
+	return( (ssize_t) n );
+}
+
+// true once there's something to read (or the end) within timeout ms,
+// -1 waits indefinitely
+
+bool
+HTTP2ClientStream :: wait( int timeout )
+{
+	unique_lock< mutex > lock( client->clientMutex );
+	auto ready = [ this ] { return( response.size() > responseOffset || responseDone || reset ); };
+	if( timeout < 0 )
+	{
+		client->changed.wait( lock, ready );
+		return( true );
+	}
+	return( client->changed.wait_for( lock, chrono::milliseconds( timeout ), ready ) );
+}
+
+ssize_t
+HTTP2ClientStream :: pending( void )
+{
+	lock_guard< mutex > lock( client->clientMutex );
+	return( (ssize_t) (response.size() - responseOffset) );
+}
+
+HTTP2Client :: HTTP2Client( Connection *connection, const char *destStr ) : decoder( HEAD_MAX )
+{
+	this->connection = connection;
+	this->destStr = destStr;
+	this->maxStreams = CLIENT_STREAMS;
+	if( pipe( wakeFds ) != 0 )
+		Exception::raise( "HTTP2Client: pipe() failed (%s)", strerror( errno ) );
+	for( int i = 0; i < 2; i++ )
+	{
+		(void) fcntl( wakeFds[ i ], F_SETFL, fcntl( wakeFds[ i ], F_GETFL ) | O_NONBLOCK );
+		(void) fcntl( wakeFds[ i ], F_SETFD, FD_CLOEXEC );
+	}
+}
+
+HTTP2Client :: ~HTTP2Client()
+{
+# if TRACE
+	Log::console( "HTTP2Client::~HTTP2Client( %s )", destStr );
+# endif // TRACE
+	delete( connection );
+	(void) ::close( wakeFds[ 0 ] );
+	(void) ::close( wakeFds[ 1 ] );
+	if( thread )
+		delete( thread );
+}
+
+// take over a connection that negotiated "h2": the preface, our SETTINGS
+// and a larger connection window, then the thread that runs it (may raise)
+
+shared_ptr< HTTP2Client >
+HTTP2Client :: start( Connection *connection, const char *destStr )
+{
+	shared_ptr< HTTP2Client > client;
+	try
+	{
+		client = make_shared< HTTP2Client >( connection, destStr );
+	}
+	catch( const char * )
+	{
+		delete( connection );
+		throw;
+	}
+	string preface( H2_PREFACE );
+	HTTP2Frame::header( &preface, 12, H2_FRAME_SETTINGS, 0, 0 );
+	preface.push_back( 0 );
+	preface.push_back( H2_SETTINGS_ENABLE_PUSH );
+	HTTP2Frame::put32( 0, &preface );
+	preface.push_back( 0 );
+	preface.push_back( H2_SETTINGS_INITIAL_WINDOW_SIZE );
+	HTTP2Frame::put32( STREAM_WINDOW, &preface );
+	HTTP2Frame::header( &preface, 4, H2_FRAME_WINDOW_UPDATE, 0, 0 );
+	HTTP2Frame::put32( CONNECTION_WINDOW - H2_DEFAULT_WINDOW, &preface );
+	if( connection->write( (void *) preface.data(), preface.size() ) != (ssize_t) preface.size() )
+		Exception::raise( "HTTP2Client[ %s ]: connection preface not sent", destStr );
+	client->self = client;
+	client->thread = new HTTP2ClientThread( client.get() );
+	client->thread->run();
+	client->thread->detach();
+	++connections;
+	return( client );
+}
+
+bool
+HTTP2Client :: reserve( void )
+{
+	lock_guard< mutex > lock( clientMutex );
+	if( closed || goingAway || reserved >= maxStreams )
+		return( false );
+	++reserved;
+	++streams;
+	return( true );
+}
+
+bool
+HTTP2Client :: isOpen( void )
+{
+	lock_guard< mutex > lock( clientMutex );
+	return( !closed && !goingAway );
+}
+
+// a full pipe is already a wakeup, so a failed write loses nothing
+
+void
+HTTP2Client :: wake( void )
+{
+	ssize_t written = ::write( wakeFds[ 1 ], "", 1 );
+	(void) written;
+}
+
+// HEADERS for a stream's request, its id taken as it's encoded so both go
+// out in order
+
+bool
+HTTP2Client :: openStream( HTTP2ClientStream *stream, vector< pair< string, string > > *fields, bool endStream )
+{
+	{
+		lock_guard< mutex > lock( clientMutex );
+		if( closed || goingAway || nextId > H2_WINDOW_MAX )
+			return( false );
+		stream->id = nextId;
+		nextId += 2;
+		stream->sendWindow = initialWindow;
+		stream->bodyDone = stream->requestEnded = endStream;
+		string block;
+		for( auto it = fields->begin(); it != fields->end(); it++ )
+			encoder.encode( it->first, it->second, &block );
+		for( size_t offset = 0; ; )
+		{
+			size_t len = min( block.size() - offset, (size_t) maxFrameSize );
+			int flags = offset + len == block.size() ? H2_FLAG_END_HEADERS : 0;
+			if( offset == 0 && endStream )
+				flags |= H2_FLAG_END_STREAM;
+			HTTP2Frame::header( &out, len, offset == 0 ? H2_FRAME_HEADERS : H2_FRAME_CONTINUATION, flags, stream->id );
+			out.append( block, offset, len );
+			offset += len;
+			if( offset == block.size() )
+				break;
+		}
+		active[ stream->id ] = stream;
+	}
+	wake();
+	return( true );
+}
+
+// a session is done with a stream: cancel it if it's still open
+
+void
+HTTP2Client :: closeStream( HTTP2ClientStream *stream )
+{
+	{
+		lock_guard< mutex > lock( clientMutex );
+		auto it = stream->id ? active.find( stream->id ) : active.end();
+		if( it != active.end() )
+		{
+			if( !stream->responseDone || !stream->requestEnded )
+			{
+				HTTP2Frame::header( &out, 4, H2_FRAME_RST_STREAM, 0, stream->id );
+				HTTP2Frame::put32( H2_CANCEL, &out );
+			}
+			active.erase( it );
+		}
+		--reserved;
+	}
+	wake();
+}
+
+// write what's queued, framing request bodies as far as flow control
+// allows and returning window for response bytes read; false on failure
+
+bool
+HTTP2Client :: flush( void )
+{
+	string frames;
+	{
+		lock_guard< mutex > lock( clientMutex );
+		bool drained = false;
+		for( auto it = active.begin(); it != active.end(); it++ )
+		{
+			HTTP2ClientStream *stream = it->second;
+			if( stream->owed && !stream->responseDone && stream->response.size() - stream->responseOffset < STREAM_BUFFER_MAX / 2 )
+			{
+				HTTP2Frame::header( &out, 4, H2_FRAME_WINDOW_UPDATE, 0, it->first );
+				HTTP2Frame::put32( (uint32_t) stream->owed, &out );
+				stream->owed = 0;
+			}
+			while( !stream->requestEnded && !stream->body.empty() && sendWindow > 0 && stream->sendWindow > 0 )
+			{
+				size_t len = min( stream->body.size(), (size_t) maxFrameSize );
+				len = (size_t) min( (int64_t) len, min( sendWindow, stream->sendWindow ) );
+				stream->requestEnded = stream->bodyDone && len == stream->body.size();
+				HTTP2Frame::header( &out, len, H2_FRAME_DATA, stream->requestEnded ? H2_FLAG_END_STREAM : 0, it->first );
+				out.append( stream->body, 0, len );
+				stream->body.erase( 0, len );
+				sendWindow -= len;
+				stream->sendWindow -= len;
+				drained = true;
+			}
+			if( !stream->requestEnded && stream->bodyDone && stream->body.empty() )
+			{
+				HTTP2Frame::header( &out, 0, H2_FRAME_DATA, H2_FLAG_END_STREAM, it->first );
+				stream->requestEnded = true;
+			}
+		}
+		if( recvCredit )
+		{
+			HTTP2Frame::header( &out, 4, H2_FRAME_WINDOW_UPDATE, 0, 0 );
+			HTTP2Frame::put32( (uint32_t) recvCredit, &out );
+			recvCredit = 0;
+		}
+		frames.swap( out );
+		if( drained )
+			changed.notify_all();
+	}
+	for( size_t offset = 0; offset < frames.size(); )
+	{
+		ssize_t sent = connection->write( (void *) (frames.data() + offset), frames.size() - offset );
+		if( sent <= 0 )
+			return( false );
+		offset += sent;
+	}
+	return( true );
+}
+
+// write what's queued, wait for the backend or a session, handle the
+// backend's frames; false to close
+
+bool
+HTTP2Client :: readFrames( void )
+{
+	if( !flush() )
+	{
+		close( "write failed" );
+		return( false );
+	}
+	{
+		lock_guard< mutex > lock( clientMutex );
+		if( goingAway && active.empty() && reserved == 0 )
+			return( false );
+	}
+	bool ready = connection->pending() > 0;
+	if( !ready )
+	{
+		struct pollfd fds[ 2 ] = { { connection->socket, POLLIN, 0 }, { wakeFds[ 0 ], POLLIN, 0 } };
+		if( poll( fds, 2, -1 ) < 0 )
+			return( errno == EINTR );
+		if( fds[ 1 ].revents )
+		{
+			char drain[ 256 ];
+			while( ::read( wakeFds[ 0 ], drain, sizeof( drain ) ) > 0 )
+				;
+		}
+		ready = fds[ 0 ].revents != 0;
+	}
+	if( !ready )
+		return( true );
+	char buf[ READ_LEN ];
+	ssize_t len = connection->read( buf, sizeof( buf ) );
+	if( len <= 0 )
+	{
+		close( nullptr );
+		return( false );
+	}
+	in.append( buf, len );
+
+	size_t used = 0;
+	while( in.size() - used >= H2_FRAME_HEADER_LEN )
+	{
+		const unsigned char *p = (const unsigned char *) in.data() + used;
+		size_t frameLen = ((size_t) p[ 0 ] << 16) | ((size_t) p[ 1 ] << 8) | p[ 2 ];
+		if( frameLen > H2_FRAME_MAX )
+		{
+			close( "frame too large" );
+			return( false );
+		}
+		if( in.size() - used < H2_FRAME_HEADER_LEN + frameLen )
+			break;
+		used += H2_FRAME_HEADER_LEN + frameLen;
+		if( !frame( p[ 3 ], p[ 4 ], HTTP2Frame::get32( p + 5 ) & 0x7fffffff, p + H2_FRAME_HEADER_LEN, frameLen ) )
+			return( false );
+	}
+	in.erase( 0, used );
+	return( true );
+}
+
+bool
+HTTP2Client :: frame( int type, int flags, uint32_t id, const unsigned char *payload, size_t len )
+{
+# if TRACE
+	Log::console( "HTTP2Client[ %s ]: frame type=%d flags=%x stream=%u len=%zu", destStr, type, flags, id, len );
+# endif // TRACE
+	if( headerStream && type != H2_FRAME_CONTINUATION )
+	{
+		close( "expected CONTINUATION" );
+		return( false );
+	}
+	switch( type )
+	{
+		case H2_FRAME_DATA:
+		{
+			recvCredit += len;	// streams' windows bound what's held, not the connection's
+			size_t pad = 0;
+			if( flags & H2_FLAG_PADDED )
+			{
+				if( len < 1 || payload[ 0 ] >= len )
+				{
+					close( "bad DATA padding" );
+					return( false );
+				}
+				pad = payload[ 0 ] + 1;
+			}
+			bool bad = false;
+			{
+				lock_guard< mutex > lock( clientMutex );
+				auto it = active.find( id );
+				if( it == active.end() )
+					return( true );
+				HTTP2ClientStream *stream = it->second;
+				if( !stream->responseStarted || stream->responseDone )
+					bad = true;
+				else
+				{
+					size_t dataLen = len - pad;
+					const char *data = (const char *) payload + (pad ? 1 : 0);
+					if( stream->chunked && dataLen )
+					{
+						char size[ 32 ];
+						snprintf( size, sizeof( size ), "%zx\r\n", dataLen );
+						stream->response += size;
+						stream->response.append( data, dataLen );
+						stream->response += "\r\n";
+					}
+					else
+						stream->response.append( data, dataLen );
+					stream->owed += len;
+					if( flags & H2_FLAG_END_STREAM )
+					{
+						if( stream->chunked )
+							stream->response += "0\r\n\r\n";
+						stream->responseDone = true;
+					}
+					changed.notify_all();
+				}
+			}
+			if( bad )
+				resetStream( id, H2_PROTOCOL_ERROR );
+			return( true );
+		}
+
+		case H2_FRAME_HEADERS:
+		{
+			size_t pad = 0;
+			if( flags & H2_FLAG_PADDED )
+			{
+				if( len < 1 )
+				{
+					close( "bad HEADERS padding" );
+					return( false );
+				}
+				pad = payload[ 0 ];
+				payload++;
+				len--;
+			}
+			if( flags & H2_FLAG_PRIORITY )
+			{
+				if( len < 5 )
+				{
+					close( "bad HEADERS priority" );
+					return( false );
+				}
+				payload += 5;
+				len -= 5;
+			}
+			if( pad > len )
+			{
+				close( "bad HEADERS padding" );
+				return( false );
+			}
+			len -= pad;
+			if( flags & H2_FLAG_END_HEADERS )
+				return( headers( id, payload, len, (flags & H2_FLAG_END_STREAM) != 0 ) );
+			headerStream = id;
+			headerEndStream = (flags & H2_FLAG_END_STREAM) != 0;
+			headerBlock.assign( (const char *) payload, len );
+			return( true );
+		}
+
+		case H2_FRAME_CONTINUATION:
+		{
+			if( !headerStream || id != headerStream )
+			{
+				close( "unexpected CONTINUATION" );
+				return( false );
+			}
+			headerBlock.append( (const char *) payload, len );
+			if( !(flags & H2_FLAG_END_HEADERS) )
+				return( true );
+			string block;
+			block.swap( headerBlock );
+			headerStream = 0;
+			return( headers( id, (const unsigned char *) block.data(), block.size(), headerEndStream ) );
+		}
+
+		case H2_FRAME_RST_STREAM:
+			resetStream( id, -1 );
+			return( true );
+
+		case H2_FRAME_SETTINGS:
+			return( settings( flags, payload, len ) );
+
+		case H2_FRAME_PUSH_PROMISE:
+			close( "PUSH_PROMISE with push disabled" );
+			return( false );
+
+		case H2_FRAME_PING:
+			if( len == 8 && !(flags & H2_FLAG_ACK) )
+			{
+				lock_guard< mutex > lock( clientMutex );
+				HTTP2Frame::header( &out, 8, H2_FRAME_PING, H2_FLAG_ACK, 0 );
+				out.append( (const char *) payload, 8 );
+			}
+			return( true );
+
+		case H2_FRAME_GOAWAY:
+		{
+			if( len < 8 )
+			{
+				close( "bad GOAWAY" );
+				return( false );
+			}
+			// streams past the last it will process never started there
+			uint32_t last = HTTP2Frame::get32( payload ) & 0x7fffffff;
+			vector< uint32_t > unprocessed;
+			{
+				lock_guard< mutex > lock( clientMutex );
+				goingAway = true;
+				for( auto it = active.upper_bound( last ); it != active.end(); it++ )
+					unprocessed.push_back( it->first );
+			}
+			for( auto it = unprocessed.begin(); it != unprocessed.end(); it++ )
+				resetStream( *it, -1 );
+			return( true );
+		}
+
+		case H2_FRAME_WINDOW_UPDATE:
+		{
+			if( len != 4 )
+			{
+				close( "bad WINDOW_UPDATE" );
+				return( false );
+			}
+			int64_t increment = HTTP2Frame::get32( payload ) & 0x7fffffff;
+			lock_guard< mutex > lock( clientMutex );
+			if( id == 0 )
+				sendWindow += increment;
+			else
+			{
+				auto it = active.find( id );
+				if( it != active.end() )
+					it->second->sendWindow += increment;
+			}
+			return( true );
+		}
+
+		default:
+			return( true );		// PRIORITY and unknown frame types
+	}
+}
+
+// a response header (or trailers) as HTTP/1.1 for the stream's reader
+
+bool
+HTTP2Client :: headers( uint32_t id, const unsigned char *block, size_t len, bool endStream )
+{
+	// decoded whatever becomes of the stream, to keep the table in step
+	vector< pair< string, string > > fields;
+	if( !decoder.decode( block, len, &fields ) )
+	{
+		close( decoder.error );
+		return( false );
+	}
+	int status = 0;
+	for( auto it = fields.begin(); it != fields.end(); it++ )
+	{
+		if( it->first == ":status" )
+			status = atoi( it->second.c_str() );
+	}
+	bool bad = false;
+	{
+		lock_guard< mutex > lock( clientMutex );
+		auto it = active.find( id );
+		if( it == active.end() )
+			return( true );
+		HTTP2ClientStream *stream = it->second;
+		if( stream->responseDone )
+			bad = true;
+		else if( stream->responseStarted )
+		{
+			// trailers end the body; they aren't passed on
+			if( !endStream )
+				bad = true;
+			else
+			{
+				if( stream->chunked )
+					stream->response += "0\r\n\r\n";
+				stream->responseDone = true;
+			}
+		}
+		else if( status < 100 || status == 101 || (status < 200 && endStream) )
+			bad = true;
+		else
+		{
+			stream->response += HTTP2ClientStream::responseHeader( status, fields, stream->headRequest, endStream, &stream->chunked );
+			if( status >= 200 )
+			{
+				stream->responseStarted = true;
+				stream->responseDone = endStream;
+			}
+		}
+		changed.notify_all();
+	}
+	if( bad )
+	{
+		Log::log( "HTTP2Client[ %s ]: stream %u: malformed response", destStr, id );
+		resetStream( id, H2_PROTOCOL_ERROR );
+	}
+	return( true );
+}
+
+bool
+HTTP2Client :: settings( int flags, const unsigned char *payload, size_t len )
+{
+	if( flags & H2_FLAG_ACK )
+		return( true );
+	if( len % 6 )
+	{
+		close( "bad SETTINGS" );
+		return( false );
+	}
+	lock_guard< mutex > lock( clientMutex );
+	for( size_t i = 0; i < len; i += 6 )
+	{
+		int setting = (payload[ i ] << 8) | payload[ i + 1 ];
+		uint32_t value = HTTP2Frame::get32( payload + i + 2 );
+		if( setting == H2_SETTINGS_HEADER_TABLE_SIZE )
+			encoder.setTableSize( value );
+		else if( setting == H2_SETTINGS_MAX_CONCURRENT_STREAMS )
+			maxStreams = min( value, (uint32_t) CLIENT_STREAMS );
+		else if( setting == H2_SETTINGS_INITIAL_WINDOW_SIZE && value <= H2_WINDOW_MAX )
+		{
+			// applies to the streams already open too
+			for( auto it = active.begin(); it != active.end(); it++ )
+				it->second->sendWindow += (int64_t) value - initialWindow;
+			initialWindow = value;
+		}
+		else if( setting == H2_SETTINGS_MAX_FRAME_SIZE && value >= 16384 && value <= 16777215 )
+			maxFrameSize = value;
+	}
+	HTTP2Frame::header( &out, 0, H2_FRAME_SETTINGS, H2_FLAG_ACK, 0 );
+	changed.notify_all();
+	return( true );
+}
+
+// end a stream: RST_STREAM with error unless the backend reset it (-1);
+// its reader sees the end of the response
+
+void
+HTTP2Client :: resetStream( uint32_t id, int error )
+{
+	lock_guard< mutex > lock( clientMutex );
+	if( error >= 0 )
+	{
+		HTTP2Frame::header( &out, 4, H2_FRAME_RST_STREAM, 0, id );
+		HTTP2Frame::put32( (uint32_t) error, &out );
+	}
+	auto it = active.find( id );
+	if( it == active.end() )
+		return;
+	it->second->reset = true;
+	active.erase( it );
+	changed.notify_all();
+}
+
+// no more streams: every open one sees its response end
+
+void
+HTTP2Client :: close( const char *reason )
+{
+	if( reason )
+		Log::log( "HTTP2Client[ %s ]: %s", destStr, reason );
+	lock_guard< mutex > lock( clientMutex );
+	closed = true;
+	for( auto it = active.begin(); it != active.end(); it++ )
+		it->second->reset = true;
+	active.clear();
+	changed.notify_all();
+}
+
+void
+HTTP2ClientThread :: _main( HTTP2Client *client )
+{
+# if TRACE
+	Log::console( "HTTP2ClientThread::_main[ %s ] RUN", client->destStr );
+# endif // TRACE
+	shared_ptr< HTTP2Client > self;
+	self.swap( client->self );
+	while( client->readFrames() )
+		;
+	client->close( nullptr );
+}
@@ -0,0 +1,136 @@
+//
+//  HTTP2Client.h
+//  Layer7LoadBalancer
+//  Created by Rick Tyler
+//
+//  SPDX-License-Identifier: MIT
+
+# ifndef _HTTP2Client_h_
+# define _HTTP2Client_h_
+
+# include "Thread.h"
+# include "Connection.h"
+# include "HTTPParser.h"
+# include "HPACK.h"
+# include <atomic>
+# include <condition_variable>
+# include <map>
+# include <memory>
+
+// A TLS backend connection that negotiated "h2" by ALPN, multiplexing the
+// requests of many sessions. Its thread owns the connection, reading and
+// writing every frame. Each request is an HTTP2ClientStream, which sessions
+// write and read as HTTP/1.1 through a Connection wrapping it, so they
+// proxy to it as they would to any pooled connection.
+
+class HTTP2Client;
+class HTTP2ClientThread;
+
+class HTTP2ClientStream
+{
+    public:
+
+	HTTP2ClientStream( shared_ptr< HTTP2Client > client );
+	~HTTP2ClientStream();
+	ssize_t write( const char *data, size_t len );
+	ssize_t read( void *buf, size_t len );
+	bool wait( int timeout );
+	ssize_t pending( void );
+
+	// HTTP/1.1 to HTTP/2 and back (RFC 9113 8.3)
+	static bool requestFields( HTTPParser *request, bool secure, vector< pair< string, string > > *fields );
+	static string responseHeader( int status, const vector< pair< string, string > >& fields, bool headRequest,
+		bool endStream, bool *chunked );
+
+    private:
+
+	shared_ptr< HTTP2Client > client;
+	uint32_t id = 0;		// assigned when the request header is complete
+	string head;			// request header so far
+	HTTPBody requestBody;
+	bool headRequest = false;
+	ssize_t queueBody( const char *data, size_t len );
+
+	// under client->clientMutex
+	string body;			// request body not yet framed
+	bool bodyDone = false;
+	bool requestEnded = false;	// END_STREAM sent
+	int64_t sendWindow = 0;
+	string response;		// as HTTP/1.1, not yet read
+	size_t responseOffset = 0;
+	bool responseStarted = false;	// final status received
+	bool responseDone = false;
+	bool chunked = false;		// response body of unknown length, chunked for the reader
+	size_t owed = 0;		// DATA read, to return as WINDOW_UPDATE
+	bool reset = false;		// by the backend, or the connection closed
+
+    friend class HTTP2Client;
+};
+
+class HTTP2Client : public ThreadContext
+{
+    public:
+
+	HTTP2Client( Connection *connection, const char *destStr );
+	~HTTP2Client();
+	static shared_ptr< HTTP2Client > start( Connection *connection, const char *destStr );
+	bool reserve( void );		// a stream, if the backend allows one more
+	bool isOpen( void );
+	static atomic< size_t > connections;
+	static atomic< size_t > streams;
+
+    private:
+
+	Connection *connection;
+	const char *destStr;
+	shared_ptr< HTTP2Client > self;	// the thread's, until it ends
+	HTTP2ClientThread *thread = nullptr;
+	mutex clientMutex;
+	condition_variable changed;	// for sessions: response bytes, window, reset
+	int wakeFds[ 2 ] = { -1, -1 };
+	map< uint32_t, HTTP2ClientStream * > active;
+	size_t reserved = 0;		// streams handed out, open or not yet
+	uint32_t nextId = 1;
+	uint32_t maxStreams;		// the backend's SETTINGS_MAX_CONCURRENT_STREAMS, capped
+	uint32_t maxFrameSize = 16384;
+	int64_t initialWindow = 65535;	// the backend's SETTINGS_INITIAL_WINDOW_SIZE
+	int64_t sendWindow = 65535;	// connection-level
+	bool goingAway = false;		// GOAWAY received: no new streams
+	bool closed = false;
+	string out;			// frames to write (under clientMutex)
+	string in;			// read, not yet framed (the thread's)
+	size_t recvCredit = 0;		// connection-level window to return (the thread's)
+	HPACKEncoder encoder;		// under clientMutex: blocks go out in the order encoded
+	HPACKDecoder decoder;		// the thread's
+	uint32_t headerStream = 0;	// HEADERS awaiting CONTINUATION
+	bool headerEndStream = false;
+	string headerBlock;
+	void wake( void );
+	bool openStream( HTTP2ClientStream *stream, vector< pair< string, string > > *fields, bool endStream );
+	void closeStream( HTTP2ClientStream *stream );
+	bool readFrames( void );
+	bool frame( int type, int flags, uint32_t id, const unsigned char *payload, size_t len );
+	bool headers( uint32_t id, const unsigned char *block, size_t len, bool endStream );
+	bool settings( int flags, const unsigned char *payload, size_t len );
+	void resetStream( uint32_t id, int error );
+	bool flush( void );
+	void close( const char *reason );
+
+    friend class HTTP2ClientStream;
+    friend class HTTP2ClientThread;
+};
+
+class HTTP2ClientThread : public Thread
+{
+    public:
+
+	HTTP2ClientThread( HTTP2Client *context ) : Thread( context ) { }
+	virtual ~HTTP2ClientThread() { }
+	ThreadMain main( void ) { return( (ThreadMain) _main ); }
+
+    private:
+
+	static void _main( HTTP2Client *client );
+};
+
+# endif // _HTTP2Client_h_
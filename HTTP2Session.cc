@@ -0,0 +1,1228 @@
+//
+//  HTTP2Session.cc
+//  Layer7LoadBalancer
+//  Created by Rick Tyler
+//
+//  SPDX-License-Identifier: MIT
+
+# include "HTTP2Session.h"
+# include "HTTP2.h"
+# include "Exception.h"
+# include "Log.h"
+# include <errno.h>
+# include <fcntl.h>
+# include <limits.h>
+# include <string.h>
+# include <unistd.h>
+# include <poll.h>
+# include <arpa/inet.h>
+
+// # define TRACE    1
+
+# define STREAM_WINDOW         (256 * 1024)	// request body a stream may have in hand
+# define CONNECTION_WINDOW     (1024 * 1024)
+# define STREAM_BUFFER_MAX     (256 * 1024)	// response bytes a stream thread reads ahead of the client
+# define READ_LEN              16384
+# define RESPONSE_BUF_LEN      16384
+
+# define RELAY_OK              1
+# define RELAY_RETRY           0	// nothing relayed to the client yet, the request can go elsewhere
+# define RELAY_FAILED         -1
+
+atomic< size_t > HTTP2SessionContext::sessions( 0 );
+atomic< size_t > HTTP2SessionContext::streams( 0 );
+atomic< size_t > HTTP2SessionContext::refused( 0 );
+
+HTTP2Connection :: HTTP2Connection( void )
+{
+	if( pipe( wakeFds ) != 0 )
+		Exception::raise( "HTTP2Connection: pipe() failed (%s)", strerror( errno ) );
+	for( int i = 0; i < 2; i++ )
+	{
+		(void) fcntl( wakeFds[ i ], F_SETFL, fcntl( wakeFds[ i ], F_GETFL ) | O_NONBLOCK );
+		(void) fcntl( wakeFds[ i ], F_SETFD, FD_CLOEXEC );
+	}
+}
+
+HTTP2Connection :: ~HTTP2Connection()
+{
+	(void) close( wakeFds[ 0 ] );
+	(void) close( wakeFds[ 1 ] );
+}
+
+// a full pipe is already a wakeup, so a failed write loses nothing
+
+void
+HTTP2Connection :: wake( void )
+{
+	ssize_t written = ::write( wakeFds[ 1 ], "", 1 );
+	(void) written;
+}
+
+HTTP2StreamContext :: HTTP2StreamContext( HTTP2SessionContext *session, uint32_t id, int64_t sendWindow )
+: request( false )
+{
+	this->connection = session->connection;
+	this->service = session->service;
+	this->rewrite = session->rewrite;
+	this->sessionCookie = session->sessionCookie;
+	this->clientAddr = session->clientAddr;
+	this->maxHeaderSize = session->maxHeaderSize;
+	this->responseTimeout = session->responseTimeout;
+	this->bodyTimeout = session->bodyTimeout;
+	this->id = id;
+	this->recvWindow = STREAM_WINDOW;
+	this->sendWindow = sendWindow;
+}
+
+HTTP2StreamContext :: ~HTTP2StreamContext()
+{
+	if( responseBuf )
+		free( responseBuf );
+	if( thread )
+		delete( thread );
+}
+
+// balance, forward and answer the stream's request
+
+void
+HTTP2StreamContext :: proxyRequest( void )
+{
+	if( request.parse( header.data(), header.size() ) != HTTP_COMPLETE )
+	{
+		Log::log( "HTTP2Session[ %p ]: stream %u: bad request (%s)", connection.get(), id, request.error ? request.error : "incomplete" );
+		sendError( 400, "Bad Request" );
+		return;
+	}
+	method = string( request.method );
+	for( int attempt = 0; ; attempt++ )
+	{
+		if( !(backend = service->sessionSelectBackend( &request )) )
+		{
+			Log::log( "HTTP2Session[ %p ]: stream %u: no backend available", connection.get(), id );
+			sendError( 503, "Service Unavailable" );
+			return;
+		}
+		bool reused;
+		int result = sendRequest( &reused );
+		if( result == RELAY_OK )
+			result = relayResponse( reused );
+		if( result == RELAY_OK )
+			return;
+		endRequest( false );
+		if( result == RELAY_FAILED )
+			return;
+		if( attempt > 0 )
+		{
+			sendError( 502, "Bad Gateway" );
+			return;
+		}
+	}
+}
+
+// the request header, then its body as DATA frames bring it
+
+int
+HTTP2StreamContext :: sendRequest( bool *reused )
+{
+	try
+	{
+		proxy = backend->getConnection( reused );
+	}
+	catch( const char *error )
+	{
+		Log::log( "HTTP2Session[ %p ]: stream %u: Connection() failed (%s)", connection.get(), id, error );
+		backend->reportFailure( "connect failed" );
+		return( RELAY_RETRY );
+	}
+	static const HeaderRewrite none;
+	const HeaderRewrite *headers = rewrite ? rewrite : &none;
+	int count = headers->build( &request, header.data(), header.size(), clientAddr, true, &requestId, &inserted, &iov );
+	if( proxy->writev( iov.data(), count ) < 0 )
+	{
+		if( !*reused )
+			backend->reportFailure( "connection reset" );
+		return( RELAY_RETRY );
+	}
+	requestStart = Thread::milliseconds();
+
+	// a request whose body is still to come can be resent if a pooled
+	// connection turns out to have been closed, unless it may have had
+	// side effects
+	replayable = method != "POST" && method != "PATCH";
+	for( bool done = false; !done; )
+	{
+		string chunk;
+		if( !takeBody( &chunk, &done ) )
+			return( RELAY_FAILED );
+		if( chunked )
+		{
+			char size[ 32 ];
+			string framed;
+			if( !chunk.empty() )
+			{
+				snprintf( size, sizeof( size ), "%zx\r\n", chunk.size() );
+				framed = size + chunk + "\r\n";
+			}
+			if( done )
+				framed += "0\r\n\r\n";
+			chunk.swap( framed );
+		}
+		if( chunk.empty() )
+			continue;
+		replayable = false;	// the body is gone once it's sent
+		if( !proxyWrite( chunk.data(), chunk.size() ) )
+		{
+			backend->reportFailure( "connection reset" );
+			sendError( 502, "Bad Gateway" );
+			return( RELAY_FAILED );
+		}
+		requestStart = Thread::milliseconds();
+	}
+	return( RELAY_OK );
+}
+
+// request body the session thread has received; false if the stream was
+// reset or the client stalled past BODY-TIMEOUT (answered)
+
+bool
+HTTP2StreamContext :: takeBody( string *chunk, bool *done )
+{
+	{
+		unique_lock< mutex > lock( connection->streamsMutex );
+		if( !connection->changed.wait_for( lock, chrono::milliseconds( bodyTimeout ),
+			[ this ] { return( reset || bodyDone || !body.empty() ); } ) )
+		{
+			lock.unlock();
+			Log::log( "HTTP2Session[ %p ]: stream %u: request body timed out (BODY-TIMEOUT %d ms)", connection.get(), id, bodyTimeout );
+			sendError( 408, "Request Timeout" );
+			return( false );
+		}
+		if( reset )
+			return( false );
+		chunk->swap( body );
+		consumed += chunk->size();
+		*done = bodyDone;
+	}
+	if( !chunk->empty() )
+		connection->wake();	// for the WINDOW_UPDATE
+	return( true );
+}
+
+// read the response header, hand it over, then its body as it arrives
+
+int
+HTTP2StreamContext :: relayResponse( bool reused )
+{
+	HTTPParser response( true );
+	size_t len = 0;
+	if( !responseBuf )
+	{
+		responseBufLen = RESPONSE_BUF_LEN;
+		responseBuf = (char *) malloc( responseBufLen );
+	}
+	for( ;; )
+	{
+		int result = response.parse( responseBuf, len );
+		if( result == HTTP_ERROR || (result == HTTP_COMPLETE && response.status == 101) )
+		{
+			Log::log( "HTTP2Session[ %p ]: stream %u: bad response from %s (%s)", connection.get(), id, backend->destStr,
+				result == HTTP_ERROR ? response.error : "101 over HTTP/2" );
+			backend->reportFailure( "bad response" );
+			sendError( 502, "Bad Gateway" );
+			return( RELAY_FAILED );
+		}
+		if( result == HTTP_COMPLETE )
+		{
+			if( response.status >= 200 )
+				break;
+			// interim responses aren't passed on
+			len -= response.headerLen;
+			memmove( responseBuf, responseBuf + response.headerLen, len );
+			response.reset();
+			continue;
+		}
+		if( len == responseBufLen )
+		{
+			if( responseBufLen >= maxHeaderSize )
+			{
+				backend->reportFailure( "response header too large" );
+				sendError( 502, "Bad Gateway" );
+				return( RELAY_FAILED );
+			}
+			responseBufLen = min( responseBufLen * 2, maxHeaderSize );
+			responseBuf = (char *) realloc( responseBuf, responseBufLen );
+		}
+		if( !proxy->wait( responseTimeout ) )
+		{
+			backend->reportFailure( "timed out" );
+			sendError( 504, "Gateway Timeout" );
+			return( RELAY_FAILED );
+		}
+		ssize_t n = proxy->read( responseBuf + len, responseBufLen - len );
+		if( n <= 0 )
+		{
+			if( len == 0 && reused && replayable )
+				return( RELAY_RETRY );
+			backend->reportFailure( "connection reset" );
+			sendError( 502, "Bad Gateway" );
+			return( RELAY_FAILED );
+		}
+		if( requestStart )
+		{
+			backend->reportLatency( Thread::milliseconds() - requestStart );
+			requestStart = 0;
+		}
+		len += n;
+	}
+
+	// passive outlier detection counts 5xx responses as failures
+	if( response.status >= 500 )
+		backend->reportFailure( "5xx response" );
+	else
+		backend->reportSuccess();
+	if( !sessionCookie.empty() )
+	{
+		string_view value = response.setCookie( sessionCookie );
+		if( !value.empty() )
+		{
+			string cookie( value );
+			service->sessionNotifyProtocolAttribute( &cookie, (void *) backend->destStr );
+		}
+	}
+
+	HTTPBody responseBody;
+	if( responseBody.frame( &response, method ) == HTTP_ERROR )
+	{
+		Log::log( "HTTP2Session[ %p ]: stream %u: bad response from %s (%s)", connection.get(), id, backend->destStr, responseBody.error );
+		sendError( 502, "Bad Gateway" );
+		return( RELAY_FAILED );
+	}
+	bool reuse = response.keepAlive() && responseBody.framing != HTTP_BODY_CLOSE;
+
+	// HTTP/2 fields are lowercase and carry nothing about the connection
+	vector< pair< string, string > > fields;
+	for( auto it = response.headers.begin(); it != response.headers.end(); it++ )
+	{
+		string name( it->name );
+		for( size_t i = 0; i < name.size(); i++ )
+			name[ i ] = (char) tolower( (unsigned char) name[ i ] );
+		if( name == "connection" || name == "keep-alive" || name == "proxy-connection" || name == "transfer-encoding"
+			|| name == "upgrade" )
+			continue;
+		fields.emplace_back( move( name ), string( it->value ) );
+	}
+	string payload;
+	size_t used = response.headerLen + responseBody.consume( responseBuf + response.headerLen, len - response.headerLen, &payload );
+	if( used < len )
+		reuse = false;	// bytes past the end of the response
+	if( !respond( response.status, &fields, false ) || !deliver( payload.data(), payload.size(), responseBody.done() ) )
+		return( RELAY_FAILED );
+	while( !responseBody.done() && !responseBody.error )
+	{
+		if( !proxy->wait( responseTimeout ) )
+		{
+			backend->reportFailure( "timed out" );
+			sendError( 504, "Gateway Timeout" );
+			return( RELAY_FAILED );
+		}
+		ssize_t n = proxy->read( responseBuf, responseBufLen );
+		if( n <= 0 )
+		{
+			if( responseBody.framing == HTTP_BODY_CLOSE )
+			{
+				if( !deliver( "", 0, true ) )
+					return( RELAY_FAILED );
+				break;
+			}
+			backend->reportFailure( "connection reset" );
+			sendError( 502, "Bad Gateway" );
+			return( RELAY_FAILED );
+		}
+		payload.clear();
+		used = responseBody.consume( responseBuf, n, &payload );
+		if( used < (size_t) n )
+			reuse = false;
+		if( !deliver( payload.data(), payload.size(), responseBody.done() ) )
+			return( RELAY_FAILED );
+	}
+	if( responseBody.error )
+	{
+		Log::log( "HTTP2Session[ %p ]: stream %u: bad response from %s (%s)", connection.get(), id, backend->destStr, responseBody.error );
+		sendError( 502, "Bad Gateway" );
+		return( RELAY_FAILED );
+	}
+	endRequest( reuse );
+	return( RELAY_OK );
+}
+
+// the response header, for the session thread to encode; false if the
+// stream was reset
+
+bool
+HTTP2StreamContext :: respond( int status, vector< pair< string, string > > *headers, bool done )
+{
+	{
+		lock_guard< mutex > lock( connection->streamsMutex );
+		if( reset )
+			return( false );
+		this->status = status;
+		responseHeaders.swap( *headers );
+		dataDone = done;
+	}
+	connection->wake();
+	return( true );
+}
+
+// response body, waiting while the client is STREAM_BUFFER_MAX behind
+
+bool
+HTTP2StreamContext :: deliver( const char *data, size_t len, bool done )
+{
+	{
+		unique_lock< mutex > lock( connection->streamsMutex );
+		if( !connection->changed.wait_for( lock, chrono::milliseconds( responseTimeout ),
+			[ this ] { return( reset || this->data.size() - dataOffset <= STREAM_BUFFER_MAX ); } ) )
+		{
+			failed = true;
+			lock.unlock();
+			Log::log( "HTTP2Session[ %p ]: stream %u: client stopped reading", connection.get(), id );
+			connection->wake();
+			return( false );
+		}
+		if( reset )
+			return( false );
+		this->data.append( data, len );
+		dataDone = done;
+	}
+	connection->wake();
+	return( true );
+}
+
+// a response of our own, or a reset stream if one was already begun
+
+void
+HTTP2StreamContext :: sendError( int status, const char *reason )
+{
+	if( this->status )
+	{
+		lock_guard< mutex > lock( connection->streamsMutex );
+		failed = true;
+	}
+	else
+	{
+		string body = to_string( status ) + " " + reason + "\n";
+		vector< pair< string, string > > headers;
+		headers.emplace_back( "content-type", "text/plain" );
+		headers.emplace_back( "content-length", to_string( body.size() ) );
+		if( respond( status, &headers, false ) )
+			(void) deliver( body.data(), body.size(), true );
+		return;
+	}
+	connection->wake();
+}
+
+void
+HTTP2StreamContext :: endRequest( bool reuse )
+{
+	if( proxy )
+	{
+		if( reuse )
+			backend->releaseConnection( proxy );
+		else
+			delete( proxy );
+		proxy = nullptr;
+	}
+	if( backend )
+	{
+		backend->sessionEnded();
+		backend = nullptr;
+	}
+	requestStart = 0;
+}
+
+bool
+HTTP2StreamContext :: proxyWrite( const char *data, size_t len )
+{
+	while( len )
+	{
+		ssize_t sent = proxy->write( (void *) data, len );
+		if( sent <= 0 )
+			return( false );
+		data += sent;
+		len -= sent;
+	}
+	return( true );
+}
+
+void
+HTTP2Stream :: _main( HTTP2StreamContext *context )
+{
+# if TRACE
+	Log::console( "HTTP2Stream::_main[ %p ] stream %u RUN", context, context->id );
+# endif // TRACE
+	context->proxyRequest();
+	context->endRequest( false );
+
+	// the session thread may still be framing the response
+	shared_ptr< HTTP2Connection > connection = context->connection;
+	bool last;
+	{
+		lock_guard< mutex > lock( connection->streamsMutex );
+		context->threadDone = true;
+		last = context->sessionDone;
+	}
+	if( last )
+		delete( context );
+	connection->wake();
+}
+
+HTTP2SessionContext :: HTTP2SessionContext
+(
+	Service *service,
+	int clientSocket,
+	SSL *clientSSL,
+	string sessionCookie,
+	size_t maxHeaderSize,
+	int keepAliveTimeout,
+	int responseTimeout,
+	int bodyTimeout,
+	const HeaderRewrite *rewrite,
+	uint32_t maxStreams
+)
+: SessionContext( service, clientSocket, clientSSL ), decoder( maxHeaderSize )
+{
+# if TRACE
+	Log::console( "HTTP2SessionContext::HTTP2SessionContext()" );
+# endif // TRACE
+	this->connection = make_shared< HTTP2Connection >();
+	this->sessionCookie = sessionCookie;
+	this->maxHeaderSize = maxHeaderSize;
+	this->keepAliveTimeout = keepAliveTimeout;
+	this->responseTimeout = responseTimeout;
+	this->bodyTimeout = bodyTimeout ? bodyTimeout : keepAliveTimeout;
+	this->rewrite = rewrite && !rewrite->empty() ? rewrite : nullptr;
+	this->maxStreams = maxStreams;
+	this->recvWindow = H2_DEFAULT_WINDOW;
+	if( this->rewrite )
+	{
+		// the client's address, for X-Forwarded-For
+		struct sockaddr_storage addr;
+		socklen_t addrLen = sizeof( addr );
+		char host[ INET6_ADDRSTRLEN ] = "";
+		if( getpeername( clientSocket, (struct sockaddr *) &addr, &addrLen ) == 0 )
+		{
+			if( addr.ss_family == AF_INET )
+				inet_ntop( AF_INET, &((struct sockaddr_in *) &addr)->sin_addr, host, sizeof( host ) );
+			else if( addr.ss_family == AF_INET6 )
+				inet_ntop( AF_INET6, &((struct sockaddr_in6 *) &addr)->sin6_addr, host, sizeof( host ) );
+		}
+		clientAddr = host;
+	}
+	++sessions;
+}
+
+HTTP2SessionContext :: ~HTTP2SessionContext()
+{
+# if TRACE
+	Log::console( "HTTP2SessionContext::~HTTP2SessionContext()" );
+# endif // TRACE
+}
+
+void
+HTTP2SessionContext :: frameHeader( size_t len, int type, int flags, uint32_t id )
+{
+	HTTP2Frame::header( &out, len, type, flags, id );
+}
+
+// finish a 0-RTT handshake (HTTP/2 requests don't go early), then our
+// SETTINGS and the larger connection window
+
+bool
+HTTP2SessionContext :: start( void )
+{
+	if( clientSSL && SSL_in_init( clientSSL ) )
+	{
+		in.swap( earlyData );
+		char buf[ READ_LEN ];
+		for( ;; )
+		{
+			size_t len = 0;
+			int result = SSL_read_early_data( clientSSL, buf, sizeof( buf ), &len );
+			in.append( buf, len );
+			if( result == SSL_READ_EARLY_DATA_FINISH )
+				break;
+			if( result == SSL_READ_EARLY_DATA_ERROR )
+				return( false );
+		}
+		if( SSL_do_handshake( clientSSL ) != 1 )
+		{
+			Log::log( "HTTP2Session[ %p ]: TLS handshake failed after early data", connection.get() );
+			return( false );
+		}
+	}
+	frameHeader( 12, H2_FRAME_SETTINGS, 0, 0 );
+	out.push_back( 0 );
+	out.push_back( H2_SETTINGS_MAX_CONCURRENT_STREAMS );
+	HTTP2Frame::put32( maxStreams, &out );
+	out.push_back( 0 );
+	out.push_back( H2_SETTINGS_INITIAL_WINDOW_SIZE );
+	HTTP2Frame::put32( STREAM_WINDOW, &out );
+	frameHeader( 4, H2_FRAME_WINDOW_UPDATE, 0, 0 );
+	HTTP2Frame::put32( CONNECTION_WINDOW - recvWindow, &out );
+	recvWindow = CONNECTION_WINDOW;
+	bool sent = clientWrite( out.data(), out.size() );
+	out.clear();
+	return( sent );
+}
+
+// handle the client's frames, frame the streams' output, then wait for
+// more of either; false to end
+
+bool
+HTTP2SessionContext :: readFrames( void )
+{
+	// what's come so far (early data, on the first call)
+	size_t used = 0;
+	if( !preface && in.size() >= H2_PREFACE_LEN )
+	{
+		if( memcmp( in.data(), H2_PREFACE, H2_PREFACE_LEN ) != 0 )
+			return( connectionError( H2_PROTOCOL_ERROR, "bad connection preface" ) );
+		used = H2_PREFACE_LEN;
+		preface = true;
+	}
+	while( preface && in.size() - used >= H2_FRAME_HEADER_LEN )
+	{
+		const unsigned char *p = (const unsigned char *) in.data() + used;
+		size_t len = ((size_t) p[ 0 ] << 16) | ((size_t) p[ 1 ] << 8) | p[ 2 ];
+		if( len > H2_FRAME_MAX )
+			return( connectionError( H2_FRAME_SIZE_ERROR, "frame too large" ) );
+		if( in.size() - used < H2_FRAME_HEADER_LEN + len )
+			break;
+		used += H2_FRAME_HEADER_LEN + len;
+		if( !frame( p[ 3 ], p[ 4 ], HTTP2Frame::get32( p + 5 ) & 0x7fffffff, p + H2_FRAME_HEADER_LEN, len ) )
+			return( false );
+	}
+	in.erase( 0, used );
+
+	flush();
+	if( goAwayError >= 0 )
+		return( false );
+	bool idle;
+	{
+		lock_guard< mutex > lock( connection->streamsMutex );
+		idle = connection->streams.empty();
+	}
+	if( goingAway && idle )
+		return( false );
+
+	bool clientReady = clientSSL && SSL_pending( clientSSL ) > 0;
+	if( !clientReady )
+	{
+		struct pollfd fds[ 2 ] = { { clientSocket, POLLIN, 0 }, { connection->wakeFds[ 0 ], POLLIN, 0 } };
+		int result = poll( fds, 2, idle ? keepAliveTimeout : -1 );
+		if( result < 0 )
+			return( errno == EINTR );
+		if( result == 0 )
+		{
+			goAwayError = H2_NO_ERROR;		// idle past KEEPALIVE-TIMEOUT
+			return( false );
+		}
+		if( fds[ 1 ].revents )
+		{
+			char drain[ 256 ];
+			while( ::read( connection->wakeFds[ 0 ], drain, sizeof( drain ) ) > 0 )
+				;
+		}
+		clientReady = fds[ 0 ].revents != 0;
+	}
+	if( clientReady )
+	{
+		char buf[ READ_LEN ];
+		ssize_t len = clientRead( buf, sizeof( buf ) );
+		if( len <= 0 )
+			return( false );
+		in.append( buf, len );
+	}
+	return( true );
+}
+
+bool
+HTTP2SessionContext :: frame( int type, int flags, uint32_t id, const unsigned char *payload, size_t len )
+{
+# if TRACE
+	Log::console( "HTTP2Session[ %p ]: frame type=%d flags=%x stream=%u len=%zu", connection.get(), type, flags, id, len );
+# endif // TRACE
+	if( headerStream && type != H2_FRAME_CONTINUATION )
+		return( connectionError( H2_PROTOCOL_ERROR, "expected CONTINUATION" ) );
+	switch( type )
+	{
+		case H2_FRAME_DATA:
+			return( data( flags, id, payload, len ) );
+
+		case H2_FRAME_HEADERS:
+		{
+			if( id == 0 )
+				return( connectionError( H2_PROTOCOL_ERROR, "HEADERS on stream 0" ) );
+			size_t pad = 0;
+			if( flags & H2_FLAG_PADDED )
+			{
+				if( len < 1 )
+					return( connectionError( H2_FRAME_SIZE_ERROR, "bad HEADERS padding" ) );
+				pad = payload[ 0 ];
+				payload++;
+				len--;
+			}
+			if( flags & H2_FLAG_PRIORITY )
+			{
+				if( len < 5 )
+					return( connectionError( H2_FRAME_SIZE_ERROR, "bad HEADERS priority" ) );
+				payload += 5;
+				len -= 5;
+			}
+			if( pad > len )
+				return( connectionError( H2_PROTOCOL_ERROR, "bad HEADERS padding" ) );
+			len -= pad;
+			if( flags & H2_FLAG_END_HEADERS )
+				return( headers( id, payload, len, (flags & H2_FLAG_END_STREAM) != 0 ) );
+			headerStream = id;
+			headerEndStream = (flags & H2_FLAG_END_STREAM) != 0;
+			headerBlock.assign( (const char *) payload, len );
+			return( true );
+		}
+
+		case H2_FRAME_CONTINUATION:
+		{
+			if( !headerStream || id != headerStream )
+				return( connectionError( H2_PROTOCOL_ERROR, "unexpected CONTINUATION" ) );
+			headerBlock.append( (const char *) payload, len );
+			if( headerBlock.size() > maxHeaderSize )
+				return( connectionError( H2_PROTOCOL_ERROR, "header block exceeds MAX-HEADER-SIZE" ) );
+			if( !(flags & H2_FLAG_END_HEADERS) )
+				return( true );
+			string block;
+			block.swap( headerBlock );
+			headerStream = 0;
+			return( headers( id, (const unsigned char *) block.data(), block.size(), headerEndStream ) );
+		}
+
+		case H2_FRAME_PRIORITY:
+			if( id == 0 )
+				return( connectionError( H2_PROTOCOL_ERROR, "PRIORITY on stream 0" ) );
+			if( len != 5 )
+				resetStream( id, H2_FRAME_SIZE_ERROR );
+			return( true );
+
+		case H2_FRAME_RST_STREAM:
+			if( id == 0 || id > lastStreamId )
+				return( connectionError( H2_PROTOCOL_ERROR, "RST_STREAM on an idle stream" ) );
+			if( len != 4 )
+				return( connectionError( H2_FRAME_SIZE_ERROR, "bad RST_STREAM" ) );
+			resetStream( id, -1 );
+			return( true );
+
+		case H2_FRAME_SETTINGS:
+			return( settings( flags, id, payload, len ) );
+
+		case H2_FRAME_PUSH_PROMISE:
+			return( connectionError( H2_PROTOCOL_ERROR, "PUSH_PROMISE from a client" ) );
+
+		case H2_FRAME_PING:
+			if( id != 0 )
+				return( connectionError( H2_PROTOCOL_ERROR, "PING on a stream" ) );
+			if( len != 8 )
+				return( connectionError( H2_FRAME_SIZE_ERROR, "bad PING" ) );
+			if( !(flags & H2_FLAG_ACK) )
+			{
+				frameHeader( 8, H2_FRAME_PING, H2_FLAG_ACK, 0 );
+				out.append( (const char *) payload, 8 );
+			}
+			return( true );
+
+		case H2_FRAME_GOAWAY:
+			goingAway = true;	// finish what's open, then close
+			return( true );
+
+		case H2_FRAME_WINDOW_UPDATE:
+			return( windowUpdate( id, payload, len ) );
+
+		default:
+			return( true );		// unknown frame types are ignored
+	}
+}
+
+bool
+HTTP2SessionContext :: settings( int flags, uint32_t id, const unsigned char *payload, size_t len )
+{
+	if( id != 0 )
+		return( connectionError( H2_PROTOCOL_ERROR, "SETTINGS on a stream" ) );
+	if( flags & H2_FLAG_ACK )
+		return( len == 0 ? true : connectionError( H2_FRAME_SIZE_ERROR, "bad SETTINGS ack" ) );
+	if( len % 6 )
+		return( connectionError( H2_FRAME_SIZE_ERROR, "bad SETTINGS" ) );
+	for( size_t i = 0; i < len; i += 6 )
+	{
+		int setting = (payload[ i ] << 8) | payload[ i + 1 ];
+		uint32_t value = HTTP2Frame::get32( payload + i + 2 );
+		if( setting == H2_SETTINGS_HEADER_TABLE_SIZE )
+			encoder.setTableSize( value );
+		else if( setting == H2_SETTINGS_ENABLE_PUSH && value > 1 )
+			return( connectionError( H2_PROTOCOL_ERROR, "bad H2_SETTINGS_ENABLE_PUSH" ) );
+		else if( setting == H2_SETTINGS_INITIAL_WINDOW_SIZE )
+		{
+			if( value > H2_WINDOW_MAX )
+				return( connectionError( H2_FLOW_CONTROL_ERROR, "bad H2_SETTINGS_INITIAL_WINDOW_SIZE" ) );
+			// applies to the streams already open too
+			lock_guard< mutex > lock( connection->streamsMutex );
+			for( auto it = connection->streams.begin(); it != connection->streams.end(); it++ )
+				it->second->sendWindow += (int64_t) value - initialWindow;
+			initialWindow = value;
+		}
+		else if( setting == H2_SETTINGS_MAX_FRAME_SIZE )
+		{
+			if( value < 16384 || value > 16777215 )
+				return( connectionError( H2_PROTOCOL_ERROR, "bad H2_SETTINGS_MAX_FRAME_SIZE" ) );
+			maxFrameSize = value;
+		}
+	}
+	frameHeader( 0, H2_FRAME_SETTINGS, H2_FLAG_ACK, 0 );
+	return( true );
+}
+
+bool
+HTTP2SessionContext :: headers( uint32_t id, const unsigned char *block, size_t len, bool endStream )
+{
+	// decoded whatever becomes of the stream, to keep the table in step
+	vector< pair< string, string > > fields;
+	if( !decoder.decode( block, len, &fields ) )
+		return( connectionError( H2_COMPRESSION_ERROR, decoder.error ) );
+	if( !(id & 1) )
+		return( connectionError( H2_PROTOCOL_ERROR, "even stream id from a client" ) );
+	if( id <= lastStreamId )
+	{
+		// trailers end a request body; they aren't passed on
+		lock_guard< mutex > lock( connection->streamsMutex );
+		auto it = connection->streams.find( id );
+		if( it == connection->streams.end() || it->second->bodyDone )
+		{
+			frameHeader( 4, H2_FRAME_RST_STREAM, 0, id );
+			HTTP2Frame::put32( H2_STREAM_CLOSED, &out );
+			return( true );
+		}
+		if( !endStream )
+			return( connectionError( H2_PROTOCOL_ERROR, "trailers without END_STREAM" ) );
+		it->second->bodyDone = true;
+		connection->changed.notify_all();
+		return( true );
+	}
+	lastStreamId = id;
+	size_t open;
+	{
+		lock_guard< mutex > lock( connection->streamsMutex );
+		open = connection->streams.size();
+	}
+	if( goingAway || open >= maxStreams )
+	{
+		++refused;
+		resetStream( id, H2_REFUSED_STREAM );
+		return( true );
+	}
+	openStream( id, &fields, endStream );
+	return( true );
+}
+
+// the request as HTTP/1.1 (RFC 9113 8.3.1), run in a stream thread; a
+// malformed one is reset
+
+void
+HTTP2SessionContext :: openStream( uint32_t id, vector< pair< string, string > > *fields, bool endStream )
+{
+	string method, scheme, authority, path, cookies, lines;
+	bool contentLength = false;
+	bool malformed = false;
+	bool regular = false;
+	for( auto it = fields->begin(); it != fields->end() && !malformed; it++ )
+	{
+		const string& name = it->first;
+		const string& value = it->second;
+		if( name.empty() || value.find_first_of( string( "\r\n\0", 3 ) ) != string::npos )
+			malformed = true;
+		else if( name[ 0 ] == ':' )
+		{
+			if( regular )
+				malformed = true;
+			else if( name == ":method" )
+				method = value;
+			else if( name == ":scheme" )
+				scheme = value;
+			else if( name == ":authority" )
+				authority = value;
+			else if( name == ":path" )
+				path = value;
+			else
+				malformed = true;
+		}
+		else
+		{
+			regular = true;
+			for( size_t i = 0; i < name.size(); i++ )
+			{
+				if( isupper( (unsigned char) name[ i ] ) || name[ i ] == ':' || name[ i ] == ' ' )
+					malformed = true;
+			}
+			if( name == "connection" || name == "keep-alive" || name == "proxy-connection" || name == "transfer-encoding"
+				|| name == "upgrade" )
+				malformed = true;
+			else if( name == "te" || name == "expect" )
+				;	// hop-by-hop here; a backend's 100 Continue wouldn't be passed on
+			else if( name == "host" )
+			{
+				if( authority.empty() )
+					authority = value;
+			}
+			else if( name == "cookie" )
+			{
+				// crumbs are rejoined for HTTP/1.1 (RFC 9113 8.2.3)
+				if( !cookies.empty() )
+					cookies += "; ";
+				cookies += value;
+			}
+			else
+			{
+				if( name == "content-length" )
+					contentLength = true;
+				lines += name + ": " + value + "\r\n";
+			}
+		}
+	}
+	if( method.empty() || scheme.empty() || path.empty() || method == "CONNECT"
+		|| method.find_first_of( " \t" ) != string::npos || path.find_first_of( " \t" ) != string::npos
+		|| authority.find_first_of( " \t" ) != string::npos )
+		malformed = true;
+	if( malformed )
+	{
+		Log::log( "HTTP2Session[ %p ]: stream %u: malformed request", connection.get(), id );
+		resetStream( id, H2_PROTOCOL_ERROR );
+		return;
+	}
+
+	HTTP2StreamContext *stream = new HTTP2StreamContext( this, id, initialWindow );
+	stream->header = method + " " + path + " HTTP/1.1\r\n";
+	if( !authority.empty() )
+		stream->header += "Host: " + authority + "\r\n";
+	stream->header += lines;
+	if( !cookies.empty() )
+		stream->header += "Cookie: " + cookies + "\r\n";
+	if( !endStream && !contentLength )
+	{
+		stream->header += "Transfer-Encoding: chunked\r\n";
+		stream->chunked = true;
+	}
+	stream->header += "\r\n";
+	stream->bodyDone = endStream;
+	{
+		lock_guard< mutex > lock( connection->streamsMutex );
+		connection->streams[ id ] = stream;
+	}
+	++streams;
+	stream->thread = new HTTP2Stream( stream );
+	stream->thread->run();
+	stream->thread->detach();
+}
+
+bool
+HTTP2SessionContext :: data( int flags, uint32_t id, const unsigned char *payload, size_t len )
+{
+	if( id == 0 )
+		return( connectionError( H2_PROTOCOL_ERROR, "DATA on stream 0" ) );
+	if( id > lastStreamId )
+		return( connectionError( H2_PROTOCOL_ERROR, "DATA on an idle stream" ) );
+	// flow control counts the whole payload, padding too
+	if( (int64_t) len > recvWindow )
+		return( connectionError( H2_FLOW_CONTROL_ERROR, "connection window exceeded" ) );
+	recvWindow -= len;
+	const unsigned char *body = payload;
+	size_t bodyLen = len;
+	if( flags & H2_FLAG_PADDED )
+	{
+		if( len < 1 || payload[ 0 ] >= len )
+			return( connectionError( H2_PROTOCOL_ERROR, "bad DATA padding" ) );
+		body = payload + 1;
+		bodyLen = len - 1 - payload[ 0 ];
+	}
+	int error = -1;
+	{
+		lock_guard< mutex > lock( connection->streamsMutex );
+		auto it = connection->streams.find( id );
+		if( it == connection->streams.end() || it->second->bodyDone )
+			error = H2_STREAM_CLOSED;
+		else if( (int64_t) len > it->second->recvWindow )
+			error = H2_FLOW_CONTROL_ERROR;
+		else
+		{
+			HTTP2StreamContext *stream = it->second;
+			stream->recvWindow -= len;
+			stream->body.append( (const char *) body, bodyLen );
+			stream->consumed += len - bodyLen;	// the padding is done with
+			if( flags & H2_FLAG_END_STREAM )
+				stream->bodyDone = true;
+			connection->changed.notify_all();
+		}
+	}
+	if( error >= 0 )
+	{
+		recvConsumed += len;	// nobody will consume it
+		resetStream( id, error );
+	}
+	return( true );
+}
+
+bool
+HTTP2SessionContext :: windowUpdate( uint32_t id, const unsigned char *payload, size_t len )
+{
+	if( len != 4 )
+		return( connectionError( H2_FRAME_SIZE_ERROR, "bad WINDOW_UPDATE" ) );
+	int64_t increment = HTTP2Frame::get32( payload ) & 0x7fffffff;
+	if( id == 0 )
+	{
+		if( increment == 0 )
+			return( connectionError( H2_PROTOCOL_ERROR, "WINDOW_UPDATE of 0" ) );
+		if( (sendWindow += increment) > H2_WINDOW_MAX )
+			return( connectionError( H2_FLOW_CONTROL_ERROR, "connection window overflow" ) );
+		return( true );
+	}
+	int error = -1;
+	{
+		lock_guard< mutex > lock( connection->streamsMutex );
+		auto it = connection->streams.find( id );
+		if( it == connection->streams.end() )
+			return( true );
+		if( increment == 0 )
+			error = H2_PROTOCOL_ERROR;
+		else if( (it->second->sendWindow += increment) > H2_WINDOW_MAX )
+			error = H2_FLOW_CONTROL_ERROR;
+	}
+	if( error >= 0 )
+		resetStream( id, error );
+	return( true );
+}
+
+// end a stream: RST_STREAM with error unless the client reset it (-1);
+// its thread stops at its next turn
+
+void
+HTTP2SessionContext :: resetStream( uint32_t id, int error )
+{
+	if( error >= 0 )
+	{
+		frameHeader( 4, H2_FRAME_RST_STREAM, 0, id );
+		HTTP2Frame::put32( (uint32_t) error, &out );
+	}
+	lock_guard< mutex > lock( connection->streamsMutex );
+	auto it = connection->streams.find( id );
+	if( it == connection->streams.end() )
+		return;
+	HTTP2StreamContext *stream = it->second;
+	connection->streams.erase( it );
+	recvConsumed += stream->body.size() + stream->consumed;	// the connection window gets it all back
+	stream->reset = true;
+	stream->sessionDone = true;
+	if( stream->threadDone )
+		delete( stream );
+	connection->changed.notify_all();
+}
+
+// frame what the streams have for the client, as far as flow control
+// allows, return window for request body they've forwarded, and write it all
+
+void
+HTTP2SessionContext :: flush( void )
+{
+	vector< pair< uint32_t, int > > finished;	// stream, error (-1 for none)
+	{
+		lock_guard< mutex > lock( connection->streamsMutex );
+		bool drained = false;
+		for( auto it = connection->streams.begin(); it != connection->streams.end(); it++ )
+		{
+			HTTP2StreamContext *stream = it->second;
+			uint32_t id = it->first;
+			if( stream->consumed )
+			{
+				if( !stream->bodyDone )
+				{
+					frameHeader( 4, H2_FRAME_WINDOW_UPDATE, 0, id );
+					HTTP2Frame::put32( (uint32_t) stream->consumed, &out );
+					stream->recvWindow += stream->consumed;
+				}
+				recvConsumed += stream->consumed;
+				stream->consumed = 0;
+			}
+			if( stream->failed )
+			{
+				finished.push_back( make_pair( id, H2_INTERNAL_ERROR ) );
+				continue;
+			}
+			if( !stream->status )
+				continue;
+			bool ended = false;
+			if( !stream->headersSent )
+			{
+				string block;
+				encoder.encode( ":status", to_string( stream->status ), &block );
+				for( auto field = stream->responseHeaders.begin(); field != stream->responseHeaders.end(); field++ )
+					encoder.encode( field->first, field->second, &block );
+				ended = stream->dataDone && stream->data.empty();
+				for( size_t offset = 0; offset < block.size() || offset == 0; )
+				{
+					size_t len = min( block.size() - offset, (size_t) maxFrameSize );
+					int flags = offset + len == block.size() ? H2_FLAG_END_HEADERS : 0;
+					if( offset == 0 && ended )
+						flags |= H2_FLAG_END_STREAM;
+					frameHeader( len, offset == 0 ? H2_FRAME_HEADERS : H2_FRAME_CONTINUATION, flags, id );
+					out.append( block, offset, len );
+					offset += len;
+					if( block.empty() )
+						break;
+				}
+				stream->headersSent = true;
+			}
+			while( !ended && stream->data.size() > stream->dataOffset && sendWindow > 0 && stream->sendWindow > 0 )
+			{
+				size_t len = stream->data.size() - stream->dataOffset;
+				len = min( len, (size_t) maxFrameSize );
+				len = (size_t) min( (int64_t) len, min( sendWindow, stream->sendWindow ) );
+				ended = stream->dataDone && stream->dataOffset + len == stream->data.size();
+				frameHeader( len, H2_FRAME_DATA, ended ? H2_FLAG_END_STREAM : 0, id );
+				out.append( stream->data, stream->dataOffset, len );
+				stream->dataOffset += len;
+				sendWindow -= len;
+				stream->sendWindow -= len;
+				drained = true;
+			}
+			if( stream->dataOffset == stream->data.size() )
+			{
+				stream->data.clear();
+				stream->dataOffset = 0;
+				if( !ended && stream->dataDone )
+				{
+					frameHeader( 0, H2_FRAME_DATA, H2_FLAG_END_STREAM, id );
+					ended = true;
+				}
+			}
+			if( ended )
+				finished.push_back( make_pair( id, stream->bodyDone ? -1 : H2_NO_ERROR ) );	// done with its body, too
+		}
+		if( drained )
+			connection->changed.notify_all();
+	}
+	for( auto it = finished.begin(); it != finished.end(); it++ )
+		resetStream( it->first, it->second );
+	if( recvConsumed )
+	{
+		frameHeader( 4, H2_FRAME_WINDOW_UPDATE, 0, 0 );
+		HTTP2Frame::put32( (uint32_t) recvConsumed, &out );
+		recvWindow += recvConsumed;
+		recvConsumed = 0;
+	}
+	if( !out.empty() )
+	{
+		if( !clientWrite( out.data(), out.size() ) && goAwayError < 0 )
+			goAwayError = H2_INTERNAL_ERROR;
+		out.clear();
+	}
+}
+
+bool
+HTTP2SessionContext :: connectionError( int error, const char *reason )
+{
+	Log::log( "HTTP2Session[ %p ]: %s", connection.get(), reason );
+	goAwayError = error;
+	return( false );
+}
+
+// GOAWAY, unless the client's gone, and every stream thread told to stop
+
+void
+HTTP2SessionContext :: finish( void )
+{
+	if( goAwayError >= 0 )
+	{
+		frameHeader( 8, H2_FRAME_GOAWAY, 0, 0 );
+		HTTP2Frame::put32( lastStreamId, &out );
+		HTTP2Frame::put32( (uint32_t) goAwayError, &out );
+		(void) clientWrite( out.data(), out.size() );
+		out.clear();
+	}
+	lock_guard< mutex > lock( connection->streamsMutex );
+	for( auto it = connection->streams.begin(); it != connection->streams.end(); it++ )
+	{
+		HTTP2StreamContext *stream = it->second;
+		stream->reset = true;
+		stream->sessionDone = true;
+		if( stream->threadDone )
+			delete( stream );
+	}
+	connection->streams.clear();
+	connection->changed.notify_all();
+}
+
+ssize_t
+HTTP2SessionContext :: clientRead( char *buf, size_t len )
+{
+	if( clientSSL )
+		return( SSL_read( clientSSL, buf, (int) len ) );
+	return( recv( clientSocket, buf, len, 0 ) );
+}
+
+bool
+HTTP2SessionContext :: clientWrite( const char *data, size_t len )
+{
+	while( len )
+	{
+		ssize_t sent;
+		if( clientSSL )
+			sent = SSL_write( clientSSL, data, (int) min( records.next( len ), (size_t) INT_MAX ) );
+		else
+			sent = send( clientSocket, data, len, 0 );
+		if( sent <= 0 )
+		{
+# if TRACE
+			Log::console( "HTTP2Session[ %p ]: client write failed [%d] (%s)", connection.get(), errno, strerror( errno ) );
+# endif // TRACE
+			return( false );
+		}
+		records.sent( sent );
+		data += sent;
+		len -= sent;
+	}
+	return( true );
+}
+
+HTTP2Session :: HTTP2Session( HTTP2SessionContext *context ) : Session( context )
+{
+# if TRACE
+	Log::console( "HTTP2Session::HTTP2Session()" );
+# endif // TRACE
+}
+
+HTTP2Session :: ~HTTP2Session()
+{
+# if TRACE
+	Log::console( "HTTP2Session::~HTTP2Session()" );
+# endif // TRACE
+}
+
+void
+HTTP2Session :: _main( HTTP2SessionContext *context )
+{
+# if TRACE
+	Log::console( "HTTP2Session::_main[ %p ] RUN", context );
+# endif // TRACE
+	if( context->start() )
+	{
+		while( context->readFrames() )
+			;
+	}
+	context->finish();
+	delete( context );
+}
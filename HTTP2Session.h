@@ -0,0 +1,215 @@
+//
+//  HTTP2Session.h
+//  Layer7LoadBalancer
+//  Created by Rick Tyler
+//
+//  SPDX-License-Identifier: MIT
+
+# ifndef _HTTP2Session_h_
+# define _HTTP2Session_h_
+
+# include "Thread.h"
+# include "Service.h"
+# include "Session.h"
+# include "Connection.h"
+# include "Backend.h"
+# include "HTTPParser.h"
+# include "HeaderRewrite.h"
+# include "HPACK.h"
+# include <atomic>
+# include <condition_variable>
+# include <map>
+# include <memory>
+
+// HTTP/2 clients (RFC 9113), negotiated by ALPN "h2" on TLS listeners
+// balancing requests. The session's thread owns the client connection:
+// it reads and writes every frame and keeps HPACK and flow control state.
+// Each stream's request runs in an HTTP2Stream thread, as HTTP/1.1 on a
+// pooled backend connection, handing the response back to the session
+// thread to frame. Stream threads block on backends, never the client.
+
+class HTTP2SessionContext;
+class HTTP2StreamContext;
+class HTTP2Stream;
+
+// what the session and its stream threads share, kept until the last of
+// them is done with it
+
+class HTTP2Connection
+{
+    public:
+
+	HTTP2Connection( void );
+	~HTTP2Connection();
+	void wake( void );		// a stream has something for the session thread
+	mutex streamsMutex;
+	condition_variable changed;	// for stream threads: body arrived, output drained, reset
+	map< uint32_t, HTTP2StreamContext * > streams;
+	int wakeFds[ 2 ] = { -1, -1 };
+};
+
+class HTTP2StreamContext : public ThreadContext
+{
+    public:
+
+	HTTP2StreamContext( HTTP2SessionContext *session, uint32_t id, int64_t sendWindow );
+	~HTTP2StreamContext();
+
+    private:
+
+	shared_ptr< HTTP2Connection > connection;
+	Service *service;
+	const HeaderRewrite *rewrite;
+	string sessionCookie;
+	string clientAddr;
+	size_t maxHeaderSize;
+	int responseTimeout;
+	int bodyTimeout;
+	uint32_t id;
+
+	// request, built by the session thread before the stream thread starts
+	string header;			// as HTTP/1.1
+	HTTPParser request;
+	string method;
+	bool chunked = false;		// body of unknown length, sent chunked
+
+	// under connection->streamsMutex from here on
+	string body;			// DATA not yet forwarded
+	bool bodyDone = false;
+	size_t consumed = 0;		// body bytes forwarded, to return as WINDOW_UPDATE
+	int64_t recvWindow;		// the client may send this much more DATA
+	int status = 0;			// response, once the header is in
+	vector< pair< string, string > > responseHeaders;
+	string data;			// response body not yet framed
+	size_t dataOffset = 0;		// of it, already framed
+	bool dataDone = false;
+	bool failed = false;		// reset the stream (response already begun)
+	bool reset = false;		// the client reset it, or the session ended
+	int64_t sendWindow;		// DATA the client will take on this stream
+	bool headersSent = false;
+	bool threadDone = false;
+	bool sessionDone = false;	// both done: whichever is last deletes
+
+	// the stream thread's own
+	HTTP2Stream *thread = nullptr;
+	Backend *backend = nullptr;
+	Connection *proxy = nullptr;
+	char *responseBuf = nullptr;
+	size_t responseBufLen = 0;
+	string inserted;
+	string requestId;
+	vector< struct iovec > iov;
+	bool replayable = false;	// request can be resent on another connection
+	int64_t requestStart = 0;
+	void proxyRequest( void );
+	int sendRequest( bool *reused );
+	int relayResponse( bool reused );
+	bool takeBody( string *chunk, bool *done );
+	bool respond( int status, vector< pair< string, string > > *headers, bool done );
+	bool deliver( const char *data, size_t len, bool done );
+	void sendError( int status, const char *reason );
+	void endRequest( bool reuse );
+	bool proxyWrite( const char *data, size_t len );
+
+    friend class HTTP2Stream;
+    friend class HTTP2SessionContext;
+};
+
+class HTTP2Stream : public Thread
+{
+    public:
+
+	HTTP2Stream( HTTP2StreamContext *context ) : Thread( context ) { }
+	virtual ~HTTP2Stream() { }
+	ThreadMain main( void ) { return( (ThreadMain) _main ); }
+
+    private:
+
+	static void _main( HTTP2StreamContext *context );
+};
+
+class HTTP2SessionContext : public SessionContext
+{
+  public:
+
+	HTTP2SessionContext
+	(
+		Service *service,
+		int clientSocket,
+		SSL *clientSSL,
+		string sessionCookie = "",
+		size_t maxHeaderSize = 65536,
+		int keepAliveTimeout = 60000,
+		int responseTimeout = 60000,
+		int bodyTimeout = 60000,
+		const HeaderRewrite *rewrite = nullptr,
+		uint32_t maxStreams = 100
+	);
+	~HTTP2SessionContext();
+	static atomic< size_t > sessions;
+	static atomic< size_t > streams;
+	static atomic< size_t > refused;	// over HTTP2-MAX-STREAMS
+
+  private:
+
+	shared_ptr< HTTP2Connection > connection;
+	string sessionCookie;
+	size_t maxHeaderSize;
+	int keepAliveTimeout;
+	int responseTimeout;
+	int bodyTimeout;
+	const HeaderRewrite *rewrite;
+	uint32_t maxStreams;
+	string clientAddr;
+	string in;			// client bytes not yet framed
+	bool preface = false;		// the client's connection preface is in
+	string out;			// frames to write
+	HPACKDecoder decoder;
+	HPACKEncoder encoder;
+	uint32_t maxFrameSize = 16384;	// the client's SETTINGS_MAX_FRAME_SIZE
+	int64_t initialWindow = 65535;	// its SETTINGS_INITIAL_WINDOW_SIZE
+	int64_t sendWindow = 65535;	// connection-level
+	int64_t recvWindow;
+	size_t recvConsumed = 0;	// connection-level credit to return
+	uint32_t lastStreamId = 0;
+	bool goingAway = false;		// GOAWAY received: no new streams
+	uint32_t headerStream = 0;	// HEADERS awaiting CONTINUATION
+	bool headerEndStream = false;
+	string headerBlock;
+	int goAwayError = -1;		// connection error to report, once set
+	bool start( void );
+	bool readFrames( void );
+	bool frame( int type, int flags, uint32_t id, const unsigned char *payload, size_t len );
+	bool settings( int flags, uint32_t id, const unsigned char *payload, size_t len );
+	bool headers( uint32_t id, const unsigned char *block, size_t len, bool endStream );
+	bool data( int flags, uint32_t id, const unsigned char *payload, size_t len );
+	bool windowUpdate( uint32_t id, const unsigned char *payload, size_t len );
+	void resetStream( uint32_t id, int error );
+	void openStream( uint32_t id, vector< pair< string, string > > *fields, bool endStream );
+	void flush( void );
+	void frameHeader( size_t len, int type, int flags, uint32_t id );
+	bool connectionError( int error, const char *reason );
+	void finish( void );
+	bool clientWrite( const char *data, size_t len );
+	ssize_t clientRead( char *buf, size_t len );
+
+  friend class HTTP2Session;
+  friend class HTTP2StreamContext;
+};
+
+class HTTP2Session : public Session
+{
+	public:
+
+		HTTP2Session( HTTP2SessionContext *context );
+		~HTTP2Session();
+
+	private:
+
+		static void _main( HTTP2SessionContext *context );
+		ThreadMain main( void ) { return( (ThreadMain) _main ); }
+
+	friend class Service;
+};
+
+# endif // _HTTP2Session_h_
@@ -0,0 +1,464 @@
+//
+//  HTTPParser.cc
+//  Layer7LoadBalancer
+//  Created by Rick Tyler
+//
+//  SPDX-License-Identifier: MIT
+
+# include "HTTPParser.h"
+# include "HTTPScan.h"
+# include <string.h>
+# include <strings.h>
+# include <ctype.h>
+# include <algorithm>
+
+// # define TRACE    1
+
+static inline bool isOWS( char c ) { return( c == ' ' || c == '\t' ); }
+
+static string_view trim( const char *start, const char *end )
+{
+	while( start < end && isOWS( *start ) )
+		++start;
+	while( end > start && isOWS( end[ -1 ] ) )
+		--end;
+	return( string_view( start, end - start ) );
+}
+
+bool
+equalsIgnoreCase( string_view a, string_view b )
+{
+	return( a.size() == b.size() && strncasecmp( a.data(), b.data(), a.size() ) == 0 );
+}
+
+HTTPParser :: HTTPParser( bool response )
+{
+	this->response = response;
+}
+
+void
+HTTPParser :: reset( void )
+{
+	method = path = version = reason = string_view();
+	status = 0;
+	headers.clear();
+	cookies.clear();
+	headerLen = 0;
+	error = nullptr;
+	base = nullptr;
+	offset = 0;
+	complete = false;
+}
+
+int
+HTTPParser :: parse( const char *buf, size_t len )
+{
+	if( complete )
+		return( HTTP_COMPLETE );
+	if( error )
+		return( HTTP_ERROR );
+	if( base && base != buf )
+		relocate( buf );
+	base = buf;
+
+	while( offset < len )
+	{
+		const char *line = buf + offset;
+		const char *newline = HTTPScan::find( line, buf + len, '\n' );
+		if( newline == buf + len )
+			return( HTTP_INCOMPLETE );
+		offset = newline + 1 - buf;
+		const char *end = newline > line && newline[ -1 ] == '\r' ? newline - 1 : newline;
+
+		int result;
+		if( end == line )
+		{
+			if( headerLen == 0 && method.empty() && status == 0 )
+			{
+				// tolerate empty lines ahead of the start line (RFC 7230 3.5)
+				continue;
+			}
+			headerLen = offset;
+			complete = true;
+			return( HTTP_COMPLETE );
+		}
+		else if( method.empty() && status == 0 )
+			result = parseStartLine( line, end );
+		else
+			result = parseHeaderLine( line, end );
+		if( result == HTTP_ERROR )
+			return( HTTP_ERROR );
+	}
+	return( HTTP_INCOMPLETE );
+}
+
+int
+HTTPParser :: parseStartLine( const char *line, const char *end )
+{
+	const char *sp1 = HTTPScan::find( line, end, ' ' );
+	if( sp1 == end )
+		return( fail( "malformed start line" ) );
+	const char *sp2 = HTTPScan::find( sp1 + 1, end, ' ' );
+	if( sp2 == end )
+		sp2 = nullptr;
+
+	if( response )
+	{
+		// HTTP/1.1 200 OK
+		version = string_view( line, sp1 - line );
+		const char *code = sp1 + 1;
+		const char *codeEnd = sp2 ? sp2 : end;
+		if( codeEnd - code != 3 || !isdigit( code[ 0 ] ) || !isdigit( code[ 1 ] ) || !isdigit( code[ 2 ] ) )
+			return( fail( "malformed status code" ) );
+		status = (code[ 0 ] - '0') * 100 + (code[ 1 ] - '0') * 10 + (code[ 2 ] - '0');
+		if( status < 100 )
+			return( fail( "malformed status code" ) );
+		if( sp2 )
+			reason = string_view( sp2 + 1, end - sp2 - 1 );
+	}
+	else
+	{
+		// GET /path HTTP/1.1
+		if( !sp2 || sp1 == line || sp2 == sp1 + 1 )
+			return( fail( "malformed request line" ) );
+		method = string_view( line, sp1 - line );
+		path = string_view( sp1 + 1, sp2 - sp1 - 1 );
+		version = string_view( sp2 + 1, end - sp2 - 1 );
+	}
+	if( version.size() != 8 || version.compare( 0, 5, "HTTP/" ) != 0 )
+		return( fail( "unsupported protocol version" ) );
+	return( HTTP_INCOMPLETE );
+}
+
+int
+HTTPParser :: parseHeaderLine( const char *line, const char *end )
+{
+	if( isOWS( *line ) )
+		return( fail( "obsolete header line folding" ) );
+	const char *colon = HTTPScan::find( line, end, ':' );
+	if( colon == end || colon == line || isOWS( colon[ -1 ] ) )
+		return( fail( "malformed header line" ) );
+	string_view name( line, colon - line );
+	string_view value = trim( colon + 1, end );
+	headers.push_back( HTTPHeader( name, value ) );
+	if( !response && equalsIgnoreCase( name, "Cookie" ) )
+		parseCookies( value );
+	return( HTTP_INCOMPLETE );
+}
+
+void
+HTTPParser :: parseCookies( string_view value )
+{
+	const char *c = value.data();
+	const char *end = c + value.size();
+	while( c < end )
+	{
+		const char *equals = HTTPScan::find( c, end, '=', ';', ';' );
+		const char *pairEnd = equals == end || *equals == ';' ? equals : HTTPScan::find( equals, end, ';' );
+		if( equals < pairEnd )
+		{
+			string_view name = trim( c, equals );
+			string_view value = trim( equals + 1, pairEnd );
+			if( value.size() >= 2 && value.front() == '"' && value.back() == '"' )
+				value = value.substr( 1, value.size() - 2 );
+			if( !name.empty() )
+				cookies.push_back( HTTPHeader( name, value ) );
+		}
+		c = pairEnd + 1;
+	}
+}
+
+string_view
+HTTPParser :: header( string_view name )
+{
+	for( auto it = headers.begin(); it != headers.end(); it++ )
+	{
+		if( equalsIgnoreCase( it->name, name ) )
+			return( it->value );
+	}
+	return( string_view() );
+}
+
+string_view
+HTTPParser :: cookie( string_view name )
+{
+	for( auto it = cookies.begin(); it != cookies.end(); it++ )
+	{
+		if( it->name == name )
+			return( it->value );
+	}
+	return( string_view() );
+}
+
+// value of the first Set-Cookie header setting the named cookie
+
+string_view
+HTTPParser :: setCookie( string_view name )
+{
+	for( auto it = headers.begin(); it != headers.end(); it++ )
+	{
+		if( !equalsIgnoreCase( it->name, "Set-Cookie" ) )
+			continue;
+		const char *c = it->value.data();
+		const char *end = c + it->value.size();
+		const char *equals = HTTPScan::find( c, end, '=', ';', ';' );
+		if( equals == end || *equals != '=' || trim( c, equals ) != name )
+			continue;
+		const char *valueEnd = HTTPScan::find( equals + 1, end, ';' );
+		string_view value = trim( equals + 1, valueEnd );
+		if( value.size() >= 2 && value.front() == '"' && value.back() == '"' )
+			value = value.substr( 1, value.size() - 2 );
+		return( value );
+	}
+	return( string_view() );
+}
+
+// does a comma-separated header (e.g. Connection) list token
+
+bool
+HTTPParser :: hasToken( string_view name, string_view token )
+{
+	for( auto it = headers.begin(); it != headers.end(); it++ )
+	{
+		if( !equalsIgnoreCase( it->name, name ) )
+			continue;
+		const char *c = it->value.data();
+		const char *end = c + it->value.size();
+		while( c < end )
+		{
+			const char *comma = HTTPScan::find( c, end, ',' );
+			if( equalsIgnoreCase( trim( c, comma ), token ) )
+				return( true );
+			c = comma + 1;
+		}
+	}
+	return( false );
+}
+
+bool
+HTTPParser :: keepAlive( void )
+{
+	if( version == "HTTP/1.0" )
+		return( hasToken( "Connection", "keep-alive" ) );
+	return( !hasToken( "Connection", "close" ) );
+}
+
+// the caller's buffer moved (e.g. realloc) with its contents intact
+
+void
+HTTPParser :: relocate( const char *buf )
+{
+	const char *old = base;
+	auto move = [ old, buf ]( string_view& view )
+	{
+		if( view.data() )
+			view = string_view( buf + (view.data() - old), view.size() );
+	};
+	move( method );
+	move( path );
+	move( version );
+	move( reason );
+	for( auto it = headers.begin(); it != headers.end(); it++ )
+	{
+		move( it->name );
+		move( it->value );
+	}
+	for( auto it = cookies.begin(); it != cookies.end(); it++ )
+	{
+		move( it->name );
+		move( it->value );
+	}
+	base = buf;
+}
+
+// decide how the body of a parsed message is delimited; requestMethod is
+// the method of the request a response answers
+
+int
+HTTPBody :: frame( HTTPParser *message, string_view requestMethod )
+{
+	framing = HTTP_BODY_NONE;
+	length = 0;
+	remaining = 0;
+	error = nullptr;
+	state = BODY_DONE;
+
+	bool response = message->status != 0;
+	if( response && (requestMethod == "HEAD" || message->status < 200 || message->status == 204 || message->status == 304) )
+		return( framing );
+
+	bool chunked = false;
+	bool encoded = false;
+	bool haveLength = false;
+	for( auto it = message->headers.begin(); it != message->headers.end(); it++ )
+	{
+		if( equalsIgnoreCase( it->name, "Transfer-Encoding" ) )
+		{
+			// chunked must be the final coding
+			encoded = true;
+			string_view value = it->value;
+			size_t comma = value.rfind( ',' );
+			string_view last = trim( value.data() + (comma == string_view::npos ? 0 : comma + 1), value.data() + value.size() );
+			chunked = equalsIgnoreCase( last, "chunked" );
+		}
+		else if( equalsIgnoreCase( it->name, "Content-Length" ) )
+		{
+			uint64_t n = 0;
+			if( it->value.empty() )
+				error = "malformed Content-Length";
+			for( size_t i = 0; i < it->value.size() && !error; i++ )
+			{
+				char c = it->value[ i ];
+				if( !isdigit( c ) || n > (UINT64_MAX - 9) / 10 )
+					error = "malformed Content-Length";
+				n = n * 10 + (c - '0');
+			}
+			if( haveLength && n != length )
+				error = "conflicting Content-Length";
+			haveLength = true;
+			length = n;
+		}
+	}
+	if( error )
+		return( HTTP_ERROR );
+
+	if( encoded )
+	{
+		if( chunked )
+		{
+			framing = HTTP_BODY_CHUNKED;
+			state = BODY_CHUNK_SIZE;
+			chunkDigits = 0;
+		}
+		else if( response )
+		{
+			framing = HTTP_BODY_CLOSE;
+			state = BODY_UNTIL_CLOSE;
+		}
+		else
+		{
+			error = "unsupported Transfer-Encoding";
+			return( HTTP_ERROR );
+		}
+	}
+	else if( haveLength )
+	{
+		framing = HTTP_BODY_LENGTH;
+		remaining = length;
+		state = remaining ? BODY_DATA : BODY_DONE;
+	}
+	else if( response )
+	{
+		framing = HTTP_BODY_CLOSE;
+		state = BODY_UNTIL_CLOSE;
+	}
+	return( framing );
+}
+
+// how many of the len bytes at buf belong to the body (the rest, if any,
+// start the next message); done() once the body is complete. The payload,
+// without chunk framing, is appended to data if given.
+
+size_t
+HTTPBody :: consume( const char *buf, size_t len, string *data )
+{
+	size_t used = 0;
+	while( used < len && state != BODY_DONE )
+	{
+		switch( state )
+		{
+			case BODY_UNTIL_CLOSE:
+				if( data )
+					data->append( buf + used, len - used );
+				return( len );
+
+			case BODY_DATA:
+			case BODY_CHUNK_DATA:
+			{
+				size_t n = (size_t) min( (uint64_t) (len - used), remaining );
+				if( data )
+					data->append( buf + used, n );
+				used += n;
+				remaining -= n;
+				if( remaining == 0 )
+					state = state == BODY_DATA ? BODY_DONE : BODY_CHUNK_END;
+				break;
+			}
+
+			case BODY_CHUNK_SIZE:
+			{
+				char c = buf[ used++ ];
+				int digit = isdigit( c ) ? c - '0' : (c >= 'a' && c <= 'f') ? c - 'a' + 10 : (c >= 'A' && c <= 'F') ? c - 'A' + 10 : -1;
+				if( digit >= 0 )
+				{
+					if( ++chunkDigits > 15 )
+					{
+						error = "chunk size too large";
+						state = BODY_DONE;
+						return( used );
+					}
+					remaining = remaining * 16 + digit;
+				}
+				else if( chunkDigits == 0 )
+				{
+					error = "malformed chunk size";
+					state = BODY_DONE;
+					return( used );
+				}
+				else if( c == '\n' )
+				{
+					chunkDigits = 0;
+					lineLen = 0;
+					state = remaining ? BODY_CHUNK_DATA : BODY_TRAILER;
+				}
+				else
+					state = BODY_CHUNK_EXTENSION;
+				break;
+			}
+
+			case BODY_CHUNK_EXTENSION:
+			{
+				const char *newline = HTTPScan::find( buf + used, buf + len, '\n' );
+				used = newline - buf;
+				if( used < len )
+				{
+					++used;
+					chunkDigits = 0;
+					lineLen = 0;
+					state = remaining ? BODY_CHUNK_DATA : BODY_TRAILER;
+				}
+				break;
+			}
+
+			case BODY_CHUNK_END:
+			{
+				// CRLF after chunk data
+				char c = buf[ used++ ];
+				if( c == '\n' )
+					state = BODY_CHUNK_SIZE;
+				else if( c != '\r' )
+				{
+					error = "malformed chunk";
+					state = BODY_DONE;
+				}
+				break;
+			}
+
+			case BODY_TRAILER:
+			{
+				// trailer fields, then an empty line
+				char c = buf[ used++ ];
+				if( c == '\n' )
+				{
+					if( lineLen == 0 )
+						state = BODY_DONE;
+					lineLen = 0;
+				}
+				else if( c != '\r' )
+					++lineLen;
+				break;
+			}
+		}
+	}
+	return( used );
+}
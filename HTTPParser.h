@@ -0,0 +1,109 @@
+//
+//  HTTPParser.h
+//  Layer7LoadBalancer
+//  Created by Rick Tyler
+//
+//  SPDX-License-Identifier: MIT
+
+# ifndef _HTTPParser_h_
+# define _HTTPParser_h_
+
+# include <string>
+# include <string_view>
+# include <vector>
+# include <stddef.h>
+# include <stdint.h>
+
+using namespace std;
+
+# define HTTP_INCOMPLETE    0
+# define HTTP_COMPLETE      1
+# define HTTP_ERROR        -1
+
+class HTTPHeader
+{
+    public:
+
+	HTTPHeader( string_view name, string_view value ) : name( name ), value( value ) { }
+	string_view name;
+	string_view value;
+};
+
+// Incremental HTTP/1.x header parser. parse() is called with the whole
+// buffer received so far (the same bytes plus whatever arrived since) and
+// resumes at the first unparsed line. Results are views into that buffer,
+// so nothing is copied; if the buffer moves (realloc) between calls the
+// views are rebased onto the new address.
+
+class HTTPParser
+{
+    public:
+
+	HTTPParser( bool response = false );
+	void reset( void );
+	int parse( const char *buf, size_t len );
+	string_view header( string_view name );
+	string_view cookie( string_view name );
+	string_view setCookie( string_view name );
+	bool hasToken( string_view name, string_view token );
+	bool keepAlive( void );
+	void relocate( const char *buf );	// the buffer moved, contents intact
+
+	// request line
+	string_view method;
+	string_view path;
+	string_view version;
+
+	// status line
+	int status = 0;
+	string_view reason;
+
+	vector< HTTPHeader > headers;
+	vector< HTTPHeader > cookies;	// name=value pairs of Cookie headers
+	size_t headerLen = 0;		// through the blank line, once complete
+	const char *error = nullptr;
+
+    private:
+
+	bool response;
+	const char *base = nullptr;
+	size_t offset = 0;
+	bool complete = false;
+	int parseStartLine( const char *line, const char *end );
+	int parseHeaderLine( const char *line, const char *end );
+	void parseCookies( string_view value );
+	int fail( const char *error ) { this->error = error; return( HTTP_ERROR ); }
+};
+
+# define HTTP_BODY_NONE       0
+# define HTTP_BODY_LENGTH     1	// Content-Length bytes
+# define HTTP_BODY_CHUNKED    2	// chunked transfer coding, through the trailer
+# define HTTP_BODY_CLOSE      3	// response delimited by the connection closing
+
+// Tracks where a message body ends as its bytes stream past, without
+// buffering or copying them (RFC 7230 3.3.3).
+
+class HTTPBody
+{
+    public:
+
+	HTTPBody( void ) { }
+	int frame( HTTPParser *message, string_view requestMethod = string_view() );
+	size_t consume( const char *buf, size_t len, string *data = nullptr );
+	bool done( void ) { return( state == BODY_DONE ); }
+	int framing = HTTP_BODY_NONE;
+	uint64_t length = 0;		// Content-Length, when framing is HTTP_BODY_LENGTH
+	const char *error = nullptr;
+
+    private:
+
+	enum { BODY_DONE, BODY_DATA, BODY_CHUNK_SIZE, BODY_CHUNK_EXTENSION, BODY_CHUNK_DATA, BODY_CHUNK_END, BODY_TRAILER, BODY_UNTIL_CLOSE };
+	int state = BODY_DONE;
+	uint64_t remaining = 0;
+	size_t chunkDigits = 0;
+	size_t lineLen = 0;
+};
+
+bool equalsIgnoreCase( string_view a, string_view b );
+
+# endif // _HTTPParser_h_
@@ -0,0 +1,960 @@
+//
+//  HTTPProxySession.cc
+//  Layer7LoadBalancer
+//  Created by Rick Tyler
+//
+//  SPDX-License-Identifier: MIT
+
+# include "HTTPProxySession.h"
+# include "Exception.h"
+# include "Log.h"
+# include "HTTPScan.h"
+# include <limits.h>
+# include <string.h>
+# include <unistd.h>
+# include <poll.h>
+# include <arpa/inet.h>
+
+// # define TRACE    1
+
+# define HEADER_BUF_LEN    8192	// initial header buffers, grow to maxHeaderSize
+# define RESPONSE_BUF_LEN  16384
+
+# define BODY_RATE_GRACE   1000	// ms before BODY-MIN-RATE applies
+
+# define RELAY_OK          1
+# define RELAY_RETRY       0	// nothing relayed to the client yet, the request can go elsewhere
+# define RELAY_FAILED     -1	// client answered (or gone), close the session
+
+HTTPProxySessionContext :: HTTPProxySessionContext
+(
+	Service *service,
+	int clientSocket,
+	SSL *clientSSL,
+	string sessionCookie,
+	size_t maxHeaderSize,
+	int keepAliveTimeout,
+	int responseTimeout,
+	Cache *cache,
+	HeaderRewrite *rewrite,
+	size_t responseBuffer,
+	size_t responseBufferFile
+)
+: SessionContext( service, clientSocket, clientSSL ), response( true )
+{
+# if TRACE
+	Log::console( "HTTPProxySessionContext::HTTPProxySessionContext()" );
+# endif // TRACE
+	this->sessionCookie = sessionCookie;
+	this->maxHeaderSize = maxHeaderSize;
+	this->keepAliveTimeout = keepAliveTimeout;
+	this->responseTimeout = responseTimeout;
+	this->cache = cache;
+	if( responseBuffer )
+		this->buffer = new ResponseBuffer( responseBuffer, responseBufferFile );
+	this->rewrite = rewrite && !rewrite->empty() ? rewrite : nullptr;
+	if( this->rewrite )
+	{
+		// the client's address, for X-Forwarded-For
+		struct sockaddr_storage addr;
+		socklen_t addrLen = sizeof( addr );
+		char host[ INET6_ADDRSTRLEN ] = "";
+		if( getpeername( clientSocket, (struct sockaddr *) &addr, &addrLen ) == 0 )
+		{
+			if( addr.ss_family == AF_INET )
+				inet_ntop( AF_INET, &((struct sockaddr_in *) &addr)->sin_addr, host, sizeof( host ) );
+			else if( addr.ss_family == AF_INET6 )
+				inet_ntop( AF_INET6, &((struct sockaddr_in6 *) &addr)->sin6_addr, host, sizeof( host ) );
+		}
+		clientAddr = host;
+	}
+	this->bufLen = HEADER_BUF_LEN;
+	this->buf = (char *) malloc( bufLen );
+	this->responseBufLen = RESPONSE_BUF_LEN;
+	this->responseBuf = (char *) malloc( responseBufLen );
+}
+
+HTTPProxySessionContext :: ~HTTPProxySessionContext()
+{
+# if TRACE
+	Log::console( "HTTPProxySessionContext::~HTTPProxySessionContext()" );
+# endif // TRACE
+	endRequest( false );
+	finishInFlight( nullptr );
+	if( buffer )
+		delete( buffer );
+	free( buf );
+	free( responseBuf );
+}
+
+void
+HTTPProxySessionContext :: setLimits( int headerTimeout, int bodyTimeout, size_t bodyMinRate, size_t requestBuffer )
+{
+	this->headerTimeout = headerTimeout;
+	this->bodyTimeout = bodyTimeout;
+	this->bodyMinRate = bodyMinRate;
+	this->requestBuffer = requestBuffer;
+}
+
+// read the next request header into buf (after any pipelined bytes left by
+// the previous request); false when the client is done or was answered
+
+bool
+HTTPProxySessionContext :: readRequest( void )
+{
+	if( consumed )
+	{
+		memmove( buf, buf + consumed, received - consumed );
+		received -= consumed;
+		consumed = 0;
+	}
+	if( bufLen > maxHeaderSize && received <= HEADER_BUF_LEN )
+	{
+		// grown for a buffered body
+		bufLen = HEADER_BUF_LEN;
+		buf = (char *) realloc( buf, bufLen );
+	}
+	request.reset();
+	continued = false;
+	// idle clients get keepAliveTimeout, a header once begun headerTimeout
+	int64_t deadline = received && headerTimeout ? Thread::milliseconds() + headerTimeout : 0;
+	int result;
+	while( (result = request.parse( buf, received )) == HTTP_INCOMPLETE )
+	{
+		if( received == bufLen )
+		{
+			if( bufLen >= maxHeaderSize )
+			{
+				Log::log( "HTTPProxySession[ %p ]: request header exceeds MAX-HEADER-SIZE (%zu)", this, maxHeaderSize );
+				sendError( 431, "Request Header Fields Too Large" );
+				return( false );
+			}
+			bufLen = min( bufLen * 2, maxHeaderSize );
+			buf = (char *) realloc( buf, bufLen );
+		}
+		if( !clientWait( deadline ? (int) max( (int64_t) 0, deadline - Thread::milliseconds() ) : keepAliveTimeout ) )
+		{
+			if( deadline )
+			{
+				Log::log( "HTTPProxySession[ %p ]: request header timed out (HEADER-TIMEOUT %d ms)", this, headerTimeout );
+				sendError( 408, "Request Timeout" );
+			}
+			return( false );
+		}
+		ssize_t len = clientRead( buf + received, bufLen - received );
+		if( len <= 0 )
+			return( false );
+		received += len;
+		if( !deadline && headerTimeout )
+			deadline = Thread::milliseconds() + headerTimeout;
+	}
+	if( result == HTTP_ERROR )
+	{
+		Log::log( "HTTPProxySession[ %p ]: bad request (%s)", this, request.error );
+		sendError( 400, "Bad Request" );
+		return( false );
+	}
+# if TRACE
+	Log::console( "HTTPProxySession[ %p ]: %.*s %.*s", this, (int) request.method.size(), request.method.data(),
+		(int) request.path.size(), request.path.data() );
+# endif // TRACE
+	return( true );
+}
+
+// RFC 7231 4.2.2
+
+static bool
+isIdempotent( string_view method )
+{
+	return( method == "GET" || method == "HEAD" || method == "OPTIONS" || method == "TRACE"
+		|| method == "PUT" || method == "DELETE" );
+}
+
+// balance, forward and answer one request; true to keep the client connection
+
+bool
+HTTPProxySessionContext :: proxyRequest( void )
+{
+	if( requestBody.frame( &request ) == HTTP_ERROR )
+	{
+		Log::log( "HTTPProxySession[ %p ]: bad request (%s)", this, requestBody.error );
+		sendError( 400, "Bad Request" );
+		return( false );
+	}
+	method = string( request.method );
+	requestId.clear();
+	records.restart();
+
+	// 0-RTT data may be a replay, so only requests that can safely be
+	// repeated go to a backend before the handshake completes
+	earlyRequest = early;
+	if( early && !isIdempotent( request.method ) )
+	{
+		if( !confirmHandshake() )
+			return( false );
+		earlyRequest = false;
+	}
+	acceptedEncodings = Compression::accepted( &request );
+	bool keepAlive = request.keepAlive();
+
+	caching = false;
+	bool lookup;
+	if( cache && requestBody.framing == HTTP_BODY_NONE && Cache::isCacheable( &request, &lookup ) )
+	{
+		// hits are answered here, without a backend
+		shared_ptr< CachedResponse > cached;
+		if( lookup && (cached = cache->lookup( &request )) )
+		{
+			consumed = request.headerLen;
+			return( sendCached( cached.get() ) && keepAlive && !cached->close );
+		}
+		if( lookup )
+		{
+			// collapse concurrent misses: one request goes to a backend,
+			// identical ones wait for and relay its response
+			bool leader;
+			shared_ptr< InFlight > fetch = cache->join( &request, &leader );
+			if( leader )
+				inFlight = fetch;
+			else if( (cached = cache->wait( fetch, &request, responseTimeout )) )
+			{
+				consumed = request.headerLen;
+				return( sendCached( cached.get() ) && keepAlive && !cached->close );
+			}
+		}
+		caching = true;
+	}
+
+	if( requestBuffer && requestBody.framing == HTTP_BODY_LENGTH && requestBody.length > requestBuffer )
+	{
+		Log::log( "HTTPProxySession[ %p ]: request body exceeds REQUEST-BUFFER (%zu)", this, requestBuffer );
+		sendError( 413, "Payload Too Large" );
+		return( false );
+	}
+	bodyStart = Thread::milliseconds();
+	bodyReceived = received - request.headerLen;
+
+	if( !requestBody.done() && request.version == "HTTP/1.1" && request.hasToken( "Expect", "100-continue" ) )
+	{
+		// answer for the backend, which isn't chosen yet
+		const char *interim = "HTTP/1.1 100 Continue\r\n\r\n";
+		if( !clientWrite( interim, strlen( interim ) ) )
+			return( false );
+		continued = true;
+	}
+	if( requestBuffer && requestBody.framing != HTTP_BODY_NONE && !bufferBody() )
+		return( false );
+
+	for( int attempt = 0; ; attempt++ )
+	{
+		if( !(backend = service->sessionSelectBackend( &request )) )
+		{
+			Log::log( "HTTPProxySession[ %p ]: no backend available", this );
+			sendError( 503, "Service Unavailable" );
+			return( false );
+		}
+		int result = sendRequest();
+		if( result == RELAY_OK )
+			result = relayResponse( &keepAlive );
+		if( result == RELAY_OK )
+			return( keepAlive );
+		endRequest( false );
+		if( result == RELAY_FAILED )
+			return( false );
+		if( attempt > 0 )
+		{
+			sendError( 502, "Bad Gateway" );
+			return( false );
+		}
+	}
+}
+
+// forward the request header and body to the selected backend
+
+int
+HTTPProxySessionContext :: sendRequest( void )
+{
+	try
+	{
+		connection = backend->getConnection( &reused );
+	}
+	catch( const char *error )
+	{
+		Log::log( "HTTPProxySession[ %p ]: Connection() failed (%s)", this, error );
+		backend->reportFailure( "connect failed" );
+		return( RELAY_RETRY );
+	}
+
+	// the header and whatever part of the body arrived with it
+	(void) requestBody.frame( &request );
+	consumed = request.headerLen + requestBody.consume( buf + request.headerLen, received - request.headerLen );
+	if( requestBody.error )
+	{
+		Log::log( "HTTPProxySession[ %p ]: bad request (%s)", this, requestBody.error );
+		sendError( 400, "Bad Request" );
+		return( RELAY_FAILED );
+	}
+	// a request still whole in buf can be resent if a pooled connection
+	// turns out to have been closed, unless it may have had side effects
+	replayable = requestBody.done() && method != "POST" && method != "PATCH";
+	requestStart = Thread::milliseconds();
+	bool sent;
+	if( rewrite || earlyRequest )
+	{
+		static const HeaderRewrite none;
+		const HeaderRewrite *headers = rewrite ? rewrite : &none;
+		int count = headers->build( &request, buf, consumed, clientAddr, clientSSL != nullptr, &requestId, &inserted, &iov, earlyRequest );
+		sent = connection->writev( iov.data(), count ) >= 0;
+	}
+	else
+		sent = proxyWrite( buf, consumed );
+	if( !sent )
+	{
+		if( !reused )
+			backend->reportFailure( "connection reset" );
+		return( RELAY_RETRY );
+	}
+
+	while( !requestBody.done() )
+	{
+		if( !bodyWait() )
+			return( RELAY_FAILED );
+		ssize_t len = clientRead( buf, bufLen );
+		if( len <= 0 )
+			return( RELAY_FAILED );
+		received = len;
+		bodyReceived += len;
+		consumed = requestBody.consume( buf, len );
+		if( requestBody.error )
+		{
+			Log::log( "HTTPProxySession[ %p ]: bad request (%s)", this, requestBody.error );
+			sendError( 400, "Bad Request" );
+			return( RELAY_FAILED );
+		}
+		if( !proxyWrite( buf, consumed ) )
+		{
+			backend->reportFailure( "connection reset" );
+			sendError( 502, "Bad Gateway" );
+			return( RELAY_FAILED );
+		}
+		requestStart = Thread::milliseconds();
+	}
+	return( RELAY_OK );
+}
+
+// wait for more of the request body: BODY-TIMEOUT bounds each wait and,
+// after the first second, BODY-MIN-RATE the average rate
+
+bool
+HTTPProxySessionContext :: bodyWait( void )
+{
+	int64_t elapsed = Thread::milliseconds() - bodyStart;
+	if( bodyMinRate && elapsed > BODY_RATE_GRACE && bodyReceived * 1000 / elapsed < bodyMinRate )
+	{
+		Log::log( "HTTPProxySession[ %p ]: request body below BODY-MIN-RATE (%zu bytes in %lld ms)", this, bodyReceived, (long long) elapsed );
+		sendError( 408, "Request Timeout" );
+		return( false );
+	}
+	if( !clientWait( bodyTimeout ? bodyTimeout : keepAliveTimeout ) )
+	{
+		Log::log( "HTTPProxySession[ %p ]: request body timed out (BODY-TIMEOUT %d ms)", this, bodyTimeout );
+		sendError( 408, "Request Timeout" );
+		return( false );
+	}
+	return( true );
+}
+
+// read the whole body in behind the header (up to REQUEST-BUFFER), so no
+// backend is chosen, let alone sent anything, until the request is complete
+
+bool
+HTTPProxySessionContext :: bufferBody( void )
+{
+	HTTPBody body;
+	(void) body.frame( &request );
+	size_t scanned = request.headerLen;
+	size_t limit = request.headerLen + requestBuffer;
+	for( ;; )
+	{
+		scanned += body.consume( buf + scanned, received - scanned );
+		if( body.error )
+		{
+			Log::log( "HTTPProxySession[ %p ]: bad request (%s)", this, body.error );
+			sendError( 400, "Bad Request" );
+			return( false );
+		}
+		if( body.done() )
+			return( true );
+		if( received == bufLen )
+		{
+			if( bufLen >= limit )
+			{
+				Log::log( "HTTPProxySession[ %p ]: request body exceeds REQUEST-BUFFER (%zu)", this, requestBuffer );
+				sendError( 413, "Payload Too Large" );
+				return( false );
+			}
+			bufLen = min( bufLen * 2, limit );
+			buf = (char *) realloc( buf, bufLen );
+			request.relocate( buf );
+		}
+		if( !bodyWait() )
+			return( false );
+		ssize_t len = clientRead( buf + received, bufLen - received );
+		if( len <= 0 )
+			return( false );
+		received += len;
+		bodyReceived += len;
+	}
+}
+
+// relay the backend's response, skipping the 100 Continue already sent
+
+int
+HTTPProxySessionContext :: relayResponse( bool *keepAlive )
+{
+	size_t len = 0;
+	response.reset();
+	for( ;; )
+	{
+		int result = response.parse( responseBuf, len );
+		if( result == HTTP_ERROR )
+		{
+			Log::log( "HTTPProxySession[ %p ]: bad response from %s (%s)", this, backend->destStr, response.error );
+			backend->reportFailure( "bad response" );
+			sendError( 502, "Bad Gateway" );
+			return( RELAY_FAILED );
+		}
+		if( result == HTTP_COMPLETE )
+		{
+			if( response.status >= 200 || response.status == 101 )
+				break;
+			// interim response
+			if( !(response.status == 100 && continued) && !clientWrite( responseBuf, response.headerLen ) )
+				return( RELAY_FAILED );
+			len -= response.headerLen;
+			memmove( responseBuf, responseBuf + response.headerLen, len );
+			response.reset();
+			continue;
+		}
+		if( len == responseBufLen )
+		{
+			if( responseBufLen >= maxHeaderSize )
+			{
+				backend->reportFailure( "response header too large" );
+				sendError( 502, "Bad Gateway" );
+				return( RELAY_FAILED );
+			}
+			responseBufLen = min( responseBufLen * 2, maxHeaderSize );
+			responseBuf = (char *) realloc( responseBuf, responseBufLen );
+		}
+		if( !connection->wait( responseTimeout ) )
+		{
+			backend->reportFailure( "timed out" );
+			sendError( 504, "Gateway Timeout" );
+			return( RELAY_FAILED );
+		}
+		ssize_t n = connection->read( responseBuf + len, responseBufLen - len );
+		if( n <= 0 )
+		{
+			if( len == 0 && reused && replayable )
+				return( RELAY_RETRY );
+			backend->reportFailure( "connection reset" );
+			sendError( 502, "Bad Gateway" );
+			return( RELAY_FAILED );
+		}
+		if( requestStart )
+		{
+			backend->reportLatency( Thread::milliseconds() - requestStart );
+			requestStart = 0;
+		}
+		len += n;
+	}
+
+	// passive outlier detection counts 5xx responses as failures
+	if( response.status >= 500 )
+		backend->reportFailure( "5xx response" );
+	else
+		backend->reportSuccess();
+
+	if( !sessionCookie.empty() )
+	{
+		string_view value = response.setCookie( sessionCookie );
+		if( !value.empty() )
+		{
+			string cookie( value );
+			service->sessionNotifyProtocolAttribute( &cookie, (void *) backend->destStr );
+		}
+	}
+
+	if( response.status == 101 )
+	{
+		// protocol upgrade (e.g. WebSocket): the connection is no longer HTTP
+		*keepAlive = false;
+		if( clientWrite( responseBuf, len ) )
+			tunnel();
+		endRequest( false );
+		return( RELAY_OK );
+	}
+
+	if( responseBody.frame( &response, method ) == HTTP_ERROR )
+	{
+		Log::log( "HTTPProxySession[ %p ]: bad response from %s (%s)", this, backend->destStr, responseBody.error );
+		sendError( 502, "Bad Gateway" );
+		return( RELAY_FAILED );
+	}
+	bool reuse = response.keepAlive() && responseBody.framing != HTTP_BODY_CLOSE;
+	*keepAlive = *keepAlive && reuse;
+
+	Compression *compression = backend->pool->compression;
+	int encoding = compression ? compression->select( acceptedEncodings ) : 0;
+	string vary( response.header( "Vary" ) );
+	string header;
+	statusLineLen = HTTPScan::find( response.version.data(), responseBuf + response.headerLen, '\n' ) + 1 - responseBuf;
+	if( encoding && compression->applies( &response, &responseBody ) )
+	{
+		header = compressedHeader( encoding, &vary );
+		compressor = Compressor::get( encoding );
+		payload.clear();
+	}
+
+	size_t used = response.headerLen + responseBody.consume( responseBuf + response.headerLen, len - response.headerLen,
+		compressor ? &payload : nullptr );
+	if( used < len )
+		reuse = false;	// bytes past the end of the response
+	if( caching && responseBody.framing != HTTP_BODY_CLOSE && (cacheTTL = Cache::freshness( &response )) > 0 )
+	{
+		// the parser's views don't survive the body overwriting responseBuf
+		cacheVary = vary;
+		cacheClose = !response.keepAlive();
+		captured.clear();
+	}
+	else
+	{
+		caching = false;
+		finishInFlight( nullptr );
+	}
+	// with RESPONSE-BUFFER, a response still arriving is held until it's all
+	// in and the backend released, then drained at the client's pace
+	buffering = buffer && !responseBody.done();
+	if( buffer )
+		buffer->clear();
+	if( compressor ? !relayCompressed( header, responseBody.done() ) : !relay( responseBuf, used ) )
+		return( RELAY_FAILED );
+	while( !responseBody.done() && !responseBody.error )
+	{
+		if( !connection->wait( responseTimeout ) )
+		{
+			backend->reportFailure( "timed out" );
+			return( RELAY_FAILED );
+		}
+		ssize_t n = connection->read( responseBuf, responseBufLen );
+		if( n <= 0 )
+		{
+			if( responseBody.framing == HTTP_BODY_CLOSE )
+			{
+				if( compressor && !relayCompressed( string(), true ) )
+					return( RELAY_FAILED );
+				break;
+			}
+			backend->reportFailure( "connection reset" );
+			return( RELAY_FAILED );
+		}
+		used = responseBody.consume( responseBuf, n, compressor ? &payload : nullptr );
+		if( used < (size_t) n )
+			reuse = false;
+		if( compressor ? !relayCompressed( string(), responseBody.done() ) : !relay( responseBuf, used ) )
+			return( RELAY_FAILED );
+	}
+	if( responseBody.error )
+	{
+		Log::log( "HTTPProxySession[ %p ]: bad response from %s (%s)", this, backend->destStr, responseBody.error );
+		return( RELAY_FAILED );
+	}
+	if( caching )
+	{
+		// a GET without a body, so request still points into an intact buf
+		finishInFlight( cache->insert( &request, cacheVary, move( captured ), statusLineLen, cacheTTL, cacheClose ) );
+		captured.clear();
+		caching = false;
+	}
+	endRequest( reuse );
+	if( buffering && !flushBuffer() )
+		return( RELAY_FAILED );
+	return( RELAY_OK );
+}
+
+// after a 101 relay bytes both ways until either side closes
+
+void
+HTTPProxySessionContext :: tunnel( void )
+{
+	if( received > consumed && !proxyWrite( buf + consumed, received - consumed ) )
+		return;
+	received = consumed = 0;
+	for( ;; )
+	{
+		bool clientReady = clientSSL && SSL_pending( clientSSL ) > 0;
+		bool proxyReady = connection->pending() > 0;
+		if( !clientReady && !proxyReady )
+		{
+			struct pollfd fds[ 2 ] = { { clientSocket, POLLIN, 0 }, { connection->socket, POLLIN, 0 } };
+			if( poll( fds, 2, keepAliveTimeout ) <= 0 )
+				return;
+			clientReady = fds[ 0 ].revents != 0;
+			proxyReady = fds[ 1 ].revents != 0;
+		}
+		if( clientReady )
+		{
+			ssize_t len = clientRead( buf, bufLen );
+			if( len <= 0 || !proxyWrite( buf, len ) )
+				return;
+		}
+		if( proxyReady )
+		{
+			ssize_t len = connection->read( responseBuf, responseBufLen );
+			if( len <= 0 || !clientWrite( responseBuf, len ) )
+				return;
+		}
+	}
+}
+
+// release the backend, returning its connection to the idle pool if reusable
+
+void
+HTTPProxySessionContext :: endRequest( bool reuse )
+{
+	if( connection )
+	{
+		if( reuse )
+			backend->releaseConnection( connection );
+		else
+			delete( connection );
+		connection = nullptr;
+	}
+	if( backend )
+	{
+		backend->sessionEnded();
+		backend = nullptr;
+	}
+	if( compressor )
+	{
+		Compressor::release( compressor );
+		compressor = nullptr;
+	}
+	requestStart = 0;
+}
+
+// start on the 0-RTT data the handshake returned with, if any
+
+void
+HTTPProxySessionContext :: takeEarlyData( void )
+{
+	if( earlyData.empty() )
+		return;
+	if( bufLen < earlyData.size() )
+	{
+		bufLen = earlyData.size();
+		buf = (char *) realloc( buf, bufLen );
+	}
+	memcpy( buf, earlyData.data(), earlyData.size() );
+	received = earlyData.size();
+	string().swap( earlyData );
+	early = true;
+}
+
+// read the rest of the 0-RTT data in behind what's in buf and finish the
+// handshake, which proves none of it was replayed
+
+bool
+HTTPProxySessionContext :: confirmHandshake( void )
+{
+	for( ;; )
+	{
+		if( received == bufLen )
+		{
+			bufLen *= 2;
+			buf = (char *) realloc( buf, bufLen );
+			request.relocate( buf );
+		}
+		size_t len = 0;
+		int result = SSL_read_early_data( clientSSL, buf + received, bufLen - received, &len );
+		received += len;
+		if( result == SSL_READ_EARLY_DATA_FINISH )
+			break;
+		if( result == SSL_READ_EARLY_DATA_ERROR )
+			return( false );
+	}
+	early = false;
+	if( SSL_do_handshake( clientSSL ) != 1 )
+	{
+		Log::log( "HTTPProxySession[ %p ]: TLS handshake failed after early data", this );
+		return( false );
+	}
+	return( true );
+}
+
+bool
+HTTPProxySessionContext :: clientWait( int timeout )
+{
+	if( clientSSL && SSL_pending( clientSSL ) > 0 )
+		return( true );
+	struct pollfd pfd = { clientSocket, POLLIN, 0 };
+	int result;
+	while( (result = poll( &pfd, 1, timeout )) < 0 && errno == EINTR )
+		;
+	return( result > 0 );
+}
+
+ssize_t
+HTTPProxySessionContext :: clientRead( char *buf, size_t len )
+{
+	while( early )
+	{
+		size_t read = 0;
+		int result = SSL_read_early_data( clientSSL, buf, len, &read );
+		if( result == SSL_READ_EARLY_DATA_ERROR )
+			return( -1 );
+		if( result == SSL_READ_EARLY_DATA_FINISH )
+		{
+			// the handshake completes on the next SSL_read()
+			early = false;
+			if( read == 0 )
+				break;
+		}
+		if( read > 0 )
+			return( (ssize_t) read );
+	}
+	if( clientSSL )
+		return( SSL_read( clientSSL, buf, (int) len ) );
+	return( recv( clientSocket, buf, len, 0 ) );
+}
+
+bool
+HTTPProxySessionContext :: clientWrite( const char *data, size_t len )
+{
+	while( len )
+	{
+		ssize_t sent;
+		if( early )
+		{
+			// 0.5-RTT data, ahead of the client's Finished
+			size_t written = 0;
+			sent = SSL_write_early_data( clientSSL, data, records.next( len ), &written ) == 1 ? (ssize_t) written : -1;
+		}
+		else if( clientSSL )
+			sent = SSL_write( clientSSL, data, (int) min( records.next( len ), (size_t) INT_MAX ) );
+		else
+			sent = send( clientSocket, data, len, 0 );
+		if( sent <= 0 )
+		{
+# if TRACE
+			Log::console( "HTTPProxySession[ %p ]: client write failed [%d] (%s)", this, errno, strerror( errno ) );
+# endif // TRACE
+			return( false );
+		}
+		records.sent( sent );
+		data += sent;
+		len -= sent;
+	}
+	return( true );
+}
+
+bool
+HTTPProxySessionContext :: proxyWrite( const char *data, size_t len )
+{
+	while( len )
+	{
+		ssize_t sent = connection->write( (void *) data, len );
+		if( sent <= 0 )
+		{
+# if TRACE
+			Log::console( "HTTPProxySession[ %p ]: backend write failed [%d] (%s)", this, errno, strerror( errno ) );
+# endif // TRACE
+			return( false );
+		}
+		data += sent;
+		len -= sent;
+	}
+	return( true );
+}
+
+// the response header for a compressed body: no Content-Length, chunked
+// (only HTTP/1.1 clients get here: Compression::accepted gives 1.0 requests no
+// encodings), Vary including Accept-Encoding (also returned, for the cache)
+// and any strong ETag weakened, the bytes no longer being the backend's
+
+string
+HTTPProxySessionContext :: compressedHeader( int encoding, string *vary )
+{
+	string header( responseBuf, statusLineLen );
+	vary->clear();
+	for( auto it = response.headers.begin(); it != response.headers.end(); it++ )
+	{
+		if( equalsIgnoreCase( it->name, "Content-Length" ) || equalsIgnoreCase( it->name, "Transfer-Encoding" ) )
+			continue;
+		if( equalsIgnoreCase( it->name, "Vary" ) )
+		{
+			if( !vary->empty() )
+				*vary += ", ";
+			*vary += it->value;
+			continue;
+		}
+		header += it->name;
+		header += ": ";
+		if( equalsIgnoreCase( it->name, "ETag" ) && !it->value.empty() && it->value[ 0 ] == '"' )
+			header += "W/";
+		header += it->value;
+		header += "\r\n";
+	}
+	if( !response.hasToken( "Vary", "Accept-Encoding" ) )
+		*vary += vary->empty() ? "Accept-Encoding" : ", Accept-Encoding";
+	header += "Content-Encoding: ";
+	header += Compression::name( encoding );
+	header += "\r\nTransfer-Encoding: chunked\r\nVary: ";
+	header += *vary;
+	header += "\r\n\r\n";
+	return( header );
+}
+
+// response bytes, as the backend framed them, to the client (and the cache)
+
+bool
+HTTPProxySessionContext :: relay( const char *data, size_t len )
+{
+	if( caching )
+		capture( data, len );
+	if( buffering )
+	{
+		if( buffer->append( data, len ) )
+			return( true );
+		// too big to hold: relay the rest as it comes
+		if( !flushBuffer() )
+			return( false );
+	}
+	return( clientWrite( data, len ) );
+}
+
+// send what's been buffered and stop buffering
+
+bool
+HTTPProxySessionContext :: flushBuffer( void )
+{
+	buffering = false;
+	string_view memory = buffer->memoryPart();
+	string_view file = buffer->filePart();
+	if( !responseBody.error && responseBody.done() )
+		++ResponseBuffer::buffered;
+	bool written = clientWrite( memory.data(), memory.size() ) && clientWrite( file.data(), file.size() );
+	buffer->clear();
+	return( written );
+}
+
+// compress the payload decoded so far and relay it as a chunk after prefix;
+// finish ends the stream and the chunked body
+
+bool
+HTTPProxySessionContext :: relayCompressed( const string& prefix, bool finish )
+{
+	Compression *compression = backend->pool->compression;
+	deflated.clear();
+	if( !compressor->compress( payload.data(), payload.size(), finish, &deflated ) )
+	{
+		Log::log( "HTTPProxySession[ %p ]: %s compression failed", this, Compression::name( compressor->encoding ) );
+		return( false );
+	}
+	compression->bytesIn += payload.size();
+	compression->bytesOut += deflated.size();
+	payload.clear();
+	encoded = prefix;
+	if( !deflated.empty() )
+	{
+		char size[ 32 ];
+		encoded.append( size, snprintf( size, sizeof( size ), "%zx\r\n", deflated.size() ) );
+		encoded += deflated;
+		encoded += "\r\n";
+	}
+	if( finish )
+	{
+		encoded += "0\r\n\r\n";
+		++compression->responses;
+	}
+	return( encoded.empty() || relay( encoded.data(), encoded.size() ) );
+}
+
+// keep a copy of a cacheable response, unless it outgrows the cache's limit
+
+void
+HTTPProxySessionContext :: capture( const char *data, size_t len )
+{
+	if( captured.size() + len > cache->maxObjectSize )
+	{
+		caching = false;
+		captured = string();
+		finishInFlight( nullptr );
+		return;
+	}
+	captured.append( data, len );
+}
+
+// hand the response (null if there isn't one to share) to requests waiting on this one
+
+void
+HTTPProxySessionContext :: finishInFlight( shared_ptr< CachedResponse > response )
+{
+	if( inFlight )
+	{
+		cache->finish( inFlight, response );
+		inFlight = nullptr;
+	}
+}
+
+// relay a cache hit, adding how long it has been stored
+
+bool
+HTTPProxySessionContext :: sendCached( CachedResponse *cached )
+{
+	char age[ 32 ];
+	int len = snprintf( age, sizeof( age ), "Age: %lld\r\n", (long long) ((Thread::milliseconds() - cached->stored) / 1000) );
+	return( clientWrite( cached->data.data(), cached->statusLineLen )
+		&& clientWrite( age, len )
+		&& clientWrite( cached->data.data() + cached->statusLineLen, cached->data.size() - cached->statusLineLen ) );
+}
+
+// only before any of the response has been relayed
+
+void
+HTTPProxySessionContext :: sendError( int status, const char *reason )
+{
+	char response[ 128 ];
+	int len = snprintf( response, sizeof( response ),
+		"HTTP/1.1 %d %s\r\nContent-Length: 0\r\nConnection: close\r\n\r\n", status, reason );
+	(void) clientWrite( response, len );
+}
+
+HTTPProxySession :: HTTPProxySession( HTTPProxySessionContext *context ) : Session( context )
+{
+# if TRACE
+	Log::console( "HTTPProxySession::HTTPProxySession()" );
+# endif // TRACE
+}
+
+HTTPProxySession :: ~HTTPProxySession()
+{
+# if TRACE
+	Log::console( "HTTPProxySession::~HTTPProxySession()" );
+# endif // TRACE
+}
+
+void
+HTTPProxySession :: _main( HTTPProxySessionContext *context )
+{
+# if TRACE
+	Log::console( "HTTPProxySession::_main[ %p ] RUN", context );
+# endif // TRACE
+	context->takeEarlyData();
+	while( context->readRequest() && context->proxyRequest() )
+		;
+	if( context->early )
+		(void) context->confirmHandshake();	// read the client's Finished, or closing resets
+	delete( context );
+}
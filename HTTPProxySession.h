@@ -0,0 +1,139 @@
+//
+//  HTTPProxySession.h
+//  Layer7LoadBalancer
+//  Created by Rick Tyler
+//
+//  SPDX-License-Identifier: MIT
+
+# ifndef _HTTPProxySession_h_
+# define _HTTPProxySession_h_
+
+# include "Thread.h"
+# include "Service.h"
+# include "Session.h"
+# include "Connection.h"
+# include "Backend.h"
+# include "HTTPParser.h"
+# include "Cache.h"
+# include "Compression.h"
+# include "HeaderRewrite.h"
+# include "ResponseBuffer.h"
+
+// Request-level balancing: each request on a keep-alive client connection
+// is framed (Content-Length or chunked), sent to the backend selected for
+// it and its response relayed back, reusing idle backend connections.
+
+class HTTPProxySessionContext : public SessionContext
+{
+  public:
+
+	HTTPProxySessionContext
+	(
+		Service *service,
+		int clientSocket,
+		SSL *clientSSL,
+		string sessionCookie = "",
+		size_t maxHeaderSize = 65536,
+		int keepAliveTimeout = 60000,
+		int responseTimeout = 60000,
+		Cache *cache = nullptr,
+		HeaderRewrite *rewrite = nullptr,
+		size_t responseBuffer = 0,
+		size_t responseBufferFile = 0
+	);
+	~HTTPProxySessionContext();
+	void setLimits( int headerTimeout, int bodyTimeout, size_t bodyMinRate, size_t requestBuffer );
+
+  private:
+
+	string sessionCookie;
+	size_t maxHeaderSize;
+	int keepAliveTimeout;		// ms a client connection may sit idle between requests
+	int responseTimeout;		// ms to wait on the backend for response bytes
+	int headerTimeout = 0;		// ms for a request header, once it's begun (0 = no limit)
+	int bodyTimeout = 0;		// ms a request body may stall (0 = keepAliveTimeout)
+	size_t bodyMinRate = 0;		// bytes/s a request body must average
+	size_t requestBuffer = 0;	// bodies up to this are read whole before balancing
+	int64_t bodyStart = 0;
+	size_t bodyReceived = 0;
+	char *buf;			// client bytes, the current request header first
+	size_t bufLen;
+	size_t received = 0;
+	size_t consumed = 0;		// bytes at buf belonging to the current request
+	char *responseBuf;
+	size_t responseBufLen;
+	HTTPParser request;
+	HTTPParser response;
+	HTTPBody requestBody;
+	HTTPBody responseBody;
+	string method;			// of the current request, once its header is overwritten
+	bool continued = false;		// 100 Continue already sent to the client
+	bool early = false;		// TLS handshake unfinished: reads are 0-RTT data
+	bool earlyRequest = false;	// this request is forwarded before it finishes
+	Backend *backend = nullptr;
+	Connection *connection = nullptr;
+	bool reused = false;		// connection came from the backend's idle pool
+	bool replayable = false;	// request can be resent on another connection
+	int64_t requestStart = 0;
+	Cache *cache;
+	bool caching = false;		// response to the current request may be stored
+	string captured;		// response bytes relayed so far, while caching
+	string cacheVary;
+	size_t statusLineLen = 0;
+	int64_t cacheTTL = 0;
+	bool cacheClose = false;
+	shared_ptr< InFlight > inFlight;	// identical requests waiting on this one's response
+	HeaderRewrite *rewrite;		// null when there's nothing to rewrite
+	string clientAddr;
+	string requestId;		// generated for the current request
+	string inserted;		// header lines added to it
+	vector< struct iovec > iov;
+	ResponseBuffer *buffer = nullptr;	// with RESPONSE-BUFFER
+	bool buffering = false;		// holding the current response
+	int acceptedEncodings = 0;	// the client's Accept-Encoding
+	Compressor *compressor = nullptr;	// compressing the current response
+	string payload;			// response body decoded from its framing, awaiting compression
+	string deflated;
+	string encoded;			// compressed and chunked for the client
+	bool readRequest( void );
+	bool proxyRequest( void );
+	int sendRequest( void );
+	int relayResponse( bool *keepAlive );
+	void tunnel( void );
+	void endRequest( bool reuse );
+	void takeEarlyData( void );
+	bool confirmHandshake( void );
+	bool clientWait( int timeout );
+	ssize_t clientRead( char *buf, size_t len );
+	bool clientWrite( const char *data, size_t len );
+	bool proxyWrite( const char *data, size_t len );
+	void sendError( int status, const char *reason );
+	bool sendCached( CachedResponse *cached );
+	string compressedHeader( int encoding, string *vary );
+	bool bodyWait( void );
+	bool bufferBody( void );
+	bool relay( const char *data, size_t len );
+	bool flushBuffer( void );
+	bool relayCompressed( const string& prefix, bool finish );
+	void capture( const char *data, size_t len );
+	void finishInFlight( shared_ptr< CachedResponse > response );
+
+  friend class HTTPProxySession;
+};
+
+class HTTPProxySession : public Session
+{
+	public:
+
+		HTTPProxySession( HTTPProxySessionContext *context );
+		~HTTPProxySession();
+
+	private:
+
+		static void _main( HTTPProxySessionContext *context );
+		ThreadMain main( void ) { return( (ThreadMain) _main ); }
+
+	friend class Service;
+};
+
+# endif // _HTTPProxySession_h_
@@ -0,0 +1,91 @@
+//
+//  HTTPScan.cc
+//  Layer7LoadBalancer
+//  Created by Rick Tyler
+//
+//  SPDX-License-Identifier: MIT
+
+# include "HTTPScan.h"
+# include <stdint.h>
+
+# if defined( __x86_64__ ) || defined( __i386__ )
+# define HTTP_SCAN_X86    1
+# include <immintrin.h>
+# endif
+
+static const char *
+findScalar( const char *p, const char *end, char c1, char c2, char c3 )
+{
+	for( ; p < end; p++ )
+	{
+		if( *p == c1 || *p == c2 || *p == c3 )
+			return( p );
+	}
+	return( end );
+}
+
+# if HTTP_SCAN_X86
+
+// PCMPESTRI compares each of 16 haystack bytes against the 3 needle bytes
+
+__attribute__(( target( "sse4.2" ) )) static const char *
+findSSE42( const char *p, const char *end, char c1, char c2, char c3 )
+{
+	const __m128i needles = _mm_setr_epi8( c1, c2, c3, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 );
+	for( ; end - p >= 16; p += 16 )
+	{
+		__m128i block = _mm_loadu_si128( (const __m128i *) p );
+		int index = _mm_cmpestri( needles, 3, block, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT );
+		if( index < 16 )
+			return( p + index );
+	}
+	return( findScalar( p, end, c1, c2, c3 ) );
+}
+
+__attribute__(( target( "avx2" ) )) static const char *
+findAVX2( const char *p, const char *end, char c1, char c2, char c3 )
+{
+	const __m256i n1 = _mm256_set1_epi8( c1 );
+	const __m256i n2 = _mm256_set1_epi8( c2 );
+	const __m256i n3 = _mm256_set1_epi8( c3 );
+	for( ; end - p >= 32; p += 32 )
+	{
+		__m256i block = _mm256_loadu_si256( (const __m256i *) p );
+		__m256i match = _mm256_or_si256(
+			_mm256_or_si256( _mm256_cmpeq_epi8( block, n1 ), _mm256_cmpeq_epi8( block, n2 ) ),
+			_mm256_cmpeq_epi8( block, n3 ) );
+		uint32_t mask = (uint32_t) _mm256_movemask_epi8( match );
+		if( mask )
+			return( p + __builtin_ctz( mask ) );
+	}
+	return( findSSE42( p, end, c1, c2, c3 ) );
+}
+
+# endif // HTTP_SCAN_X86
+
+static HTTPScan::Kernel
+selectKernel( void )
+{
+# if HTTP_SCAN_X86
+	__builtin_cpu_init();
+	if( __builtin_cpu_supports( "avx2" ) )
+		return( findAVX2 );
+	if( __builtin_cpu_supports( "sse4.2" ) )
+		return( findSSE42 );
+# endif // HTTP_SCAN_X86
+	return( findScalar );
+}
+
+HTTPScan::Kernel HTTPScan :: kernel = selectKernel();
+
+const char *
+HTTPScan :: kernelName( void )
+{
+# if HTTP_SCAN_X86
+	if( kernel == findAVX2 )
+		return( "avx2" );
+	if( kernel == findSSE42 )
+		return( "sse4.2" );
+# endif // HTTP_SCAN_X86
+	return( "scalar" );
+}
@@ -0,0 +1,39 @@
+//
+//  HTTPScan.h
+//  Layer7LoadBalancer
+//  Created by Rick Tyler
+//
+//  SPDX-License-Identifier: MIT
+
+# ifndef _HTTPScan_h_
+# define _HTTPScan_h_
+
+// Delimiter scanning for header parsing. find() returns the first byte in
+// [p, end) equal to c1, c2 or c3 (end if none), examining 32 (AVX2) or 16
+// (SSE4.2) bytes per step. The kernel is picked once at startup from the
+// running CPU's features, with a scalar fallback elsewhere.
+
+class HTTPScan
+{
+    public:
+
+	static const char *find( const char *p, const char *end, char c1, char c2, char c3 )
+	{
+		return( kernel( p, end, c1, c2, c3 ) );
+	}
+
+	static const char *find( const char *p, const char *end, char c )
+	{
+		return( kernel( p, end, c, c, c ) );
+	}
+
+	static const char *kernelName( void );
+
+	typedef const char *(*Kernel)( const char *, const char *, char, char, char );
+
+    private:
+
+	static Kernel kernel;
+};
+
+# endif // _HTTPScan_h_
@@ -0,0 +1,117 @@
+//
+//  HTTPStream.cc
+//  Layer7LoadBalancer
+//  Created by Rick Tyler
+//
+//  SPDX-License-Identifier: MIT
+
+# include "HTTPStream.h"
+# include <stdlib.h>
+# include <string.h>
+# include <algorithm>
+
+// # define TRACE    1
+
+# define STREAM_BUF_LEN    4096
+# define MAX_PIPELINED     256	// request methods remembered for unanswered requests
+
+HTTPStream :: HTTPStream( bool response, size_t maxHeaderSize ) : parser( response )
+{
+	this->response = response;
+	this->maxHeaderSize = maxHeaderSize;
+}
+
+HTTPStream :: ~HTTPStream()
+{
+	if( buf )
+		free( buf );
+}
+
+// consume bytes of the stream, up to len; *header is set when a header
+// completes, in which case the bytes after it are left for the next call
+
+size_t
+HTTPStream :: scan( const char *data, size_t len, HTTPParser **header )
+{
+	switch( state )
+	{
+		case STREAM_PASSTHROUGH:
+			return( len );
+
+		case STREAM_BODY:
+		{
+			size_t used = body.consume( data, len );
+			if( body.error )
+				state = STREAM_PASSTHROUGH;
+			else if( body.done() )
+			{
+				state = STREAM_HEADER;
+				parser.reset();
+				received = 0;
+			}
+			return( used );
+		}
+	}
+
+	// STREAM_HEADER: only header bytes are copied, once
+	if( received + len > bufLen )
+	{
+		size_t newLen = max( received + len, bufLen ? bufLen * 2 : (size_t) STREAM_BUF_LEN );
+		if( received + len > maxHeaderSize )
+			newLen = maxHeaderSize;
+		if( newLen > bufLen )
+		{
+			buf = (char *) realloc( buf, newLen );
+			bufLen = newLen;
+		}
+	}
+	size_t copied = min( len, bufLen - received );
+	memcpy( buf + received, data, copied );
+	received += copied;
+
+	int result = parser.parse( buf, received );
+	if( result == HTTP_ERROR || (result == HTTP_INCOMPLETE && received == maxHeaderSize) )
+	{
+		state = STREAM_PASSTHROUGH;
+		return( len );
+	}
+	if( result == HTTP_INCOMPLETE )
+		return( len );
+
+	// bytes copied beyond the header belong to the body
+	size_t used = copied - (received - parser.headerLen);
+	*header = &parser;
+	if( !response )
+	{
+		if( methods.size() < MAX_PIPELINED )
+			methods.push_back( string( parser.method ) );
+		(void) body.frame( &parser );
+	}
+	else if( parser.status == 101 )
+	{
+		state = STREAM_PASSTHROUGH;
+		return( used );
+	}
+	else if( parser.status < 200 )
+	{
+		// interim response, the final one follows
+		(void) body.frame( &parser );
+	}
+	else
+		(void) body.frame( &parser, nextMethod() );
+
+	// with no body the next scan() starts the next header; the parser is
+	// left alone until then so the caller can inspect it
+	state = body.error ? STREAM_PASSTHROUGH : STREAM_BODY;
+	return( used );
+}
+
+string
+HTTPStream :: nextMethod( void )
+{
+	if( !requests || requests->methods.empty() )
+		return( "" );
+	string method = requests->methods.front();
+	requests->methods.pop_front();
+	return( method );
+}
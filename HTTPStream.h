@@ -0,0 +1,53 @@
+//
+//  HTTPStream.h
+//  Layer7LoadBalancer
+//  Created by Rick Tyler
+//
+//  SPDX-License-Identifier: MIT
+
+# ifndef _HTTPStream_h_
+# define _HTTPStream_h_
+
+# include "HTTPParser.h"
+# include <deque>
+# include <string>
+
+// Follows HTTP/1.x message boundaries in one direction of a relayed
+// connection. Each header is parsed exactly once, even when it arrives
+// split across reads; body bytes are only counted. Anything that stops
+// looking like HTTP (or an upgraded connection) is passed through.
+//
+//	while( offset < len )
+//	{
+//		HTTPParser *header = nullptr;
+//		offset += stream.scan( buf + offset, len - offset, &header );
+//		if( header )
+//			... inspect it
+//	}
+
+class HTTPStream
+{
+    public:
+
+	HTTPStream( bool response, size_t maxHeaderSize = 65536 );
+	~HTTPStream();
+	size_t scan( const char *data, size_t len, HTTPParser **header );
+	bool isPassthrough( void ) { return( state == STREAM_PASSTHROUGH ); }
+	HTTPStream *requests = nullptr;	// for a response stream, the stream of requests answered
+
+    private:
+
+	enum { STREAM_HEADER, STREAM_BODY, STREAM_PASSTHROUGH };
+	int state = STREAM_HEADER;
+	bool response;
+	HTTPParser parser;
+	HTTPBody body;
+	char *buf = nullptr;		// header bytes so far
+	size_t bufLen = 0;
+	size_t received = 0;
+	size_t maxHeaderSize;
+	deque< string > methods;	// of requests not yet answered
+	string nextMethod( void );
+};
+
+# endif // _HTTPStream_h_
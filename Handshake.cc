@@ -0,0 +1,76 @@
+//
+//  Handshake.cc
+//  Layer7LoadBalancer
+//  Created by Rick Tyler
+//
+//  SPDX-License-Identifier: MIT
+
+# include "Handshake.h"
+# include "Service.h"
+# include <unistd.h>
+
+// # define TRACE    1
+
+# define HANDSHAKE_QUEUE_MAX    4096	// sockets awaiting a handshake thread
+
+HandshakeContext :: HandshakeContext( Service *service, int timeout ) : dropped( 0 )
+{
+	this->service = service;
+	this->timeout = timeout;
+}
+
+bool
+HandshakeContext :: enqueue( int clientSocket )
+{
+	{
+		lock_guard< mutex > lock( queueMutex );
+		if( sockets.size() >= HANDSHAKE_QUEUE_MAX )
+		{
+			++dropped;
+			return( false );
+		}
+		sockets.push_back( clientSocket );
+	}
+	queued.notify_one();
+	return( true );
+}
+
+size_t
+HandshakeContext :: queueLength( void )
+{
+	lock_guard< mutex > lock( queueMutex );
+	return( sockets.size() );
+}
+
+int
+HandshakeContext :: next( void )
+{
+	unique_lock< mutex > lock( queueMutex );
+	queued.wait( lock, [ this ] { return( !sockets.empty() ); } );
+	int clientSocket = sockets.front();
+	sockets.pop_front();
+	return( clientSocket );
+}
+
+void
+Handshake :: _main( HandshakeContext *context )
+{
+	for( ;; )
+	{
+		int clientSocket = context->next();
+# if TRACE
+		Log::console( "Handshake::_main: clientSocket=%d", clientSocket );
+# endif // TRACE
+		try
+		{
+			SSL *clientSSL;
+			string earlyData;
+			if( context->service->handshake( clientSocket, &clientSSL, context->timeout, &earlyData ) )
+				context->service->startSession( clientSocket, clientSSL, &earlyData );
+		}
+		catch( const char *error )
+		{
+			Log::log( "Handshake::_main: %s", error );
+		}
+	}
+}
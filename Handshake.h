@@ -0,0 +1,57 @@
+//
+//  Handshake.h
+//  Layer7LoadBalancer
+//  Created by Rick Tyler
+//
+//  SPDX-License-Identifier: MIT
+
+# ifndef _Handshake_h_
+# define _Handshake_h_
+
+# include "Thread.h"
+# include <atomic>
+# include <condition_variable>
+# include <deque>
+
+class Service;
+
+// TLS handshakes taken off the accept thread: accepted sockets queue here
+// for a fixed set of Handshake threads, which run SSL_accept (and so the
+// private key operations) and start each session. Handshakes per second
+// scale with, and crypto load is bounded by, the number of threads;
+// sessions already running relay in their own threads meanwhile.
+
+class HandshakeContext : public ThreadContext
+{
+    public:
+
+	HandshakeContext( Service *service, int timeout );
+	bool enqueue( int clientSocket );	// false if the queue is full
+	size_t queueLength( void );
+	atomic< size_t > dropped;
+
+    private:
+
+	Service *service;
+	int timeout;		// ms a client gets to complete its handshake
+	mutex queueMutex;
+	condition_variable queued;
+	deque< int > sockets;
+	int next( void );
+
+    friend class Handshake;
+};
+
+class Handshake : public Thread
+{
+    public:
+
+	Handshake( HandshakeContext *context ) : Thread( context ) { }
+	ThreadMain main( void ) { return( (ThreadMain) _main ); }
+
+    private:
+
+	static void _main( HandshakeContext *context );
+};
+
+# endif // _Handshake_h_
@@ -0,0 +1,111 @@
+//
+//  HeaderRewrite.cc
+//  Layer7LoadBalancer
+//  Created by Rick Tyler
+//
+//  SPDX-License-Identifier: MIT
+
+# include "HeaderRewrite.h"
+# include "HTTPScan.h"
+# include <openssl/rand.h>
+# include <stdio.h>
+
+// # define TRACE    1
+
+# define REQUEST_ID_BYTES    16
+
+// a header line that's dropped, its replacement (if any) being inserted
+
+bool
+HeaderRewrite :: replaces( string_view name ) const
+{
+	for( auto it = removed.begin(); it != removed.end(); it++ )
+	{
+		if( equalsIgnoreCase( name, *it ) )
+			return( true );
+	}
+	for( auto it = headers.begin(); it != headers.end(); it++ )
+	{
+		if( equalsIgnoreCase( name, it->first ) )
+			return( true );
+	}
+	if( forwardedFor && (equalsIgnoreCase( name, "X-Forwarded-For" ) || equalsIgnoreCase( name, "X-Forwarded-Proto" )) )
+		return( true );
+	return( false );
+}
+
+// iovec list (returns its length) sending the len bytes at buf, starting
+// with the parsed request header, rewritten; the inserted lines are kept in
+// *inserted, which must outlive the write. *requestId is generated when
+// empty, so a retried request keeps its id.
+
+int
+HeaderRewrite :: build( HTTPParser *request, const char *buf, size_t len, const string& clientAddr, bool secure,
+	string *requestId, string *inserted, vector< struct iovec > *iov, bool earlyData ) const
+{
+	// the empty line ending the header, where new lines go
+	const char *headerEnd = buf + request->headerLen;
+	const char *insertAt = headerEnd - (request->headerLen >= 2 && headerEnd[ -2 ] == '\r' ? 2 : 1);
+
+	inserted->clear();
+	for( auto it = headers.begin(); it != headers.end(); it++ )
+	{
+		*inserted += it->first;
+		*inserted += ": ";
+		*inserted += it->second;
+		*inserted += "\r\n";
+	}
+	if( forwardedFor )
+	{
+		*inserted += "X-Forwarded-For: ";
+		for( auto it = request->headers.begin(); it != request->headers.end(); it++ )
+		{
+			if( equalsIgnoreCase( it->name, "X-Forwarded-For" ) && !it->value.empty() )
+			{
+				*inserted += it->value;
+				*inserted += ", ";
+			}
+		}
+		*inserted += clientAddr;
+		*inserted += secure ? "\r\nX-Forwarded-Proto: https\r\n" : "\r\nX-Forwarded-Proto: http\r\n";
+	}
+	if( !requestIdHeader.empty() && request->header( requestIdHeader ).empty() )
+	{
+		if( requestId->empty() )
+		{
+			unsigned char bytes[ REQUEST_ID_BYTES ];
+			char hex[ REQUEST_ID_BYTES * 2 + 1 ];
+			(void) RAND_bytes( bytes, sizeof( bytes ) );
+			for( int i = 0; i < REQUEST_ID_BYTES; i++ )
+				snprintf( hex + i * 2, 3, "%02x", bytes[ i ] );
+			*requestId = hex;
+		}
+		*inserted += requestIdHeader;
+		*inserted += ": ";
+		*inserted += *requestId;
+		*inserted += "\r\n";
+	}
+
+	if( earlyData )
+		*inserted += "Early-Data: 1\r\n";
+
+	// runs of kept lines, cut where a line is dropped
+	iov->clear();
+	const char *start = buf;
+	for( auto it = request->headers.begin(); it != request->headers.end(); it++ )
+	{
+		if( !replaces( it->name ) )
+			continue;
+		const char *line = it->name.data();
+		const char *next = HTTPScan::find( line, insertAt, '\n' ) + 1;
+		if( line > start )
+			iov->push_back( { (void *) start, (size_t) (line - start) } );
+		start = min( next, insertAt );
+	}
+	if( insertAt > start )
+		iov->push_back( { (void *) start, (size_t) (insertAt - start) } );
+	if( !inserted->empty() )
+		iov->push_back( { (void *) inserted->data(), inserted->size() } );
+	iov->push_back( { (void *) insertAt, (size_t) (buf + len - insertAt) } );
+	return( (int) iov->size() );
+}
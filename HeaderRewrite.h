@@ -0,0 +1,46 @@
+//
+//  HeaderRewrite.h
+//  Layer7LoadBalancer
+//  Created by Rick Tyler
+//
+//  SPDX-License-Identifier: MIT
+
+# ifndef _HeaderRewrite_h_
+# define _HeaderRewrite_h_
+
+# include "HTTPParser.h"
+# include <string>
+# include <utility>
+# include <vector>
+# include <sys/uio.h>
+
+using namespace std;
+
+// Request header mutation: SET-HEADER replaces (or adds) a header,
+// REMOVE-HEADER drops one, FORWARDED-FOR appends the client's address to
+// X-Forwarded-For and sets X-Forwarded-Proto, REQUEST-ID names a header
+// given a generated id unless the client sent one, and requests forwarded
+// from TLS 0-RTT data get "Early-Data: 1" (RFC 8470). The rewritten header is
+// an iovec list over the received bytes plus the inserted lines, so
+// nothing already in the buffer (the body least of all) is copied.
+
+class HeaderRewrite
+{
+    public:
+
+	void set( const string& name, const string& value ) { headers.push_back( make_pair( name, value ) ); }
+	void remove( const string& name ) { removed.push_back( name ); }
+	bool empty( void ) const { return( headers.empty() && removed.empty() && !forwardedFor && requestIdHeader.empty() ); }
+	int build( HTTPParser *request, const char *buf, size_t len, const string& clientAddr, bool secure,
+		string *requestId, string *inserted, vector< struct iovec > *iov, bool earlyData = false ) const;
+	bool forwardedFor = false;
+	string requestIdHeader;
+
+    private:
+
+	vector< pair< string, string > > headers;	// SET-HEADER name, value
+	vector< string > removed;			// REMOVE-HEADER names
+	bool replaces( string_view name ) const;
+};
+
+# endif // _HeaderRewrite_h_
@@ -0,0 +1,93 @@
+//
+//  HealthCheck.cc
+//  Layer7LoadBalancer
+//  Created by Rick Tyler
+//
+//  SPDX-License-Identifier: MIT
+
+# include "HealthCheck.h"
+# include "Connection.h"
+# include "Exception.h"
+# include "Log.h"
+# include <string.h>
+
+// # define TRACE    1
+
+HealthCheckContext :: HealthCheckContext( Backend *backend, int type, const char *path, int status, int interval, int timeout )
+{
+	this->backend = backend;
+	this->type = type;
+	this->path = path;
+	this->status = status;
+	this->interval = interval;
+	this->timeout = timeout;
+}
+
+void
+HealthCheckContext :: probe( void )
+{
+	bool useTLS = type == HEALTH_CHECK_TLS || (type == HEALTH_CHECK_HTTP && backend->useTLS);
+	Connection connection( backend->destStr, useTLS, timeout );
+
+	if( type != HEALTH_CHECK_HTTP )
+		return;
+
+	char buf[ 1024 ];
+	int len = snprintf( buf, sizeof( buf ), "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n", path, backend->destStr );
+	if( connection.write( buf, len ) != len )
+		Exception::raise( "write() failed (%s)", strerror( errno ) );
+
+	// only the status line is needed
+	size_t total = 0;
+	bzero( buf, sizeof( buf ) );
+	while( !strstr( buf, "\r\n" ) && total < sizeof( buf ) - 1 )
+	{
+		ssize_t n = connection.read( buf + total, sizeof( buf ) - 1 - total );
+		if( n <= 0 )
+			Exception::raise( "no response" );
+		total += n;
+	}
+	int code = 0;
+	if( sscanf( buf, "HTTP/1.%*d %d", &code ) != 1 )
+		Exception::raise( "malformed status line" );
+	if( code != status )
+		Exception::raise( "GET %s returned %d", path, code );
+}
+
+int
+HealthCheck :: type( const char *name )
+{
+	if( strcmp( name, "TCP" ) == 0 )
+		return( HEALTH_CHECK_TCP );
+	if( strcmp( name, "TLS" ) == 0 )
+		return( HEALTH_CHECK_TLS );
+	if( strcmp( name, "HTTP" ) == 0 )
+		return( HEALTH_CHECK_HTTP );
+	Exception::raise( "unknown HEALTH-CHECK type: %s", name );
+	return( HEALTH_CHECK_NONE );
+}
+
+void
+HealthCheck :: _main( HealthCheckContext *context )
+{
+# if TRACE
+	Log::console( "HealthCheck[ %s ]::_main RUN", context->backend->destStr );
+# endif // TRACE
+
+	for( ;; )
+	{
+		int64_t start = Thread::milliseconds();
+		try
+		{
+			context->probe();
+			context->backend->healthCheckSucceeded();
+		}
+		catch( const char *error )
+		{
+			context->backend->healthCheckFailed( error );
+		}
+		int64_t elapsed = Thread::milliseconds() - start;
+		if( elapsed < context->interval )
+			std::this_thread::sleep_for( std::chrono::milliseconds( context->interval - elapsed ) );
+	}
+}
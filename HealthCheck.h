@@ -0,0 +1,60 @@
+//
+//  HealthCheck.h
+//  Layer7LoadBalancer
+//  Created by Rick Tyler
+//
+//  SPDX-License-Identifier: MIT
+
+# ifndef _HealthCheck_h_
+# define _HealthCheck_h_
+
+# include "Thread.h"
+# include "Backend.h"
+
+# define HEALTH_CHECK_NONE    0
+# define HEALTH_CHECK_TCP     1	// connect() succeeds
+# define HEALTH_CHECK_TLS     2	// connect() and TLS handshake succeed
+# define HEALTH_CHECK_HTTP    3	// GET path returns expected status
+
+class HealthCheckContext : public ThreadContext
+{
+    public:
+
+	HealthCheckContext(
+		Backend *backend,
+		int type,
+		const char *path = "/",
+		int status = 200,
+		int interval = 2000,
+		int timeout = 1000
+	);
+
+    private:
+
+	Backend *backend;
+	int type;
+	const char *path;
+	int status;
+	int interval;
+	int timeout;
+	void probe( void );
+
+    friend class HealthCheck;
+};
+
+// background prober for one backend; opens and closes its circuit
+
+class HealthCheck : public Thread
+{
+    public:
+
+	HealthCheck( HealthCheckContext *context ) : Thread( context ) { }
+	ThreadMain main( void ) { return( (ThreadMain) _main ); }
+	static int type( const char *name );
+
+    private:
+
+	static void _main( HealthCheckContext *context );
+};
+
+# endif // _HealthCheck_h_
@@ -12,6 +12,17 @@
 # include "Service.h"
 # include "Session.h"
 # include "ProxySession.h"
+# include "HTTPProxySession.h"
+# include "PassthroughSession.h"
+# include "HTTP2Session.h"
+# include "HTTP2Client.h"
+# include "Backend.h"
+# include "HealthCheck.h"
+# include "HTTPParser.h"
+# include "Router.h"
+# include "Cache.h"
+# include "Compression.h"
+# include "HeaderRewrite.h"
 # include "Exception.h"
 # include "Event.h"
 # include "Log.h"
@@ -21,7 +32,9 @@
 # include <fstream>
 # include <string>
 # include <map>
+# include <sstream>
 # include <sys/time.h>
+# include <signal.h>
 
 # include <strings.h>
 
@@ -37,16 +50,107 @@ class L7LBServiceContext: public ServiceContext
 	public:
 
 		L7LBServiceContext( ServiceConfig *serviceConfig )
-			: ServiceContext( serviceConfig->listenStr.c_str(), serviceConfig->keyPath.c_str(), serviceConfig->certPath.c_str() )
+			: ServiceContext( serviceConfig->listenStr.c_str(), serviceConfig->certPath.c_str(), serviceConfig->keyPath.c_str() )
 		{
+			this->serviceConfig = serviceConfig;
+			for( auto it = serviceConfig->certificates.begin(); it != serviceConfig->certificates.end(); it++ )
+				addCertificate( it->first.c_str(), it->second.c_str() );
+			setSessionCache( serviceConfig->tlsSessionCache, serviceConfig->tlsSessionTimeout, serviceConfig->tlsTicketRotation );
+			setHandshakes( serviceConfig->handshakeThreads, serviceConfig->handshakeTimeout );
+			setRecordSizing( serviceConfig->tlsRecordSize, serviceConfig->tlsRecordRamp, serviceConfig->tlsRecordIdle );
+			if( serviceConfig->balanceRequests )	// HTTP sessions finish 0-RTT handshakes
+				setEarlyData( serviceConfig->tlsEarlyData, serviceConfig->tlsEarlyDataWindow );
+			else if( serviceConfig->tlsEarlyData )
+				Log::log( "%s: TLS-EARLY-DATA needs BALANCE REQUEST, ignored", serviceConfig->listenStr.c_str() );
+			if( serviceConfig->balanceRequests && !serviceConfig->certPath.empty() )	// streams are balanced as requests
+				setHTTP2( serviceConfig->http2 );
+			else if( serviceConfig->http2 )
+				Log::log( "%s: HTTP2 needs BALANCE REQUEST and a CERTIFICATE, ignored", serviceConfig->listenStr.c_str() );
+			if( serviceConfig->http2Backends && !serviceConfig->balanceRequests )	// requests are what's multiplexed
+				Log::log( "%s: HTTP2-BACKENDS needs BALANCE REQUEST, ignored", serviceConfig->listenStr.c_str() );
 			this->sessionConfigs = serviceConfig->sessionConfigs;
 			this->sessionCookie = serviceConfig->sessionCookie;
+			addBackends( &pool, sessionConfigs, &serviceConfig->compress );
+			pools.push_back( &pool );
+			map< string, BackendPool * > named;
+			for( auto const& [ name, poolConfig ] : serviceConfig->pools )
+			{
+				BackendPool *pool = new BackendPool();
+				addBackends( pool, &poolConfig->sessionConfigs, &poolConfig->compress );
+				named[ name ] = pool;
+				pools.push_back( pool );
+			}
+			for( auto it = serviceConfig->setHeaders.begin(); it != serviceConfig->setHeaders.end(); it++ )
+				rewrite.set( it->first, it->second );
+			for( auto it = serviceConfig->removeHeaders.begin(); it != serviceConfig->removeHeaders.end(); it++ )
+				rewrite.remove( *it );
+			rewrite.forwardedFor = serviceConfig->forwardedFor;
+			rewrite.requestIdHeader = serviceConfig->requestIdHeader;
+			if( serviceConfig->cacheSize )
+				cache = new Cache( serviceConfig->cacheSize, serviceConfig->cacheMaxObjectSize );
+			for( auto it = serviceConfig->routes.begin(); it != serviceConfig->routes.end(); it++ )
+			{
+				RouteConfig *route = *it;
+				if( route->regex )
+					router.addRegex( route->host, route->path, named[ route->pool ] );
+				else
+					router.add( route->host, route->path, named[ route->pool ] );
+			}
 		}
 
 	private:
 
+		ServiceConfig *serviceConfig;
 		vector< SessionConfig * > *sessionConfigs;
 		string sessionCookie;
+		BackendPool pool;		// the listener's own backends, used when no route matches
+		vector< BackendPool * > pools;	// every pool, pool first
+		Router router;
+		Cache *cache = nullptr;
+		HeaderRewrite rewrite;
+
+		void addBackends( BackendPool *pool, vector< SessionConfig * > *sessionConfigs, CompressConfig *compress )
+		{
+			for( auto it = sessionConfigs->begin(); it != sessionConfigs->end(); it++ )
+			{
+				if( serviceConfig->tlsPassthrough && (*it)->useTLS )
+					Exception::raise( "%s: TLS-PASSTHROUGH backends must be TCP (%s)", serviceConfig->listenStr.c_str(), (*it)->destStr );
+				Backend *backend = new Backend( (*it)->destStr, (*it)->useTLS );
+				backend->rise = serviceConfig->healthCheckRise;
+				backend->fall = serviceConfig->healthCheckFall;
+				backend->connectTimeout = serviceConfig->connectTimeout;
+				backend->outlierConsecutiveFailures = serviceConfig->outlierConsecutiveFailures;
+				backend->outlierErrorRate = serviceConfig->outlierErrorRate;
+				backend->outlierMinRequests = serviceConfig->outlierMinRequests;
+				backend->outlierInterval = serviceConfig->outlierInterval;
+				backend->outlierEjectionTime = serviceConfig->outlierEjectionTime;
+				backend->outlierMaxEjectionTime = serviceConfig->outlierMaxEjectionTime;
+				backend->slowStart = serviceConfig->slowStart;
+				backend->slowStartExponential = serviceConfig->slowStartExponential;
+				backend->slowStartMinWeight = serviceConfig->slowStartMinWeight / 100.0;
+				backend->concurrencyMin = serviceConfig->concurrencyMin;
+				backend->concurrencyMax = serviceConfig->concurrencyMax;
+				backend->concurrencyTolerance = serviceConfig->concurrencyTolerance;
+				backend->setConcurrencyLimit( serviceConfig->concurrencyLimit );
+				backend->maxIdleConnections = serviceConfig->maxIdleConnections;
+				backend->http2 = serviceConfig->http2Backends && serviceConfig->balanceRequests && (*it)->useTLS;
+				pool->add( backend );
+			}
+			pool->queueSize = serviceConfig->queueSize;
+			pool->queueTimeout = serviceConfig->queueTimeout;
+			if( compress->encodings )
+			{
+				vector< string > types;
+				stringstream list( compress->types );
+				string type;
+				while( getline( list, type, ',' ) )
+				{
+					if( !type.empty() )
+						types.push_back( type );
+				}
+				pool->compression = new Compression( compress->encodings, compress->minSize, types );
+			}
+		}
 
 	friend class L7LBService;
 };
@@ -58,82 +162,259 @@ class L7LBService : public Service
 		L7LBService( L7LBServiceContext *context ) : Service( context )
 		{
 			this->context = context;
+
+			ServiceConfig *config = context->serviceConfig;
+			if( config->healthCheck.empty() )
+				return;
+			int type = HealthCheck::type( config->healthCheck.c_str() );
+			for( auto pool = context->pools.begin(); pool != context->pools.end(); pool++ )
+			{
+				for( auto it = (*pool)->backends.begin(); it != (*pool)->backends.end(); it++ )
+				{
+					HealthCheckContext *healthCheckContext = new HealthCheckContext(
+						*it,
+						type,
+						config->healthCheckPath.c_str(),
+						config->healthCheckStatus,
+						config->healthCheckInterval,
+						config->healthCheckTimeout
+					);
+					HealthCheck *healthCheck = new HealthCheck( healthCheckContext );
+					healthCheck->run();
+					healthCheck->detach();
+				}
+			}
 		}
 
 		ThreadMain main( void ) { return( (ThreadMain) _main ); }
 
+		void logStats( void )
+		{
+			Service::logStats();
+			for( auto it = context->pools.begin(); it != context->pools.end(); it++ )
+			{
+				BackendPool *pool = *it;
+				for( auto it = pool->backends.begin(); it != pool->backends.end(); it++ )
+				{
+					Backend *backend = *it;
+					const char *state = !backend->isAvailable() ? (backend->isEjected() ? "EJECTED" : "DOWN") : "UP";
+					Log::log( "  backend %s: %s sessions=%d limit=%d weight=%.2f idle=%zu",
+						backend->destStr, state, backend->sessionCount(), backend->concurrencyLimit(), backend->weight(),
+						backend->idleConnections() );
+				}
+				if( !pool->backends.empty() )
+					Log::log( "  queue: length=%zu rejected=%zu timed-out=%zu",
+						pool->queueLength(), pool->queueRejected.load(), pool->queueTimedOut.load() );
+				if( pool->compression )
+					Log::log( "  compression: responses=%zu in=%zu out=%zu",
+						pool->compression->responses.load(), pool->compression->bytesIn.load(), pool->compression->bytesOut.load() );
+			}
+			if( context->serviceConfig->tlsPassthrough )
+				Log::log( "  passthrough: sessions=%zu no-sni=%zu rejected=%zu",
+					PassthroughSessionContext::sessions.load(), PassthroughSessionContext::noServerName.load(),
+					PassthroughSessionContext::rejected.load() );
+			if( context->serviceConfig->http2 )
+				Log::log( "  h2: sessions=%zu streams=%zu refused=%zu",
+					HTTP2SessionContext::sessions.load(), HTTP2SessionContext::streams.load(),
+					HTTP2SessionContext::refused.load() );
+			if( context->serviceConfig->http2Backends )
+				Log::log( "  h2 backends: connections=%zu streams=%zu",
+					HTTP2Client::connections.load(), HTTP2Client::streams.load() );
+			if( context->serviceConfig->responseBuffer )
+				Log::log( "  response buffer: buffered=%zu spilled=%zu",
+					ResponseBuffer::buffered.load(), ResponseBuffer::spilled.load() );
+			Cache *cache = context->cache;
+			if( cache )
+				Log::log( "  cache: hits=%zu misses=%zu coalesced=%zu insertions=%zu evictions=%zu rejected=%zu entries=%zu bytes=%zu/%zu",
+					cache->hits.load(), cache->misses.load(), cache->coalesced.load(), cache->insertions.load(), cache->evictions.load(),
+					cache->rejections.load(), cache->entries(), cache->bytes(), cache->size );
+		}
+
 	private:
 
 		L7LBServiceContext *context;
 
 		map< string, string > stickySessionDestStr;
 		map< string, int > stickySessionLastUsed;
+		int stickySessionSwept = 0;
+		mutex stickySessionMutex;
 
-		Session *getSession( int clientSocket, SSL *clientSSL )
+#		define SESSION_COOKIE_TIMEOUT    1800
+#		define SESSION_COOKIE_SWEEP      60	// seconds between sweeps for timed-out cookies
+
+		static int seconds( void )
 		{
-			const char *httpHeaderStart = "HTTP/1.1 200 OK\r\n";
-			const char *httpCookieDelimiter = ":";
-			const char *httpCookieEnd = "\r\n";
-			const char *httpHeaderEnd = "\r\n";
+			struct timeval tv;
+			(void) gettimeofday( &tv, NULL );
+			return( tv.tv_sec );
+		}
 
-			if( !context->sessionCookie.empty() )
+		// backend a session cookie value was last seen from, unless it's been
+		// idle past SESSION_COOKIE_TIMEOUT
+
+		Backend *stickyBackend( string_view value )
+		{
+			if( value.empty() )
+				return( nullptr );
+			Backend *backend = nullptr;
+			int now = seconds();
+			stickySessionMutex.lock();
+			auto it = stickySessionDestStr.find( string( value ) );
+			if( it != stickySessionDestStr.end() && now - stickySessionLastUsed[ it->first ] > SESSION_COOKIE_TIMEOUT )
 			{
+				stickySessionLastUsed.erase( it->first );
+				stickySessionDestStr.erase( it );
+			}
+			else if( it != stickySessionDestStr.end() )
+			{
+				stickySessionLastUsed[ it->first ] = now;
+				for( auto pool = context->pools.begin(); !backend && pool != context->pools.end(); pool++ )
+					backend = (*pool)->find( it->second.c_str() );
+			}
+			stickySessionMutex.unlock();
 # if TRACE
-				Log::console( "sessionCookie=%s", context->sessionCookie.c_str() );
-# endif // TRACE
- 				char buf[ 1024 ];
- 				bzero( buf, sizeof( buf ) );
- 				int peeked = context->service->peek( clientSocket, clientSSL, buf, sizeof( buf ) );
-				if( peeked == sizeof( buf ) )
-					Exception::raise( "L7LBService::getSession: HTTP header length exceeds static buffer length (%d)", sizeof( buf ) );
-				if( peeked == 0 ) 
-					return( nullptr );
-
-				char lineBuf[ 1024 ];
-				char *line = buf + 17;
-				char *newline;
-				map< string, string * > httpCookies;
-
-				while( (newline = strstr( line, httpCookieEnd )) )
-				{
-					if( strncmp( line, httpHeaderEnd, strlen( httpHeaderEnd ) ) == 0 )
-						break;
-					bzero( lineBuf, sizeof( lineBuf ) );
-					memcpy( lineBuf, line, newline - line );
-					char *c1;
-					for( c1 = lineBuf; *c1 && isspace( *c1 ); c1++ );
-					char *c2;
-					for( c2 = c1; strncmp( c2, httpCookieDelimiter, strlen( httpCookieDelimiter ) ) != 0 && strstr( c2, httpCookieEnd ) != c2; c2++ );
-					if( strncmp( c2, httpCookieDelimiter, strlen( httpCookieDelimiter ) ) == 0 )
-					{
-						*c2++ = '\0';
-						string name(c1);
-						while( isspace( *c2 ) )
-							++c2;
-						string value( c2 );
-						httpCookies[ name ] = &value;
-					}
-						line = newline + 2;
-				}
-# if TRACE
-				// Log::console( "httpCookies.size()=%d", httpCookies.size() );
-				// for( auto const& [name, value] : httpCookies )
-				// 	Log::console( "%s: %s", name.c_str(), value.c_str() );
-# endif // TRACE
-# if TRACE
-				string *sessionCookieValue = httpCookies[ context->sessionCookie ];
-				if( sessionCookieValue )
-					Log::console( "%s NOT FOUND", context->sessionCookie.c_str() );
+			Log::console( "%s=%.*s -> %s", context->sessionCookie.c_str(), (int) value.size(), value.data(),
+				backend ? backend->destStr : "(none)" );
 # endif // TRACE
+			return( backend );
+		}
+
+		// pool for a request by Host and path, the listener's own when no route matches
+
+		BackendPool *route( HTTPParser *request )
+		{
+			if( context->router.empty() )
+				return( &context->pool );
+			string_view host = request->header( "Host" );
+			string_view path = request->path;
+			if( path.compare( 0, 7, "http://" ) == 0 || path.compare( 0, 8, "https://" ) == 0 )
+			{
+				// absolute-form target overrides Host
+				size_t start = path.find( "//" ) + 2;
+				size_t end = path.find( '/', start );
+				host = path.substr( start, end == string_view::npos ? string_view::npos : end - start );
+				path = end == string_view::npos ? string_view( "/" ) : path.substr( end );
+			}
+			BackendPool *pool = context->router.route( host, path );
+			return( pool ? pool : &context->pool );
+		}
+
+		Backend *sessionSelectBackend( HTTPParser *request )
+		{
+			BackendPool *pool = route( request );
+			Backend *preferred = nullptr;
+			if( !context->sessionCookie.empty() )
+				preferred = stickyBackend( request->cookie( context->sessionCookie ) );
+			Backend *backend = pool->select( preferred );
+			if( !backend && pool->queueSize )
+				backend = pool->acquire();
+			return( backend );
+		}
+
+		// backend for a passthrough session: ROUTE host/ matches the server name
+
+		Backend *sessionSelectBackend( ClientHello *hello )
+		{
+			BackendPool *pool = nullptr;
+			if( !context->router.empty() && !hello->serverName.empty() )
+				pool = context->router.route( hello->serverName, "/" );
+			if( !pool )
+				pool = &context->pool;
+			Backend *backend = pool->select();
+			if( !backend && pool->queueSize )
+				backend = pool->acquire();
+			return( backend );
+		}
+
+		Session *getSession( int clientSocket, SSL *clientSSL )
+		{
+			if( context->serviceConfig->tlsPassthrough )
+			{
+				// the session peeks the ClientHello and routes on it in its own thread
+				PassthroughSessionContext *context = new PassthroughSessionContext(
+					this,
+					clientSocket,
+					this->context->serviceConfig->handshakeTimeout
+				);
+				return( new PassthroughSession( context ) );
+			}
+
+			const unsigned char *protocol = nullptr;
+			unsigned int protocolLen = 0;
+			if( clientSSL && context->serviceConfig->balanceRequests )
+				SSL_get0_alpn_selected( clientSSL, &protocol, &protocolLen );
+			if( protocolLen == 2 && memcmp( protocol, "h2", 2 ) == 0 )
+			{
+				// each stream's request is balanced in a thread of its own
+				HTTP2SessionContext *context = new HTTP2SessionContext(
+					this,
+					clientSocket,
+					clientSSL,
+					this->context->sessionCookie,
+					this->context->serviceConfig->maxHeaderSize,
+					this->context->serviceConfig->keepAliveTimeout,
+					this->context->serviceConfig->responseTimeout,
+					this->context->serviceConfig->bodyTimeout,
+					&this->context->rewrite,
+					(uint32_t) this->context->serviceConfig->http2MaxStreams
+				);
+				return( new HTTP2Session( context ) );
+			}
+
+			if( context->serviceConfig->balanceRequests )
+			{
+				// requests are balanced individually, in the session's thread
+				HTTPProxySessionContext *context = new HTTPProxySessionContext(
+					this,
+					clientSocket,
+					clientSSL,
+					this->context->sessionCookie,
+					this->context->serviceConfig->maxHeaderSize,
+					this->context->serviceConfig->keepAliveTimeout,
+					this->context->serviceConfig->responseTimeout,
+					this->context->cache,
+					&this->context->rewrite,
+					this->context->serviceConfig->responseBuffer,
+					this->context->serviceConfig->responseBufferFile
+				);
+				context->setLimits(
+					this->context->serviceConfig->headerTimeout,
+					this->context->serviceConfig->bodyTimeout,
+					this->context->serviceConfig->bodyMinRate,
+					this->context->serviceConfig->requestBuffer
+				);
+				return( new HTTPProxySession( context ) );
 			}
 
-			L7LBServiceContext *myServiceContext = (L7LBServiceContext *) context;
-			vector<SessionConfig *> sessionConfigs = *myServiceContext->sessionConfigs;
-			int sessionIndex = 0;
-			// ### TO DO: RESPECT COOKIE-SESSION PERSISTENCE OR DO ROUND-ROBIN ###
-			SessionConfig sessionConfig = *sessionConfigs[ sessionIndex ];
-			const char *destStr = sessionConfig.destStr;
-			bool useTLS = sessionConfig.useTLS;
+			if( !context->sessionCookie.empty() || !this->context->router.empty() )
+			{
+				// the session reads the first request header and routes on it
+				// in its own thread, so a slow client can't hold up accept()
+				ProxySessionContext *context = new ProxySessionContext(
+					this,
+					clientSocket,
+					clientSSL,
+					nullptr,
+					false,
+					this->context->sessionCookie,
+					nullptr,
+					nullptr,
+					this->context->serviceConfig->maxHeaderSize
+				);
+				context->routeOnHeader( this->context->serviceConfig->headerTimeout );
+				return( new ProxySession( context ) );
+			}
+
+			BackendPool *pool = &this->context->pool;
+			Backend *backend = pool->select();
+			if( !backend && pool->queueLength() >= pool->queueSize )
+			{
+				Log::log( "L7LBService::getSession: no backend available" );
+				return( nullptr );
+			}
+			// without a backend the session queues for one in its own thread
+			const char *destStr = backend ? backend->destStr : nullptr;
+			bool useTLS = backend ? backend->useTLS : false;
 			ProxySessionContext *context = new ProxySessionContext(
 				this,
 				clientSocket,
@@ -141,27 +422,41 @@ class L7LBService : public Service
 				destStr,
 				useTLS,
 				this->context->sessionCookie,
-				httpHeaderStart,
-				httpCookieDelimiter,
-				httpCookieEnd,
-				httpHeaderEnd
+				backend,
+				pool,
+				this->context->serviceConfig->maxHeaderSize
 			);
 			return( new ProxySession( context ) );
 		}
 
-#		define SESSION_COOKIE_TIMEOUT    1800
-
-		// ### TO-DO: PERIODICALLY REMOVE TIMED-OUT STICKY SESSION MAP ELEMENTS ###
+		// a backend set a session cookie: remember it, and now and then drop
+		// the cookies that have timed out so the maps don't grow without bound
 
 		void sessionNotifyProtocolAttribute( string *value, void *data )
 		{
 			const char *destStr = (const char *) data;
+# if TRACE
 			Log::console( "notifyProxyProtocolAttribute( \"%s\" ) destStr=%s", value->c_str(), destStr );
-			struct timeval tv;
-			(void) gettimeofday( &tv, NULL );
-			int now = tv.tv_sec;
+# endif // TRACE
+			int now = seconds();
+			stickySessionMutex.lock();
 			stickySessionDestStr[ *value ] = string( destStr );
 			stickySessionLastUsed[ *value ] = now;
+			if( now - stickySessionSwept >= SESSION_COOKIE_SWEEP )
+			{
+				stickySessionSwept = now;
+				for( auto it = stickySessionLastUsed.begin(); it != stickySessionLastUsed.end(); )
+				{
+					if( now - it->second <= SESSION_COOKIE_TIMEOUT )
+					{
+						it++;
+						continue;
+					}
+					stickySessionDestStr.erase( it->first );
+					it = stickySessionLastUsed.erase( it );
+				}
+			}
+			stickySessionMutex.unlock();
 		}
 };
 
@@ -184,7 +479,15 @@ int main( int argc, char **argv )
 		::exit( -1 );
 	}
 
-	Event done;
+	// SIGUSR1 logs stats and SIGHUP reloads certificates; blocked here so
+	// every thread inherits the mask and only the sigwait() below sees them
+	sigset_t signals;
+	sigemptyset( &signals );
+	sigaddset( &signals, SIGUSR1 );
+	sigaddset( &signals, SIGHUP );
+	pthread_sigmask( SIG_BLOCK, &signals, NULL );
+
+	vector< L7LBService * > services;
 
 	for( auto it = L7LBConfig::config->serviceConfigs.begin(); it != L7LBConfig::config->serviceConfigs.end(); it++ )
 	{
@@ -201,6 +504,7 @@ int main( int argc, char **argv )
 			L7LBService *service = new L7LBService( context );
 			service->run();
 			service->detach();
+			services.push_back( service );
 		}
 		catch( const char *error )
 		{
@@ -208,6 +512,21 @@ int main( int argc, char **argv )
 			exit( -1 );
 		}
 	}	
-	done.wait();
+	for( ;; )
+	{
+		int signal;
+		if( sigwait( &signals, &signal ) != 0 )
+			continue;
+		if( signal == SIGUSR1 )
+		{
+			for( auto it = services.begin(); it != services.end(); it++ )
+				(*it)->logStats();
+		}
+		else if( signal == SIGHUP )
+		{
+			for( auto it = services.begin(); it != services.end(); it++ )
+				(void) (*it)->reloadCertificates();
+		}
+	}
 }
 
@@ -23,6 +23,52 @@ class SessionConfig
 	bool useTLS;
 
     friend class L7LBService;
+    friend class L7LBServiceContext;
+};
+
+// ROUTE host/path-prefix pool or ROUTE host~regex pool
+
+class RouteConfig
+{
+    public:
+
+	RouteConfig( const string& match, const string& pool )
+	{
+		size_t at = match.find_first_of( "/~" );
+		this->host = match.substr( 0, at );
+		this->path = at == string::npos ? "/" : match.substr( at );
+		this->regex = at != string::npos && match[ at ] == '~';
+		if( this->regex )
+			this->path = this->path.substr( 1 );
+		this->pool = pool;
+	}
+
+	string host;
+	string path;
+	bool regex;
+	string pool;
+};
+
+// COMPRESS gzip[,zstd] with COMPRESS-MIN-SIZE and COMPRESS-TYPES (Content-Type
+// prefixes), for a listener's own backends or a POOL
+
+class CompressConfig
+{
+    public:
+
+	int encodings = 0;
+	size_t minSize = 1024;
+	string types = "text/,application/json,application/javascript,application/xml,image/svg+xml";
+};
+
+// POOL name { TCP|TLS host:port ... }
+
+class PoolConfig
+{
+    public:
+
+	vector< SessionConfig * > sessionConfigs;
+	CompressConfig compress;
 };
 
 class ServiceConfig
@@ -59,8 +105,66 @@ class ServiceConfig
 	string certPath;
 	string keyPath;
 	string trustPath;
+	vector< pair< string, string > > certificates;	// further CERTIFICATE, KEY pairs
 	string sessionCookie;
 	vector< SessionConfig * > *sessionConfigs;	
+	map< string, PoolConfig * > pools;	// named POOL blocks
+	vector< RouteConfig * > routes;
+	CompressConfig compress;
+	vector< pair< string, string > > setHeaders;	// SET-HEADER name:value
+	vector< string > removeHeaders;
+	bool forwardedFor = false;
+	string requestIdHeader;
+	string healthCheck = "";
+	string healthCheckPath = "/";
+	int healthCheckStatus = 200;
+	int healthCheckInterval = 2000;
+	int healthCheckTimeout = 1000;
+	int healthCheckRise = 2;
+	int healthCheckFall = 3;
+	int connectTimeout = 0;
+	int outlierConsecutiveFailures = 5;
+	int outlierErrorRate = 0;
+	int outlierMinRequests = 20;
+	int outlierInterval = 10000;
+	int outlierEjectionTime = 30000;
+	int outlierMaxEjectionTime = 300000;
+	int slowStart = 0;
+	bool slowStartExponential = false;
+	int slowStartMinWeight = 10;
+	int concurrencyLimit = 0;
+	int concurrencyMin = 1;
+	int concurrencyMax = 1000;
+	int concurrencyTolerance = 200;
+	int queueSize = 0;
+	int queueTimeout = 1000;
+	size_t maxHeaderSize = 65536;
+	bool balanceRequests = false;
+	int keepAliveTimeout = 60000;
+	int responseTimeout = 60000;
+	int headerTimeout = 30000;			// ms from a request header's first byte to its last
+	int bodyTimeout = 60000;			// ms a request body may stall
+	size_t bodyMinRate = 0;				// bytes/s a request body must average
+	size_t requestBuffer = 0;			// request bodies read whole before balancing, up to this
+	size_t responseBuffer = 0;			// bytes held in memory per response, 0 relays in lockstep
+	size_t responseBufferFile = 1024 * 1024 * 1024;	// and in a temp file beyond that
+	int maxIdleConnections = 16;
+	size_t cacheSize = 0;
+	size_t cacheMaxObjectSize = 0;
+	size_t tlsSessionCache = 20480;			// OpenSSL's default
+	int tlsSessionTimeout = 300;
+	int tlsTicketRotation = 3600;
+	size_t tlsRecordSize = 1400;
+	size_t tlsRecordRamp = 65536;
+	int tlsRecordIdle = 1000;
+	size_t tlsEarlyData = 0;
+	int tlsEarlyDataWindow = 10;
+	int handshakeThreads = 0;
+	int handshakeTimeout = 10000;
+	bool tlsPassthrough = false;			// relay TLS undecrypted, routed by SNI
+	bool http2 = false;				// offer ALPN "h2" to TLS clients
+	int http2MaxStreams = 100;			// concurrent streams per HTTP/2 client
+	bool http2Backends = false;			// offer ALPN "h2" to TLS backends
 };
 
 class L7LBConfig
@@ -129,10 +233,16 @@ class L7LBConfig
 	{
 		string *protocol = nullptr;
 		string *listenStr = nullptr;
-		string *keyPath = nullptr;
-		string *certPath = nullptr;
+		vector< string * > keyPaths;
+		vector< string * > certPaths;
 		string *trustPath = nullptr;
 		string *sessionCookie = nullptr;
+		map< string, string * > parameters;
+		map< string, PoolConfig * > pools;
+		vector< RouteConfig * > routes;
+		CompressConfig compress;
+		vector< pair< string, string > > setHeaders;
+		vector< string > removeHeaders;
 		if( (protocol = nextToken()) == nullptr )
 			return nullptr;
 		if( *protocol == "#" )
@@ -155,19 +265,67 @@ class L7LBConfig
 			cout << "protocol=" << *protocol << " name=" << *name << " value=" << *value << endl;
 # endif // TRACE
 			if( *name == "CERTIFICATE" )
-				certPath = value;
+				certPaths.push_back( value );
 			else if( *name == "KEY" )
-				keyPath = value;
+				keyPaths.push_back( value );
 			else if( *name == "TRUST" )
 				trustPath = value;
 			else if( *name == "SESSION-COOKIE" )
 				sessionCookie = value;
+			else if( name->compare( 0, 12, "HEALTH-CHECK" ) == 0
+				|| name->compare( 0, 8, "OUTLIER-" ) == 0
+				|| name->compare( 0, 10, "SLOW-START" ) == 0
+				|| name->compare( 0, 11, "CONCURRENCY" ) == 0
+				|| name->compare( 0, 6, "QUEUE-" ) == 0
+				|| name->compare( 0, 6, "CACHE-" ) == 0
+				|| name->compare( 0, 4, "TLS-" ) == 0
+				|| name->compare( 0, 10, "HANDSHAKE-" ) == 0
+				|| name->compare( 0, 5, "HTTP2" ) == 0
+				|| *name == "CONNECT-TIMEOUT"
+				|| *name == "MAX-HEADER-SIZE"
+				|| *name == "BALANCE"
+				|| *name == "KEEPALIVE-TIMEOUT"
+				|| *name == "RESPONSE-TIMEOUT"
+				|| *name == "RESPONSE-BUFFER"
+				|| *name == "HEADER-TIMEOUT"
+				|| *name == "BODY-TIMEOUT"
+				|| *name == "BODY-MIN-RATE"
+				|| *name == "REQUEST-BUFFER"
+				|| *name == "RESPONSE-BUFFER-FILE"
+				|| *name == "MAX-IDLE-CONNECTIONS"
+				|| *name == "FORWARDED-FOR"
+				|| *name == "REQUEST-ID" )
+				parameters[ *name ] = value;
 			else if( *name == "TCP" || *name == "TLS" )
 			{
 				const char *destStr = value->c_str();
 				bool useTLS = strcmp( name->c_str(), "TLS" ) == 0 ? true : false;
 				sessionConfigs->push_back( new SessionConfig( destStr, useTLS ) );
 			}
+			else if( name->compare( 0, 8, "COMPRESS" ) == 0 )
+				compressParameter( &compress, *name, value );
+			else if( *name == "SET-HEADER" )
+			{
+				size_t colon = value->find( ':' );
+				if( colon == string::npos || colon == 0 )
+					Exception::raise( "SET-HEADER: expected name:value (%s)", value->c_str() );
+				setHeaders.push_back( make_pair( value->substr( 0, colon ), value->substr( colon + 1 ) ) );
+			}
+			else if( *name == "REMOVE-HEADER" )
+				removeHeaders.push_back( *value );
+			else if( *name == "POOL" )
+			{
+				if( pools.count( *value ) )
+					Exception::raise( "POOL %s: defined twice", value->c_str() );
+				pools[ *value ] = parsePoolConfig( *value );
+			}
+			else if( *name == "ROUTE" )
+			{
+				string *pool;
+				if( (pool = nextToken()) == nullptr )
+					Exception::raise( "ROUTE %s: expected pool name", value->c_str() );
+				routes.push_back( new RouteConfig( *value, *pool ) );
+			}
 			else
 			{
 				Exception::raise( "unknown parameter: %s", name->c_str() );
@@ -177,14 +335,252 @@ class L7LBConfig
 		cout << "PROTOCOL=" << *protocol << endl;
 		cout << "LISTEN=" << *listenStr << endl;
 # endif // TRACE
-		return new ServiceConfig(
+		// CERTIFICATE and KEY pair up in order; the first pair is the default
+		if( certPaths.size() != keyPaths.size() )
+			Exception::raise( "%s: %zu CERTIFICATE but %zu KEY", listenStr->c_str(), certPaths.size(), keyPaths.size() );
+		ServiceConfig *serviceConfig = new ServiceConfig(
 			*listenStr,
-			keyPath == nullptr ? "" : *keyPath,
-			certPath == nullptr ? "" : *certPath,
+			certPaths.empty() ? "" : *certPaths[ 0 ],
+			keyPaths.empty() ? "" : *keyPaths[ 0 ],
 			trustPath == nullptr ? "" : *trustPath,
 			sessionCookie == nullptr ? "" : *sessionCookie,
 			sessionConfigs
 		);
+		for( auto it = routes.begin(); it != routes.end(); it++ )
+		{
+			if( !pools.count( (*it)->pool ) )
+				Exception::raise( "ROUTE %s%s: unknown pool %s", (*it)->host.c_str(), (*it)->path.c_str(), (*it)->pool.c_str() );
+		}
+		for( size_t i = 1; i < certPaths.size(); i++ )
+			serviceConfig->certificates.push_back( make_pair( *certPaths[ i ], *keyPaths[ i ] ) );
+		serviceConfig->pools = pools;
+		serviceConfig->routes = routes;
+		serviceConfig->compress = compress;
+		serviceConfig->setHeaders = setHeaders;
+		serviceConfig->removeHeaders = removeHeaders;
+		for( auto const& [ name, value ] : parameters )
+		{
+			if( name == "HEALTH-CHECK" )
+				serviceConfig->healthCheck = *value;
+			else if( name == "HEALTH-CHECK-PATH" )
+				serviceConfig->healthCheckPath = *value;
+			else if( name == "HEALTH-CHECK-STATUS" )
+				serviceConfig->healthCheckStatus = intValue( name, value );
+			else if( name == "HEALTH-CHECK-INTERVAL" )
+				serviceConfig->healthCheckInterval = intValue( name, value );
+			else if( name == "HEALTH-CHECK-TIMEOUT" )
+				serviceConfig->healthCheckTimeout = intValue( name, value );
+			else if( name == "HEALTH-CHECK-RISE" )
+				serviceConfig->healthCheckRise = intValue( name, value );
+			else if( name == "HEALTH-CHECK-FALL" )
+				serviceConfig->healthCheckFall = intValue( name, value );
+			else if( name == "CONNECT-TIMEOUT" )
+				serviceConfig->connectTimeout = intValue( name, value );
+			else if( name == "OUTLIER-CONSECUTIVE-FAILURES" )
+				serviceConfig->outlierConsecutiveFailures = intValue( name, value );
+			else if( name == "OUTLIER-ERROR-RATE" )
+				serviceConfig->outlierErrorRate = intValue( name, value );
+			else if( name == "OUTLIER-MIN-REQUESTS" )
+				serviceConfig->outlierMinRequests = intValue( name, value );
+			else if( name == "OUTLIER-INTERVAL" )
+				serviceConfig->outlierInterval = intValue( name, value );
+			else if( name == "OUTLIER-EJECTION-TIME" )
+				serviceConfig->outlierEjectionTime = intValue( name, value );
+			else if( name == "OUTLIER-MAX-EJECTION-TIME" )
+				serviceConfig->outlierMaxEjectionTime = intValue( name, value );
+			else if( name == "SLOW-START" )
+				serviceConfig->slowStart = intValue( name, value );
+			else if( name == "SLOW-START-MODE" )
+			{
+				if( *value != "LINEAR" && *value != "EXPONENTIAL" )
+					Exception::raise( "SLOW-START-MODE: expected LINEAR or EXPONENTIAL (%s)", value->c_str() );
+				serviceConfig->slowStartExponential = *value == "EXPONENTIAL";
+			}
+			else if( name == "MAX-HEADER-SIZE" )
+				serviceConfig->maxHeaderSize = intValue( name, value );
+			else if( name == "BALANCE" )
+			{
+				if( *value != "CONNECTION" && *value != "REQUEST" )
+					Exception::raise( "BALANCE: expected CONNECTION or REQUEST (%s)", value->c_str() );
+				serviceConfig->balanceRequests = *value == "REQUEST";
+			}
+			else if( name == "KEEPALIVE-TIMEOUT" )
+				serviceConfig->keepAliveTimeout = intValue( name, value );
+			else if( name == "RESPONSE-TIMEOUT" )
+				serviceConfig->responseTimeout = intValue( name, value );
+			else if( name == "MAX-IDLE-CONNECTIONS" )
+				serviceConfig->maxIdleConnections = intValue( name, value );
+			else if( name == "FORWARDED-FOR" )
+			{
+				if( *value != "ON" && *value != "OFF" )
+					Exception::raise( "FORWARDED-FOR: expected ON or OFF (%s)", value->c_str() );
+				serviceConfig->forwardedFor = *value == "ON";
+			}
+			else if( name == "REQUEST-ID" )
+				serviceConfig->requestIdHeader = *value;
+			else if( name == "HEADER-TIMEOUT" )
+				serviceConfig->headerTimeout = intValue( name, value );
+			else if( name == "BODY-TIMEOUT" )
+				serviceConfig->bodyTimeout = intValue( name, value );
+			else if( name == "BODY-MIN-RATE" )
+				serviceConfig->bodyMinRate = sizeValue( name, value );
+			else if( name == "REQUEST-BUFFER" )
+				serviceConfig->requestBuffer = sizeValue( name, value );
+			else if( name == "RESPONSE-BUFFER" )
+				serviceConfig->responseBuffer = sizeValue( name, value );
+			else if( name == "RESPONSE-BUFFER-FILE" )
+				serviceConfig->responseBufferFile = sizeValue( name, value );
+			else if( name == "TLS-SESSION-CACHE" )
+				serviceConfig->tlsSessionCache = sizeValue( name, value );
+			else if( name == "TLS-SESSION-TIMEOUT" )
+				serviceConfig->tlsSessionTimeout = intValue( name, value );
+			else if( name == "TLS-TICKET-ROTATION" )
+				serviceConfig->tlsTicketRotation = intValue( name, value );
+			else if( name == "TLS-RECORD-SIZE" )
+				serviceConfig->tlsRecordSize = sizeValue( name, value );
+			else if( name == "TLS-RECORD-RAMP" )
+				serviceConfig->tlsRecordRamp = sizeValue( name, value );
+			else if( name == "TLS-RECORD-IDLE" )
+				serviceConfig->tlsRecordIdle = intValue( name, value );
+			else if( name == "TLS-EARLY-DATA" )
+				serviceConfig->tlsEarlyData = sizeValue( name, value );
+			else if( name == "TLS-EARLY-DATA-WINDOW" )
+				serviceConfig->tlsEarlyDataWindow = intValue( name, value );
+			else if( name == "TLS-PASSTHROUGH" )
+			{
+				if( *value != "ON" && *value != "OFF" )
+					Exception::raise( "TLS-PASSTHROUGH: expected ON or OFF (%s)", value->c_str() );
+				serviceConfig->tlsPassthrough = *value == "ON";
+			}
+			else if( name == "HTTP2" )
+			{
+				if( *value != "ON" && *value != "OFF" )
+					Exception::raise( "HTTP2: expected ON or OFF (%s)", value->c_str() );
+				serviceConfig->http2 = *value == "ON";
+			}
+			else if( name == "HTTP2-BACKENDS" )
+			{
+				if( *value != "ON" && *value != "OFF" )
+					Exception::raise( "HTTP2-BACKENDS: expected ON or OFF (%s)", value->c_str() );
+				serviceConfig->http2Backends = *value == "ON";
+			}
+			else if( name == "HTTP2-MAX-STREAMS" )
+			{
+				serviceConfig->http2MaxStreams = intValue( name, value );
+				if( serviceConfig->http2MaxStreams < 1 )
+					Exception::raise( "HTTP2-MAX-STREAMS: expected at least 1 (%s)", value->c_str() );
+			}
+			else if( name == "HANDSHAKE-THREADS" )
+				serviceConfig->handshakeThreads = intValue( name, value );
+			else if( name == "HANDSHAKE-TIMEOUT" )
+				serviceConfig->handshakeTimeout = intValue( name, value );
+			else if( name == "CACHE-SIZE" )
+				serviceConfig->cacheSize = sizeValue( name, value );
+			else if( name == "CACHE-MAX-OBJECT-SIZE" )
+				serviceConfig->cacheMaxObjectSize = sizeValue( name, value );
+			else if( name == "CONCURRENCY-LIMIT" )
+				serviceConfig->concurrencyLimit = intValue( name, value );
+			else if( name == "CONCURRENCY-LIMIT-MIN" )
+				serviceConfig->concurrencyMin = max( 1, intValue( name, value ) );
+			else if( name == "CONCURRENCY-LIMIT-MAX" )
+				serviceConfig->concurrencyMax = intValue( name, value );
+			else if( name == "CONCURRENCY-LATENCY-TOLERANCE" )
+				serviceConfig->concurrencyTolerance = intValue( name, value );
+			else if( name == "QUEUE-SIZE" )
+				serviceConfig->queueSize = intValue( name, value );
+			else if( name == "QUEUE-TIMEOUT" )
+				serviceConfig->queueTimeout = intValue( name, value );
+			else if( name == "SLOW-START-MIN-WEIGHT" )
+			{
+				serviceConfig->slowStartMinWeight = intValue( name, value );
+				if( serviceConfig->slowStartMinWeight < 1 || serviceConfig->slowStartMinWeight > 100 )
+					Exception::raise( "SLOW-START-MIN-WEIGHT: expected percentage 1-100 (%s)", value->c_str() );
+			}
+			else
+				Exception::raise( "unknown parameter: %s", name.c_str() );
+		}
+		if( serviceConfig->tlsPassthrough )
+		{
+			// nothing is decrypted: there's only the ClientHello to go on
+			if( !certPaths.empty() )
+				Exception::raise( "%s: TLS-PASSTHROUGH listeners take no CERTIFICATE", listenStr->c_str() );
+			if( serviceConfig->balanceRequests )
+				Exception::raise( "%s: TLS-PASSTHROUGH needs BALANCE CONNECTION", listenStr->c_str() );
+			for( auto it = routes.begin(); it != routes.end(); it++ )
+			{
+				if( (*it)->regex || (*it)->path != "/" )
+					Exception::raise( "ROUTE %s%s: TLS-PASSTHROUGH routes by server name only", (*it)->host.c_str(), (*it)->path.c_str() );
+			}
+		}
+		return( serviceConfig );
+	}
+
+	// POOL name { TCP|TLS host:port ... COMPRESS ... }
+
+	PoolConfig *parsePoolConfig( const string& poolName )
+	{
+		string *s;
+		if( (s = nextToken()) == nullptr || *s != "{" )
+			Exception::raise( "POOL %s: expected {", poolName.c_str() );
+		PoolConfig *poolConfig = new PoolConfig();
+		string *name;
+		while( (name = nextToken()) != nullptr && *name != "}" )
+		{
+			string *value;
+			if( (value = nextToken()) == nullptr )
+				Exception::raise( "POOL %s: expected value", poolName.c_str() );
+			if( *name == "TCP" || *name == "TLS" )
+				poolConfig->sessionConfigs.push_back( new SessionConfig( value->c_str(), *name == "TLS" ) );
+			else if( name->compare( 0, 8, "COMPRESS" ) == 0 )
+				compressParameter( &poolConfig->compress, *name, value );
+			else
+				Exception::raise( "POOL %s: unknown parameter: %s", poolName.c_str(), name->c_str() );
+		}
+		if( name == nullptr )
+			Exception::raise( "POOL %s: expected }", poolName.c_str() );
+		return( poolConfig );
+	}
+
+	void compressParameter( CompressConfig *compress, const string& name, string *value )
+	{
+		if( name == "COMPRESS" )
+		{
+			if( (compress->encodings = Compression::parseEncodings( *value )) < 0 )
+				Exception::raise( "COMPRESS: expected gzip or zstd, comma-separated (%s)", value->c_str() );
+		}
+		else if( name == "COMPRESS-MIN-SIZE" )
+			compress->minSize = sizeValue( name, value );
+		else if( name == "COMPRESS-TYPES" )
+			compress->types = *value;
+		else
+			Exception::raise( "unknown parameter: %s", name.c_str() );
+	}
+
+	int intValue( const string& name, string *value )
+	{
+		char *end;
+		long n = strtol( value->c_str(), &end, 10 );
+		if( value->empty() || *end || n < 0 )
+			Exception::raise( "%s: expected non-negative integer (%s)", name.c_str(), value->c_str() );
+		return( (int) n );
+	}
+
+	// bytes, with an optional K, M or G suffix
+
+	size_t sizeValue( const string& name, string *value )
+	{
+		char *end;
+		long long n = strtoll( value->c_str(), &end, 10 );
+		size_t scale = 1;
+		if( *end == 'K' || *end == 'k' )
+			scale = 1024, ++end;
+		else if( *end == 'M' || *end == 'm' )
+			scale = 1024 * 1024, ++end;
+		else if( *end == 'G' || *end == 'g' )
+			scale = 1024 * 1024 * 1024, ++end;
+		if( value->empty() || *end || n < 0 )
+			Exception::raise( "%s: expected size in bytes, K, M or G (%s)", name.c_str(), value->c_str() );
+		return( (size_t) n * scale );
 	}
 
 	vector<ServiceConfig *> serviceConfigs;	
@@ -0,0 +1,252 @@
+//
+//  PassthroughSession.cc
+//  Layer7LoadBalancer
+//  Created by Rick Tyler
+//
+//  SPDX-License-Identifier: MIT
+
+# include "PassthroughSession.h"
+# include "Exception.h"
+# include "Log.h"
+# include <errno.h>
+# include <fcntl.h>
+# include <string.h>
+# include <unistd.h>
+# include <poll.h>
+# include <sys/socket.h>
+# include <vector>
+
+// # define TRACE    1
+
+# define PASSTHROUGH_CHUNK    65536	// bytes per splice(), a default pipe's capacity
+# define HELLO_PEEK_MAX       (CLIENT_HELLO_MAX + 1024)	// a ClientHello's records, headers and all
+# define HELLO_TIMEOUT_DEFAULT    10000	// ms allowed for the ClientHello when HANDSHAKE-TIMEOUT is 0
+
+atomic< size_t > PassthroughSessionContext::sessions( 0 );
+atomic< size_t > PassthroughSessionContext::noServerName( 0 );
+atomic< size_t > PassthroughSessionContext::rejected( 0 );
+
+PassthroughSessionContext :: PassthroughSessionContext( Service *service, int clientSocket, int helloTimeout )
+: SessionContext( service, clientSocket )
+{
+# if TRACE
+	Log::console( "PassthroughSessionContext::PassthroughSessionContext()" );
+# endif // TRACE
+	this->helloTimeout = helloTimeout;
+	++sessions;
+}
+
+PassthroughSessionContext :: ~PassthroughSessionContext()
+{
+# if TRACE
+	Log::console( "PassthroughSessionContext::~PassthroughSessionContext()" );
+# endif // TRACE
+	if( proxy )
+		delete( proxy );
+	if( backend )
+		backend->sessionEnded();
+}
+
+// wait for the whole ClientHello without consuming it; the backend
+// must see the handshake byte for byte. SO_RCVLOWAT past what's been peeked
+// keeps poll() asleep until more of it arrives (or the client closes)
+
+bool
+PassthroughSessionContext :: peekHello( void )
+{
+	vector< unsigned char > buf( HELLO_PEEK_MAX );
+	int timeout = helloTimeout ? helloTimeout : HELLO_TIMEOUT_DEFAULT;
+	int64_t deadline = Thread::milliseconds() + timeout;
+	ssize_t peeked = 0;
+	bool complete = false;
+	while( !complete )
+	{
+		int lowat = (int) peeked + 1;
+		(void) setsockopt( clientSocket, SOL_SOCKET, SO_RCVLOWAT, &lowat, sizeof( lowat ) );
+		struct pollfd pfd = { clientSocket, POLLIN, 0 };
+		int64_t remaining = deadline - Thread::milliseconds();
+		int ready = remaining > 0 ? poll( &pfd, 1, (int) remaining ) : 0;
+		if( ready < 0 && errno == EINTR )
+			continue;
+		if( ready == 0 )
+		{
+			Log::log( "PassthroughSession[ %p ]: ClientHello timed out (HANDSHAKE-TIMEOUT %d ms)", this, timeout );
+			break;
+		}
+		ssize_t len = ready < 0 ? -1 : recv( clientSocket, buf.data(), buf.size(), MSG_PEEK | MSG_DONTWAIT );
+		if( len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) )
+			continue;
+		if( len <= 0 )
+			break;
+		if( len == peeked )
+			continue;
+		peeked = len;
+		int result = hello.parse( buf.data(), (size_t) len );
+		if( result == CLIENT_HELLO_ERROR )
+		{
+			Log::log( "PassthroughSession[ %p ]: bad ClientHello (%s)", this, hello.error );
+			break;
+		}
+		if( (complete = result == CLIENT_HELLO_COMPLETE) )
+			break;
+		if( (size_t) len == buf.size() )
+		{
+			Log::log( "PassthroughSession[ %p ]: ClientHello too long", this );
+			break;
+		}
+	}
+	int lowat = 1;
+	(void) setsockopt( clientSocket, SOL_SOCKET, SO_RCVLOWAT, &lowat, sizeof( lowat ) );
+	return( complete );
+}
+
+// move what's readable on from to to: bytes moved, 0 at end of stream,
+// -1 on an error
+
+ssize_t
+PassthroughSessionContext :: relay( int from, int to, int pipe[ 2 ] )
+{
+# ifdef __linux__
+	ssize_t len = splice( from, nullptr, pipe[ 1 ], nullptr, PASSTHROUGH_CHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+	if( len < 0 && (errno == EAGAIN || errno == EINTR) )
+		return( 1 );
+	for( ssize_t left = len; left > 0; )
+	{
+		ssize_t sent = splice( pipe[ 0 ], nullptr, to, nullptr, (size_t) left, SPLICE_F_MOVE );
+		if( sent <= 0 )
+			return( -1 );
+		left -= sent;
+	}
+# else
+	(void) pipe;
+	char buf[ PASSTHROUGH_CHUNK ];
+	ssize_t len = recv( from, buf, sizeof( buf ), 0 );
+	if( len < 0 && (errno == EAGAIN || errno == EINTR) )
+		return( 1 );
+	for( ssize_t total = 0; total < len; )
+	{
+		ssize_t sent = send( to, buf + total, (size_t) (len - total), 0 );
+		if( sent <= 0 )
+			return( -1 );
+		total += sent;
+	}
+# endif // __linux__
+	return( len );
+}
+
+PassthroughSession :: PassthroughSession( PassthroughSessionContext *context ) : Session( context )
+{
+# if TRACE
+	Log::console( "PassthroughSession::PassthroughSession()" );
+# endif // TRACE
+}
+
+PassthroughSession :: ~PassthroughSession()
+{
+# if TRACE
+	Log::console( "PassthroughSession::~PassthroughSession()" );
+# endif // TRACE
+}
+
+void
+PassthroughSession :: _main( PassthroughSessionContext *context )
+{
+# if TRACE
+	Log::console( "PassthroughSession::_main[ %p ] RUN", context );
+# endif // TRACE
+
+	if( !context->peekHello() )
+	{
+		++PassthroughSessionContext::rejected;
+		delete( context );
+		return;
+	}
+	ClientHello *hello = &context->hello;
+# if TRACE
+	Log::console( "PassthroughSession[ %p ]: SNI=%s ALPN=%s", context, hello->serverName.c_str(),
+		hello->protocols.empty() ? "" : hello->protocols[ 0 ].c_str() );
+# endif // TRACE
+	if( hello->serverName.empty() )
+		++PassthroughSessionContext::noServerName;
+	if( !(context->backend = context->service->sessionSelectBackend( hello )) )
+	{
+		Log::log( "PassthroughSession[ %p ]: no backend available for \"%s\"", context, hello->serverName.c_str() );
+		++PassthroughSessionContext::rejected;
+		delete( context );
+		return;
+	}
+
+	try {
+		context->proxy = new Connection( context->backend->destStr, false, context->backend->connectTimeout );
+	}
+	catch( const char *error )
+	{
+		Log::log( "PassthroughSession[ %p ]::_main: Connection() failed (%s)", context, error );
+		context->backend->reportFailure( "connect failed" );
+		delete( context );
+		return;
+	}
+	context->backend->reportSuccess();
+
+	int toBackend[ 2 ] = { -1, -1 };
+	int toClient[ 2 ] = { -1, -1 };
+# ifdef __linux__
+	if( pipe2( toBackend, O_CLOEXEC ) != 0 || pipe2( toClient, O_CLOEXEC ) != 0 )
+	{
+		Log::log( "PassthroughSession[ %p ]::_main: pipe() failed [%d] (%s)", context, errno, strerror( errno ) );
+		for( int fd : { toBackend[ 0 ], toBackend[ 1 ] } )
+		{
+			if( fd >= 0 )
+				(void) close( fd );
+		}
+		delete( context );
+		return;
+	}
+# endif // __linux__
+
+	// each direction runs until its sender closes, which is passed on as a
+	// half close; an error on either ends both
+	int clientSocket = context->clientSocket;
+	int backendSocket = context->proxy->socket;
+	bool clientOpen = true;
+	bool backendOpen = true;
+	while( clientOpen || backendOpen )
+	{
+		struct pollfd fds[ 2 ] = { { clientOpen ? clientSocket : -1, POLLIN, 0 }, { backendOpen ? backendSocket : -1, POLLIN, 0 } };
+		if( poll( fds, 2, -1 ) < 0 )
+		{
+			if( errno == EINTR )
+				continue;
+			break;
+		}
+		if( fds[ 0 ].revents )
+		{
+			ssize_t len = context->relay( clientSocket, backendSocket, toBackend );
+			if( len < 0 )
+				break;
+			if( len == 0 )
+			{
+				clientOpen = false;
+				(void) shutdown( backendSocket, SHUT_WR );
+			}
+		}
+		if( fds[ 1 ].revents )
+		{
+			ssize_t len = context->relay( backendSocket, clientSocket, toClient );
+			if( len < 0 )
+				break;
+			if( len == 0 )
+			{
+				backendOpen = false;
+				(void) shutdown( clientSocket, SHUT_WR );
+			}
+		}
+	}
+
+	for( int fd : { toBackend[ 0 ], toBackend[ 1 ], toClient[ 0 ], toClient[ 1 ] } )
+	{
+		if( fd >= 0 )
+			(void) close( fd );
+	}
+	delete( context );
+}
@@ -0,0 +1,61 @@
+//
+//  PassthroughSession.h
+//  Layer7LoadBalancer
+//  Created by Rick Tyler
+//
+//  SPDX-License-Identifier: MIT
+
+# ifndef _PassthroughSession_h_
+# define _PassthroughSession_h_
+
+# include "Thread.h"
+# include "Service.h"
+# include "Session.h"
+# include "Connection.h"
+# include "Backend.h"
+# include "ClientHello.h"
+# include <atomic>
+
+// A TLS session relayed without terminating it: the ClientHello is peeked,
+// not read, a backend chosen by its server name, and the ciphertext moved
+// between the sockets with splice() (on Linux), never entering user space.
+
+class PassthroughSessionContext : public SessionContext
+{
+  public:
+
+	PassthroughSessionContext( Service *service, int clientSocket, int helloTimeout );
+	~PassthroughSessionContext();
+	static atomic< size_t > sessions;
+	static atomic< size_t > noServerName;	// routed to the listener's own backends
+	static atomic< size_t > rejected;	// not TLS, timed out or no backend
+
+  private:
+
+	int helloTimeout;		// ms allowed for the ClientHello, 0 for the default
+	ClientHello hello;
+	Connection *proxy = nullptr;
+	Backend *backend = nullptr;
+	bool peekHello( void );
+	ssize_t relay( int from, int to, int pipe[ 2 ] );
+
+  friend class PassthroughSession;
+};
+
+class PassthroughSession : public Session
+{
+	public:
+
+		PassthroughSession( PassthroughSessionContext *context );
+		~PassthroughSession();
+
+	private:
+
+		static void _main( PassthroughSessionContext *context );
+		ThreadMain main( void ) { return( (ThreadMain) _main ); }
+		PassthroughSessionContext *context;
+
+	friend class Service;
+};
+
+# endif // _PassthroughSession_h_
@@ -11,6 +11,7 @@
 # include <map>
 # include <string.h>
 # include <unistd.h>
+# include <poll.h>
 
 // # define TRACE    1
 
@@ -22,12 +23,11 @@ ProxySessionContext :: ProxySessionContext
 	const char *destStr,
 	bool useTLS,
 	string protocolAttribute,
-	const char *protocolHeaderStart,
-	const char *protocolAttributeDelimeter,
-	const char *protocolAttributeEnd,
-	const char *protocolHeaderEnd
+	Backend *backend,
+	BackendPool *pool,
+	size_t maxHeaderSize
 )
-: SessionContext( service, clientSocket, clientSSL )
+: SessionContext( service, clientSocket, clientSSL ), requests( false, maxHeaderSize ), responses( true, maxHeaderSize )
 {
 
 # if TRACE
@@ -39,10 +39,10 @@ ProxySessionContext :: ProxySessionContext
 	this->destStr = destStr;
 	this->useTLS = useTLS;
 	this->protocolAttribute = protocolAttribute;
-	this->protocolHeaderStart = protocolHeaderStart;
-	this->protocolAttributeDelimiter = protocolAttributeDelimeter;
-	this->protocolAttributeEnd  = protocolAttributeEnd;
-	this->protocolHeaderEnd = protocolHeaderEnd;
+	this->responses.requests = &this->requests;
+	this->backend = backend;
+	this->pool = pool;
+	this->maxHeaderSize = maxHeaderSize;
 	this->bufLen = service->bufLen;
 	this->buf = (char *) malloc( service->bufLen );
 }
@@ -56,6 +56,68 @@ ProxySessionContext :: ~ProxySessionContext()
 		free( buf );
 	if( proxy ) 
 		delete( proxy );
+	if( backend )
+		backend->sessionEnded();
+}
+
+// read the first request header in the session's own thread, so a slow
+// client holds up nothing else, then select a backend for it
+
+void
+ProxySessionContext :: routeOnHeader( int headerTimeout )
+{
+	this->route = true;
+	this->headerTimeout = headerTimeout;
+}
+
+bool
+ProxySessionContext :: selectBackend( void )
+{
+	HTTPParser request;
+	int64_t deadline = headerTimeout ? Thread::milliseconds() + headerTimeout : 0;
+	int result;
+	while( (result = request.parse( buf, bufPending )) == HTTP_INCOMPLETE )
+	{
+		if( bufPending == bufLen )
+		{
+			if( bufLen >= maxHeaderSize )
+			{
+				Log::log( "ProxySession[ %p ]: HTTP header exceeds MAX-HEADER-SIZE (%zu)", this, maxHeaderSize );
+				return( false );
+			}
+			bufLen = min( bufLen * 2, maxHeaderSize );
+			buf = (char *) realloc( buf, bufLen );
+		}
+		if( !(clientSSL && SSL_pending( clientSSL ) > 0) )
+		{
+			struct pollfd fds = { clientSocket, POLLIN, 0 };
+			int timeout = deadline ? (int) max( (int64_t) 0, deadline - Thread::milliseconds() ) : -1;
+			if( poll( &fds, 1, timeout ) <= 0 )
+			{
+				if( deadline )
+					Log::log( "ProxySession[ %p ]: request header timed out (HEADER-TIMEOUT %d ms)", this, headerTimeout );
+				return( false );
+			}
+		}
+		ssize_t len = clientSSL ? SSL_read( clientSSL, buf + bufPending, (int) (bufLen - bufPending) )
+			: recv( clientSocket, buf + bufPending, bufLen - bufPending, 0 );
+		if( len <= 0 )
+			return( false );
+		bufPending += len;
+	}
+	if( result == HTTP_ERROR )
+	{
+		Log::log( "ProxySession[ %p ]: bad request (%s)", this, request.error );
+		return( false );
+	}
+	if( !(backend = service->sessionSelectBackend( &request )) )
+	{
+		Log::log( "ProxySession[ %p ]: no backend available", this );
+		return( false );
+	}
+	destStr = backend->destStr;
+	useTLS = backend->useTLS;
+	return( true );
 }
 
 bool
@@ -78,6 +140,77 @@ ProxySessionContext :: clientDataReady( void )
 	return( recv( clientSocket, &buf, 1, MSG_PEEK ) > 0 );
 }
 
+// HEAD requests change how their responses are framed
+
+void
+ProxySessionContext :: scanRequests( const char *data, size_t len )
+{
+	if( !backend && protocolAttribute.empty() )
+		return;
+	size_t offset = 0;
+	while( offset < len && !requests.isPassthrough() )
+	{
+		HTTPParser *request = nullptr;
+		offset += requests.scan( data + offset, len - offset, &request );
+	}
+}
+
+// inspect each response header once, wherever the reads split it
+
+void
+ProxySessionContext :: scanResponses( const char *data, size_t len )
+{
+	if( !backend && protocolAttribute.empty() )
+		return;
+	size_t offset = 0;
+	while( offset < len && !responses.isPassthrough() )
+	{
+		HTTPParser *response = nullptr;
+		offset += responses.scan( data + offset, len - offset, &response );
+		if( !response || response->status < 200 )
+			continue;
+		if( backend )
+		{
+			// passive outlier detection counts 5xx responses as failures
+			if( response->status >= 500 )
+				backend->reportFailure( "5xx response" );
+			else
+				backend->reportSuccess();
+		}
+		if( !protocolAttribute.empty() )
+		{
+			// Set-Cookie, or a header named after the cookie
+			string_view value = response->setCookie( protocolAttribute );
+			if( value.empty() )
+				value = response->header( protocolAttribute );
+			if( !value.empty() )
+			{
+				string cookie( value );
+# if TRACE
+				Log::console( "PROTOCOL ATTRIBUTE [%s: %s]", protocolAttribute.c_str(), cookie.c_str() );
+# endif // TRACE
+				service->sessionNotifyProtocolAttribute( &cookie, (void *) destStr );
+			}
+		}
+	}
+}
+
+// a read filled the buffer: double it, for this session and those to come
+
+void
+ProxySessionContext :: growBuffer( void )
+{
+	service->bufLenMutex.lock();
+	service->bufLen *= 2;
+	bufLen = service->bufLen;
+	service->bufLenMutex.unlock();
+	free( buf );
+	buf = (char *) malloc( bufLen );
+# if TRACE
+	Log::console( "ProxySession[ %p ]: BUFLEN=%zu", this, bufLen );
+# endif // TRACE
+}
+
 ProxySession :: ProxySession( ProxySessionContext *context ) : Session( context )
 {
 # if TRACE
@@ -99,19 +232,86 @@ ProxySession :: _main( ProxySessionContext *context )
 	Log::console( "ProxySession::_main[ %p ] RUN", context );
 # endif // TRACE
 
+	if( context->route && !context->selectBackend() )
+	{
+		delete( context );
+		return;
+	}
+	if( !context->backend && context->pool )
+	{
+		// every backend was at its concurrency limit: wait our turn
+		if( !(context->backend = context->pool->acquire()) )
+		{
+			Log::log( "ProxySession[ %p ]::_main: no backend available (queue full or timed out)", context );
+			delete( context );
+			return;
+		}
+		context->destStr = context->backend->destStr;
+		context->useTLS = context->backend->useTLS;
+	}
+
 	try {
-		context->proxy = new Connection( context->destStr, context->useTLS );
+		int timeout = context->backend ? context->backend->connectTimeout : 0;
+		context->proxy = new Connection( context->destStr, context->useTLS, timeout );
 	}
 	catch( const char *error )
 	{
 		Log::log( "ProxySession[ %p ]::_main: Connection() failed (%s)", context, error );
+		if( context->backend )
+			context->backend->reportFailure( "connect failed" );
 		delete( context );
 		return;
 	}
+	// a connect isn't a request: responses are the success samples
 
-	ssize_t pending = 0;
 	int loops = 0; 
 
+	if( context->bufPending )
+	{
+		// forward what was read from the client before the session started
+		size_t total = 0;
+		while( total < context->bufPending )
+		{
+			ssize_t sent = context->proxy->write( context->buf + total, context->bufPending - total );
+			if( sent <= 0 )
+			{
+				Log::log( "ProxySession[ %p ]::_main: context->proxy->write() failed [%d]", context, errno );
+				delete( context );
+				return;
+			}
+			total += sent;
+		}
+		context->scanRequests( context->buf, context->bufPending );
+		context->bufPending = 0;
+		if( context->backend )
+			context->requestStart = Thread::milliseconds();
+		loops = 1;	// client data was already consumed; don't wait for more
+	}
+
+	// one relay loop per client and backend transport pair
+	if( context->clientSSL )
+	{
+		if( context->useTLS )
+			relay< TLSTransport, TLSTransport >( context, loops );
+		else
+			relay< TLSTransport, PlainTransport >( context, loops );
+	}
+	else
+	{
+		if( context->useTLS )
+			relay< PlainTransport, TLSTransport >( context, loops );
+		else
+			relay< PlainTransport, PlainTransport >( context, loops );
+	}
+}
+
+template< class Client, class Server > void
+ProxySession :: relay( ProxySessionContext *context, int loops )
+{
+	Client client( context->clientSocket, context->clientSSL );
+	Server server( context->proxy->socket, context->proxy->ssl );
+	ssize_t pending = 0;
+
 	for( ;; )
 	{
 		fd_set fdset;
@@ -124,23 +324,24 @@ ProxySession :: _main( ProxySessionContext *context )
 
 		FD_ZERO( &fdset );
 		FD_ZERO( &empty_fdset );
-		FD_SET( context->clientSocket, &fdset );
-		FD_SET( context->proxy->socket, &fdset );
+		FD_SET( client.socket, &fdset );
+		FD_SET( server.socket, &fdset );
 
 		try
 		{
 			if( pending )
 				Exception::raise( "pending != 0" );
 # if TRACE
-//			Log::console( "ProxySession[ %p ]::_main: select( %d, %d )...",
-//				context, context->clientSocket, context->proxy->socket );
+//			Log::console( "ProxySession[ %p ]::relay: select( %d, %d )...",
+//				context, client.socket, server.socket );
 # endif // TRACE
 			if( (selected = select( FD_SETSIZE, &fdset, &empty_fdset, &empty_fdset, &timeout )) < 0 )
 			{
 # if TRACE
-				Log::console( "ProxySession[ %p ]::_main: select() failed (%s) [%d]", context, strerror( errno ), errno );
+				Log::console( "ProxySession[ %p ]::relay: select() failed (%s) [%d]", context, strerror( errno ), errno );
 # endif // TRACE
-				SSL_shutdown( context->clientSSL );
+				if( Client::secure )
+					SSL_shutdown( context->clientSSL );
 				context->clientSSL = nullptr;
 				delete( context );
 				return;
@@ -148,22 +349,18 @@ ProxySession :: _main( ProxySessionContext *context )
 
 			if( selected == 0 )
 			{
-# if TRACE
-//				Log::console( "SELECT() RETURNED selected=%d errno=%d (%s)", selected, errno, strerror( errno ) );
-# endif // TRACE
 				if( loops > 0 )
 				{
 # if TRACE
 					if( loops % 20 == 0 )
-						Log::console( "ProxySession[ %p ]::_main: *IDLE*", context );
+						Log::console( "ProxySession[ %p ]::relay: *IDLE*", context );
 # endif // TRACE
 					++loops;
 					continue;
 				}
 				else if( !context->clientDataReady() )
 				{
-					if( context->clientSSL )
-						context->clientSSL = nullptr;
+					context->clientSSL = nullptr;
 					delete( context );
 					return;
 				}
@@ -171,16 +368,10 @@ ProxySession :: _main( ProxySessionContext *context )
 
 			size_t loopReads = 0;
 
-			if( loops == 0 || FD_ISSET( context->clientSocket, &fdset ) || (context->clientSSL && SSL_pending( context->clientSSL )) )
+			if( loops == 0 || FD_ISSET( client.socket, &fdset ) || client.pending() )
 			{
 				// client has data ready
-				bzero( context->buf, context->bufLen );
-
-				ssize_t len;
-				if( context->clientSSL )
-					len = (int) SSL_read( context->clientSSL, context->buf, (int) context->bufLen );
-				else
-					len = (int) recv( context->clientSocket, context->buf, context->bufLen, 0 );
+				ssize_t len = client.read( context->buf, context->bufLen );
 
 				if( len > 0 )
 				{
@@ -189,192 +380,95 @@ ProxySession :: _main( ProxySessionContext *context )
 					ssize_t sent, total = 0;
 					size_t recvLen = len;
 # if TRACE
-					context->buf[ len ] = '\0';
-					Log::console( "SENDING %d BYTES TO SERVER [\n%s]", len, context->buf );
+					Log::console( "SENDING %d BYTES TO SERVER [\n%.*s]", len, (int) len, context->buf );
 # endif // TRACE
-					while( len && (sent = context->proxy->write( ((char *) context->buf) + total, len )) <= len )
+					while( len && (sent = server.write( context->buf + total, len )) <= len )
 					{
 						if( sent < 0 )
 						{
 # if TRACE
-							if( context->clientSSL )
-							{
-								Log::console( "ProxySession[ %p ]::_main: context->proxy->write() failed [%d] (%s)",
-									context, errno, ERR_error_string( ERR_get_error(), NULL ) ); 
-							}
-							else
-							{
-								Log::console( "ProxySession[ %p ]::_main: context->proxy->write() failed [%d] (%s)",
-									context, errno, strerror( errno ) );
-							}
+							Log::console( "ProxySession[ %p ]::relay: server.write() failed [%d] (%s)",
+								context, errno, Server::secure ? ERR_error_string( ERR_get_error(), NULL ) : strerror( errno ) );
 # endif // TRACE
 							delete( context );
 							return;
 						}
 # if TRACE
 						if( sent < len )
-						{
-							Log::console( "ProxySession[ %p ]::_main( %p ) PARTIAL SEND TO SERVER (sent = %zu)",
-								context, sent );
-						}
+							Log::console( "ProxySession[ %p ]::relay: PARTIAL SEND TO SERVER (sent = %zu)", context, sent );
 # endif // TRACE
 						len -= sent;
 						total += sent;
 					}
 
+					context->scanRequests( context->buf, recvLen );
+					if( context->backend && !context->requestStart )
+						context->requestStart = Thread::milliseconds();
+
 					if( recvLen == context->bufLen )
-					{
-						context->service->bufLenMutex.lock();
-						context->service->bufLen *= 2;
-						context->bufLen = context->service->bufLen;
-						context->service->bufLenMutex.unlock();
-						free( context->buf );
-						context->buf = (char *) malloc( context->bufLen );
-# if TRACE
-						Log::console( "ProxySession[ %p ]::_main: BUFLEN=%d", context, context->service->bufLen ); 
-# endif // TRACE
-					}
+						context->growBuffer();
 				}
 				else if( errno != EAGAIN && len < 0 )
 				{
-					SSL_shutdown( context->clientSSL );
-					context->clientSSL = nullptr;
 # if TRACE
-					if( context->clientSSL )
-					{
-						Log::console( "ProxySession[ %p ]::_main: SSL_read() failed (%s)",
-							context, ERR_error_string( ERR_get_error(), NULL ) ); 
-					}
-					else
-					{
-						Log::console( "ProxySession[ %p ]::_main: recv() failed [%d] (%s)",
-							context, errno, strerror( errno ) ); 
-					}
+					Log::console( "ProxySession[ %p ]::relay: client.read() failed [%d] (%s)",
+						context, errno, Client::secure ? ERR_error_string( ERR_get_error(), NULL ) : strerror( errno ) );
 # endif // TRACE
+					if( Client::secure )
+						SSL_shutdown( context->clientSSL );
+					context->clientSSL = nullptr;
 					delete( context );
 					return;
 				}
 			}
 
-			if( FD_ISSET( context->proxy->socket, &fdset ) || context->proxy->pending() )
+			if( FD_ISSET( server.socket, &fdset ) || server.pending() )
 			{
 				// server has data ready
-				bzero( context->buf, context->bufLen );
-
-				// receive from server
-				if( (pending = context->proxy->read( context->buf, context->bufLen )) > 0 )
+				if( (pending = server.read( context->buf, context->bufLen )) > 0 )
 				{
 # if TRACE
-					Log::console( "ProxySession[ %p ]::_main: RECEIVED %d BYTES FROM SERVER", context, pending );
-//						Log::console( "ProxySession[ %p ]::_main: RECEIVED FROM SERVER [%s]", context, context->buf );
+					Log::console( "ProxySession[ %p ]::relay: RECEIVED %d BYTES FROM SERVER", context, pending );
 # endif // TRACE
 					++loopReads;
 					ssize_t sent;
 					ssize_t total = 0;
 					size_t recvLen = pending;
-					if( context->clientSSL )
-						sent = SSL_write( context->clientSSL, context->buf + total, (int) pending );
-					else
-						sent = send( context->clientSocket, context->buf + total, (int) pending, 0 );
-					while( pending && sent <= pending )
+					if( context->requestStart )
 					{
-						if( sent < 0 )
+						context->backend->reportLatency( Thread::milliseconds() - context->requestStart );
+						context->requestStart = 0;
+					}
+					while( pending > 0 )
+					{
+						// TLS clients get records sized for the response so far
+						size_t len = Client::secure ? context->records.next( pending ) : pending;
+						if( (sent = client.write( context->buf + total, len )) <= 0 )
 						{
 # if TRACE
-							Log::console( "ProxySession[ %p ]::_main: PENDING=%d SENT=%d", context, pending, sent );
-# endif // TRACE
-							if( context->clientSSL )
-							{
-# ifdef TRACE
-								Log::console( "ProxySession[ %p ]::_main SSL_write() failed [%d] (%s)",
-									context, errno, ERR_error_string( ERR_get_error(), NULL ) );
+							Log::console( "ProxySession[ %p ]::relay: client.write() failed [%d] (%s) PENDING=%d",
+								context, errno, Client::secure ? ERR_error_string( ERR_get_error(), NULL ) : strerror( errno ), pending );
 # endif // TRACE
-							}
-							else
-							{
-# ifdef TRACE
-								Log::console( "ProxySession[ %p ]::_main: send() failed [%d] (%s)",
-									context, errno, strerror( errno ) );
-# endif // TRACE
-							}
 							delete( context );
 							return;
 						}
-						if( pending == 0 )
-						{
-# ifdef TRACE
-							Log::console( "USLEEP( 1000 )" );
-# endif // TRACE
-							usleep( 10000 );
-						}
+						if( Client::secure )
+							context->records.sent( sent );
 						pending -= sent;
 						total += sent;
 					}
-# if TRACE
-//						Log::console( "ProxySession[ %p ]::_main: SENT TO CLIENT [\n%s]", context, context->buf );
-# endif // TRACE
-					if( strncmp( context->buf, context->protocolHeaderStart, strlen( context->protocolHeaderStart )  ) == 0 )
-					{
-						ProxySessionContext *proxySessionContext = (ProxySessionContext *) context;
-						char lineBuf[ 1024 ];
-						char *line = context->buf + strlen( context->protocolHeaderStart );
-						char *newline;
-						const char *attributeEnd = context->protocolAttributeEnd;
-						const char *attributeDelimeter = context->protocolAttributeDelimiter; 
-						while( (newline = strstr( line, attributeEnd )) )
-						{
-							if( strncmp( line, context->protocolHeaderEnd, strlen( context->protocolHeaderEnd ) ) == 0 )
-								break;
-							bzero( lineBuf, sizeof( lineBuf ) );
-							memcpy( lineBuf, line, newline - line );
-							char *c1;
-							for( c1 = lineBuf; *c1 && isspace( *c1 ); c1++ );
-							char *c2;
-							for( c2 = c1; strncmp( c2, attributeDelimeter, strlen( attributeDelimeter ) ) != 0 && strstr( c2, attributeEnd ) != c2; c2++ );
-							if( strncmp( c2, attributeDelimeter, strlen( attributeDelimeter ) ) == 0 )
-							{
-								*c2++ = '\0';
-								string name( c1 );
-								while( isspace( *c2 ) )
-									++c2;
-								if( context->protocolAttribute == name )
-								{
-# if TRACE
-									Log::console( "PROTOCOL ATTRIBUTE [%s: %s]", name.c_str(), c2 );
-# endif // TRACE
-									string value( c2 );
-									proxySessionContext->service->sessionNotifyProtocolAttribute( &value, (void *) context->destStr );
-									break;
-								}
-							}
-							line = newline + 2;
-						}
-					}
+					context->scanResponses( context->buf, recvLen );
 
 					if( recvLen == context->bufLen )
-					{
-						context->service->bufLenMutex.lock();
-						context->service->bufLen *= 2;
-						context->bufLen = context->service->bufLen;
-						context->service->bufLenMutex.unlock();
-						free( context->buf );
-						context->buf = (char *) malloc( context->bufLen );
-# if TRACE
-						Log::console( "ProxySession[ %p ]::_main: BUFLEN=%d", context, context->service->bufLen ); 
-# endif // TRACE
-					}
+						context->growBuffer();
 				}
 				else if( errno != EAGAIN && pending <= 0 )
 				{
+					if( context->backend && pending < 0 && (errno == ECONNRESET || errno == ETIMEDOUT) )
+						context->backend->reportFailure( errno == ECONNRESET ? "connection reset" : "timed out" );
 # if TRACE
-					Log::console( "ProxySession[ % ]::_main: END SESSION (pending <= 0)" );
-
-					if( context->clientSSL )
-						Log::console( "ProxySession[ %p ]::_main: SSL_read() failed [%d] (%s)",
-							context, errno, ERR_error_string( ERR_get_error(), NULL ) );
-					else
-						Log::console( "ProxySession[ %p ]._main: recv() failed [%d] (%s)",
-							context, errno, strerror( errno ) );
+					Log::console( "ProxySession[ %p ]::relay: END SESSION server.read() = %d [%d] (%s)",
+						context, pending, errno, Server::secure ? ERR_error_string( ERR_get_error(), NULL ) : strerror( errno ) );
 # endif // TRACE
 					delete( context );
 					return;
@@ -385,7 +479,7 @@ ProxySession :: _main( ProxySessionContext *context )
 			{
 				if( errno == 60 ) {
 # if TRACE
-					Log::console( "ProxySession[ %p ]._main: ERRNO == 60", context );
+					Log::console( "ProxySession[ %p ]::relay: ERRNO == 60", context );
 # endif // TRACE
 					delete( context );	
 					return;
@@ -400,9 +494,8 @@ ProxySession :: _main( ProxySessionContext *context )
 		}
 		catch( const char *error )
 		{
-			Log::console( "ProxySession[ %p ]::_main: : %s", error );
+			Log::console( "ProxySession[ %p ]::relay: : %s", context, error );
 			::exit( -1 );
 		}
 	}
 }
-
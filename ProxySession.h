@@ -12,6 +12,9 @@
 # include "Service.h"
 # include "Session.h"
 # include "Connection.h"
+# include "Backend.h"
+# include "HTTPStream.h"
+# include "Transport.h"
 
 class ProxySessionContext : public SessionContext
 {
@@ -25,12 +28,12 @@ class ProxySessionContext : public SessionContext
 		const char *destStr,
 		bool useTLS,
 		string protocolAttribute = "",
-		const char *protocolHeaderStart = "HTTP/1.1 200 OK\r\n",
-		const char *protocolAttributeDelimiter = ":",
-		const char *protocolAttributeEnd = "\r\n",
-		const char *protocolHeaderEnd = "\r\n"
+		Backend *backend = nullptr,
+		BackendPool *pool = nullptr,
+		size_t maxHeaderSize = 65536
 	);
 	~ProxySessionContext();
+	void routeOnHeader( int headerTimeout );
 
   private:
 
@@ -38,13 +41,22 @@ class ProxySessionContext : public SessionContext
 	bool useTLS; 
 	char *buf;
 	size_t bufLen;
-	string protocolAttribute;
-	const char *protocolHeaderStart;
-	const char *protocolAttributeDelimiter;
-	const char *protocolAttributeEnd;
-	const char *protocolHeaderEnd;
+	size_t bufPending = 0;		// client bytes already read, not yet forwarded
+	string protocolAttribute;	// session cookie name
+	HTTPStream requests;		// message boundaries in each direction, so
+	HTTPStream responses;		// each header is inspected once
 	Connection *proxy = nullptr;
+	Backend *backend;
+	BackendPool *pool;		// waited on when backend wasn't assigned up front
+	int64_t requestStart = 0;	// for latency samples (adaptive concurrency)
+	size_t maxHeaderSize;
+	bool route = false;		// backend is chosen on the first request header
+	int headerTimeout = 0;		// ms allowed for it, 0 for no limit
+	bool selectBackend( void );
 	bool clientDataReady( void ); 
+	void scanRequests( const char *data, size_t len );
+	void scanResponses( const char *data, size_t len );
+	void growBuffer( void );
 
   friend class ProxySession;
 };
@@ -59,6 +71,7 @@ class ProxySession : public Session
 	private:
 
 		static void _main( ProxySessionContext *context );
+		template< class Client, class Server > static void relay( ProxySessionContext *context, int loops );
 		ThreadMain main( void ) { return( (ThreadMain) _main ); }
 		ProxySessionContext *context;
 
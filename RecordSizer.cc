@@ -0,0 +1,35 @@
+//
+//  RecordSizer.cc
+//  Layer7LoadBalancer
+//  Created by Rick Tyler
+//
+//  SPDX-License-Identifier: MIT
+
+# include "RecordSizer.h"
+# include "Thread.h"
+
+void
+RecordSizer :: configure( size_t small, size_t ramp, int idle )
+{
+	this->small = small;
+	this->ramp = ramp;
+	this->idle = idle;
+}
+
+size_t
+RecordSizer :: next( size_t len )
+{
+	if( !small )
+		return( len );
+	int64_t now = Thread::milliseconds();
+	if( idle && last && now - last > idle )
+		total = 0;	// the congestion window may have shrunk too
+	last = now;
+	return( total < ramp ? (len < small ? len : small) : len );
+}
+
+void
+RecordSizer :: sent( size_t len )
+{
+	total += len;
+}
@@ -0,0 +1,38 @@
+//
+//  RecordSizer.h
+//  Layer7LoadBalancer
+//  Created by Rick Tyler
+//
+//  SPDX-License-Identifier: MIT
+
+# ifndef _RecordSizer_h_
+# define _RecordSizer_h_
+
+# include <stddef.h>
+# include <stdint.h>
+
+// Dynamic TLS record sizing for a client connection. The first ramp bytes
+// of a response (or after idle ms without writes) go out in records of
+// small bytes, each fitting one TCP segment, so the browser can decrypt
+// and act on them as they arrive; after that SSL_write gets whole buffers
+// and fills full 16K records, minimizing per-record overhead.
+
+class RecordSizer
+{
+    public:
+
+	void configure( size_t small, size_t ramp, int idle );
+	size_t next( size_t len );		// bytes of len for the next SSL_write
+	void sent( size_t len );
+	void restart( void ) { total = 0; }	// a response starts: small again
+
+    private:
+
+	size_t small = 0;	// 0 leaves sizing to OpenSSL
+	size_t ramp = 0;
+	int idle = 0;
+	size_t total = 0;	// sent since the last restart
+	int64_t last = 0;	// ms of the last write
+};
+
+# endif // _RecordSizer_h_
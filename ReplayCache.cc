@@ -0,0 +1,50 @@
+//
+//  ReplayCache.cc
+//  Layer7LoadBalancer
+//  Created by Rick Tyler
+//
+//  SPDX-License-Identifier: MIT
+
+# include "ReplayCache.h"
+
+// # define TRACE    1
+
+ReplayCache :: ReplayCache( int window ) : replays( 0 )
+{
+	this->window = window;
+}
+
+void
+ReplayCache :: install( SSL_CTX *ssl_ctx )
+{
+	SSL_CTX_set_allow_early_data_cb( ssl_ctx, allowEarlyData, this );
+}
+
+bool
+ReplayCache :: firstUse( const string& random )
+{
+	time_t now = time( nullptr );
+	lock_guard< mutex > lock( seenMutex );
+	while( !expiry.empty() && now - expiry.front().first >= window )
+	{
+		seen.erase( expiry.front().second );
+		expiry.pop_front();
+	}
+	if( !seen.insert( random ).second )
+	{
+		++replays;
+		return( false );
+	}
+	expiry.push_back( make_pair( now, random ) );
+	return( true );
+}
+
+// OpenSSL asks before accepting a resumption's early data: 1 to accept
+
+int
+ReplayCache :: allowEarlyData( SSL *ssl, void *arg )
+{
+	unsigned char random[ SSL3_RANDOM_SIZE ];
+	size_t len = SSL_get_client_random( ssl, random, sizeof( random ) );
+	return( ((ReplayCache *) arg)->firstUse( string( (const char *) random, len ) ) ? 1 : 0 );
+}
@@ -0,0 +1,46 @@
+//
+//  ReplayCache.h
+//  Layer7LoadBalancer
+//  Created by Rick Tyler
+//
+//  SPDX-License-Identifier: MIT
+
+# ifndef _ReplayCache_h_
+# define _ReplayCache_h_
+
+# include <atomic>
+# include <deque>
+# include <mutex>
+# include <string>
+# include <unordered_set>
+# include <utility>
+# include <time.h>
+# include <openssl/ssl.h>
+
+using namespace std;
+
+// TLS 1.3 0-RTT anti-replay (RFC 8446 8.2): the ClientHello random of each
+// handshake offering early data is remembered for window seconds, and a
+// repeat loses its early data (the handshake goes ahead a round trip
+// slower). OpenSSL refuses early data whose ticket age is off by more than
+// its own allowance (10s), which bounds how late a replay can come.
+
+class ReplayCache
+{
+    public:
+
+	ReplayCache( int window );
+	void install( SSL_CTX *ssl_ctx );
+	bool firstUse( const string& random );
+	atomic< size_t > replays;
+
+    private:
+
+	int window;
+	mutex seenMutex;
+	unordered_set< string > seen;
+	deque< pair< time_t, string > > expiry;	// oldest first
+	static int allowEarlyData( SSL *ssl, void *arg );
+};
+
+# endif // _ReplayCache_h_
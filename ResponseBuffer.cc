@@ -0,0 +1,117 @@
+//
+//  ResponseBuffer.cc
+//  Layer7LoadBalancer
+//  Created by Rick Tyler
+//
+//  SPDX-License-Identifier: MIT
+
+# include "ResponseBuffer.h"
+# include "Thread.h"
+# include "Log.h"
+# include <errno.h>
+# include <fcntl.h>
+# include <stdlib.h>
+# include <string.h>
+# include <unistd.h>
+# include <sys/mman.h>
+
+// # define TRACE    1
+
+# define SPILL_MIN_MAP       (1024 * 1024)	// temp file mapping grows from this, doubling
+# define MEMORY_KEEP         65536		// capacity kept between responses
+
+atomic< size_t > ResponseBuffer::buffered( 0 );
+atomic< size_t > ResponseBuffer::spilled( 0 );
+
+ResponseBuffer :: ResponseBuffer( size_t memoryLimit, size_t fileLimit )
+{
+	this->memoryLimit = memoryLimit;
+	this->fileLimit = fileLimit;
+}
+
+ResponseBuffer :: ~ResponseBuffer()
+{
+	clear();
+}
+
+bool
+ResponseBuffer :: append( const char *data, size_t len )
+{
+	if( fd < 0 && memory.size() + len <= memoryLimit )
+	{
+		memory.append( data, len );
+		return( true );
+	}
+	if( fileUsed + len > mapLen && !spill( fileUsed + len ) )
+		return( false );
+	memcpy( map + fileUsed, data, len );
+	fileUsed += len;
+	return( true );
+}
+
+// make room in the temp file for needed bytes, creating it on first use
+
+bool
+ResponseBuffer :: spill( size_t needed )
+{
+	if( needed > fileLimit )
+		return( false );
+	if( fd < 0 )
+	{
+		const char *dir = getenv( "TMPDIR" );
+		string path = string( dir && *dir ? dir : "/tmp" ) + "/l7lb.XXXXXX";
+		if( (fd = mkstemp( &path[ 0 ] )) < 0 )
+		{
+			Log::log( "ResponseBuffer: mkstemp( %s ) failed [%d] (%s)", path.c_str(), errno, strerror( errno ) );
+			return( false );
+		}
+		(void) unlink( path.c_str() );	// gone once closed
+		++spilled;
+	}
+	size_t len = max( mapLen, (size_t) SPILL_MIN_MAP );
+	while( len < needed )
+		len *= 2;
+	len = min( len, fileLimit );
+# ifdef __linux__
+	// allocate the blocks now: a full disk is an error here, not a SIGBUS later
+	int error = posix_fallocate( fd, 0, (off_t) len );
+# else
+	int error = ftruncate( fd, (off_t) len ) == 0 ? 0 : errno;
+# endif // __linux__
+	if( error )
+	{
+		Log::log( "ResponseBuffer: can't grow temp file to %zu [%d] (%s)", len, error, strerror( error ) );
+		return( false );
+	}
+	// the file keeps what's been written, so the old mapping can just go
+	char *grown = (char *) mmap( nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+	if( grown == MAP_FAILED )
+	{
+		Log::log( "ResponseBuffer: mmap( %zu ) failed [%d] (%s)", len, errno, strerror( errno ) );
+		return( false );
+	}
+	if( map )
+		(void) munmap( map, mapLen );
+	map = grown;
+	mapLen = len;
+	return( true );
+}
+
+// empty, ready for the next response; the temp file goes too
+
+void
+ResponseBuffer :: clear( void )
+{
+	if( memory.capacity() > MEMORY_KEEP )
+		string().swap( memory );
+	else
+		memory.clear();
+	if( map )
+		(void) munmap( map, mapLen );
+	if( fd >= 0 )
+		(void) close( fd );
+	map = nullptr;
+	mapLen = 0;
+	fileUsed = 0;
+	fd = -1;
+}
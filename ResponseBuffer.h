@@ -0,0 +1,48 @@
+//
+//  ResponseBuffer.h
+//  Layer7LoadBalancer
+//  Created by Rick Tyler
+//
+//  SPDX-License-Identifier: MIT
+
+# ifndef _ResponseBuffer_h_
+# define _ResponseBuffer_h_
+
+# include <atomic>
+# include <string>
+# include <string_view>
+# include <stddef.h>
+
+using namespace std;
+
+// A whole backend response, held so the backend connection can be released
+// before a slow client has read it. Bytes go to memory up to memoryLimit,
+// then to an unlinked temp file (mmap'd) up to fileLimit more.
+
+class ResponseBuffer
+{
+    public:
+
+	ResponseBuffer( size_t memoryLimit, size_t fileLimit );
+	~ResponseBuffer();
+	bool append( const char *data, size_t len );	// false if it won't fit
+	string_view memoryPart( void ) { return( string_view( memory ) ); }
+	string_view filePart( void ) { return( string_view( map, fileUsed ) ); }
+	size_t size( void ) { return( memory.size() + fileUsed ); }
+	void clear( void );
+	static atomic< size_t > buffered;	// responses held whole
+	static atomic< size_t > spilled;	// of which some went to a file
+
+    private:
+
+	size_t memoryLimit;
+	size_t fileLimit;
+	string memory;
+	int fd = -1;
+	char *map = nullptr;
+	size_t mapLen = 0;
+	size_t fileUsed = 0;
+	bool spill( size_t needed );
+};
+
+# endif // _ResponseBuffer_h_
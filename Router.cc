@@ -0,0 +1,218 @@
+//
+//  Router.cc
+//  Layer7LoadBalancer
+//  Created by Rick Tyler
+//
+//  SPDX-License-Identifier: MIT
+
+# include "Router.h"
+# include "Exception.h"
+# include <ctype.h>
+# include <stdint.h>
+# include <strings.h>
+
+// # define TRACE    1
+
+# define MAX_HOST_LEN    255
+
+// FNV-1a over the lowercased name
+
+static inline uint32_t
+hostHash( const char *name, size_t len )
+{
+	uint32_t hash = 2166136261u;
+	for( size_t i = 0; i < len; i++ )
+		hash = (hash ^ (uint8_t) tolower( name[ i ] )) * 16777619u;
+	return( hash );
+}
+
+RadixNode :: ~RadixNode()
+{
+	for( auto it = children.begin(); it != children.end(); it++ )
+		delete( *it );
+}
+
+Router :: ~Router()
+{
+	for( auto it = hosts.begin(); it != hosts.end(); it++ )
+		delete( *it );
+	for( auto it = wildcards.begin(); it != wildcards.end(); it++ )
+		delete( *it );
+	if( anyHost )
+		delete( anyHost );
+}
+
+// the rules for a host pattern, created on first use
+
+HostRoutes *
+Router :: routes( const string& pattern )
+{
+	string host;
+	for( auto c : pattern )
+		host += tolower( c );
+	if( host.empty() || host == "*" )
+	{
+		if( !anyHost )
+			anyHost = new HostRoutes( "*" );
+		return( anyHost );
+	}
+	bool wildcard = host.compare( 0, 2, "*." ) == 0;
+	if( wildcard )
+		host = host.substr( 1 );
+	else if( host.find( '*' ) != string::npos )
+		Exception::raise( "Router: unsupported host pattern (%s)", pattern.c_str() );
+	vector< HostRoutes * >& list = wildcard ? wildcards : hosts;
+	for( auto it = list.begin(); it != list.end(); it++ )
+	{
+		if( (*it)->host == host )
+			return( *it );
+	}
+	HostRoutes *routes = new HostRoutes( host );
+	list.push_back( routes );
+	rehash( list, wildcard ? wildcardBuckets : hostBuckets );
+	return( routes );
+}
+
+// a power-of-two table with at least twice as many buckets as names
+
+void
+Router :: rehash( vector< HostRoutes * >& list, vector< vector< HostRoutes * > >& buckets )
+{
+	size_t n = 1;
+	while( n < list.size() * 2 )
+		n *= 2;
+	buckets.assign( n, vector< HostRoutes * >() );
+	for( auto it = list.begin(); it != list.end(); it++ )
+		buckets[ hostHash( (*it)->host.data(), (*it)->host.size() ) & (n - 1) ].push_back( *it );
+}
+
+HostRoutes *
+Router :: lookup( vector< vector< HostRoutes * > >& buckets, const char *name, size_t len )
+{
+	if( buckets.empty() )
+		return( nullptr );
+	vector< HostRoutes * >& bucket = buckets[ hostHash( name, len ) & (buckets.size() - 1) ];
+	for( auto it = bucket.begin(); it != bucket.end(); it++ )
+	{
+		if( (*it)->host.size() == len && strncasecmp( (*it)->host.data(), name, len ) == 0 )
+			return( *it );
+	}
+	return( nullptr );
+}
+
+void
+Router :: add( const string& host, const string& path, BackendPool *pool )
+{
+	RadixNode *node = routes( host )->root;
+	size_t i = 0;
+	while( i < path.size() )
+	{
+		size_t child = node->first.find( path[ i ] );
+		if( child == string::npos )
+		{
+			RadixNode *leaf = new RadixNode;
+			leaf->label = path.substr( i );
+			node->first += path[ i ];
+			node->children.push_back( leaf );
+			node = leaf;
+			i = path.size();
+			break;
+		}
+		RadixNode *next = node->children[ child ];
+		size_t common = 0;
+		while( common < next->label.size() && i + common < path.size() && next->label[ common ] == path[ i + common ] )
+			++common;
+		if( common < next->label.size() )
+		{
+			// split the edge where the new prefix diverges
+			RadixNode *split = new RadixNode;
+			split->label = next->label.substr( 0, common );
+			next->label = next->label.substr( common );
+			split->first += next->label[ 0 ];
+			split->children.push_back( next );
+			node->children[ child ] = split;
+			next = split;
+		}
+		node = next;
+		i += common;
+	}
+	if( node->pool && node->pool != pool )
+		Exception::raise( "Router: duplicate route %s%s", host.c_str(), path.c_str() );
+	node->pool = pool;
+	++rules;
+}
+
+void
+Router :: addRegex( const string& host, const string& pattern, BackendPool *pool )
+{
+	try
+	{
+		routes( host )->regexes.push_back( make_pair( regex( pattern, regex::ECMAScript | regex::optimize ), pool ) );
+	}
+	catch( const regex_error& error )
+	{
+		Exception::raise( "Router: bad regex %s (%s)", pattern.c_str(), error.what() );
+	}
+	++rules;
+}
+
+// regexes in order, then the longest matching prefix
+
+BackendPool *
+Router :: match( HostRoutes *routes, string_view path )
+{
+	for( auto it = routes->regexes.begin(); it != routes->regexes.end(); it++ )
+	{
+		if( regex_search( path.begin(), path.end(), it->first ) )
+			return( it->second );
+	}
+	RadixNode *node = routes->root;
+	BackendPool *best = node->pool;
+	size_t i = 0;
+	while( i < path.size() )
+	{
+		size_t child = node->first.find( path[ i ] );
+		if( child == string::npos )
+			break;
+		node = node->children[ child ];
+		if( path.compare( i, node->label.size(), node->label ) != 0 )
+			break;
+		i += node->label.size();
+		if( node->pool )
+			best = node->pool;
+	}
+	return( best );
+}
+
+// most specific host first: exact, then wildcards from the longest suffix
+
+BackendPool *
+Router :: route( string_view host, string_view path )
+{
+	// drop any :port and a trailing dot
+	size_t len = host.size();
+	if( len && host[ 0 ] != '[' )
+	{
+		size_t colon = host.rfind( ':' );
+		if( colon != string_view::npos )
+			len = colon;
+	}
+	if( len && host[ len - 1 ] == '.' )
+		--len;
+	if( len > MAX_HOST_LEN )
+		len = 0;
+	const char *name = host.data();
+
+	BackendPool *pool;
+	HostRoutes *routes;
+	if( len && (routes = lookup( hostBuckets, name, len )) && (pool = match( routes, path )) )
+		return( pool );
+	for( size_t dot = 0; dot < len && !wildcardBuckets.empty(); dot++ )
+	{
+		if( name[ dot ] == '.' && (routes = lookup( wildcardBuckets, name + dot, len - dot )) && (pool = match( routes, path )) )
+			return( pool );
+	}
+	if( anyHost )
+		return( match( anyHost, path ) );
+	return( nullptr );
+}
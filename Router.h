@@ -0,0 +1,73 @@
+//
+//  Router.h
+//  Layer7LoadBalancer
+//  Created by Rick Tyler
+//
+//  SPDX-License-Identifier: MIT
+
+# ifndef _Router_h_
+# define _Router_h_
+
+# include <regex>
+# include <string>
+# include <string_view>
+# include <vector>
+
+using namespace std;
+
+class BackendPool;
+
+// Maps Host plus path to a backend pool. Rules are compiled at load time:
+// hosts into hash buckets (exact names, and *.suffix wildcards looked up
+// label by label), each host's path prefixes into a radix trie. Regex
+// rules for a host are tried, in order, before its prefixes. Lookups copy
+// nothing, so they stay sub-microsecond however many rules there are.
+
+class RadixNode
+{
+    public:
+
+	~RadixNode();
+	string label;			// edge from the parent
+	BackendPool *pool = nullptr;	// route ending here, if any
+	string first;			// children's first label bytes, for the scan
+	vector< RadixNode * > children;
+};
+
+class HostRoutes
+{
+    public:
+
+	HostRoutes( const string& host ) : host( host ) { }
+	~HostRoutes() { delete( root ); }
+	string host;
+	RadixNode *root = new RadixNode;
+	vector< pair< regex, BackendPool * > > regexes;
+};
+
+class Router
+{
+    public:
+
+	Router( void ) { }
+	~Router();
+	void add( const string& host, const string& path, BackendPool *pool );
+	void addRegex( const string& host, const string& pattern, BackendPool *pool );
+	BackendPool *route( string_view host, string_view path );
+	bool empty( void ) { return( rules == 0 ); }
+
+    private:
+
+	size_t rules = 0;
+	vector< HostRoutes * > hosts;		// exact names
+	vector< HostRoutes * > wildcards;	// "*.example.com" kept as ".example.com"
+	HostRoutes *anyHost = nullptr;		// "*" or no host
+	vector< vector< HostRoutes * > > hostBuckets;
+	vector< vector< HostRoutes * > > wildcardBuckets;
+	HostRoutes *routes( const string& host );
+	void rehash( vector< HostRoutes * >& list, vector< vector< HostRoutes * > >& buckets );
+	HostRoutes *lookup( vector< vector< HostRoutes * > >& buckets, const char *name, size_t len );
+	BackendPool *match( HostRoutes *routes, string_view path );
+};
+
+# endif // _Router_h_
@@ -10,6 +10,10 @@
 # include "Connection.h"
 # include "Event.h"
 # include "Log.h"
+# include "TicketKeys.h"
+# include "Certificates.h"
+# include "Handshake.h"
+# include "ReplayCache.h"
 # include <openssl/ssl.h>
 # include <openssl/err.h>
 # include <poll.h>
@@ -39,9 +43,106 @@ ServiceContext :: ~ServiceContext()
 # endif // TRACE
 	if( sockAddr )
 		delete( sockAddr );
+	if( ticketKeys )
+		delete( ticketKeys );
+	if( replayCache )
+		delete( replayCache );
 }
 
-SSL_CTX *ServiceContext :: get_SSL_CTX( void )
+// TLS resumption: cacheSize sessions held server-side, resumable for
+// timeout seconds, plus stateless tickets whose key changes every
+// ticketRotation seconds (0 turns tickets off)
+
+void
+ServiceContext :: setSessionCache( size_t cacheSize, int timeout, int ticketRotation )
+{
+	this->sessionCacheSize = cacheSize;
+	this->sessionTimeout = timeout;
+	this->ticketRotation = ticketRotation;
+}
+
+// another certificate, served to clients asking (SNI) for a name it lists
+
+void
+ServiceContext :: addCertificate( const char *certPath, const char *keyPath )
+{
+	certificates.push_back( make_pair( string( certPath ), string( keyPath ) ) );
+}
+
+// threads > 0 runs TLS handshakes on that many threads instead of the
+// accept thread; either way a client gets timeout ms (0 = no limit)
+
+void
+ServiceContext :: setHandshakes( int threads, int timeout )
+{
+	this->handshakeThreads = threads;
+	this->handshakeTimeout = timeout;
+}
+
+// TLS records of small bytes for the first ramp bytes of a response and
+// after idle ms without writes, then full size; small 0 turns this off
+
+void
+ServiceContext :: setRecordSizing( size_t small, size_t ramp, int idle )
+{
+	this->recordSmall = small;
+	this->recordRamp = ramp;
+	this->recordIdle = idle;
+}
+
+// accept up to maxEarlyData bytes of TLS 1.3 0-RTT data from resuming
+// clients, a ClientHello replayed within replayWindow seconds getting none;
+// sessions then start before the handshake is finished, so must read with
+// SSL_read_early_data() until it is (as HTTPProxySession does)
+
+void
+ServiceContext :: setEarlyData( size_t maxEarlyData, int replayWindow )
+{
+	this->maxEarlyData = maxEarlyData;
+	if( maxEarlyData && !replayCache )
+		replayCache = new ReplayCache( replayWindow );
+}
+
+// a context per certificate, each loaded now so a handshake only picks one
+
+Certificates *
+ServiceContext :: getCertificates( void )
+{
+	Certificates *certificates = new Certificates();
+	try
+	{
+		certificates->add( get_SSL_CTX( certPath, keyPath ) );
+		for( auto it = this->certificates.begin(); it != this->certificates.end(); it++ )
+			certificates->add( get_SSL_CTX( it->first.c_str(), it->second.c_str() ) );
+	}
+	catch( const char * )
+	{
+		delete( certificates );
+		throw;
+	}
+	if( certificates->size() > 1 )
+	{
+		SSL_CTX_set_tlsext_servername_callback( certificates->defaultContext(), Certificates::serverNameCallback );
+		SSL_CTX_set_tlsext_servername_arg( certificates->defaultContext(), certificates );
+	}
+	return( certificates );
+}
+
+// ALPN: "h2" when the client offers it, else "http/1.1"; a client
+// offering neither gets no protocol rather than a failed handshake
+
+static int
+selectProtocol( SSL *, const unsigned char **out, unsigned char *outLen, const unsigned char *in, unsigned int inLen, void * )
+{
+	static const unsigned char protocols[] = "\x02h2\x08http/1.1";
+	unsigned char *selected;
+	if( SSL_select_next_proto( &selected, outLen, protocols, sizeof( protocols ) - 1, in, inLen ) != OPENSSL_NPN_NEGOTIATED )
+		return( SSL_TLSEXT_ERR_NOACK );
+	*out = selected;
+	return( SSL_TLSEXT_ERR_OK );
+}
+
+SSL_CTX *ServiceContext :: get_SSL_CTX( const char *certPath, const char *keyPath )
 {
 	SSL_CTX *ssl_ctx = SSL_CTX_new( SSLv23_server_method() );
 
@@ -59,16 +160,18 @@ SSL_CTX *ServiceContext :: get_SSL_CTX( void )
 		SSL_OP_NO_COMPRESSION
 	);
 
-	if( SSL_CTX_use_certificate_file( ssl_ctx, certPath, SSL_FILETYPE_PEM ) != 1 )
+	if( SSL_CTX_use_certificate_chain_file( ssl_ctx, certPath ) != 1 )
 	{
-		Exception::raise( "SSL_CTX_use_certificate_file() failed: %s",
-			ERR_error_string( ERR_get_error(), NULL ) );
+		SSL_CTX_free( ssl_ctx );
+		Exception::raise( "SSL_CTX_use_certificate_chain_file( %s ) failed: %s",
+			certPath, ERR_error_string( ERR_get_error(), NULL ) );
 	}
 
 	if( SSL_CTX_use_PrivateKey_file( ssl_ctx, keyPath, SSL_FILETYPE_PEM ) != 1 )
 	{
-		Exception::raise( "SSL_CTX_use_PrivateKey_file() failed: %s",
-			ERR_error_string( ERR_get_error(), NULL ) );
+		SSL_CTX_free( ssl_ctx );
+		Exception::raise( "SSL_CTX_use_PrivateKey_file( %s ) failed: %s",
+			keyPath, ERR_error_string( ERR_get_error(), NULL ) );
 	}
 
 	if( trustPath && SSL_CTX_load_verify_locations( ssl_ctx, NULL, trustPath) <= 0 )
@@ -77,16 +180,37 @@ SSL_CTX *ServiceContext :: get_SSL_CTX( void )
 			ERR_error_string( ERR_get_error(), NULL ) );
 	}
 
+	SSL_CTX_set_session_cache_mode( ssl_ctx, SSL_SESS_CACHE_SERVER );
+	SSL_CTX_sess_set_cache_size( ssl_ctx, (long) sessionCacheSize );
+	SSL_CTX_set_timeout( ssl_ctx, sessionTimeout );
+	SSL_CTX_set_session_id_context( ssl_ctx, (const unsigned char *) listenStr,
+		(unsigned int) min( strlen( listenStr ), (size_t) SSL_MAX_SID_CTX_LENGTH ) );
+	if( ticketRotation > 0 )
+	{
+		if( !ticketKeys )
+			ticketKeys = new TicketKeys( ticketRotation, sessionTimeout );
+		ticketKeys->install( ssl_ctx );
+	}
+	else
+		SSL_CTX_set_options( ssl_ctx, SSL_OP_NO_TICKET );
+	if( maxEarlyData )
+	{
+		SSL_CTX_set_max_early_data( ssl_ctx, (uint32_t) maxEarlyData );
+		SSL_CTX_set_recv_max_early_data( ssl_ctx, (uint32_t) maxEarlyData );
+		replayCache->install( ssl_ctx );
+	}
+	// on every context, so it survives an SNI switch
+	if( http2 )
+		SSL_CTX_set_alpn_select_cb( ssl_ctx, selectProtocol, nullptr );
+
 	return( ssl_ctx );
 }
 
 size_t Service :: bufLen = 8192;
 mutex Service :: bufLenMutex;
-SSL_CTX * Service :: ssl_ctx = nullptr;
-mutex Service :: ssl_ctx_mutex;
-set< SessionContext * > Service :: sslSessions;
+mutex Service :: sslInitMutex;
 
-Service :: Service( ServiceContext *context ) : Thread( context )
+Service :: Service( ServiceContext *context ) : Thread( context ), handshakes( 0 ), resumed( 0 ), failedHandshakes( 0 ), earlyData( 0 )
 {
 # if TRACE
 	Log::console( "Service::Service()" );
@@ -98,16 +222,27 @@ Service :: Service( ServiceContext *context ) : Thread( context )
 	{
 		if( context->service->isSecure() )
 		{
-			Service::ssl_ctx_mutex.lock();
-			if( !Service::ssl_ctx )
+			Service::sslInitMutex.lock();
+			OpenSSL_add_all_algorithms();
+			SSL_load_error_strings();	
+			int result = SSL_library_init();
+			Service::sslInitMutex.unlock();
+			if( result < 0 )
+				Exception::raise( "SSL_library_init() failed: %s", ERR_error_string( ERR_get_error(), NULL ) );
+			certificates = shared_ptr< Certificates >( context->getCertificates() );
+			if( certificates->size() > 1 )
+				Log::log( "Service[ %s ]: %zu certificates for %zu names", context->listenStr,
+					certificates->size(), certificates->nameCount() );
+			if( context->handshakeThreads > 0 )
 			{
-				OpenSSL_add_all_algorithms();
-				SSL_load_error_strings();	
-				if( SSL_library_init() < 0 )
-					Exception::raise( "SSL_library_init() failed: %s", ERR_error_string( ERR_get_error(), NULL ) );
-				Service::ssl_ctx = context->get_SSL_CTX();
+				context->handshakes = new HandshakeContext( this, context->handshakeTimeout );
+				for( int i = 0; i < context->handshakeThreads; i++ )
+				{
+					Handshake *handshake = new Handshake( context->handshakes );
+					handshake->run();
+					handshake->detach();
+				}
 			}
-			Service::ssl_ctx_mutex.unlock();
 		}
 
 		context->socket = socket( AF_INET, SOCK_STREAM, 0 );
@@ -160,22 +295,80 @@ Service :: sessionNotifyProtocolAttribute( string *value, void *data )
 	return;
 }
 
-void
-Service :: endSession( SessionContext *context )
+// backend for a request on a request-balanced (HTTP) session
+
+Backend *
+Service :: sessionSelectBackend( HTTPParser *request )
 {
-	if( !context->service->isSecure() )
-	 	return;
+	(void) request;
+	return( nullptr );
+}
 
-	Service::ssl_ctx_mutex.lock();
+// backend for a TLS passthrough session, by the ClientHello's server name
 
-	Service::sslSessions.erase( context );
+Backend *
+Service :: sessionSelectBackend( ClientHello *hello )
+{
+	(void) hello;
+	return( nullptr );
+}
 
-	if( Service::ssl_ctx && Service::sslSessions.size() == 0 )
+void
+Service :: logStats( void )
+{
+	if( !isSecure() )
+		return;
+	size_t sessions;
 	{
-		SSL_CTX_free( Service::ssl_ctx );
-		Service::ssl_ctx = context->service->context->get_SSL_CTX();
+		lock_guard< mutex > lock( sslSessionsMutex );
+		sessions = sslSessions.size();
 	}
-	Service::ssl_ctx_mutex.unlock();
+	size_t handshakes = this->handshakes.load();
+	size_t resumed = this->resumed.load();
+	Log::log( "Service[ %s ]: %zu TLS sessions, handshakes=%zu resumed=%zu (%.1f%%) session-cache=%ld",
+		context->listenStr, sessions, handshakes, resumed, handshakes ? 100.0 * resumed / handshakes : 0.0,
+		SSL_CTX_sess_number( atomic_load( &certificates )->defaultContext() ) );
+	if( context->handshakes )
+		Log::log( "  handshake threads: %d queue=%zu dropped=%zu failed=%zu", context->handshakeThreads,
+			context->handshakes->queueLength(), context->handshakes->dropped.load(), failedHandshakes.load() );
+	else
+		Log::log( "  handshakes failed=%zu", failedHandshakes.load() );
+	if( context->replayCache )
+		Log::log( "  early data: accepted=%zu replays=%zu", earlyData.load(), context->replayCache->replays.load() );
+}
+
+// reread the certificates and keys, off the accept path; handshakes
+// from now on use them, while sessions already up keep their context
+// until they close. On any error the current ones stay.
+
+bool
+Service :: reloadCertificates( void )
+{
+	if( !isSecure() )
+		return( true );
+	try
+	{
+		shared_ptr< Certificates > certificates( context->getCertificates() );
+		atomic_store( &this->certificates, certificates );
+		Log::log( "Service[ %s ]: reloaded %zu certificate%s", context->listenStr,
+			certificates->size(), certificates->size() == 1 ? "" : "s" );
+		return( true );
+	}
+	catch( const char *error )
+	{
+		Log::log( "Service[ %s ]: certificate reload failed, keeping the current ones (%s)", context->listenStr, error );
+		return( false );
+	}
+}
+
+void
+Service :: endSession( SessionContext *context )
+{
+	if( !context->service->isSecure() )
+	 	return;
+
+	lock_guard< mutex > lock( sslSessionsMutex );
+	sslSessions.erase( context );
 }
 
 ssize_t
@@ -197,6 +390,119 @@ Service :: peek( int socket, SSL *ssl, void *buf, size_t len )
 	return( recv( socket, buf, len, MSG_PEEK ) );
 }
 
+// the server side of a client's TLS handshake, allowed timeout ms (0 for
+// no limit); on failure the client is closed. With 0-RTT data accepted it
+// returns as soon as some arrives, in *earlyData, leaving the session to
+// finish the handshake (so the request can be answered meanwhile).
+
+bool
+Service :: handshake( int clientSocket, SSL **clientSSL, int timeout, string *earlyData )
+{
+	// held through the handshake, which may switch to another of its
+	// contexts (SNI); the SSL keeps a reference to the one it ends up with
+	shared_ptr< Certificates > certificates = atomic_load( &this->certificates );
+	SSL *ssl;
+	if( (ssl = SSL_new( certificates->defaultContext() )) == NULL )
+	{
+		Log::log( "Service::handshake: SSL_new() failed (%s)", ERR_error_string( ERR_get_error(), NULL ) );
+		(void) close( clientSocket );
+		return( false );
+	}
+	if( !SSL_set_fd( ssl, clientSocket ) )
+	{
+		Log::log( "Service::handshake: SSL_set_fd() failed (%s)", ERR_error_string( ERR_get_error(), NULL ) );
+		SSL_free( ssl );
+		(void) close( clientSocket );
+		return( false );
+	}
+# if TRACE
+	Log::console( "Service::handshake: clientSocket=%d clientSSL=<%p>", clientSocket, ssl );
+# endif // TRACE
+
+	// a client stalling mid-handshake gives up its thread after timeout
+	struct timeval tv = { timeout / 1000, (timeout % 1000) * 1000 };
+	if( timeout )
+	{
+		(void) setsockopt( clientSocket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof( tv ) );
+		(void) setsockopt( clientSocket, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof( tv ) );
+	}
+	int result = 1;
+	earlyData->clear();
+	if( context->maxEarlyData )
+	{
+		char buf[ 16384 ];
+		size_t len;
+		while( (result = SSL_read_early_data( ssl, buf, sizeof( buf ), &len )) == SSL_READ_EARLY_DATA_SUCCESS )
+		{
+			earlyData->append( buf, len );
+			if( len > 0 )
+				break;
+		}
+		if( result == SSL_READ_EARLY_DATA_ERROR )
+			result = -1;
+		else if( result == SSL_READ_EARLY_DATA_FINISH )
+			earlyData->append( buf, len );
+	}
+	if( result == SSL_READ_EARLY_DATA_FINISH || !context->maxEarlyData )
+		result = SSL_accept( ssl );
+	if( timeout )
+	{
+		tv = { 0, 0 };
+		(void) setsockopt( clientSocket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof( tv ) );
+		(void) setsockopt( clientSocket, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof( tv ) );
+	}
+	if( result <= 0 )
+	{
+# if TRACE
+		Log::console( "Service::handshake: SSL_accept() failed [%d]", SSL_get_error( ssl, result ) );
+# endif // TRACE
+		++failedHandshakes;
+		SSL_free( ssl );
+		(void) close( clientSocket );
+		return( false );
+	}
+	++handshakes;
+	if( SSL_session_reused( ssl ) )
+		++resumed;
+	if( SSL_get_early_data_status( ssl ) == SSL_EARLY_DATA_ACCEPTED )
+		++this->earlyData;
+	*clientSSL = ssl;
+	return( true );
+}
+
+// hand a connected (and for TLS, handshaken) client to a session thread
+
+void
+Service :: startSession( int clientSocket, SSL *clientSSL, string *earlyData )
+{
+# if TRACE
+	Log::console( "Service::startSession: CALLING getSession( %d, <%p> )", clientSocket, clientSSL );
+# endif // TRACE
+	Session *session = getSession( clientSocket, clientSSL );
+
+	if( !session )
+	{
+		if( clientSSL )
+		{
+			SSL_shutdown( clientSSL );
+			SSL_free( clientSSL );
+		}
+		(void) close( clientSocket );
+		return;
+	}
+
+	if( isSecure() )
+	{
+		lock_guard< mutex > lock( sslSessionsMutex );
+		sslSessions.insert( session->context );
+	}
+	if( earlyData )
+		session->context->earlyData.swap( *earlyData );
+
+	session->run();
+	session->detach();
+}
+
 void Service :: _main( ServiceContext *context )
 {
 # if TRACE
@@ -221,66 +527,21 @@ void Service :: _main( ServiceContext *context )
 			Log::console( "Service::_main: accept() (clientSocket=%d)", clientSocket );
 # endif // TRACE
 
-			struct pollfd server_poll;
-			server_poll.fd = context->socket;
-			server_poll.events = POLLIN;
-			SSL *clientSSL = nullptr;
-
-			if( context->service->isSecure() )
+			Service *service = context->service;
+			if( !service->isSecure() )
+				service->startSession( clientSocket, nullptr );
+			else if( context->handshakes )
 			{
-				Service::ssl_ctx_mutex.lock();
-
-				if( !Service::ssl_ctx )
-					Service::ssl_ctx = context->get_SSL_CTX();
-
-				if( (clientSSL = SSL_new( Service::ssl_ctx )) == NULL )
-					Exception::raise( "SSL_new() failed (%s)", ERR_error_string( ERR_get_error(), NULL ) );
-# if TRACE
-				Log::console( "Service::_main: clientSocket=%d clientSSL=<%p>", clientSocket, clientSSL );
-# endif // TRACE
-				Service::ssl_ctx_mutex.unlock();
-
-				if( !SSL_set_fd( clientSSL, clientSocket ) )
-					Exception::raise( "SSL_set_fd() failed (%s)", ERR_error_string( ERR_get_error(), NULL ) ); 
-
-				int result = 0;
-				if( (result = SSL_accept( clientSSL )) < 0 )
-				{
-					SSL_shutdown( clientSSL );
-					SSL_free( clientSSL );
+				if( !context->handshakes->enqueue( clientSocket ) )
 					(void) close( clientSocket );
-
-					int optval = 1;
-					if( setsockopt( context->socket, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof( optval ) ) < 0 )
-						Exception::raise( "setsockopt( SO_REUSEADDR ) on listen socket failed (%s)", strerror( errno ) );
-				}
-
-				if( result == 0 )
-					Exception::raise( "SSL_accept() == 0" );
 			}
-# if TRACE
-			Log::console( "Service::_main: CALLING getSession( %d, <%p> )", clientSocket, clientSSL );
-# endif // TRACE
-
-			Session *session = context->service->getSession( clientSocket, clientSSL );
-
-			if( !session )
+			else
 			{
-				if( context->service->isSecure() )
-					SSL_shutdown( clientSSL );
-				(void) close( clientSocket );
-				continue;
+				SSL *clientSSL;
+				string earlyData;
+				if( service->handshake( clientSocket, &clientSSL, context->handshakeTimeout, &earlyData ) )
+					service->startSession( clientSocket, clientSSL, &earlyData );
 			}
-
-			if( context->service->isSecure() )
-			{
-				Service::ssl_ctx_mutex.lock();
-				Service::sslSessions.insert( session->context );
-				Service::ssl_ctx_mutex.unlock();
-			}
-
-			session->run();
-			session->detach();
 		}
 		catch( const char *error )
 		{
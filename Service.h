@@ -12,8 +12,20 @@
 # include "Session.h"
 # include "SocketAddress.h"
 # include "Event.h"
+# include <atomic>
+# include <memory>
+# include <string>
+# include <utility>
+# include <vector>
 
 class Service;
+class Backend;
+class HTTPParser;
+class ClientHello;
+class TicketKeys;
+class Certificates;
+class HandshakeContext;
+class ReplayCache;
 
 class ServiceContext : public ThreadContext
 {
@@ -26,6 +38,12 @@ class ServiceContext : public ThreadContext
 		const char *trustPath = nullptr
 	);
 	~ServiceContext();
+	void setSessionCache( size_t cacheSize, int timeout, int ticketRotation );
+	void addCertificate( const char *certPath, const char *keyPath );
+	void setHandshakes( int threads, int timeout );
+	void setRecordSizing( size_t small, size_t ramp, int idle );
+	void setEarlyData( size_t maxEarlyData, int replayWindow );
+	void setHTTP2( bool http2 ) { this->http2 = http2; }
 	Service *service;
 
     private:
@@ -36,10 +54,26 @@ class ServiceContext : public ThreadContext
 	const char *keyPath;
 	SocketAddress *sockAddr;
 	int socket;
-	SSL_CTX *get_SSL_CTX( void ); 
+	size_t sessionCacheSize = SSL_SESSION_CACHE_MAX_SIZE_DEFAULT;
+	int sessionTimeout = 300;	// seconds a session may be resumed
+	int ticketRotation = 3600;	// seconds between ticket keys (0 = no tickets)
+	TicketKeys *ticketKeys = nullptr;
+	vector< pair< string, string > > certificates;	// beyond the first, selected by SNI
+	int handshakeThreads = 0;	// 0 handshakes in the accept thread
+	int handshakeTimeout = 10000;	// ms
+	HandshakeContext *handshakes = nullptr;
+	size_t recordSmall = 1400;	// TLS record payload early in a response
+	size_t recordRamp = 65536;	// bytes of a response sent in small records
+	int recordIdle = 1000;		// ms without writes before records are small again
+	size_t maxEarlyData = 0;	// TLS 1.3 0-RTT bytes accepted (0 = none)
+	ReplayCache *replayCache = nullptr;
+	bool http2 = false;		// ALPN offers "h2" ahead of "http/1.1"
+	SSL_CTX *get_SSL_CTX( const char *certPath, const char *keyPath ); 
+	Certificates *getCertificates( void );
 	// void notifyEndOfSession( SessionContext *sessionContext );
 
     friend class Service;
+    friend class SessionContext;
 };
 
 class Service : public Thread
@@ -49,6 +83,8 @@ class Service : public Thread
 	Service( ServiceContext *context );
 	~Service();
 	ssize_t peek( int clientSocket, SSL *clientSSL, void *buf, size_t len );
+	virtual void logStats( void );
+	bool reloadCertificates( void );
 
     protected:
 
@@ -59,18 +95,32 @@ class Service : public Thread
 	ServiceContext *context; 
 	virtual Session *getSession( int clientSocket, SSL *clientSSL = nullptr ) = 0;
 	virtual void sessionNotifyProtocolAttribute( string *value, void *data = nullptr );
+	virtual Backend *sessionSelectBackend( HTTPParser *request );
+	virtual Backend *sessionSelectBackend( ClientHello *hello );
 	bool isSecure( void );
 	void endSession( SessionContext *context );
+	bool handshake( int clientSocket, SSL **clientSSL, int timeout, string *earlyData );
+	void startSession( int clientSocket, SSL *clientSSL, string *earlyData = nullptr );
 	static mutex bufLenMutex;
 	static size_t bufLen;
-	static SSL_CTX *ssl_ctx;
-	static mutex ssl_ctx_mutex;
-	static set< SessionContext * > sslSessions;
+	static mutex sslInitMutex;
+	shared_ptr< Certificates > certificates;	// swapped whole by reloadCertificates()
+	mutex sslSessionsMutex;
+	set< SessionContext * > sslSessions;
+	atomic< size_t > handshakes;
+	atomic< size_t > resumed;
+	atomic< size_t > failedHandshakes;
+	atomic< size_t > earlyData;	// handshakes whose 0-RTT data was accepted
 
     friend class Session;
     friend class SessionContext;
     friend class ProxySession;
     friend class ProxySessionContext;
+    friend class HTTPProxySessionContext;
+    friend class PassthroughSessionContext;
+    friend class PassthroughSession;
+    friend class HTTP2StreamContext;
+    friend class Handshake;
 };
 
 # endif // _Service_h_
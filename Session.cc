@@ -33,6 +33,8 @@ SessionContext :: SessionContext( Service *service, int clientSocket, SSL *clien
 	this->service= service;
 	this->clientSocket = clientSocket;
 	this->clientSSL = clientSSL;
+	ServiceContext *serviceContext = service->context;
+	records.configure( serviceContext->recordSmall, serviceContext->recordRamp, serviceContext->recordIdle );
 }
 
 SessionContext :: ~SessionContext()
@@ -9,8 +9,10 @@
 # define _Session_h_
 
 # include "Thread.h"
+# include "RecordSizer.h"
 # include <openssl/ssl.h>
 # include <set>
+# include <string>
 
 class Service;
 class Session;
@@ -23,6 +25,8 @@ class SessionContext : public ThreadContext
 	~SessionContext();
 	int clientSocket;
 	SSL *clientSSL;
+	RecordSizer records;	// for clientSSL writes
+	string earlyData;	// 0-RTT bytes read while the handshake is unfinished
 
     protected:
 
@@ -0,0 +1,225 @@
+//
+//  TestBackend.cc
+//  Layer7LoadBalancer
+//  Created by Rick Tyler
+//
+//  Test for Backend and BackendPool.
+//
+//  SPDX-License-Identifier: MIT
+
+# include "Backend.h"
+# include "Exception.h"
+# include "Log.h"
+
+# include <math.h>
+# include <unistd.h>
+# include <thread>
+
+// # define TRACE    1
+
+using namespace std;
+
+static void
+expect( bool condition, const char *what )
+{
+	if( !condition )
+		Exception::raise( "test failed (%s)", what );
+}
+
+// the circuit opens after fall failed checks and closes after rise passed
+// ones; selection skips a backend while its circuit is open
+
+static void
+testCircuitBreaker( void )
+{
+	Backend down( "localhost:1", false ), up( "localhost:2", false );
+	down.healthCheckFailed( "refused" );
+	down.healthCheckFailed( "refused" );
+	down.healthCheckSucceeded();
+	down.healthCheckFailed( "refused" );
+	down.healthCheckFailed( "refused" );
+	expect( down.isAvailable(), "failures must be consecutive" );
+	down.healthCheckFailed( "refused" );
+	expect( !down.isAvailable(), "open after fall" );
+	BackendPool pool;
+	pool.add( &down );
+	pool.add( &up );
+	for( int i = 0; i < 4; i++ )
+	{
+		Backend *selected = pool.select();
+		expect( selected == &up, "open circuit skipped" );
+		selected->sessionEnded();
+	}
+	up.healthCheckFailed( "refused" );
+	up.healthCheckFailed( "refused" );
+	up.healthCheckFailed( "refused" );
+	expect( !pool.select(), "nothing to select" );
+	down.healthCheckSucceeded();
+	expect( !down.isAvailable(), "still open before rise" );
+	down.healthCheckSucceeded();
+	expect( down.isAvailable() && pool.select() == &down, "closed after rise" );
+}
+
+// ejection on consecutive failures (reset by any success) and on the
+// error rate once there are enough requests in the interval
+
+static void
+testOutlierDetection( void )
+{
+	Backend consecutive( "localhost:1", false );
+	consecutive.outlierConsecutiveFailures = 3;
+	consecutive.reportSuccess();
+	consecutive.reportFailure( "5xx response" );
+	consecutive.reportFailure( "5xx response" );
+	consecutive.reportSuccess();
+	consecutive.reportFailure( "5xx response" );
+	consecutive.reportFailure( "5xx response" );
+	expect( !consecutive.isEjected(), "a success resets the count" );
+	consecutive.reportFailure( "5xx response" );
+	expect( consecutive.isEjected() && !consecutive.isAvailable(), "ejected on consecutive failures" );
+
+	Backend rate( "localhost:2", false ), healthy( "localhost:3", false );
+	rate.outlierConsecutiveFailures = healthy.outlierConsecutiveFailures = 0;
+	rate.outlierErrorRate = healthy.outlierErrorRate = 60;
+	rate.outlierMinRequests = healthy.outlierMinRequests = 10;
+	for( int i = 0; i < 20; i++ )
+	{
+		// 75% and 50% errors
+		if( i % 4 == 0 )
+			rate.reportSuccess();
+		else
+			rate.reportFailure( "5xx response" );
+		expect( rate.isEjected() == (i >= 9), "ejected on error rate, not before the minimum" );
+		if( i % 2 == 0 )
+			healthy.reportSuccess();
+		else
+			healthy.reportFailure( "5xx response" );
+	}
+	expect( !healthy.isEjected(), "error rate below the threshold" );
+}
+
+// slow start ramps weight up after recovery; weighted least-connections
+// favors a full-weight backend until its load outweighs the ramp
+
+static void
+testSlowStart( void )
+{
+	Backend linear( "localhost:1", false ), exponential( "localhost:2", false ), full( "localhost:3", false );
+	for( Backend *backend : { &linear, &exponential } )
+	{
+		backend->slowStart = 10000;
+		backend->slowStartMinWeight = 0.1;
+		for( int i = 0; i < backend->fall; i++ )
+			backend->healthCheckFailed( "refused" );
+	}
+	exponential.slowStartExponential = true;
+	full.slowStart = 10000;
+	int64_t before = Thread::milliseconds();
+	for( int i = 0; i < linear.rise; i++ )
+	{
+		linear.healthCheckSucceeded();
+		exponential.healthCheckSucceeded();
+	}
+	int64_t after = Thread::milliseconds();
+	double slack = (double) (after - before) / 10000 + 0.001;	// recovered somewhere in [before, after]
+	expect( fabs( linear.weight( before ) - 0.1 ) < slack, "linear: minimum at recovery" );
+	expect( fabs( linear.weight( before + 2500 ) - 0.325 ) < slack, "linear: a quarter in" );
+	expect( fabs( linear.weight( before + 5000 ) - 0.55 ) < slack, "linear: halfway" );
+	expect( linear.weight( after + 10000 ) == 1.0, "linear: full weight after SLOW-START" );
+	expect( fabs( exponential.weight( before + 5000 ) - 0.1 * sqrt( 10.0 ) ) < slack * 3, "exponential: halfway" );
+	expect( exponential.weight( before + 2500 ) < linear.weight( before + 2500 ), "exponential: slower at first" );
+	expect( exponential.weight( after + 10000 ) == 1.0, "exponential: full weight after SLOW-START" );
+	expect( full.weight() == 1.0, "never recovered: full weight" );
+
+	// (sessions + 1) / weight: about 10 for the ramping backend while it's idle
+	BackendPool pool;
+	pool.add( &linear );
+	pool.add( &full );
+	for( int i = 0; i < 8; i++ )
+		expect( pool.select() == &full, "full weight preferred" );
+	expect( full.sessionCount() == 8 && linear.sessionCount() == 0, "ramping backend idle" );
+	while( linear.sessionCount() == 0 && full.sessionCount() < 20 )
+		(void) pool.select();
+	expect( linear.sessionCount() == 1 && full.sessionCount() >= 9 && full.sessionCount() <= 10,
+		"ramping backend chosen once the other has ten times its load" );
+}
+
+// the limit grows additively while fast responses keep it in use, backs off
+// once per latency period when they slow down; sessions over every limit
+// queue in FIFO order, rejected when the queue is full and timed out,
+// rather than falling back to ejected backends
+
+static void
+testConcurrencyLimit( void )
+{
+	Backend backend( "localhost:1", false );
+	backend.setConcurrencyLimit( 10 );
+	BackendPool pool;
+	pool.add( &backend );
+	for( int i = 0; i < 9; i++ )
+		expect( pool.select() == &backend, "below the limit" );
+	for( int i = 0; i < 30; i++ )
+		backend.reportLatency( 10 );
+	expect( backend.concurrencyLimit() == 11, "additive increase, only while in use" );
+	backend.reportLatency( 100 );
+	expect( backend.concurrencyLimit() == 9, "multiplicative decrease" );
+	backend.reportLatency( 100 );
+	expect( backend.concurrencyLimit() == 9, "one decrease per latency period" );
+	usleep( 20000 );
+	backend.reportLatency( 100 );
+	expect( backend.concurrencyLimit() == 8, "another period, another decrease" );
+
+	Backend single( "localhost:2", false );
+	single.setConcurrencyLimit( 1 );
+	BackendPool queued;
+	queued.add( &single );
+	queued.queueSize = 1;
+	queued.queueTimeout = 100;
+	expect( queued.select() == &single && !queued.select(), "at the limit" );
+	Backend *waited = &single;
+	thread waiter( [ & ] { waited = queued.acquire(); } );
+	while( queued.queueLength() == 0 )
+		usleep( 1000 );
+	expect( !queued.acquire() && queued.queueRejected == 1, "queue full" );
+	waiter.join();
+	expect( !waited && queued.queueTimedOut == 1 && queued.queueLength() == 0, "timed out" );
+	thread next( [ & ] { waited = queued.acquire(); } );
+	while( queued.queueLength() == 0 )
+		usleep( 1000 );
+	single.sessionEnded();
+	next.join();
+	expect( waited == &single && single.sessionCount() == 1, "queued session gets the backend" );
+
+	// a healthy backend that's only full queues sessions; ejected ones
+	// are the fallback only when no backend is available at all
+	Backend full( "localhost:3", false ), ejected( "localhost:4", false );
+	full.setConcurrencyLimit( 1 );
+	ejected.outlierConsecutiveFailures = 1;
+	ejected.reportFailure( "connection reset" );
+	BackendPool limited;
+	limited.add( &full );
+	limited.add( &ejected );
+	expect( limited.select() == &full && !limited.select(), "no fallback while a backend is only full" );
+	for( int i = 0; i < full.fall; i++ )
+		full.healthCheckFailed( "refused" );
+	expect( limited.select() == &ejected, "fallback when none is available" );
+}
+
+int
+main( int argc, char **argv )
+{
+	try
+	{
+		if( argc != 1 )
+			Exception::raise( "Usage: %s", argv[ 0 ] );
+		testCircuitBreaker();
+		testOutlierDetection();
+		testSlowStart();
+		testConcurrencyLimit();
+	}
+	catch( const char *error ) {
+		Log::console( "%s: test failed [%s]", argv[ 0 ], error );
+		exit( -1 );
+	}
+	Log::console( "%s: test passed", argv[ 0 ] );
+}
@@ -0,0 +1,757 @@
+//
+//  TestHTTP.cc
+//  Layer7LoadBalancer
+//  Created by Rick Tyler
+//
+//  Test for HTTPParser, HTTPStream, HTTPScan, Router and Cache.
+//
+//  SPDX-License-Identifier: MIT
+
+# include "HTTPParser.h"
+# include "HTTPStream.h"
+# include "HTTPScan.h"
+# include "Router.h"
+# include "Cache.h"
+# include "Compression.h"
+# include "HeaderRewrite.h"
+# include "ResponseBuffer.h"
+# include "RecordSizer.h"
+# include "ReplayCache.h"
+# include "ClientHello.h"
+# include "HPACK.h"
+# include "HTTP2Client.h"
+# include "Backend.h"
+# include "Thread.h"
+# include "Exception.h"
+# include "Log.h"
+
+# include <string>
+# include <list>
+# include <string.h>
+# include <algorithm>
+# include <atomic>
+# include <thread>
+
+// # define TRACE    1
+
+using namespace std;
+
+static void
+expect( bool condition, const char *what )
+{
+	if( !condition )
+		Exception::raise( "test failed (%s)", what );
+}
+
+// feed the message one byte at a time, moving the buffer on every call
+
+static void
+testIncremental( void )
+{
+	string request =
+		"GET /index.html?q=1 HTTP/1.1\r\n"
+		"Host: www.example.com\r\n"
+		"Cookie: theme=dark; JSESSIONID=\"abc123\"\r\n"
+		"X-Empty:\r\n"
+		"Accept:  */*  \r\n"
+		"\r\n"
+		"body";
+	HTTPParser parser;
+	int result = HTTP_INCOMPLETE;
+	size_t len;
+	char *buf = nullptr;
+	for( len = 1; len <= request.size() && result == HTTP_INCOMPLETE; len++ )
+	{
+		char *moved = (char *) malloc( len );
+		memcpy( moved, request.data(), len );
+		result = parser.parse( moved, len );
+		if( buf )
+			free( buf );
+		buf = moved;
+	}
+	expect( result == HTTP_COMPLETE, "incremental parse completes" );
+	expect( parser.headerLen == request.size() - 4, "header length" );
+	expect( parser.method == "GET", "method" );
+	expect( parser.path == "/index.html?q=1", "path" );
+	expect( parser.version == "HTTP/1.1", "version" );
+	expect( parser.headers.size() == 4, "header count" );
+	expect( parser.header( "host" ) == "www.example.com", "case-insensitive header lookup" );
+	expect( parser.header( "X-Empty" ).empty(), "empty header value" );
+	expect( parser.header( "Accept" ) == "*/*", "header value trimmed" );
+	expect( parser.cookie( "theme" ) == "dark", "cookie" );
+	expect( parser.cookie( "JSESSIONID" ) == "abc123", "quoted cookie" );
+	expect( parser.cookie( "missing" ).empty(), "missing cookie" );
+	free( buf );
+}
+
+static void
+testLargeHeader( void )
+{
+	string request = "POST /upload HTTP/1.1\r\n";
+	for( int i = 0; i < 2000; i++ )
+		request += "X-Header-" + to_string( i ) + ": " + string( 100, 'x' ) + "\r\n";
+	request += "\r\n";
+	HTTPParser parser;
+	expect( parser.parse( request.data(), request.size() / 2 ) == HTTP_INCOMPLETE, "large header incomplete" );
+	expect( parser.parse( request.data(), request.size() ) == HTTP_COMPLETE, "large header complete" );
+	expect( parser.headers.size() == 2000, "large header count" );
+	expect( parser.header( "X-Header-1999" ).size() == 100, "last large header" );
+}
+
+static void
+testResponse( void )
+{
+	string response = "\r\nHTTP/1.1 503 Service Unavailable\r\nSet-Cookie: JSESSIONID=xyz; Path=/\r\nContent-Length: 0\r\n\r\n";
+	HTTPParser parser( true );
+	expect( parser.parse( response.data(), response.size() ) == HTTP_COMPLETE, "response complete" );
+	expect( parser.status == 503, "status" );
+	expect( parser.reason == "Service Unavailable", "reason" );
+	expect( parser.header( "set-cookie" ) == "JSESSIONID=xyz; Path=/", "set-cookie" );
+	expect( parser.cookies.empty(), "responses don't parse Cookie" );
+}
+
+static void
+testErrors( void )
+{
+	const char *bad[] = {
+		"GET\r\n\r\n",
+		"GET / FTP/1.0\r\n\r\n",
+		"GET / HTTP/1.1\r\nNoColon\r\n\r\n",
+		"GET / HTTP/1.1\r\nName : value\r\n\r\n",
+		"GET / HTTP/1.1\r\nA: b\r\n folded\r\n\r\n",
+	};
+	for( size_t i = 0; i < sizeof( bad ) / sizeof( bad[ 0 ] ); i++ )
+	{
+		HTTPParser parser;
+		expect( parser.parse( bad[ i ], strlen( bad[ i ] ) ) == HTTP_ERROR, bad[ i ] );
+		expect( parser.error != nullptr, "error message" );
+	}
+	HTTPParser parser( true );
+	const char *badStatus = "HTTP/1.1 2000 OK\r\n\r\n";
+	expect( parser.parse( badStatus, strlen( badStatus ) ) == HTTP_ERROR, badStatus );
+}
+
+// body framing across arbitrary read boundaries
+
+static size_t
+consumeSplit( HTTPBody *body, const string& data, size_t split )
+{
+	size_t used = body->consume( data.data(), min( split, data.size() ) );
+	if( used == min( split, data.size() ) && split < data.size() )
+		used += body->consume( data.data() + split, data.size() - split );
+	return( used );
+}
+
+static void
+testBody( void )
+{
+	string request = "POST /upload HTTP/1.1\r\nTransfer-Encoding: gzip, chunked\r\n\r\n";
+	string chunked = "5;ext=1\r\nhello\r\n1A\r\nabcdefghijklmnopqrstuvwxyz\r\n0\r\nX-Trailer: t\r\n\r\n";
+	string next = "GET / HTTP/1.1\r\n\r\n";
+	for( size_t split = 0; split <= chunked.size(); split++ )
+	{
+		HTTPParser parser;
+		expect( parser.parse( request.data(), request.size() ) == HTTP_COMPLETE, "chunked request" );
+		HTTPBody body;
+		expect( body.frame( &parser ) == HTTP_BODY_CHUNKED, "chunked framing" );
+		expect( consumeSplit( &body, chunked + next, split ) == chunked.size(), "chunked body ends at trailer" );
+		expect( body.done() && !body.error, "chunked body done" );
+	}
+
+	HTTPParser parser;
+	string post = "POST / HTTP/1.1\r\nContent-Length: 4\r\nConnection: keep-alive, Upgrade\r\n\r\n";
+	expect( parser.parse( post.data(), post.size() ) == HTTP_COMPLETE, "post" );
+	expect( parser.hasToken( "connection", "UPGRADE" ), "connection token" );
+	expect( parser.keepAlive(), "HTTP/1.1 keep-alive" );
+	HTTPBody body;
+	expect( body.frame( &parser ) == HTTP_BODY_LENGTH && body.length == 4, "content-length framing" );
+	expect( body.consume( "abcdefg", 7 ) == 4 && body.done(), "content-length body" );
+
+	string response = "HTTP/1.0 200 OK\r\nSet-Cookie: theme=dark\r\nSet-Cookie: JSESSIONID=\"xyz\"; Path=/\r\n\r\n";
+	HTTPParser responseParser( true );
+	expect( responseParser.parse( response.data(), response.size() ) == HTTP_COMPLETE, "response" );
+	expect( responseParser.setCookie( "JSESSIONID" ) == "xyz", "set-cookie value" );
+	expect( !responseParser.keepAlive(), "HTTP/1.0 closes" );
+	expect( body.frame( &responseParser ) == HTTP_BODY_CLOSE, "close-delimited response" );
+	expect( body.frame( &responseParser, "HEAD" ) == HTTP_BODY_NONE && body.done(), "HEAD response has no body" );
+
+	const char *bad[] = {
+		"POST / HTTP/1.1\r\nContent-Length: 1x\r\n\r\n",
+		"POST / HTTP/1.1\r\nContent-Length: 1\r\nContent-Length: 2\r\n\r\n",
+		"POST / HTTP/1.1\r\nTransfer-Encoding: gzip\r\n\r\n",
+	};
+	for( size_t i = 0; i < sizeof( bad ) / sizeof( bad[ 0 ] ); i++ )
+	{
+		HTTPParser parser;
+		expect( parser.parse( bad[ i ], strlen( bad[ i ] ) ) == HTTP_COMPLETE, bad[ i ] );
+		expect( body.frame( &parser ) == HTTP_ERROR, bad[ i ] );
+	}
+	expect( body.frame( &parser ) == HTTP_BODY_LENGTH, "reframe" );
+	HTTPParser chunkedParser;
+	expect( chunkedParser.parse( request.data(), request.size() ) == HTTP_COMPLETE, "chunked request" );
+	(void) body.frame( &chunkedParser );
+	(void) body.consume( "zz\r\n", 4 );
+	expect( body.error != nullptr, "malformed chunk size" );
+}
+
+// headers found once each, whatever the read boundaries
+
+static void
+testStream( void )
+{
+	string requests = "HEAD / HTTP/1.1\r\n\r\nGET / HTTP/1.1\r\n\r\n";
+	string responses =
+		"HTTP/1.1 200 OK\r\nContent-Length: 100\r\n\r\n"
+		"HTTP/1.1 100 Continue\r\n\r\n"
+		"HTTP/1.1 404 Not Found\r\nSet-Cookie: JSESSIONID=a1\r\nTransfer-Encoding: chunked\r\n\r\n"
+		"4\r\nHTTP\r\n0\r\n\r\n";
+	for( size_t split = 1; split <= responses.size(); split++ )
+	{
+		HTTPStream request( false );
+		HTTPStream response( true );
+		response.requests = &request;
+		int headers = 0;
+		for( size_t offset = 0; offset < requests.size(); )
+		{
+			HTTPParser *header = nullptr;
+			offset += request.scan( requests.data() + offset, requests.size() - offset, &header );
+			headers += header != nullptr;
+		}
+		expect( headers == 2, "request headers" );
+		string cookie;
+		int statuses = 0;
+		for( size_t at = 0; at < responses.size(); at += split )
+		{
+			size_t len = min( split, responses.size() - at );
+			for( size_t offset = 0; offset < len; )
+			{
+				HTTPParser *header = nullptr;
+				offset += response.scan( responses.data() + at + offset, len - offset, &header );
+				if( header )
+				{
+					statuses = statuses * 1000 + header->status;
+					if( !header->setCookie( "JSESSIONID" ).empty() )
+						cookie = header->setCookie( "JSESSIONID" );
+				}
+			}
+		}
+		expect( statuses == 200100404, "each response header once" );
+		expect( cookie == "a1", "Set-Cookie on a split 404" );
+		expect( !response.isPassthrough(), "stream still tracked" );
+	}
+}
+
+static void
+testRouter( void )
+{
+	BackendPool api, images, users, example, wildcard, fallback;
+	Router router;
+	router.add( "api.example.com", "/", &api );
+	router.add( "api.example.com", "/v1/images/", &images );
+	router.add( "api.example.com", "/v1/img", &example );
+	router.addRegex( "API.example.com", "^/users/[0-9]+$", &users );
+	router.add( "*.example.com", "/", &wildcard );
+	router.add( "*", "/static/", &fallback );
+	for( int i = 0; i < 5000; i++ )
+		router.add( "host" + to_string( i ) + ".example.org", "/path/" + to_string( i ) + "/", &example );
+
+	expect( router.route( "api.example.com", "/v1/images/a.png" ) == &images, "longest prefix" );
+	expect( router.route( "api.example.com", "/v1/img.png" ) == &example, "split edge" );
+	expect( router.route( "api.example.com", "/v1/i" ) == &api, "shorter prefix" );
+	expect( router.route( "Api.Example.COM:8443", "/users/42" ) == &users, "regex, case and port" );
+	expect( router.route( "api.example.com", "/users/x" ) == &api, "regex mismatch" );
+	expect( router.route( "www.example.com.", "/" ) == &wildcard, "wildcard host" );
+	expect( router.route( "example.com", "/" ) == nullptr, "wildcard needs a label" );
+	expect( router.route( "other.net", "/static/x" ) == &fallback, "any host" );
+	expect( router.route( "", "/static/x" ) == &fallback, "no host" );
+	expect( router.route( "host4999.example.org", "/path/4999/x" ) == &example, "many hosts" );
+	expect( router.route( "host4999.example.org", "/path/4998/x" ) == nullptr, "no route" );
+
+	int64_t start = Thread::milliseconds();
+	BackendPool *pool = nullptr;
+	for( int i = 0; i < 1000000; i++ )
+		pool = router.route( "host1234.example.org", "/path/1234/index.html" );
+	expect( pool == &example, "timed lookup" );
+# if TRACE
+	Log::console( "Router: %.3f us per lookup", (Thread::milliseconds() - start) / 1000.0 );
+# else
+	(void) start;
+# endif // TRACE
+}
+
+// the parser's views need the message to outlive it
+
+static HTTPParser *
+parsed( HTTPParser *parser, const string& message )
+{
+	static list< string > messages;
+	messages.push_back( message );
+	parser->reset();
+	expect( parser->parse( messages.back().data(), message.size() ) == HTTP_COMPLETE, message.c_str() );
+	return( parser );
+}
+
+static void
+testCache( void )
+{
+	HTTPParser response( true );
+	expect( Cache::freshness( parsed( &response, "HTTP/1.1 200 OK\r\nCache-Control: public, max-age=60\r\n\r\n" ) ) == 60000, "max-age" );
+	expect( Cache::freshness( parsed( &response, "HTTP/1.1 200 OK\r\nCache-Control: max-age=60, s-maxage=5\r\nAge: 2\r\n\r\n" ) ) == 3000, "s-maxage less Age" );
+	expect( Cache::freshness( parsed( &response, "HTTP/1.1 200 OK\r\nDate: Mon, 19 Oct 2026 10:00:00 GMT\r\n"
+		"Expires: Mon, 19 Oct 2026 10:01:00 GMT\r\n\r\n" ) ) == 60000, "Expires" );
+	expect( Cache::freshness( parsed( &response, "HTTP/1.1 200 OK\r\nCache-Control: private, max-age=60\r\n\r\n" ) ) == 0, "private" );
+	expect( Cache::freshness( parsed( &response, "HTTP/1.1 200 OK\r\nExpires: 0\r\n\r\n" ) ) == 0, "bad Expires" );
+	expect( Cache::freshness( parsed( &response, "HTTP/1.1 500 Oops\r\nCache-Control: max-age=60\r\n\r\n" ) ) == 0, "500" );
+	expect( Cache::freshness( parsed( &response, "HTTP/1.1 200 OK\r\n\r\n" ) ) == 0, "no freshness" );
+
+	Cache cache( 16 * 64 * 1024 );
+	HTTPParser gzip, plain, other;
+	parsed( &gzip, "GET /a HTTP/1.1\r\nHost: Example.com\r\nAccept-Encoding: gzip\r\n\r\n" );
+	parsed( &plain, "GET /a HTTP/1.1\r\nHost: example.com\r\n\r\n" );
+	parsed( &other, "GET /b HTTP/1.1\r\nHost: example.com\r\n\r\n" );
+	bool lookup;
+	expect( Cache::isCacheable( &gzip, &lookup ) && lookup, "GET is cacheable" );
+	expect( !cache.lookup( &gzip ), "cold miss" );
+	cache.insert( &gzip, "Accept-Encoding", "HTTP/1.1 200 OK\r\n\r\ngz", 17, 60000, false );
+	expect( cache.lookup( &gzip ) && cache.lookup( &gzip )->data == "HTTP/1.1 200 OK\r\n\r\ngz", "hit" );
+	expect( !cache.lookup( &plain ), "Vary keys on Accept-Encoding" );
+	expect( !cache.lookup( &other ), "different path" );
+	cache.insert( &plain, "Accept-Encoding", "HTTP/1.1 200 OK\r\n\r\nplain", 17, 60000, false );
+	expect( cache.lookup( &plain )->data.size() == 24 && cache.lookup( &gzip )->data.size() == 21, "both variants" );
+	cache.insert( &other, "", "HTTP/1.1 200 OK\r\n\r\n", 17, -1, false );
+	expect( !cache.lookup( &other ), "expired" );
+	expect( cache.hits.load() == 4 && cache.insertions.load() == 3, "counters" );
+
+	// a one-hit wonder can't displace a popular entry from a full shard
+	Cache small( 16 * 1000, 1000 );
+	HTTPParser popular, wonder;
+	parsed( &popular, "GET /popular HTTP/1.1\r\nHost: h\r\n\r\n" );
+	for( int i = 0; i < 5; i++ )
+		(void) small.lookup( &popular );
+	small.insert( &popular, "", string( 900, 'p' ), 0, 60000, false );
+	for( int i = 0; i < 1000 && small.rejections.load() == 0; i++ )
+	{
+		parsed( &wonder, "GET /" + to_string( i ) + " HTTP/1.1\r\nHost: h\r\n\r\n" );
+		(void) small.lookup( &wonder );
+		small.insert( &wonder, "", string( 900, 'w' ), 0, 60000, false );
+	}
+	expect( small.rejections.load() == 1 && small.lookup( &popular ), "TinyLFU admission" );
+}
+
+// identical misses wait for the first one's response instead of fetching it
+
+static void
+testCoalesce( void )
+{
+	Cache cache( 16 * 64 * 1024 );
+	HTTPParser first, second;
+	parsed( &first, "GET /hot HTTP/1.1\r\nHost: h\r\n\r\n" );
+	parsed( &second, "GET /hot HTTP/1.1\r\nHost: h\r\n\r\n" );
+	bool leader;
+	shared_ptr< InFlight > fetch = cache.join( &first, &leader );
+	expect( leader, "first miss fetches" );
+	atomic< int > served( 0 );
+	vector< thread > waiters;
+	for( int i = 0; i < 4; i++ )
+	{
+		bool waiterLeads;
+		shared_ptr< InFlight > joined = cache.join( &second, &waiterLeads );
+		expect( !waiterLeads && joined == fetch, "later misses wait" );
+		waiters.push_back( thread( [ &cache, &second, &served, joined ] {
+			shared_ptr< CachedResponse > response = cache.wait( joined, &second, 5000 );
+			if( response && response->data == "HTTP/1.1 200 OK\r\n\r\nhot" )
+				++served;
+		} ) );
+	}
+	cache.finish( fetch, cache.insert( &first, "", "HTTP/1.1 200 OK\r\n\r\nhot", 17, 60000, false ) );
+	for( auto it = waiters.begin(); it != waiters.end(); it++ )
+		it->join();
+	expect( served.load() == 4 && cache.coalesced.load() == 4, "one response fanned out" );
+
+	// nothing to share: waiters go to a backend themselves
+	HTTPParser gzip, plain;
+	parsed( &gzip, "GET /v HTTP/1.1\r\nHost: h\r\nAccept-Encoding: gzip\r\n\r\n" );
+	parsed( &plain, "GET /v HTTP/1.1\r\nHost: h\r\n\r\n" );
+	fetch = cache.join( &gzip, &leader );
+	shared_ptr< InFlight > joined = cache.join( &plain, &leader );
+	expect( !leader, "variants unknown until the response" );
+	cache.finish( fetch, cache.insert( &gzip, "Accept-Encoding", "HTTP/1.1 200 OK\r\n\r\ngz", 17, 60000, false ) );
+	expect( !cache.wait( joined, &plain, 5000 ), "other variant isn't shared" );
+	fetch = cache.join( &first, &leader );
+	expect( leader, "finished fetch is forgotten" );
+	cache.finish( fetch, nullptr );
+	expect( !cache.wait( fetch, &first, 5000 ), "uncacheable response isn't shared" );
+}
+
+// Accept-Encoding negotiation, which responses qualify, and pooled gzip streams
+
+static void
+testCompression( void )
+{
+	HTTPParser request;
+	expect( Compression::accepted( parsed( &request, "GET / HTTP/1.1\r\nAccept-Encoding: gzip, deflate, br\r\n\r\n" ) ) == ENCODING_GZIP, "gzip" );
+	expect( Compression::accepted( parsed( &request, "GET / HTTP/1.1\r\nAccept-Encoding: gzip;q=0, *;q=0.5\r\n\r\n" ) ) == ENCODING_ZSTD, "q=0" );
+	expect( Compression::accepted( parsed( &request, "GET / HTTP/1.0\r\nAccept-Encoding: gzip\r\n\r\n" ) ) == 0, "HTTP/1.0 can't take chunked" );
+	expect( Compression::parseEncodings( "gzip" ) == ENCODING_GZIP && Compression::parseEncodings( "gzip,br" ) < 0, "COMPRESS" );
+
+	Compression compression( ENCODING_GZIP, 1024, { "text/", "application/json" } );
+	expect( compression.select( ENCODING_GZIP | ENCODING_ZSTD ) == ENCODING_GZIP && compression.select( ENCODING_ZSTD ) == 0, "select" );
+	HTTPParser response( true );
+	HTTPBody body;
+	body.frame( parsed( &response, "HTTP/1.1 200 OK\r\nContent-Type: application/json; charset=utf-8\r\nContent-Length: 5000\r\n\r\n" ), "GET" );
+	expect( compression.applies( &response, &body ), "JSON" );
+	body.frame( parsed( &response, "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: 100\r\n\r\n" ), "GET" );
+	expect( !compression.applies( &response, &body ), "below COMPRESS-MIN-SIZE" );
+	body.frame( parsed( &response, "HTTP/1.1 200 OK\r\nContent-Type: image/png\r\nContent-Length: 5000\r\n\r\n" ), "GET" );
+	expect( !compression.applies( &response, &body ), "type not allowed" );
+	body.frame( parsed( &response, "HTTP/1.1 200 OK\r\nContent-Type: text/html\r\nContent-Encoding: br\r\nTransfer-Encoding: chunked\r\n\r\n" ), "GET" );
+	expect( !compression.applies( &response, &body ), "already encoded" );
+
+	// chunk framing stripped from the payload
+	string payload;
+	body.frame( parsed( &response, "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n" ), "GET" );
+	const char *chunked = "5\r\nhello\r\n6;x=y\r\n world\r\n0\r\n\r\n";
+	expect( body.consume( chunked, strlen( chunked ), &payload ) == strlen( chunked ) && body.done() && payload == "hello world", "decoded" );
+
+	string text;
+	for( int i = 0; i < 1000; i++ )
+		text += "{\"id\": " + to_string( i ) + "}, ";
+	Compressor *compressor = Compressor::get( ENCODING_GZIP );
+	for( int round = 0; round < 2; round++ )
+	{
+		string out;
+		expect( compressor->compress( text.data(), 6000, false, &out ) && !out.empty(), "compress" );
+		z_stream zs;
+		memset( &zs, 0, sizeof( zs ) );
+		inflateInit2( &zs, 15 + 16 );
+		string inflated( text.size() + 1, '\0' );
+		zs.next_in = (Bytef *) out.data();
+		zs.avail_in = out.size();
+		zs.next_out = (Bytef *) &inflated[ 0 ];
+		zs.avail_out = inflated.size();
+		// what's been read so far decodes before the stream ends (SSE)
+		expect( inflate( &zs, Z_SYNC_FLUSH ) == Z_OK && zs.total_out == 6000 && inflated.compare( 0, 6000, text, 0, 6000 ) == 0, "flushed" );
+		size_t flushed = out.size();
+		expect( compressor->compress( text.data() + 6000, text.size() - 6000, true, &out ), "finish" );
+		expect( out.size() < text.size() / 4, "smaller" );
+		zs.next_in = (Bytef *) out.data() + flushed;
+		zs.avail_in = out.size() - flushed;
+		expect( inflate( &zs, Z_FINISH ) == Z_STREAM_END && zs.total_out == text.size() && inflated.compare( 0, text.size(), text ) == 0, "gunzip" );
+		inflateEnd( &zs );
+		Compressor::release( compressor );
+		Compressor *again = Compressor::get( ENCODING_GZIP );
+		expect( again == compressor, "pooled" );
+	}
+	Compressor::release( compressor );
+}
+
+// header lines dropped and added around the original bytes, body untouched
+
+static void
+testHeaderRewrite( void )
+{
+	HeaderRewrite rewrite;
+	expect( rewrite.empty(), "nothing to rewrite" );
+	rewrite.set( "X-Env", "prod" );
+	rewrite.remove( "x-secret" );
+	rewrite.forwardedFor = true;
+	rewrite.requestIdHeader = "X-Request-Id";
+
+	HTTPParser request;
+	string message = "POST /p HTTP/1.1\r\nHost: h\r\nX-Secret: s\r\nX-Forwarded-For: 10.0.0.1\r\nX-Env: dev\r\n"
+		"Content-Length: 4\r\n\r\nbody";
+	expect( request.parse( message.data(), message.size() ) == HTTP_COMPLETE, "parse" );
+	string requestId, inserted;
+	vector< struct iovec > iov;
+	int count = rewrite.build( &request, message.data(), message.size(), "127.0.0.1", true, &requestId, &inserted, &iov );
+	string sent;
+	for( int i = 0; i < count; i++ )
+		sent.append( (const char *) iov[ i ].iov_base, iov[ i ].iov_len );
+	expect( requestId.size() == 32, "request id" );
+	expect( sent == "POST /p HTTP/1.1\r\nHost: h\r\nContent-Length: 4\r\nX-Env: prod\r\n"
+		"X-Forwarded-For: 10.0.0.1, 127.0.0.1\r\nX-Forwarded-Proto: https\r\nX-Request-Id: " + requestId + "\r\n\r\nbody", "rewritten" );
+	expect( iov.back().iov_base == message.data() + message.size() - 6, "body not copied" );
+
+	// a retry keeps its id
+	string first = requestId;
+	(void) rewrite.build( &request, message.data(), message.size(), "127.0.0.1", true, &requestId, &inserted, &iov );
+	expect( requestId == first, "same id on retry" );
+}
+
+// memory first, then the temp file, refusing what exceeds both
+
+static void
+testResponseBuffer( void )
+{
+	ResponseBuffer buffer( 1000, 3 * 1024 * 1024 );
+	string expected;
+	for( int i = 0; i < 3000; i++ )
+	{
+		string line = "line " + to_string( i ) + "\n";
+		expect( buffer.append( line.data(), line.size() ), "append" );
+		expected += line;
+	}
+	expect( buffer.memoryPart().size() <= 1000 && buffer.filePart().size() > 0, "spilled" );
+	expect( string( buffer.memoryPart() ) + string( buffer.filePart() ) == expected, "contents" );
+	string big( 2 * 1024 * 1024, 'b' );
+	expect( buffer.append( big.data(), big.size() ), "file grows" );
+	expect( !buffer.append( big.data(), big.size() ), "over the limit" );
+	buffer.clear();
+	expect( buffer.size() == 0 && buffer.append( "x", 1 ) && buffer.memoryPart() == "x", "cleared" );
+}
+
+// small records for the first bytes of a response, and again after idle
+
+static void
+testRecordSizer( void )
+{
+	RecordSizer records;
+	expect( records.next( 16384 ) == 16384, "off by default" );
+	records.configure( 1400, 4000, 50 );
+	size_t sent = 0;
+	while( sent < 4000 )
+	{
+		size_t len = records.next( 16384 );
+		expect( len == 1400, "small records first" );
+		records.sent( len );
+		sent += len;
+	}
+	expect( records.next( 16384 ) == 16384 && records.next( 100 ) == 100, "full records after the ramp" );
+	records.sent( 16384 );
+	records.restart();
+	expect( records.next( 16384 ) == 1400, "small again for a new response" );
+	records.sent( 4000 );
+	usleep( 100000 );
+	expect( records.next( 16384 ) == 1400, "small again after idle" );
+}
+
+static void
+testReplayCache( void )
+{
+	ReplayCache replays( 1 );
+	expect( replays.firstUse( "hello-a" ) && replays.firstUse( "hello-b" ), "first use" );
+	expect( !replays.firstUse( "hello-a" ) && replays.replays == 1, "replay" );
+	usleep( 1100000 );
+	expect( replays.firstUse( "hello-a" ), "outside the window" );
+}
+
+// a real ClientHello, from an OpenSSL client writing into a memory BIO
+
+static string
+clientHello( const char *serverName, const unsigned char *protocols, unsigned int protocolsLen )
+{
+	SSL_CTX *ctx = SSL_CTX_new( TLS_client_method() );
+	SSL *ssl = SSL_new( ctx );
+	BIO *in = BIO_new( BIO_s_mem() );
+	BIO *out = BIO_new( BIO_s_mem() );
+	SSL_set_bio( ssl, in, out );
+	if( serverName )
+		SSL_set_tlsext_host_name( ssl, serverName );
+	if( protocols )
+		SSL_set_alpn_protos( ssl, protocols, protocolsLen );
+	(void) SSL_connect( ssl );
+	char *data;
+	long len = BIO_get_mem_data( out, &data );
+	string hello( data, (size_t) len );
+	SSL_free( ssl );
+	SSL_CTX_free( ctx );
+	return( hello );
+}
+
+static void
+testClientHello( void )
+{
+	static const unsigned char alpn[] = "\x02h2\x08http/1.1";
+	string bytes = clientHello( "WWW.Example.com", alpn, sizeof( alpn ) - 1 );
+	const unsigned char *data = (const unsigned char *) bytes.data();
+	ClientHello hello;
+	expect( hello.parse( data, bytes.size() ) == CLIENT_HELLO_COMPLETE, "ClientHello" );
+	expect( hello.serverName == "www.example.com", "SNI lowercased" );
+	expect( hello.protocols.size() == 2 && hello.protocols[ 0 ] == "h2" && hello.protocols[ 1 ] == "http/1.1", "ALPN" );
+	for( size_t len = 0; len < bytes.size(); len++ )
+		expect( hello.parse( data, len ) == CLIENT_HELLO_INCOMPLETE, "partial ClientHello" );
+
+	// the same message split over two handshake records
+	size_t messageLen = bytes.size() - 5;
+	size_t first = messageLen / 3;
+	string split = bytes.substr( 0, 5 ) + bytes.substr( 5, first ) + bytes.substr( 0, 5 ) + bytes.substr( 5 + first );
+	split[ 3 ] = (char) (first >> 8);
+	split[ 4 ] = (char) first;
+	split[ 5 + first + 3 ] = (char) ((messageLen - first) >> 8);
+	split[ 5 + first + 4 ] = (char) (messageLen - first);
+	expect( hello.parse( (const unsigned char *) split.data(), split.size() ) == CLIENT_HELLO_COMPLETE
+		&& hello.serverName == "www.example.com", "ClientHello across records" );
+
+	bytes = clientHello( nullptr, nullptr, 0 );
+	expect( hello.parse( (const unsigned char *) bytes.data(), bytes.size() ) == CLIENT_HELLO_COMPLETE
+		&& hello.serverName.empty() && hello.protocols.empty(), "no SNI" );
+	const char *request = "GET / HTTP/1.1\r\n";
+	expect( hello.parse( (const unsigned char *) request, strlen( request ) ) == CLIENT_HELLO_ERROR, "not TLS" );
+	bytes[ 7 ] = 0;		// a ClientHello of 10 bytes can't hold its own fields
+	bytes[ 8 ] = 10;
+	expect( hello.parse( (const unsigned char *) bytes.data(), bytes.size() ) == CLIENT_HELLO_ERROR, "truncated" );
+}
+
+static string
+unhex( const char *hex )
+{
+	string bytes;
+	for( ; hex[ 0 ] && hex[ 1 ]; hex += 2 )
+		bytes.push_back( (char) strtol( string( hex, 2 ).c_str(), nullptr, 16 ) );
+	return( bytes );
+}
+
+static void
+testHPACK( void )
+{
+	// RFC 7541 C.4: requests with Huffman coding, sharing one dynamic table
+	HPACKDecoder decoder( 65536 );
+	vector< pair< string, string > > headers;
+	string block = unhex( "828684418cf1e3c2e5f23a6ba0ab90f4ff" );
+	expect( decoder.decode( (const unsigned char *) block.data(), block.size(), &headers ) && headers.size() == 4
+		&& headers[ 0 ].first == ":method" && headers[ 0 ].second == "GET" && headers[ 3 ].second == "www.example.com", "C.4.1" );
+	block = unhex( "828684be5886a8eb10649cbf" );
+	expect( decoder.decode( (const unsigned char *) block.data(), block.size(), &headers ) && headers.size() == 5
+		&& headers[ 3 ].second == "www.example.com" && headers[ 4 ].first == "cache-control" && headers[ 4 ].second == "no-cache", "C.4.2" );
+	block = unhex( "828785bf408825a849e95ba97d7f8925a849e95bb8e8b4bf" );
+	expect( decoder.decode( (const unsigned char *) block.data(), block.size(), &headers ) && headers.size() == 5
+		&& headers[ 2 ].second == "/index.html" && headers[ 4 ].first == "custom-key" && headers[ 4 ].second == "custom-value", "C.4.3" );
+	block = unhex( "be" );
+	expect( decoder.decode( (const unsigned char *) block.data(), block.size(), &headers ) && headers[ 0 ].first == "custom-key", "indexed" );
+	block = unhex( "c8" );
+	expect( !decoder.decode( (const unsigned char *) block.data(), block.size(), &headers ), "index beyond table" );
+
+	// what the encoder writes decodes to the same fields, shorter the second time
+	HPACKEncoder encoder;
+	HPACKDecoder client( 65536 );
+	const char *fields[][ 2 ] = { { ":status", "200" }, { "content-type", "text/html; charset=utf-8" },
+		{ "server", "l7lb" }, { "content-length", "1234" }, { "set-cookie", "id=\x7f\xc3\xa9" } };
+	size_t count = sizeof( fields ) / sizeof( fields[ 0 ] );
+	size_t lengths[ 2 ];
+	for( int round = 0; round < 2; round++ )
+	{
+		block.clear();
+		if( round )
+			encoder.setTableSize( 256 );
+		for( size_t i = 0; i < count; i++ )
+			encoder.encode( fields[ i ][ 0 ], fields[ i ][ 1 ], &block );
+		lengths[ round ] = block.size();
+		expect( client.decode( (const unsigned char *) block.data(), block.size(), &headers ) && headers.size() == count, "round trip" );
+		for( size_t i = 0; i < count; i++ )
+			expect( headers[ i ].first == fields[ i ][ 0 ] && headers[ i ].second == fields[ i ][ 1 ], "round trip field" );
+	}
+	expect( lengths[ 1 ] < lengths[ 0 ], "dynamic table" );
+
+	string huffman;
+	Huffman::encode( "no-cache", &huffman );
+	expect( huffman == unhex( "a8eb10649cbf" ), "Huffman encode" );
+	string decoded;
+	expect( !Huffman::decode( (const unsigned char *) "\xff\xff\xff\xff", 4, &decoded ), "EOS rejected" );
+	HPACKDecoder small( 64 );
+	block = unhex( "828684418cf1e3c2e5f23a6ba0ab90f4ff" );
+	expect( !small.decode( (const unsigned char *) block.data(), block.size(), &headers ), "header list limit" );
+}
+
+static void
+testHTTP2Translation( void )
+{
+	const char *text = "POST /upload?x=1 HTTP/1.1\r\nHost: example.com\r\nConnection: keep-alive\r\n"
+		"Transfer-Encoding: chunked\r\nTE: gzip\r\nX-Custom: A\r\n\r\n";
+	HTTPParser request;
+	expect( request.parse( text, strlen( text ) ) == HTTP_COMPLETE, "request parsed" );
+	vector< pair< string, string > > fields;
+	expect( HTTP2ClientStream::requestFields( &request, true, &fields ), "request fields" );
+	expect( fields.size() == 5 && fields[ 0 ] == make_pair( string( ":method" ), string( "POST" ) )
+		&& fields[ 1 ].second == "https" && fields[ 2 ] == make_pair( string( ":authority" ), string( "example.com" ) )
+		&& fields[ 3 ].second == "/upload?x=1" && fields[ 4 ] == make_pair( string( "x-custom" ), string( "A" ) ),
+		"pseudo-headers first, connection fields dropped" );
+	text = "CONNECT example.com:443 HTTP/1.1\r\nHost: example.com\r\n\r\n";
+	HTTPParser tunnel;
+	expect( tunnel.parse( text, strlen( text ) ) == HTTP_COMPLETE, "CONNECT parsed" );
+	expect( !HTTP2ClientStream::requestFields( &tunnel, true, &fields ), "CONNECT not translated" );
+
+	// a response delimited only by END_STREAM is chunked for HTTP/1.1 readers
+	vector< pair< string, string > > response = { { ":status", "200" }, { "content-type", "text/plain" } };
+	bool chunked;
+	string header = HTTP2ClientStream::responseHeader( 200, response, false, false, &chunked );
+	expect( chunked && header == "HTTP/1.1 200 OK\r\ncontent-type: text/plain\r\ntransfer-encoding: chunked\r\n\r\n", "chunked response" );
+	header = HTTP2ClientStream::responseHeader( 200, response, false, true, &chunked );
+	expect( !chunked && header.find( "content-length: 0\r\n" ) != string::npos, "empty response" );
+	response.emplace_back( "content-length", "5" );
+	header = HTTP2ClientStream::responseHeader( 200, response, false, false, &chunked );
+	expect( !chunked && header.find( "transfer-encoding" ) == string::npos, "length kept" );
+	response.pop_back();
+	header = HTTP2ClientStream::responseHeader( 304, response, false, false, &chunked );
+	expect( !chunked && header.find( "content-length" ) == string::npos, "304 has no body" );
+	header = HTTP2ClientStream::responseHeader( 200, response, true, false, &chunked );
+	expect( !chunked && header.find( "transfer-encoding" ) == string::npos, "HEAD has no body" );
+	HTTPParser parsed( true );
+	header = HTTP2ClientStream::responseHeader( 404, response, false, false, &chunked );
+	expect( parsed.parse( header.data(), header.size() ) == HTTP_COMPLETE && parsed.status == 404 && parsed.reason == "Not Found",
+		"response parses as HTTP/1.1" );
+}
+
+// the dispatched kernel must agree with a byte loop at every length and offset
+
+static void
+testScan( void )
+{
+	char buf[ 256 ];
+	for( size_t i = 0; i < sizeof( buf ); i++ )
+		buf[ i ] = 'a' + i % 26;
+	for( size_t len = 0; len <= 100; len++ )
+	{
+		for( size_t at = 0; at <= len; at++ )
+		{
+			char saved = buf[ at ];
+			if( at < len )
+				buf[ at ] = ';';
+			const char *found = HTTPScan::find( buf, buf + len, '\r', ':', ';' );
+			expect( found == buf + at, "scan finds first delimiter" );
+			expect( HTTPScan::find( buf, buf + at, ';' ) == buf + at, "scan stops at end" );
+			buf[ at ] = saved;
+		}
+	}
+	// delimiter bytes with the high bit set must not match ASCII ones
+	memset( buf, 0xba, sizeof( buf ) );
+	expect( HTTPScan::find( buf, buf + sizeof( buf ), ':' ) == buf + sizeof( buf ), "no false match" );
+	buf[ 200 ] = ':';
+	buf[ 201 ] = '\r';
+	expect( HTTPScan::find( buf + 1, buf + sizeof( buf ), '\r', ':', ';' ) == buf + 200, "late match" );
+# if TRACE
+	Log::console( "HTTPScan kernel: %s", HTTPScan::kernelName() );
+# endif // TRACE
+}
+
+int
+main( int argc, char **argv )
+{
+	try
+	{
+		if( argc != 1 )
+			Exception::raise( "Usage: %s", argv[ 0 ] );
+		testScan();
+		testIncremental();
+		testLargeHeader();
+		testResponse();
+		testErrors();
+		testBody();
+		testStream();
+		testRouter();
+		testCache();
+		testCoalesce();
+		testCompression();
+		testHeaderRewrite();
+		testResponseBuffer();
+		testRecordSizer();
+		testReplayCache();
+		testClientHello();
+		testHPACK();
+		testHTTP2Translation();
+	}
+	catch( const char *error ) {
+		Log::console( "%s: test failed [%s]", argv[ 0 ], error );
+		exit( -1 );
+	}
+	Log::console( "%s: test passed", argv[ 0 ] );
+}
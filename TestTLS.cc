@@ -306,6 +306,7 @@ main( int argc, char **argv )
 		// proxy test service
 		ProxyServiceContext *proxyContext = new ProxyServiceContext(
 			"localhost:666", "localhost:667", "localhost.crt", "localhost.key" );
+		proxyContext->setHandshakes( 4, 10000 );	// the echo service handshakes inline
 		ProxyService *proxyService = new ProxyService( proxyContext );
 		proxyService->run();
 		proxyService->detach();
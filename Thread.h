@@ -58,6 +58,12 @@ class Thread
 		std::this_thread::sleep_for( duration );
 	}
 
+	// monotonic clock for timeouts and intervals (not wall-clock time)
+	static int64_t milliseconds( void ) {
+		return( std::chrono::duration_cast< std::chrono::milliseconds >(
+			std::chrono::steady_clock::now().time_since_epoch() ).count() );
+	}
+
 	ThreadContext *context;
 
     private:
@@ -0,0 +1,133 @@
+//
+//  TicketKeys.cc
+//  Layer7LoadBalancer
+//  Created by Rick Tyler
+//
+//  SPDX-License-Identifier: MIT
+
+# include "TicketKeys.h"
+# include "Exception.h"
+# include <string.h>
+# include <openssl/evp.h>
+# include <openssl/rand.h>
+# if OPENSSL_VERSION_NUMBER >= 0x30000000L
+# include <openssl/core_names.h>
+# else
+# include <openssl/hmac.h>
+# endif
+
+// # define TRACE    1
+
+static int ticketKeysIndex = SSL_CTX_get_ex_new_index( 0, nullptr, nullptr, nullptr, nullptr );
+
+TicketKeys :: TicketKeys( int rotation, int lifetime )
+{
+	this->rotation = rotation;
+	this->lifetime = lifetime;
+	rotate( time( nullptr ) );
+}
+
+void
+TicketKeys :: install( SSL_CTX *ssl_ctx )
+{
+	SSL_CTX_set_ex_data( ssl_ctx, ticketKeysIndex, this );
+# if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	SSL_CTX_set_tlsext_ticket_key_evp_cb( ssl_ctx, callback );
+# else
+	SSL_CTX_set_tlsext_ticket_key_cb( ssl_ctx, callback );
+# endif
+}
+
+// add a key if the newest is due for rotation, and drop those whose
+// tickets have all expired; keysMutex held
+
+void
+TicketKeys :: rotate( time_t now )
+{
+	if( keys.empty() || now - keys.front().created >= rotation )
+	{
+		Key key;
+		if( RAND_bytes( key.name, sizeof( key.name ) ) != 1
+		 || RAND_bytes( key.aesKey, sizeof( key.aesKey ) ) != 1
+		 || RAND_bytes( key.hmacKey, sizeof( key.hmacKey ) ) != 1 )
+			Exception::raise( "TicketKeys::rotate: RAND_bytes() failed" );
+		key.created = now;
+		keys.push_front( key );
+	}
+	// a key issues tickets for rotation seconds, each valid lifetime more
+	while( keys.size() > 1 && now - keys.back().created >= rotation + lifetime )
+		keys.pop_back();
+}
+
+TicketKeys::Key
+TicketKeys :: current( void )
+{
+	lock_guard< mutex > lock( keysMutex );
+	rotate( time( nullptr ) );
+	return( keys.front() );
+}
+
+bool
+TicketKeys :: find( const unsigned char *name, Key *key, bool *renew )
+{
+	lock_guard< mutex > lock( keysMutex );
+	rotate( time( nullptr ) );
+	for( auto it = keys.begin(); it != keys.end(); it++ )
+	{
+		if( memcmp( it->name, name, sizeof( it->name ) ) == 0 )
+		{
+			*key = *it;
+			*renew = it != keys.begin();
+			return( true );
+		}
+	}
+	return( false );
+}
+
+// OpenSSL's ticket key callback: 1 to use the key set up, 2 to also issue
+// a fresh ticket, 0 for an unknown key (full handshake), -1 on error
+
+# if OPENSSL_VERSION_NUMBER >= 0x30000000L
+int
+TicketKeys :: callback( SSL *ssl, unsigned char *name, unsigned char *iv, EVP_CIPHER_CTX *cipher, EVP_MAC_CTX *hmac, int encrypt )
+# else
+int
+TicketKeys :: callback( SSL *ssl, unsigned char *name, unsigned char *iv, EVP_CIPHER_CTX *cipher, HMAC_CTX *hmac, int encrypt )
+# endif
+{
+	TicketKeys *ticketKeys = (TicketKeys *) SSL_CTX_get_ex_data( SSL_get_SSL_CTX( ssl ), ticketKeysIndex );
+	Key key;
+	bool renew = false;
+	if( encrypt )
+	{
+		try
+		{
+			key = ticketKeys->current();
+		}
+		catch( const char * )
+		{
+			return( -1 );
+		}
+		memcpy( name, key.name, sizeof( key.name ) );
+		if( RAND_bytes( iv, EVP_MAX_IV_LENGTH ) != 1 )
+			return( -1 );
+	}
+	else if( !ticketKeys->find( name, &key, &renew ) )
+		return( 0 );
+# if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	OSSL_PARAM params[] =
+	{
+		OSSL_PARAM_construct_octet_string( OSSL_MAC_PARAM_KEY, key.hmacKey, sizeof( key.hmacKey ) ),
+		OSSL_PARAM_construct_utf8_string( OSSL_MAC_PARAM_DIGEST, (char *) "SHA256", 0 ),
+		OSSL_PARAM_construct_end()
+	};
+	if( !EVP_MAC_CTX_set_params( hmac, params ) )
+		return( -1 );
+# else
+	if( !HMAC_Init_ex( hmac, key.hmacKey, sizeof( key.hmacKey ), EVP_sha256(), nullptr ) )
+		return( -1 );
+# endif
+	if( !EVP_CipherInit_ex( cipher, EVP_aes_256_cbc(), nullptr, key.aesKey, iv, encrypt ) )
+		return( -1 );
+	return( renew ? 2 : 1 );
+}
@@ -0,0 +1,55 @@
+//
+//  TicketKeys.h
+//  Layer7LoadBalancer
+//  Created by Rick Tyler
+//
+//  SPDX-License-Identifier: MIT
+
+# ifndef _TicketKeys_h_
+# define _TicketKeys_h_
+
+# include <deque>
+# include <mutex>
+# include <time.h>
+# include <openssl/ssl.h>
+
+using namespace std;
+
+// Session ticket keys for a listener's SSL_CTX, so a client resumes
+// without any server-side state. A new key takes over every rotation
+// seconds; older ones still decrypt (and get the ticket renewed) until
+// tickets they issued have expired. Keys are random and never leave
+// memory, so tickets don't survive a restart.
+
+class TicketKeys
+{
+    public:
+
+	TicketKeys( int rotation, int lifetime );
+	void install( SSL_CTX *ssl_ctx );
+
+    private:
+
+	struct Key
+	{
+		unsigned char name[ 16 ];
+		unsigned char aesKey[ 32 ];
+		unsigned char hmacKey[ 32 ];
+		time_t created;
+	};
+
+	mutex keysMutex;
+	deque< Key > keys;	// newest first
+	int rotation;		// seconds a key issues tickets
+	int lifetime;		// seconds a ticket is honored
+	Key current( void );
+	bool find( const unsigned char *name, Key *key, bool *renew );
+	void rotate( time_t now );
+# if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	static int callback( SSL *ssl, unsigned char *name, unsigned char *iv, EVP_CIPHER_CTX *cipher, EVP_MAC_CTX *hmac, int encrypt );
+# else
+	static int callback( SSL *ssl, unsigned char *name, unsigned char *iv, EVP_CIPHER_CTX *cipher, HMAC_CTX *hmac, int encrypt );
+# endif
+};
+
+# endif // _TicketKeys_h_
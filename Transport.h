@@ -0,0 +1,46 @@
+//
+//  Transport.h
+//  Layer7LoadBalancer
+//  Created by Rick Tyler
+//
+//  SPDX-License-Identifier: MIT
+
+# ifndef _Transport_h_
+# define _Transport_h_
+
+# include <openssl/ssl.h>
+# include <sys/types.h>
+# include <sys/socket.h>
+
+// The two ends of a relay as types rather than a flag tested on every call.
+// A session picks the client and backend pair once it is connected, and its
+// relay loop is compiled for that pair, each read and write inlined.
+
+class PlainTransport
+{
+    public:
+
+	static const bool secure = false;
+	PlainTransport( int socket, SSL *ssl ) { this->socket = socket; (void) ssl; }
+	ssize_t read( void *buf, size_t len ) { return( recv( socket, buf, len, 0 ) ); }
+	ssize_t write( const void *data, size_t len ) { return( send( socket, data, len, 0 ) ); }
+	ssize_t peek( void *buf, size_t len ) { return( recv( socket, buf, len, MSG_PEEK ) ); }
+	bool pending( void ) { return( false ); }	// select() sees everything the socket has
+	int socket;
+};
+
+class TLSTransport
+{
+    public:
+
+	static const bool secure = true;
+	TLSTransport( int socket, SSL *ssl ) { this->socket = socket; this->ssl = ssl; }
+	ssize_t read( void *buf, size_t len ) { return( SSL_read( ssl, buf, (int) len ) ); }
+	ssize_t write( const void *data, size_t len ) { return( SSL_write( ssl, data, (int) len ) ); }
+	ssize_t peek( void *buf, size_t len ) { return( SSL_peek( ssl, buf, (int) len ) ); }
+	bool pending( void ) { return( SSL_pending( ssl ) > 0 ); }	// decrypted, so select() won't see it
+	int socket;
+	SSL *ssl;
+};
+
+# endif // _Transport_h_